@@ -0,0 +1,780 @@
+// nfload: drives nfserver with thousands of simulated clients from a few threads.
+// Every thread runs an epoll loop over its share of non-blocking connections. Linux only.
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_threads.h>
+#include <cs_time.h>
+#include <cs_histogram.h>
+#include <net_common.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "workload.h"
+
+#define LOAD_MAX_THREADS 64
+#define LOAD_MAX_EVENTS 256
+#define LOAD_MAX_REPLY_SIZE (u64)(64 * 1024 * 1024)
+#define LOAD_IO_BUFFER_SIZE (usize)(256 * 1024)
+#define LOAD_RECONNECT_NS (1 * CTM_NS_PER_SEC)
+#define LOAD_NAME_MAX 64
+
+typedef enum _netfs_load_client_state {
+    ClientState_Connecting,
+    ClientState_Idle,   // Waiting for its next operation (or reconnect) to come due.
+    ClientState_Busy,   // Operation in flight.
+    ClientState_Closed  // Waiting to reconnect.
+} ClientState;
+
+typedef struct _netfs_load_client {
+    int fd;
+    ClientState state;
+    u32 id;
+    u64 due_ns;
+    bool want_write;
+
+    LoadOp op;
+    u64 start_ns; // Latency is measured from when the operation was due, not when it went out.
+    u64 bytes;
+
+    // Outgoing request bytes, then upload payload streamed from the shared random buffer.
+    u8 out[sizeof(PacketHeader) + LOAD_NAME_MAX + sizeof(FileStat)];
+    usize out_size;
+    usize out_offset;
+    u64 payload_remaining;
+    u64 upload_remaining;
+    bool upload_acked;
+
+    // Incoming packet being parsed.
+    PacketHeader header;
+    usize header_received;
+    u64 reply_remaining;
+    u8 reply[sizeof(FileStat)];
+    usize reply_received;
+    bool in_stream;
+    u64 file_remaining;
+} LoadClient;
+
+typedef struct _netfs_load_stats {
+    Histogram latency[LoadOp_Count];
+    u64 ops[LoadOp_Count];
+    u64 errors[LoadOp_Count];
+    u64 bytes[LoadOp_Count];
+    u64 connects;
+    u64 connect_errors;
+
+    // Taken and reset by the reporter every interval.
+    Mutex* mutex;
+    Histogram interval;
+    u64 interval_ops;
+    u64 interval_errors;
+    u64 interval_bytes;
+} LoadStats;
+
+typedef struct _netfs_load_thread {
+    u32 index;
+    const Workload* workload;
+    struct sockaddr_in addr;
+    LoadClient* clients;
+    usize clients_count;
+    double arrival_mean_ns; // Open loop: mean gap between operations of one client.
+
+    int epoll_fd;
+    u32* heap; // Clients waiting on a timer, ordered by due_ns.
+    usize heap_count;
+    Rng rng;
+    u8* scratch;
+    LoadStats stats;
+} LoadThread;
+
+volatile bool g_stop = false;
+u8* g_upload_data = NULL;
+
+// Timer heap.
+
+bool _heap_less(const LoadThread* restrict t, const u32 a, const u32 b) {
+    return t->clients[a].due_ns < t->clients[b].due_ns;
+}
+
+void heap_push(LoadThread* restrict t, const u32 client) {
+    usize i = t->heap_count++;
+    t->heap[i] = client;
+    while (i > 0) {
+        const usize parent = (i - 1) / 2;
+        if (!_heap_less(t, t->heap[i], t->heap[parent]))
+            break;
+        const u32 tmp = t->heap[i];
+        t->heap[i] = t->heap[parent];
+        t->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+u32 heap_pop(LoadThread* restrict t) {
+    const u32 top = t->heap[0];
+    t->heap[0] = t->heap[--t->heap_count];
+    usize i = 0;
+    for (;;) {
+        const usize left = i * 2 + 1;
+        const usize right = left + 1;
+        usize smallest = i;
+        if (left < t->heap_count && _heap_less(t, t->heap[left], t->heap[smallest]))
+            smallest = left;
+        if (right < t->heap_count && _heap_less(t, t->heap[right], t->heap[smallest]))
+            smallest = right;
+        if (smallest == i)
+            break;
+        const u32 tmp = t->heap[i];
+        t->heap[i] = t->heap[smallest];
+        t->heap[smallest] = tmp;
+        i = smallest;
+    }
+    return top;
+}
+
+// Connections.
+
+void client_watch(LoadThread* restrict t, LoadClient* restrict c, const bool want_write) {
+    if (c->want_write == want_write)
+        return;
+    c->want_write = want_write;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | ((want_write) ? EPOLLOUT : 0);
+    ev.data.u32 = c->id;
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void client_close(LoadThread* restrict t, LoadClient* restrict c, const u64 now) {
+    if (c->fd >= 0) {
+        epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+    c->state = ClientState_Closed;
+    c->due_ns = now + LOAD_RECONNECT_NS;
+    heap_push(t, c->id);
+}
+
+void client_connect(LoadThread* restrict t, LoadClient* restrict c, const u64 now) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (c->fd < 0) {
+        ++t->stats.connect_errors;
+        client_close(t, c, now);
+        return;
+    }
+    const int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr*)&t->addr, sizeof(t->addr)) != 0 && errno != EINPROGRESS) {
+        ++t->stats.connect_errors;
+        close(c->fd);
+        c->fd = -1;
+        client_close(t, c, now);
+        return;
+    }
+    c->state = ClientState_Connecting;
+    c->want_write = true;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u32 = c->id;
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+void client_schedule(LoadThread* restrict t, LoadClient* restrict c, const u64 now) {
+    c->state = ClientState_Idle;
+    if (t->workload->rate > 0.0) {
+        // Open loop: arrivals do not wait for the previous operation, a late client starts
+        // right away and the wait counts towards its latency.
+        c->due_ns += Rng_Exponential(&t->rng, t->arrival_mean_ns);
+        if (c->due_ns < now - CTM_NS_PER_SEC)
+            c->due_ns = now - CTM_NS_PER_SEC;
+    } else {
+        c->due_ns = now + Rng_Exponential(&t->rng, (double)t->workload->think_ns);
+    }
+    heap_push(t, c->id);
+}
+
+// Operations.
+
+void client_finish(LoadThread* restrict t, LoadClient* restrict c, const bool ok, const u64 now) {
+    const u64 latency = now - c->start_ns;
+    LoadStats* s = &t->stats;
+    if (ok) {
+        Histogram_Record(&s->latency[c->op], latency);
+        ++s->ops[c->op];
+        s->bytes[c->op] += c->bytes;
+    } else {
+        ++s->errors[c->op];
+    }
+
+    Mutex_Lock(s->mutex);
+    if (ok) {
+        Histogram_Record(&s->interval, latency);
+        ++s->interval_ops;
+        s->interval_bytes += c->bytes;
+    } else {
+        ++s->interval_errors;
+    }
+    Mutex_Unlock(s->mutex);
+    client_schedule(t, c, now);
+}
+
+void _client_queue(LoadClient* restrict c, const NetPacketType type, const void* restrict payload, const usize size) {
+    PacketHeader header;
+    memset(&header, 0, sizeof(header));
+    header.id = type;
+    header.size = size;
+    memcpy(c->out + c->out_size, &header, sizeof(header));
+    c->out_size += sizeof(header);
+    if (payload) {
+        memcpy(c->out + c->out_size, payload, size);
+        c->out_size += size;
+    }
+}
+
+void client_start(LoadThread* restrict t, LoadClient* restrict c) {
+    const Workload* w = t->workload;
+    c->state = ClientState_Busy;
+    c->start_ns = c->due_ns;
+    c->bytes = 0;
+    c->out_size = 0;
+    c->out_offset = 0;
+    c->payload_remaining = 0;
+    c->upload_remaining = 0;
+    c->upload_acked = false;
+    c->header_received = 0;
+    c->in_stream = false;
+    c->op = Workload_PickOp(w, &t->rng);
+
+    char name[LOAD_NAME_MAX];
+    switch (c->op) {
+        case LoadOp_Ls:
+            _client_queue(c, NetPacketType_ListEntries, NULL, 0);
+            break;
+        case LoadOp_Fget:
+            Workload_FileName(name, sizeof(name), w->sizes[Workload_PickSize(w, &t->rng)].size);
+            _client_queue(c, NetPacketType_FileDownloadRequest, name, strlen(name) + 1);
+            break;
+        case LoadOp_Fup: {
+            // Every client has a file of its own, concurrent uploads to one name would collide.
+            snprintf(name, sizeof(name), "nfload_up_%u_%u.bin", t->index, c->id);
+            const usize name_size = strlen(name) + 1;
+            FileStat st = {w->sizes[Workload_PickSize(w, &t->rng)].size, 0};
+            u8 payload[LOAD_NAME_MAX + sizeof(FileStat)];
+            memcpy(payload, name, name_size);
+            memcpy(payload + name_size, &st, sizeof(st));
+            _client_queue(c, NetPacketType_FileUploadRequest, payload, name_size + sizeof(st));
+            c->upload_remaining = st.size;
+            break;
+        }
+        default:
+            break;
+    }
+    client_watch(t, c, true);
+}
+
+// Queue the next FileUploadData packet, false once everything is out.
+bool _client_next_upload_chunk(LoadClient* restrict c) {
+    if (c->upload_remaining == 0)
+        return false;
+    const u64 n = (c->upload_remaining < LOAD_IO_BUFFER_SIZE) ? c->upload_remaining : LOAD_IO_BUFFER_SIZE;
+    c->out_size = 0;
+    c->out_offset = 0;
+    _client_queue(c, NetPacketType_FileUploadData, NULL, (usize)n);
+    c->payload_remaining = n;
+    c->upload_remaining -= n;
+    return true;
+}
+
+// Returns false if the connection broke.
+bool client_write(LoadThread* restrict t, LoadClient* restrict c) {
+    for (;;) {
+        ssize_t n;
+        if (c->out_offset < c->out_size) {
+            n = send(c->fd, c->out + c->out_offset, c->out_size - c->out_offset, MSG_NOSIGNAL);
+            if (n > 0)
+                c->out_offset += n;
+        } else if (c->payload_remaining > 0) {
+            const usize size = (c->payload_remaining < LOAD_IO_BUFFER_SIZE) ? (usize)c->payload_remaining : LOAD_IO_BUFFER_SIZE;
+            n = send(c->fd, g_upload_data, size, MSG_NOSIGNAL);
+            if (n > 0) {
+                c->payload_remaining -= n;
+                c->bytes += n;
+            }
+        } else if (c->op == LoadOp_Fup && c->upload_acked && _client_next_upload_chunk(c)) {
+            continue;
+        } else {
+            client_watch(t, c, false);
+            return true;
+        }
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+}
+
+// A complete packet arrived, reply[] holds the start of its payload. Returns false on a
+// protocol violation (the connection is dropped then).
+bool client_handle_packet(LoadThread* restrict t, LoadClient* restrict c, const u64 now) {
+    const PacketHeader* h = &c->header;
+    if (c->state != ClientState_Busy)
+        return false;
+
+    if (h->id == NetPacketType_Error) {
+        // A failed upload leaves the server ignoring our remaining data, start over clean.
+        if (c->op == LoadOp_Fup && (c->upload_remaining > 0 || c->payload_remaining > 0)) {
+            client_finish(t, c, false, now);
+            return false;
+        }
+        client_finish(t, c, false, now);
+        return true;
+    }
+
+    switch (c->op) {
+        case LoadOp_Ls:
+            if (h->id != NetPacketType_Message)
+                return false;
+            c->bytes = h->size;
+            client_finish(t, c, true, now);
+            return true;
+        case LoadOp_Fget:
+            if (!c->in_stream) {
+                if (h->id != NetPacketType_FileInfo || h->size < sizeof(FileStat))
+                    return false;
+                FileStat st;
+                memcpy(&st, c->reply, sizeof(st));
+                c->in_stream = true;
+                c->file_remaining = st.size;
+            } else if (h->id == NetPacketType_FileDownloadData) {
+                c->file_remaining -= (h->size < c->file_remaining) ? h->size : c->file_remaining;
+                c->bytes += h->size;
+            } else if (h->id == NetPacketType_FileDownloadHole && h->size == sizeof(u64)) {
+                u64 hole = 0;
+                memcpy(&hole, c->reply, sizeof(hole));
+                c->file_remaining -= (hole < c->file_remaining) ? hole : c->file_remaining;
+                c->bytes += hole;
+            } else {
+                return false;
+            }
+            if (c->file_remaining == 0)
+                client_finish(t, c, true, now);
+            return true;
+        case LoadOp_Fup:
+            if (!c->upload_acked) {
+                if (h->id != NetPacketType_FileInfo)
+                    return false;
+                c->upload_acked = true;
+                if (c->upload_remaining > 0)
+                    client_watch(t, c, true);
+                return true;
+            }
+            if (h->id != NetPacketType_Message)
+                return false;
+            client_finish(t, c, true, now);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Returns false if the connection broke or the server sent something we did not expect.
+bool client_read(LoadThread* restrict t, LoadClient* restrict c, const u64 now) {
+    for (;;) {
+        ssize_t n;
+        if (c->header_received < sizeof(PacketHeader)) {
+            n = recv(c->fd, (u8*)&c->header + c->header_received, sizeof(PacketHeader) - c->header_received, 0);
+            if (n > 0) {
+                c->header_received += n;
+                if (c->header_received == sizeof(PacketHeader)) {
+                    // A full server answers with a bare string, which fails this check.
+                    if (c->header.id >= NetPacketType_None || c->header.size > LOAD_MAX_REPLY_SIZE)
+                        return false;
+                    c->reply_remaining = c->header.size;
+                    c->reply_received = 0;
+                }
+            }
+        } else if (c->reply_received < sizeof(c->reply) && c->reply_remaining > 0) {
+            const usize want = sizeof(c->reply) - c->reply_received;
+            n = recv(c->fd, c->reply + c->reply_received, (c->reply_remaining < want) ? (usize)c->reply_remaining : want, 0);
+            if (n > 0) {
+                c->reply_received += n;
+                c->reply_remaining -= n;
+            }
+        } else if (c->reply_remaining > 0) {
+            const usize want = (c->reply_remaining < LOAD_IO_BUFFER_SIZE) ? (usize)c->reply_remaining : LOAD_IO_BUFFER_SIZE;
+            n = recv(c->fd, t->scratch, want, 0);
+            if (n > 0)
+                c->reply_remaining -= n;
+        } else {
+            c->header_received = 0;
+            if (!client_handle_packet(t, c, now))
+                return false;
+            continue;
+        }
+
+        if (n == 0)
+            return false;
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+}
+
+void client_event(LoadThread* restrict t, LoadClient* restrict c, const u32 events, const u64 now) {
+    if (c->state == ClientState_Connecting) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if ((events & (EPOLLERR | EPOLLHUP)) || getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0) {
+            ++t->stats.connect_errors;
+            client_close(t, c, now);
+            return;
+        }
+        ++t->stats.connects;
+        client_watch(t, c, false);
+        c->due_ns = now;
+        client_schedule(t, c, now);
+        return;
+    }
+
+    bool ok = true;
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        ok = client_read(t, c, now);
+    if (ok && (events & EPOLLOUT) && c->state == ClientState_Busy)
+        ok = client_write(t, c);
+    if (!ok) {
+        if (c->state == ClientState_Busy)
+            client_finish(t, c, false, now);
+        // client_finish() scheduled the next operation, the reconnect replaces it.
+        if (c->state == ClientState_Idle) {
+            for (usize i = 0; i < t->heap_count; ++i) {
+                if (t->heap[i] == c->id) {
+                    t->heap[i] = t->heap[--t->heap_count];
+                    // Restore the heap order from scratch, this is the rare path.
+                    const usize count = t->heap_count;
+                    t->heap_count = 0;
+                    for (usize j = 0; j < count; ++j)
+                        heap_push(t, t->heap[j]);
+                    break;
+                }
+            }
+        }
+        client_close(t, c, now);
+    }
+}
+
+ThreadArg load_thread(ThreadArg args) {
+    LoadThread* t = (LoadThread*)args;
+    struct epoll_event events[LOAD_MAX_EVENTS];
+
+    u64 now = Time_NowNs();
+    for (usize i = 0; i < t->clients_count; ++i)
+        client_connect(t, t->clients + i, now);
+
+    while (!g_stop) {
+        now = Time_NowNs();
+        while (t->heap_count > 0 && t->clients[t->heap[0]].due_ns <= now) {
+            LoadClient* c = t->clients + heap_pop(t);
+            if (c->state == ClientState_Closed)
+                client_connect(t, c, now);
+            else if (c->state == ClientState_Idle)
+                client_start(t, c);
+        }
+
+        int timeout_ms = 100;
+        if (t->heap_count > 0) {
+            const u64 due = t->clients[t->heap[0]].due_ns;
+            const u64 wait_ms = (due > now) ? (due - now + CTM_NS_PER_MS - 1) / CTM_NS_PER_MS : 0;
+            timeout_ms = (wait_ms < 100) ? (int)wait_ms : 100;
+        }
+
+        const int n = epoll_wait(t->epoll_fd, events, LOAD_MAX_EVENTS, timeout_ms);
+        now = Time_NowNs();
+        for (int i = 0; i < n; ++i)
+            client_event(t, t->clients + events[i].data.u32, events[i].events, now);
+    }
+
+    for (usize i = 0; i < t->clients_count; ++i) {
+        if (t->clients[i].fd >= 0)
+            close(t->clients[i].fd);
+    }
+    return NULL;
+}
+
+// Blocking upload used to put the files fget reads on the server before the run.
+bool load_prepare_file(const IPEndPoint ep, const char* restrict name, const u64 size) {
+    Socket* s = Socket_New(AddressFamily_InterNetwork, SocketType_Stream, ProtocolType_Tcp);
+    if (!s || Socket_Connect(s, ep) == CS_SOCKET_ERROR) {
+        if (s)
+            Socket_Dispose(s);
+        return false;
+    }
+
+    const usize name_size = strlen(name) + 1;
+    FileStat st = {size, 0};
+    NetPacket* request = NetPacket_New(NetPacketType_FileUploadRequest, (const u8*)name, name_size);
+    NetPacket_AddData(request, (const u8*)&st, sizeof(st));
+    NetPacket_Send(s, request);
+    NetPacket_Dispose(request);
+
+    bool ok = false;
+    NetPacket* reply = NetPacket_Receive(s);
+    if (reply && reply->header.id == NetPacketType_FileInfo) {
+        u64 sent = 0;
+        while (sent < size) {
+            const usize n = (size - sent < LOAD_IO_BUFFER_SIZE) ? (usize)(size - sent) : LOAD_IO_BUFFER_SIZE;
+            NetPacket data = {{NetPacketType_FileUploadData, n}, g_upload_data};
+            if (NetPacket_Send(s, &data) == CS_SOCKET_ERROR)
+                break;
+            sent += n;
+        }
+        NetPacket_Dispose(reply);
+        reply = (sent == size) ? NetPacket_Receive(s) : NULL;
+        ok = reply && reply->header.id == NetPacketType_Message;
+    }
+    NetPacket_Dispose(reply);
+    Socket_Dispose(s);
+    return ok;
+}
+
+void print_summary(LoadThread* restrict threads, const usize threads_count, const double elapsed_s) {
+    Histogram* all = (Histogram*)malloc(sizeof(Histogram));
+    Histogram* h = (Histogram*)malloc(sizeof(Histogram));
+    Histogram_Reset(all);
+    u64 connects = 0, connect_errors = 0;
+    for (usize i = 0; i < threads_count; ++i) {
+        connects += threads[i].stats.connects;
+        connect_errors += threads[i].stats.connect_errors;
+    }
+
+    printf("\n%-6s %10s %8s %10s %9s %9s %9s %9s %9s %9s %9s\n",
+           "op", "count", "errors", "ops/s", "MB/s", "mean ms", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (u32 op = 0; op <= LoadOp_Count; ++op) {
+        u64 count = 0, errors = 0, bytes = 0;
+        if (op < LoadOp_Count) {
+            Histogram_Reset(h);
+            for (usize i = 0; i < threads_count; ++i) {
+                Histogram_Merge(h, &threads[i].stats.latency[op]);
+                count += threads[i].stats.ops[op];
+                errors += threads[i].stats.errors[op];
+                bytes += threads[i].stats.bytes[op];
+            }
+            Histogram_Merge(all, h);
+        } else {
+            memcpy(h, all, sizeof(Histogram));
+            for (usize i = 0; i < threads_count; ++i) {
+                for (u32 o = 0; o < LoadOp_Count; ++o) {
+                    count += threads[i].stats.ops[o];
+                    errors += threads[i].stats.errors[o];
+                    bytes += threads[i].stats.bytes[o];
+                }
+            }
+        }
+        if (count == 0 && errors == 0)
+            continue;
+        const double ms = (double)CTM_NS_PER_MS;
+        printf("%-6s %10llu %8llu %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+               (op < LoadOp_Count) ? LoadOp_Name((LoadOp)op) : "all",
+               (unsigned long long)count,
+               (unsigned long long)errors,
+               (double)count / elapsed_s,
+               (double)bytes / elapsed_s / (1024.0 * 1024.0),
+               Histogram_Mean(h) / ms,
+               (double)Histogram_Percentile(h, 50.0) / ms,
+               (double)Histogram_Percentile(h, 90.0) / ms,
+               (double)Histogram_Percentile(h, 99.0) / ms,
+               (double)Histogram_Percentile(h, 99.9) / ms,
+               (double)h->max / ms);
+    }
+    printf("connections: %llu established, %llu failed\n", (unsigned long long)connects, (unsigned long long)connect_errors);
+    free(h);
+    free(all);
+}
+
+i32 main(const i32 argc, const char* argv[]) {
+    if (argc < 3) {
+        puts("Usage: nfload [ IPv4 ] [ port ] [ -c clients ] [ -t threads ] [ -d duration_s ] [ -i report_interval_s ]\n"
+             "              [ -m ls:fget:fup ] [ -s size:weight,... ] [ -z think_ms (closed loop) ]\n"
+             "              [ -r ops_per_s (open loop) ] [ -P (files are already on the server) ]");
+        return 0;
+    }
+
+    Workload w;
+    memset(&w, 0, sizeof(w));
+    Workload_ParseMix(&w, "20:70:10");
+    Workload_ParseSizes(&w, "4K:60,64K:30,1M:9,16M:1");
+    usize clients = 100;
+    usize threads_count = 4;
+    double duration_s = 10.0;
+    double interval_s = 1.0;
+    bool prepare = true;
+
+    const char* ipv4 = argv[1];
+    const u16 port = atoi(argv[2]);
+    for (i32 i = 3; i < argc; ++i) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            clients = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            threads_count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            duration_s = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+            interval_s = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            if (!Workload_ParseMix(&w, argv[++i])) {
+                fprintf(stderr, "Bad mix %s, expected ls:fget:fup weights.\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            if (!Workload_ParseSizes(&w, argv[++i])) {
+                fprintf(stderr, "Bad size distribution %s, expected size:weight,...\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (!strcmp(argv[i], "-z") && i + 1 < argc) {
+            w.think_ns = (u64)(atof(argv[++i]) * (double)CTM_NS_PER_MS);
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            w.rate = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-P")) {
+            prepare = false;
+        }
+    }
+    if (clients < 1)
+        clients = 1;
+    if (threads_count < 1)
+        threads_count = 1;
+    if (threads_count > LOAD_MAX_THREADS)
+        threads_count = LOAD_MAX_THREADS;
+    if (threads_count > clients)
+        threads_count = clients;
+    if (interval_s <= 0.0)
+        interval_s = 1.0;
+
+    signal(SIGPIPE, SIG_IGN);
+    CSSocket_Init();
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && clients + 64 > limit.rlim_cur) {
+        fprintf(stderr, "The open file limit (%llu) is too low for %zu clients.\n", (unsigned long long)limit.rlim_cur, clients);
+        return EXIT_FAILURE;
+    }
+
+    g_upload_data = (u8*)malloc(LOAD_IO_BUFFER_SIZE);
+    Rng seed_rng = {0x9e3779b97f4a7c15ull ^ Time_NowNs()};
+    for (usize i = 0; i < LOAD_IO_BUFFER_SIZE; i += sizeof(u64)) {
+        const u64 x = Rng_Next(&seed_rng);
+        memcpy(g_upload_data + i, &x, sizeof(x));
+    }
+
+    IPEndPoint ep = IPEndPoint_New(IPAddress_Parse(ipv4), AddressFamily_InterNetwork, port);
+    if (prepare && w.mix[LoadOp_Fget] > 0) {
+        printf("Uploading %zu file(s) for fget...\n", w.sizes_count);
+        for (usize i = 0; i < w.sizes_count; ++i) {
+            char name[LOAD_NAME_MAX];
+            Workload_FileName(name, sizeof(name), w.sizes[i].size);
+            if (!load_prepare_file(ep, name, w.sizes[i].size)) {
+                fprintf(stderr, "Failed to upload %s.\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    printf("%zu clients on %zu threads for %.1fs, mix ls:fget:fup %u:%u:%u, %s loop",
+           clients, threads_count, duration_s,
+           w.mix[LoadOp_Ls], w.mix[LoadOp_Fget], w.mix[LoadOp_Fup],
+           (w.rate > 0.0) ? "open" : "closed");
+    if (w.rate > 0.0)
+        printf(" at %.1f ops/s\n", w.rate);
+    else
+        printf(", think time %.1f ms\n", (double)w.think_ns / (double)CTM_NS_PER_MS);
+
+    LoadThread* threads = (LoadThread*)calloc(threads_count, sizeof(LoadThread));
+    Thread* handles[LOAD_MAX_THREADS];
+    for (usize i = 0; i < threads_count; ++i) {
+        LoadThread* t = threads + i;
+        t->index = (u32)i;
+        t->workload = &w;
+        t->addr = ep.address.ipv4_addr;
+        t->clients_count = clients / threads_count + ((i < clients % threads_count) ? 1 : 0);
+        t->clients = (LoadClient*)calloc(t->clients_count, sizeof(LoadClient));
+        for (usize j = 0; j < t->clients_count; ++j) {
+            t->clients[j].fd = -1;
+            t->clients[j].id = (u32)j;
+        }
+        t->arrival_mean_ns = (w.rate > 0.0) ? (double)clients * (double)CTM_NS_PER_SEC / w.rate : 0.0;
+        t->epoll_fd = epoll_create1(0);
+        t->heap = (u32*)malloc(sizeof(u32) * t->clients_count);
+        t->heap_count = 0;
+        t->rng.state = Rng_Next(&seed_rng) | 1;
+        t->scratch = (u8*)malloc(LOAD_IO_BUFFER_SIZE);
+        for (u32 op = 0; op < LoadOp_Count; ++op)
+            Histogram_Reset(&t->stats.latency[op]);
+        Histogram_Reset(&t->stats.interval);
+        t->stats.mutex = Mutex_New();
+
+        ThreadAttributes attr;
+        attr.args = (ThreadArg)t;
+        attr.initial_stack_size = 0;
+        attr.detached = false;
+        attr.cpus = NULL;
+        attr.name = "nfload";
+        attr.routine = load_thread;
+        handles[i] = Thread_New(&attr);
+    }
+
+    // Report throughput and latency every interval.
+    Histogram* interval = (Histogram*)malloc(sizeof(Histogram));
+    const u64 start = Time_NowNs();
+    const u64 end = start + (u64)(duration_s * (double)CTM_NS_PER_SEC);
+    u64 next_report = start;
+    printf("%8s %10s %9s %7s %9s %9s %9s\n", "time s", "ops/s", "MB/s", "errors", "p50 ms", "p99 ms", "max ms");
+    while (Time_NowNs() < end) {
+        next_report += (u64)(interval_s * (double)CTM_NS_PER_SEC);
+        const u64 now = Time_NowNs();
+        const u64 wake = (next_report < end) ? next_report : end;
+        if (wake > now)
+            usleep((useconds_t)((wake - now) / CTM_NS_PER_US));
+
+        Histogram_Reset(interval);
+        u64 ops = 0, errors = 0, bytes = 0;
+        for (usize i = 0; i < threads_count; ++i) {
+            LoadStats* s = &threads[i].stats;
+            Mutex_Lock(s->mutex);
+            Histogram_Merge(interval, &s->interval);
+            ops += s->interval_ops;
+            errors += s->interval_errors;
+            bytes += s->interval_bytes;
+            Histogram_Reset(&s->interval);
+            s->interval_ops = s->interval_errors = s->interval_bytes = 0;
+            Mutex_Unlock(s->mutex);
+        }
+        const double elapsed = (double)(Time_NowNs() - start) / (double)CTM_NS_PER_SEC;
+        printf("%8.1f %10.1f %9.2f %7llu %9.3f %9.3f %9.3f\n",
+               elapsed,
+               (double)ops / interval_s,
+               (double)bytes / interval_s / (1024.0 * 1024.0),
+               (unsigned long long)errors,
+               (double)Histogram_Percentile(interval, 50.0) / (double)CTM_NS_PER_MS,
+               (double)Histogram_Percentile(interval, 99.0) / (double)CTM_NS_PER_MS,
+               (double)interval->max / (double)CTM_NS_PER_MS);
+        fflush(stdout);
+    }
+    g_stop = true;
+    for (usize i = 0; i < threads_count; ++i) {
+        Thread_Join(handles[i]);
+        Thread_Dispose(handles[i]);
+    }
+    const double elapsed_s = (double)(Time_NowNs() - start) / (double)CTM_NS_PER_SEC;
+    print_summary(threads, threads_count, elapsed_s);
+
+    for (usize i = 0; i < threads_count; ++i) {
+        close(threads[i].epoll_fd);
+        Mutex_Dispose(threads[i].stats.mutex);
+        free(threads[i].clients);
+        free(threads[i].heap);
+        free(threads[i].scratch);
+    }
+    free(threads);
+    free(interval);
+    free(g_upload_data);
+    return 0;
+}
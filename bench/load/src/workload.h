@@ -0,0 +1,132 @@
+#ifndef NETFS_LOAD_WORKLOAD_H
+#define NETFS_LOAD_WORKLOAD_H
+
+#include <stdnfs.h>
+#include <math.h>
+
+#define LOAD_MAX_SIZES 16
+
+typedef enum _netfs_load_op {
+    LoadOp_Ls,
+    LoadOp_Fget,
+    LoadOp_Fup,
+    LoadOp_Count
+} LoadOp;
+
+const char* LoadOp_Name(const LoadOp op) {
+    static const char* names[] = {"ls", "fget", "fup"};
+    return (op < LoadOp_Count) ? names[op] : "?";
+}
+
+typedef struct _netfs_load_size_class {
+    u64 size;
+    u32 weight;
+} SizeClass;
+
+// What every simulated client does: which operations in what proportion, how big the
+// files are, and how the next operation is scheduled.
+typedef struct _netfs_load_workload {
+    u32 mix[LoadOp_Count];
+    u32 mix_total;
+    SizeClass sizes[LOAD_MAX_SIZES];
+    usize sizes_count;
+    u32 sizes_total;
+    u64 think_ns; // Closed loop: mean pause between the end of one operation and the next.
+    double rate;  // Open loop: operations per second over all clients, 0 for closed loop.
+} Workload;
+
+// xorshift64*, one per thread.
+typedef struct _netfs_load_rng {
+    u64 state;
+} Rng;
+
+u64 Rng_Next(Rng* restrict r) {
+    r->state ^= r->state >> 12;
+    r->state ^= r->state << 25;
+    r->state ^= r->state >> 27;
+    return r->state * 0x2545f4914f6cdd1dull;
+}
+
+// Uniform in (0, 1].
+double Rng_Uniform(Rng* restrict r) {
+    return ((double)(Rng_Next(r) >> 11) + 1.0) / 9007199254740992.0;
+}
+
+// Exponentially distributed with the given mean, the gaps between Poisson arrivals.
+u64 Rng_Exponential(Rng* restrict r, const double mean) {
+    if (mean <= 0.0)
+        return 0;
+    return (u64)(-log(Rng_Uniform(r)) * mean);
+}
+
+// Parse "64K", "1M", "2G" or a plain byte count.
+u64 _load_parse_size(const char* restrict str, char** restrict end) {
+    u64 value = strtoull(str, end, 10);
+    switch (**end) {
+        case 'k': case 'K': value <<= 10; ++*end; break;
+        case 'm': case 'M': value <<= 20; ++*end; break;
+        case 'g': case 'G': value <<= 30; ++*end; break;
+        default: break;
+    }
+    return value;
+}
+
+// "ls:fget:fup" weights, e.g. "20:70:10".
+bool Workload_ParseMix(Workload* restrict w, const char* restrict str) {
+    unsigned ls = 0, fget = 0, fup = 0;
+    if (sscanf(str, "%u:%u:%u", &ls, &fget, &fup) != 3 || ls + fget + fup == 0)
+        return false;
+    w->mix[LoadOp_Ls] = ls;
+    w->mix[LoadOp_Fget] = fget;
+    w->mix[LoadOp_Fup] = fup;
+    w->mix_total = ls + fget + fup;
+    return true;
+}
+
+// "size:weight,..." e.g. "4K:60,64K:30,1M:9,16M:1".
+bool Workload_ParseSizes(Workload* restrict w, const char* restrict str) {
+    w->sizes_count = 0;
+    w->sizes_total = 0;
+    char* p = (char*)str;
+    while (*p && w->sizes_count < LOAD_MAX_SIZES) {
+        SizeClass* c = w->sizes + w->sizes_count;
+        c->size = _load_parse_size(p, &p);
+        if (*p != ':')
+            return false;
+        c->weight = (u32)strtoul(p + 1, &p, 10);
+        w->sizes_total += c->weight;
+        ++w->sizes_count;
+        if (*p == ',')
+            ++p;
+        else if (*p)
+            return false;
+    }
+    return w->sizes_count > 0 && w->sizes_total > 0;
+}
+
+LoadOp Workload_PickOp(const Workload* restrict w, Rng* restrict r) {
+    u32 x = (u32)(Rng_Next(r) % w->mix_total);
+    for (u32 op = 0; op < LoadOp_Count; ++op) {
+        if (x < w->mix[op])
+            return (LoadOp)op;
+        x -= w->mix[op];
+    }
+    return LoadOp_Ls;
+}
+
+usize Workload_PickSize(const Workload* restrict w, Rng* restrict r) {
+    u32 x = (u32)(Rng_Next(r) % w->sizes_total);
+    for (usize i = 0; i < w->sizes_count; ++i) {
+        if (x < w->sizes[i].weight)
+            return i;
+        x -= w->sizes[i].weight;
+    }
+    return 0;
+}
+
+// Remote name of the prepared file fget reads for a size class.
+void Workload_FileName(char* restrict buffer, const usize buffer_size, const u64 size) {
+    snprintf(buffer, buffer_size, "nfload_%llu.bin", (unsigned long long)size);
+}
+
+#endif // NETFS_LOAD_WORKLOAD_H
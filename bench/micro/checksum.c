@@ -0,0 +1,56 @@
+// Checksumming one fget/fup frame: CRC32C on the crc32 instruction against the portable
+// slicing-by-8 version, and the FNV-1a content hash of the cache for scale. The per
+// operation time of the frame sized runs is what every frame costs on either side.
+#include "micro.h"
+#include <cs_crc32c.h>
+#include <net_transfer.h>
+
+// Keeps the compiler from optimizing the checksums away.
+volatile u32 g_sink = 0;
+
+typedef enum _micro_checksum_kind {
+    ChecksumKind_Crc32c,
+    ChecksumKind_Crc32cPortable,
+    ChecksumKind_Fnv1a64
+} ChecksumKind;
+
+void bench_checksum(const ChecksumKind kind, const u8* restrict data, const usize size, const u64 iterations) {
+    static const char* kinds[] = {"Crc32c", "Crc32cPortable", "Fnv1a64"};
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%zu", kinds[kind], size);
+    MicroRun run;
+    Micro_Begin(&run);
+    const u64 start_ns = Time_NowNs();
+    for (u64 i = 0; i < iterations; ++i) {
+        switch (kind) {
+            case ChecksumKind_Crc32c: g_sink ^= Crc32c_Update(0, data, size); break;
+            case ChecksumKind_Crc32cPortable: g_sink ^= Crc32c_UpdatePortable(0, data, size); break;
+            case ChecksumKind_Fnv1a64: g_sink ^= (u32)Hash_Fnv1a64(NET_HASH_SEED, data, size); break;
+        }
+    }
+    const u64 elapsed_ns = Time_NowNs() - start_ns;
+    Micro_End(&run, name, iterations);
+    printf("  %s: %.2f GB/s\n", name, (double)size * (double)iterations / (double)((elapsed_ns) ? elapsed_ns : 1));
+}
+
+i32 main(const i32 argc, const char* argv[]) {
+    const double scale = Micro_ParseScale(argc, argv);
+    Micro_PrintHeader("frame checksums: CRC32C (hardware, portable) vs FNV-1a");
+    if (!Crc32c_HasHardware())
+        puts("# no crc32 instruction on this cpu, Crc32c falls back to the portable version");
+
+    // A minimum chunk, a frame and a maximum chunk.
+    static const usize sizes[] = {4096, NET_BULK_FRAME_SIZE, NET_CHUNK_MAX_SIZE};
+    u8* data = (u8*)malloc(NET_CHUNK_MAX_SIZE);
+    for (usize i = 0; i < NET_CHUNK_MAX_SIZE; ++i)
+        data[i] = (u8)(i * 2654435761u >> 13);
+
+    for (usize i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        const u64 iterations = (u64)(2000000 * scale) / (1 + sizes[i] / 1024);
+        bench_checksum(ChecksumKind_Crc32c, data, sizes[i], iterations);
+        bench_checksum(ChecksumKind_Crc32cPortable, data, sizes[i], iterations / 4 + 1);
+        bench_checksum(ChecksumKind_Fnv1a64, data, sizes[i], iterations / 8 + 1);
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,82 @@
+// Directory_Open on synthetic directories of 1k to 1M empty files, the work behind every ls.
+// POSIX only.
+#include "micro.h"
+#include <cs_systemio.h>
+#include <ftw.h>
+#include <fcntl.h>
+
+int _micro_remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Directory_Open() resolves entries against the working directory, so list "." from inside.
+void bench_directory(const char* restrict root, const usize entries, const u64 iterations) {
+    char dir[CIO_PATH_MAX + 32];
+    snprintf(dir, sizeof(dir), "%s/d%zu", root, entries);
+    if (Directory_Create(dir) == CIO_FILE_ERROR)
+        return;
+    for (usize i = 0; i < entries; ++i) {
+        char path[CIO_PATH_MAX + 64];
+        snprintf(path, sizeof(path), "%s/entry_%07zu", dir, i);
+        const int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            perror("open");
+            return;
+        }
+        close(fd);
+    }
+
+    char cwd[CIO_PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)) || chdir(dir) != 0)
+        return;
+
+    char name[64];
+    snprintf(name, sizeof(name), "Directory_Open/%zu_entries", entries);
+    // One run to warm the dentry and inode caches.
+    DirectoryInfo* info = Directory_Open(".");
+    if (info)
+        Directory_Close(info);
+
+    MicroRun run;
+    Micro_Begin(&run);
+    for (u64 i = 0; i < iterations; ++i) {
+        info = Directory_Open(".");
+        if (info)
+            Directory_Close(info);
+    }
+    Micro_End(&run, name, iterations);
+
+    if (chdir(cwd) != 0)
+        perror("chdir");
+}
+
+i32 main(const i32 argc, const char* argv[]) {
+    const double scale = Micro_ParseScale(argc, argv);
+    usize max_entries = 1000000;
+    const char* base = "/tmp";
+    for (i32 i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "-m"))
+            max_entries = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-w"))
+            base = argv[i + 1];
+    }
+
+    char root[CIO_PATH_MAX];
+    snprintf(root, sizeof(root), "%s/nfmicro.XXXXXX", base);
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    Micro_PrintHeader("directory listing: Directory_Open + Directory_Close");
+    for (usize entries = 1000; entries <= max_entries; entries *= 10) {
+        u64 iterations = (u64)(200000 * scale) / entries;
+        bench_directory(root, entries, (iterations > 0) ? iterations : 1);
+    }
+
+    nftw(root, _micro_remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#ifndef NETFS_MICRO_H
+#define NETFS_MICRO_H
+
+// Tiny harness shared by the nfmicro_* microbenchmarks.
+// Every measurement reports time, CPU cycles (where a cycle counter is available),
+// heap allocations and allocated bytes per operation.
+// Allocations are counted by wrapping malloc() and friends, which also catches the ones
+// made inside libc (opendir() for example). That needs glibc, elsewhere the counts read 0.
+
+#include <stdnfs.h>
+#include <cs_time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MICRO_HAVE_CYCLES 1
+#else
+#define MICRO_HAVE_CYCLES 0
+#endif
+
+// Counters are volatile: malloc() is declared leaf, so without it the compiler may keep
+// a counter in a register across allocating calls.
+volatile u64 g_micro_allocs = 0;
+volatile u64 g_micro_alloc_bytes = 0;
+
+#ifdef __GLIBC__
+#define MICRO_HAVE_ALLOC_COUNT 1
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+void _micro_count(const size_t size) {
+    __atomic_fetch_add(&g_micro_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_micro_alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+    _micro_count(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    _micro_count(count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    _micro_count(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+#else
+#define MICRO_HAVE_ALLOC_COUNT 0
+#endif
+
+u64 Micro_Cycles() {
+#if MICRO_HAVE_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+typedef struct _netfs_micro_run {
+    u64 start_ns;
+    u64 start_cycles;
+    u64 start_allocs;
+    u64 start_alloc_bytes;
+} MicroRun;
+
+void Micro_PrintHeader(const char* restrict title) {
+    printf("# %s\n", title);
+    printf("%-40s %12s %12s %12s %10s %12s\n", "benchmark", "ops", "ns/op", "cycles/op", "allocs/op", "bytes/op");
+}
+
+void Micro_Begin(MicroRun* restrict run) {
+    run->start_allocs = __atomic_load_n(&g_micro_allocs, __ATOMIC_SEQ_CST);
+    run->start_alloc_bytes = __atomic_load_n(&g_micro_alloc_bytes, __ATOMIC_SEQ_CST);
+    run->start_cycles = Micro_Cycles();
+    run->start_ns = Time_NowNs();
+}
+
+// Finish a run of ops operations and print its per operation figures.
+void Micro_End(MicroRun* restrict run, const char* restrict name, const u64 ops) {
+    const u64 ns = Time_NowNs() - run->start_ns;
+    const u64 cycles = Micro_Cycles() - run->start_cycles;
+    const u64 allocs = __atomic_load_n(&g_micro_allocs, __ATOMIC_SEQ_CST) - run->start_allocs;
+    const u64 alloc_bytes = __atomic_load_n(&g_micro_alloc_bytes, __ATOMIC_SEQ_CST) - run->start_alloc_bytes;
+    const double n = (ops > 0) ? (double)ops : 1.0;
+
+    printf("%-40s %12llu %12.1f ", name, (unsigned long long)ops, (double)ns / n);
+    if (MICRO_HAVE_CYCLES)
+        printf("%12.1f ", (double)cycles / n);
+    else
+        printf("%12s ", "-");
+    if (MICRO_HAVE_ALLOC_COUNT)
+        printf("%10.2f %12.1f\n", (double)allocs / n, (double)alloc_bytes / n);
+    else
+        printf("%10s %12s\n", "-", "-");
+    fflush(stdout);
+}
+
+// Common -i option: scale every iteration count by this factor.
+double Micro_ParseScale(const i32 argc, const char* argv[]) {
+    for (i32 i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "-i"))
+            return atof(argv[i + 1]);
+    }
+    return 1.0;
+}
+
+#endif // NETFS_MICRO_H
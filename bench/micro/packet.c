@@ -0,0 +1,58 @@
+// NetPacket_New/NetPacket_AddData/NetPacket_Dispose churn, the allocation pattern of every
+// request and reply.
+#include "micro.h"
+#include <net_common.h>
+
+// Keeps the compiler from optimizing the packets away.
+volatile u8 g_sink = 0;
+
+void bench_new_dispose(const usize payload_size, const u64 iterations) {
+    u8* payload = (u8*)malloc(payload_size);
+    memset(payload, 0xab, payload_size);
+
+    char name[64];
+    snprintf(name, sizeof(name), "New+Dispose/%zu", payload_size);
+    MicroRun run;
+    Micro_Begin(&run);
+    for (u64 i = 0; i < iterations; ++i) {
+        NetPacket* p = NetPacket_New(NetPacketType_Message, payload, payload_size);
+        g_sink ^= p->buffer[0];
+        NetPacket_Dispose(p);
+    }
+    Micro_End(&run, name, iterations);
+    free(payload);
+}
+
+// Build a payload out of parts, like the ls reply does with one AddData per entry.
+void bench_add_data(const usize part_size, const usize parts, const u64 iterations) {
+    u8* part = (u8*)malloc(part_size);
+    memset(part, 0xcd, part_size);
+
+    char name[64];
+    snprintf(name, sizeof(name), "New+AddData*%zu+Dispose/%zu", parts, part_size);
+    MicroRun run;
+    Micro_Begin(&run);
+    for (u64 i = 0; i < iterations; ++i) {
+        NetPacket* p = NetPacket_New(NetPacketType_Message, NULL, 0);
+        for (usize j = 0; j < parts; ++j)
+            NetPacket_AddData(p, part, part_size);
+        g_sink ^= p->buffer[p->header.size - 1];
+        NetPacket_Dispose(p);
+    }
+    Micro_End(&run, name, iterations);
+    free(part);
+}
+
+i32 main(const i32 argc, const char* argv[]) {
+    const double scale = Micro_ParseScale(argc, argv);
+    Micro_PrintHeader("packet encode: NetPacket_New / NetPacket_AddData / NetPacket_Dispose");
+
+    static const usize sizes[] = {16, 256, 4096, 65536};
+    for (usize i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        bench_new_dispose(sizes[i], (u64)(2000000 * scale) / (1 + sizes[i] / 4096));
+
+    bench_add_data(48, 1, (u64)(1000000 * scale));
+    bench_add_data(48, 16, (u64)(200000 * scale));
+    bench_add_data(48, 256, (u64)(20000 * scale));
+    return 0;
+}
@@ -0,0 +1,96 @@
+// NetPacketQueue push/pop with 1..N producer threads feeding a single consumer,
+// which is how the client receiver thread hands replies to the command thread.
+#include "micro.h"
+#include <cs_threads.h>
+#include <net_common.h>
+
+#define QUEUE_MAX_PRODUCERS 16
+
+typedef struct _micro_queue_producer {
+    NetPacketQueue* queue;
+    NetPacket* packets;
+    u64 count;
+} QueueProducer;
+
+ThreadArg queue_producer(ThreadArg args) {
+    QueueProducer* p = (QueueProducer*)args;
+    for (u64 i = 0; i < p->count; ++i) {
+        while (!NetPacketQueue_TryAdd(p->queue, p->packets + i)) ;
+    }
+    return NULL;
+}
+
+// Packets are preallocated so only the queue's own allocations are counted.
+void bench_queue(const usize producers, const u64 per_producer) {
+    NetPacketQueue* q = NetPacketQueue_New();
+    QueueProducer args[QUEUE_MAX_PRODUCERS];
+    Thread* threads[QUEUE_MAX_PRODUCERS];
+    for (usize i = 0; i < producers; ++i) {
+        args[i].queue = q;
+        args[i].count = per_producer;
+        args[i].packets = (NetPacket*)calloc(per_producer, sizeof(NetPacket));
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "TryAdd+TryPop/%zu_producers", producers);
+    MicroRun run;
+    Micro_Begin(&run);
+    for (usize i = 0; i < producers; ++i) {
+        ThreadAttributes attr;
+        attr.args = (ThreadArg)(args + i);
+        attr.initial_stack_size = 0;
+        attr.detached = false;
+        attr.cpus = NULL;
+        attr.name = NULL;
+        attr.routine = queue_producer;
+        threads[i] = Thread_New(&attr);
+    }
+
+    const u64 total = per_producer * producers;
+    u64 popped = 0;
+    while (popped < total) {
+        if (NetPacketQueue_TryPop(q))
+            ++popped;
+    }
+    for (usize i = 0; i < producers; ++i)
+        Thread_Join(threads[i]);
+    Micro_End(&run, name, total);
+
+    for (usize i = 0; i < producers; ++i) {
+        Thread_Dispose(threads[i]);
+        free(args[i].packets);
+    }
+    NetPacketQueue_Dispose(q);
+}
+
+// Single threaded, the queue never holds more than one packet: the uncontended cost.
+void bench_queue_uncontended(const u64 iterations) {
+    NetPacketQueue* q = NetPacketQueue_New();
+    NetPacket packet = {{NetPacketType_Message, 0}, NULL};
+
+    MicroRun run;
+    Micro_Begin(&run);
+    for (u64 i = 0; i < iterations; ++i) {
+        NetPacketQueue_TryAdd(q, &packet);
+        NetPacketQueue_TryPop(q);
+    }
+    Micro_End(&run, "TryAdd+TryPop/uncontended", iterations);
+    NetPacketQueue_Dispose(q);
+}
+
+i32 main(const i32 argc, const char* argv[]) {
+    const double scale = Micro_ParseScale(argc, argv);
+    usize max_producers = 8;
+    for (i32 i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "-p"))
+            max_producers = atoi(argv[i + 1]);
+    }
+    if (max_producers > QUEUE_MAX_PRODUCERS)
+        max_producers = QUEUE_MAX_PRODUCERS;
+
+    Micro_PrintHeader("packet queue: NetPacketQueue_TryAdd / NetPacketQueue_TryPop");
+    bench_queue_uncontended((u64)(5000000 * scale));
+    for (usize producers = 1; producers <= max_producers; producers *= 2)
+        bench_queue(producers, (u64)(2000000 * scale) / producers);
+    return 0;
+}
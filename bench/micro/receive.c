@@ -0,0 +1,86 @@
+// NetPacket_Send/NetPacket_Receive framing over a socketpair: the per packet cost of
+// the syscalls and allocations without any network in the way. POSIX only.
+#include "micro.h"
+#include <cs_sockets.h>
+#include <cs_threads.h>
+#include <net_common.h>
+
+typedef struct _micro_receive_sender {
+    Socket* socket;
+    usize payload_size;
+    u64 count;
+} ReceiveSender;
+
+Socket* micro_socket_from_fd(const int fd) {
+    Socket* s = (Socket*)malloc(sizeof(Socket));
+    memset(s, 0, sizeof(Socket));
+    s->family = AF_UNIX;
+    s->stype = SocketType_Stream;
+    s->_native_handle = fd;
+    s->_passed_fd = -1;
+    s->connected = true;
+    return s;
+}
+
+ThreadArg receive_sender(ThreadArg args) {
+    ReceiveSender* sender = (ReceiveSender*)args;
+    NetPacket* p = NetPacket_New(NetPacketType_Message, NULL, sender->payload_size);
+    for (u64 i = 0; i < sender->count; ++i) {
+        if (NetPacket_Send(sender->socket, p) == CS_SOCKET_ERROR)
+            break;
+    }
+    NetPacket_Dispose(p);
+    return NULL;
+}
+
+// The sender's allocations happen once up front, everything counted is the receiver's.
+void bench_receive(const usize payload_size, const u64 count) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("socketpair");
+        return;
+    }
+    Socket* receiver = micro_socket_from_fd(fds[0]);
+    ReceiveSender sender;
+    sender.socket = micro_socket_from_fd(fds[1]);
+    sender.payload_size = payload_size;
+    sender.count = count;
+
+    char name[64];
+    snprintf(name, sizeof(name), "Send+Receive/%zu", payload_size);
+    ThreadAttributes attr;
+    attr.args = (ThreadArg)&sender;
+    attr.initial_stack_size = 0;
+    attr.detached = false;
+    attr.cpus = NULL;
+    attr.name = NULL;
+    attr.routine = receive_sender;
+
+    MicroRun run;
+    Micro_Begin(&run);
+    Thread* t = Thread_New(&attr);
+    u64 received = 0;
+    for (; received < count; ++received) {
+        NetPacket* p = NetPacket_Receive(receiver);
+        if (!p)
+            break;
+        NetPacket_Dispose(p);
+    }
+    Thread_Join(t);
+    Micro_End(&run, name, received);
+
+    Thread_Dispose(t);
+    Socket_Dispose(sender.socket);
+    Socket_Dispose(receiver);
+}
+
+i32 main(const i32 argc, const char* argv[]) {
+    const double scale = Micro_ParseScale(argc, argv);
+    CSSocket_Init();
+
+    Micro_PrintHeader("packet framing: NetPacket_Send / NetPacket_Receive over a socketpair");
+    static const usize sizes[] = {0, 64, 4096, 65536, 1048576};
+    for (usize i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        bench_receive(sizes[i], (u64)(200000 * scale) / (1 + sizes[i] / 4096));
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Request/reply round trips between two threads, over a shared memory channel and, for
+// comparison, over a socketpair: what a local metadata request costs in transport alone.
+// The channel's busy poll window only applies with more than one cpu. Linux only.
+#include "micro.h"
+#include <cs_sockets.h>
+#include <cs_shmring.h>
+#include <cs_threads.h>
+#include <net_common.h>
+
+#ifdef CSR_AVAILABLE
+typedef struct _micro_ring_echo {
+    ShmChannel* channel;
+    Socket* socket;
+    u64 count;
+} RingEcho;
+
+// Answers every packet with the same packet.
+ThreadArg ring_echo(ThreadArg args) {
+    RingEcho* echo = (RingEcho*)args;
+    for (u64 i = 0; i < echo->count; ++i) {
+        NetPacket* p = (echo->channel) ? NetPacket_ReceiveShm(echo->channel) : NetPacket_Receive(echo->socket);
+        if (!p)
+            break;
+        const i32 res = (echo->channel) ? NetPacket_SendShm(echo->channel, p) : NetPacket_Send(echo->socket, p);
+        NetPacket_Dispose(p);
+        if (res == CS_SOCKET_ERROR)
+            break;
+    }
+    return NULL;
+}
+
+Socket* ring_socket_from_fd(const int fd) {
+    Socket* s = (Socket*)malloc(sizeof(Socket));
+    memset(s, 0, sizeof(Socket));
+    s->family = AF_UNIX;
+    s->stype = SocketType_Stream;
+    s->_native_handle = fd;
+    s->_passed_fd = -1;
+    s->connected = true;
+    return s;
+}
+
+// Counted allocations include the echo thread's, two packets per round trip on either side.
+void bench_round_trip(const bool shared_memory, const usize payload_size, const u64 count) {
+    RingEcho echo;
+    memset(&echo, 0, sizeof(echo));
+    echo.count = count;
+    ShmChannel* client_channel = NULL;
+    Socket* client_socket = NULL;
+    if (shared_memory) {
+        echo.channel = ShmChannel_Create(0);
+        client_channel = (echo.channel) ? ShmChannel_Attach(dup(echo.channel->fd)) : NULL;
+        if (!client_channel) {
+            if (echo.channel)
+                ShmChannel_Dispose(echo.channel);
+            return;
+        }
+    } else {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            perror("socketpair");
+            return;
+        }
+        client_socket = ring_socket_from_fd(fds[0]);
+        echo.socket = ring_socket_from_fd(fds[1]);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "RoundTrip/%s/%zu", (shared_memory) ? "shm" : "socketpair", payload_size);
+    ThreadAttributes attr;
+    attr.args = (ThreadArg)&echo;
+    attr.initial_stack_size = 0;
+    attr.detached = false;
+    attr.cpus = NULL;
+    attr.name = NULL;
+    attr.routine = ring_echo;
+
+    NetPacket* request = NetPacket_New(NetPacketType_ListEntries, NULL, payload_size);
+    MicroRun run;
+    Micro_Begin(&run);
+    Thread* t = Thread_New(&attr);
+    u64 done = 0;
+    for (; done < count; ++done) {
+        const i32 res = (client_channel) ? NetPacket_SendShm(client_channel, request) : NetPacket_Send(client_socket, request);
+        if (res == CS_SOCKET_ERROR)
+            break;
+        NetPacket* reply = (client_channel) ? NetPacket_ReceiveShm(client_channel) : NetPacket_Receive(client_socket);
+        if (!reply)
+            break;
+        NetPacket_Dispose(reply);
+    }
+    Thread_Join(t);
+    Micro_End(&run, name, done);
+
+    Thread_Dispose(t);
+    NetPacket_Dispose(request);
+    if (shared_memory) {
+        ShmChannel_Dispose(client_channel);
+        ShmChannel_Dispose(echo.channel);
+    } else {
+        Socket_Dispose(client_socket);
+        Socket_Dispose(echo.socket);
+    }
+}
+
+i32 main(const i32 argc, const char* argv[]) {
+    const double scale = Micro_ParseScale(argc, argv);
+    CSSocket_Init();
+
+    Micro_PrintHeader("local transport: request/reply over ShmChannel vs a socketpair");
+    static const usize sizes[] = {0, 256, 4096, 65536};
+    for (usize i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        const u64 count = (u64)(100000 * scale) / (1 + sizes[i] / 4096);
+        bench_round_trip(true, sizes[i], count);
+        bench_round_trip(false, sizes[i], count);
+    }
+    return 0;
+}
+#else
+i32 main(const i32 argc, const char* argv[]) {
+    puts("Shared memory channels are only available on Linux.");
+    return 0;
+}
+#endif
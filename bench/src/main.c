@@ -0,0 +1,514 @@
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_systemio.h>
+#include <cs_time.h>
+#include <net_common.h>
+#include <ftw.h>
+#include <sys/resource.h>
+#include "stats.h"
+#include "report.h"
+#include "server.h"
+
+#ifndef NFBENCH_SERVER_PATH
+#define NFBENCH_SERVER_PATH "./nfserver"
+#endif
+
+#define BENCH_MAX_REPLY_SIZE (usize)(64 * 1024 * 1024)
+#define BENCH_SMALL_FILE_COUNT 1000
+#define BENCH_SMALL_FILE_SIZE (u64)4096
+
+typedef struct _netfs_bench_config {
+    const char* server_path;
+    char work_dir[CIO_PATH_MAX];
+    u16 next_port;
+    bool quick;
+    usize max_clients;
+} BenchConfig;
+
+Socket* bench_connect(const u16 port) {
+    Socket* s = Socket_New(AddressFamily_InterNetwork, SocketType_Stream, ProtocolType_Tcp);
+    if (!s)
+        return NULL;
+    IPEndPoint ep = IPEndPoint_New(IPAddress_Parse("127.0.0.1"), AddressFamily_InterNetwork, port);
+    if (Socket_Connect(s, ep) == CS_SOCKET_ERROR) {
+        Socket_Dispose(s);
+        return NULL;
+    }
+    Socket_SetNoDelay(s, true);
+    return s;
+}
+
+// Read a reply header, rejecting anything that is not a sane framed packet
+// (a full server answers with a bare string instead).
+bool bench_receive_header(Socket* restrict s, PacketHeader* restrict header) {
+    if (NetPacket_ReceiveHeader(s, header) == CS_SOCKET_ERROR)
+        return false;
+    return header->id < NetPacketType_None && header->size <= BENCH_MAX_REPLY_SIZE;
+}
+
+bool bench_ls(Socket* restrict s) {
+    NetPacket request = {{NetPacketType_ListEntries, 0}, NULL};
+    if (NetPacket_Send(s, &request) == CS_SOCKET_ERROR)
+        return false;
+
+    PacketHeader header;
+    if (!bench_receive_header(s, &header) || NetPacket_DiscardPayload(s, &header) == CS_SOCKET_ERROR)
+        return false;
+    return header.id == NetPacketType_Message;
+}
+
+// Download name and throw the data away, returns the file size or -1.
+i64 bench_fget(Socket* restrict s, const char* restrict name, u8** buffer, usize* capacity) {
+    NetPacket request = {{NetPacketType_FileDownloadRequest, strlen(name) + 1}, (u8*)name};
+    if (NetPacket_Send(s, &request) == CS_SOCKET_ERROR)
+        return -1;
+
+    PacketHeader header;
+    if (!bench_receive_header(s, &header))
+        return -1;
+    if (header.id != NetPacketType_FileInfo || header.size < sizeof(FileStat)) {
+        NetPacket_DiscardPayload(s, &header);
+        return -1;
+    }
+    FileStat st;
+    if (Socket_ReceiveAll(s, (u8*)&st, sizeof(st), 0) == CS_SOCKET_ERROR)
+        return -1;
+
+    u64 received = 0;
+    while (received < st.size) {
+        if (!bench_receive_header(s, &header))
+            return -1;
+        if (header.id == NetPacketType_FileDownloadHole) {
+            u64 hole_size = 0;
+            if (header.size != sizeof(hole_size) || Socket_ReceiveAll(s, (u8*)&hole_size, sizeof(hole_size), 0) == CS_SOCKET_ERROR)
+                return -1;
+            received += hole_size;
+            continue;
+        }
+        if (header.id != NetPacketType_FileDownloadData) {
+            NetPacket_DiscardPayload(s, &header);
+            return -1;
+        }
+        if (header.size > *capacity) {
+            *capacity = header.size;
+            *buffer = (u8*)realloc(*buffer, *capacity);
+        }
+        if (header.size > 0 && Socket_ReceiveAll(s, *buffer, header.size, 0) == CS_SOCKET_ERROR)
+            return -1;
+        received += header.size;
+    }
+    return (i64)st.size;
+}
+
+bool bench_start_server(BenchConfig* restrict cfg, BenchServer* restrict srv, const char* restrict root) {
+    return BenchServer_Start(srv, cfg->server_path, root, cfg->next_port++) == 0;
+}
+
+// Single stream download throughput for a range of file sizes, one connection.
+void bench_download(BenchConfig* restrict cfg, Report* restrict report, const char* restrict data_dir) {
+    static const u64 sizes[] = {64ull << 10, 1ull << 20, 16ull << 20, 256ull << 20};
+    static const char* names[] = {"64KiB", "1MiB", "16MiB", "256MiB"};
+    const usize sizes_count = (cfg->quick) ? 3 : 4;
+    const u64 bytes_per_size = (cfg->quick) ? (64ull << 20) : (512ull << 20);
+
+    for (usize i = 0; i < sizes_count; ++i) {
+        char path[CIO_PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%s/dl_%s.bin", data_dir, names[i]);
+        if (Bench_CreateFile(path, sizes[i]) != 0) {
+            fprintf(stderr, "nfbench: Failed to create %s.\n", path);
+            return;
+        }
+    }
+
+    BenchServer srv;
+    if (!bench_start_server(cfg, &srv, data_dir))
+        return;
+    Socket* s = bench_connect(srv.port);
+
+    u8* buffer = NULL;
+    usize capacity = 0;
+    for (usize i = 0; s && i < sizes_count; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "dl_%s.bin", names[i]);
+
+        u64 reps = bytes_per_size / sizes[i];
+        reps = (reps < 3) ? 3 : (reps > 200) ? 200 : reps;
+
+        // One unmeasured run so every size starts from the page cache.
+        bench_fget(s, name, &buffer, &capacity);
+
+        Samples latencies;
+        Samples_Init(&latencies);
+        u64 errors = 0;
+        u64 bytes = 0;
+        for (u64 r = 0; r < reps && s->connected; ++r) {
+            const u64 start = Time_NowNs();
+            const i64 n = bench_fget(s, name, &buffer, &capacity);
+            if (n < 0) {
+                ++errors;
+                continue;
+            }
+            Samples_Add(&latencies, Time_NowNs() - start);
+            bytes += (u64)n;
+        }
+
+        const u64 total_ns = Samples_Sum(&latencies);
+        const double mbps = (total_ns) ? (double)bytes / (1024.0 * 1024.0) / ((double)total_ns / (double)CTM_NS_PER_SEC) : 0.0;
+        char result_name[REPORT_NAME_MAX];
+        snprintf(result_name, sizeof(result_name), "download.%s", names[i]);
+        Report_Add(report, result_name, "MB/s", mbps, true, &latencies, errors);
+        Samples_Dispose(&latencies);
+    }
+    free(buffer);
+    if (s)
+        Socket_Dispose(s);
+    BenchServer_Stop(&srv);
+}
+
+// Many tiny fgets back to back on one connection, dominated by per request overhead.
+void bench_small_files(BenchConfig* restrict cfg, Report* restrict report, const char* restrict data_dir) {
+    char dir[CIO_PATH_MAX + 32];
+    snprintf(dir, sizeof(dir), "%s/small", data_dir);
+    if (Directory_Create(dir) == CIO_FILE_ERROR)
+        return;
+    for (usize i = 0; i < BENCH_SMALL_FILE_COUNT; ++i) {
+        char path[CIO_PATH_MAX + 64];
+        snprintf(path, sizeof(path), "%s/f%04zu", dir, i);
+        if (Bench_CreateFile(path, BENCH_SMALL_FILE_SIZE) != 0)
+            return;
+    }
+
+    BenchServer srv;
+    if (!bench_start_server(cfg, &srv, data_dir))
+        return;
+    Socket* s = bench_connect(srv.port);
+    if (!s) {
+        BenchServer_Stop(&srv);
+        return;
+    }
+
+    u8* buffer = NULL;
+    usize capacity = 0;
+    Samples latencies;
+    Samples_Init(&latencies);
+    u64 errors = 0;
+    const usize passes = (cfg->quick) ? 2 : 5;
+    u64 start = 0;
+    for (usize pass = 0; pass < passes && s->connected; ++pass) {
+        // The first pass only warms the page cache.
+        if (pass == 1)
+            start = Time_NowNs();
+        for (usize i = 0; i < BENCH_SMALL_FILE_COUNT && s->connected; ++i) {
+            char name[32];
+            snprintf(name, sizeof(name), "small/f%04zu", i);
+            const u64 op_start = Time_NowNs();
+            const i64 n = bench_fget(s, name, &buffer, &capacity);
+            if (pass == 0)
+                continue;
+            if (n < 0)
+                ++errors;
+            else
+                Samples_Add(&latencies, Time_NowNs() - op_start);
+        }
+    }
+    const u64 elapsed = Time_NowNs() - start;
+    const double ops = (start && elapsed) ? (double)latencies.count * (double)CTM_NS_PER_SEC / (double)elapsed : 0.0;
+    Report_Add(report, "small_files.fget_4KiB", "ops/s", ops, true, &latencies, errors);
+
+    Samples_Dispose(&latencies);
+    free(buffer);
+    Socket_Dispose(s);
+    BenchServer_Stop(&srv);
+}
+
+// ls latency for directories of growing size, every size gets a server of its own since
+// ls lists the server root.
+void bench_ls_latency(BenchConfig* restrict cfg, Report* restrict report) {
+    static const usize sizes[] = {10, 100, 1000, 10000};
+    const usize sizes_count = (cfg->quick) ? 3 : 4;
+
+    for (usize i = 0; i < sizes_count; ++i) {
+        char dir[CIO_PATH_MAX + 32];
+        snprintf(dir, sizeof(dir), "%s/ls_%zu", cfg->work_dir, sizes[i]);
+        if (Directory_Create(dir) == CIO_FILE_ERROR)
+            return;
+        for (usize j = 0; j < sizes[i]; ++j) {
+            char path[CIO_PATH_MAX + 64];
+            snprintf(path, sizeof(path), "%s/entry_%06zu", dir, j);
+            FILE* fs = fopen(path, "w");
+            if (!fs)
+                return;
+            fclose(fs);
+        }
+
+        BenchServer srv;
+        if (!bench_start_server(cfg, &srv, dir))
+            return;
+        Socket* s = bench_connect(srv.port);
+        if (!s) {
+            BenchServer_Stop(&srv);
+            return;
+        }
+
+        usize iterations = 20000 / sizes[i];
+        iterations = (iterations < 20) ? 20 : (iterations > 500) ? 500 : iterations;
+        Samples latencies;
+        Samples_Init(&latencies);
+        u64 errors = 0;
+        bench_ls(s);
+        for (usize j = 0; j < iterations && s->connected; ++j) {
+            const u64 start = Time_NowNs();
+            if (bench_ls(s))
+                Samples_Add(&latencies, Time_NowNs() - start);
+            else
+                ++errors;
+        }
+
+        char result_name[REPORT_NAME_MAX];
+        snprintf(result_name, sizeof(result_name), "ls.%zu_entries", sizes[i]);
+        Report_Add(report, result_name, "ms", Samples_PercentileMs(&latencies, 50.0), false, &latencies, errors);
+        Samples_Dispose(&latencies);
+        Socket_Dispose(s);
+        BenchServer_Stop(&srv);
+    }
+}
+
+// ls round trips on a connection that is busy downloading a big file. Replies interleave
+// with the file data, so everything read until the listing shows up is consumed here.
+void bench_ls_during_download(BenchConfig* restrict cfg, Report* restrict report, const char* restrict data_dir) {
+    const u64 file_size = (cfg->quick) ? (64ull << 20) : (256ull << 20);
+    char path[CIO_PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/bulk.bin", data_dir);
+    if (Bench_CreateFile(path, file_size) != 0) {
+        fprintf(stderr, "nfbench: Failed to create %s.\n", path);
+        return;
+    }
+
+    BenchServer srv;
+    if (!bench_start_server(cfg, &srv, data_dir))
+        return;
+    Socket* s = bench_connect(srv.port);
+    if (!s) {
+        BenchServer_Stop(&srv);
+        return;
+    }
+
+    u8* buffer = NULL;
+    usize capacity = 0;
+    // Warm the page cache so the download is limited by the connection, not the disk.
+    bench_fget(s, "bulk.bin", &buffer, &capacity);
+
+    Samples latencies;
+    Samples_Init(&latencies);
+    u64 errors = 0;
+    const char* name = "bulk.bin";
+    NetPacket fget_request = {{NetPacketType_FileDownloadRequest, strlen(name) + 1}, (u8*)name};
+    NetPacket ls_request = {{NetPacketType_ListEntries, 0}, NULL};
+    bool ok = NetPacket_Send(s, &fget_request) != CS_SOCKET_ERROR;
+    u64 received = 0;
+    bool info = false;
+    while (ok && (!info || received < file_size)) {
+        const u64 start = Time_NowNs();
+        ok = NetPacket_Send(s, &ls_request) != CS_SOCKET_ERROR;
+        bool listed = false;
+        while (ok && !listed) {
+            PacketHeader header;
+            if (!bench_receive_header(s, &header)) {
+                ok = false;
+                break;
+            }
+            if (header.size > capacity) {
+                capacity = header.size;
+                buffer = (u8*)realloc(buffer, capacity);
+            }
+            if (header.size > 0 && Socket_ReceiveAll(s, buffer, header.size, 0) == CS_SOCKET_ERROR) {
+                ok = false;
+                break;
+            }
+            if (header.id == NetPacketType_Message) {
+                Samples_Add(&latencies, Time_NowNs() - start);
+                listed = true;
+            } else if (header.id == NetPacketType_FileInfo) {
+                info = true;
+            } else if (header.id == NetPacketType_FileDownloadData) {
+                received += header.size;
+            } else if (header.id == NetPacketType_FileDownloadHole && header.size == sizeof(u64)) {
+                received += *(u64*)buffer;
+            } else {
+                ++errors;
+                ok = false;
+            }
+        }
+        usleep(5000);
+    }
+    if (!ok)
+        ++errors;
+
+    Report_Add(report, "ls.during_download", "ms", Samples_PercentileMs(&latencies, 50.0), false, &latencies, errors);
+    Samples_Dispose(&latencies);
+    free(buffer);
+    Socket_Dispose(s);
+    BenchServer_Stop(&srv);
+}
+
+// Hold N connections open at once and do an ls round trip on each of them.
+// Connections the server turns away show up as errors.
+void bench_connection_scaling(BenchConfig* restrict cfg, Report* restrict report, const char* restrict data_dir) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    getrlimit(RLIMIT_NOFILE, &limit);
+
+    BenchServer srv;
+    if (!bench_start_server(cfg, &srv, data_dir))
+        return;
+
+    Socket** sockets = (Socket**)malloc(sizeof(Socket*) * cfg->max_clients);
+    for (usize n = 1; n <= cfg->max_clients; n *= 10) {
+        if (n + 64 > limit.rlim_cur) {
+            fprintf(stderr, "nfbench: Skipping %zu clients, the open file limit is %llu.\n", n, (unsigned long long)limit.rlim_cur);
+            break;
+        }
+
+        Samples latencies;
+        Samples_Init(&latencies);
+        u64 errors = 0;
+        usize connected = 0;
+        for (usize i = 0; i < n; ++i) {
+            sockets[connected] = bench_connect(srv.port);
+            if (sockets[connected])
+                ++connected;
+            else
+                ++errors;
+        }
+
+        const u64 start = Time_NowNs();
+        for (usize i = 0; i < connected; ++i) {
+            const u64 op_start = Time_NowNs();
+            if (bench_ls(sockets[i]))
+                Samples_Add(&latencies, Time_NowNs() - op_start);
+            else
+                ++errors;
+        }
+        const u64 elapsed = Time_NowNs() - start;
+
+        char result_name[REPORT_NAME_MAX];
+        snprintf(result_name, sizeof(result_name), "scale.%zu_clients", n);
+        Report_Add(report, result_name, "ops/s", (elapsed) ? (double)latencies.count * (double)CTM_NS_PER_SEC / (double)elapsed : 0.0, true, &latencies, errors);
+        Samples_Dispose(&latencies);
+
+        for (usize i = 0; i < connected; ++i)
+            Socket_Dispose(sockets[i]);
+        // Let the server notice the disconnects and free its slots before the next round.
+        usleep(200000);
+    }
+    free(sockets);
+    BenchServer_Stop(&srv);
+}
+
+int _bench_remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+i32 main(const i32 argc, const char* argv[]) {
+    BenchConfig cfg;
+    cfg.server_path = NFBENCH_SERVER_PATH;
+    cfg.next_port = 19500;
+    cfg.quick = false;
+    cfg.max_clients = 10000;
+    cfg.work_dir[0] = 0;
+
+    const char* output_path = NULL;
+    const char* baseline_path = NULL;
+    double threshold_pct = 10.0;
+    for (i32 i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            cfg.server_path = argv[++i];
+        } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            cfg.next_port = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            threshold_pct = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            snprintf(cfg.work_dir, sizeof(cfg.work_dir), "%s", argv[++i]);
+        } else if (!strcmp(argv[i], "-x") && i + 1 < argc) {
+            char* end = NULL;
+            const long max_clients = strtol(argv[++i], &end, 10);
+            if (*end || max_clients <= 0) {
+                fputs("Bad client count, expected a number above 0.\n", stderr);
+                return EXIT_FAILURE;
+            }
+            cfg.max_clients = (usize)max_clients;
+        } else if (!strcmp(argv[i], "-q")) {
+            cfg.quick = true;
+        } else {
+            puts("Usage: nfbench [ -s nfserver_path ] [ -p base_port ] [ -o results.json ] [ -c baseline.json ]\n"
+                 "               [ -t regression_threshold_percent ] [ -w work_dir ] [ -x max_clients ] [ -q (quick) ]");
+            return 0;
+        }
+    }
+    // Connections the server drops must not take the benchmark down with them.
+    signal(SIGPIPE, SIG_IGN);
+    CSSocket_Init();
+
+    bool own_work_dir = false;
+    if (!cfg.work_dir[0]) {
+        snprintf(cfg.work_dir, sizeof(cfg.work_dir), "/tmp/nfbench.XXXXXX");
+        if (!mkdtemp(cfg.work_dir)) {
+            perror("nfbench: mkdtemp");
+            return EXIT_FAILURE;
+        }
+        own_work_dir = true;
+    }
+    char data_dir[CIO_PATH_MAX + 16];
+    snprintf(data_dir, sizeof(data_dir), "%s/data", cfg.work_dir);
+    if (Directory_Create(data_dir) == CIO_FILE_ERROR) {
+        fprintf(stderr, "nfbench: Failed to create %s.\n", data_dir);
+        return EXIT_FAILURE;
+    }
+
+    Report report;
+    Report_Init(&report);
+    bench_download(&cfg, &report, data_dir);
+    bench_small_files(&cfg, &report, data_dir);
+    bench_ls_latency(&cfg, &report);
+    bench_ls_during_download(&cfg, &report, data_dir);
+    bench_connection_scaling(&cfg, &report, data_dir);
+
+    if (own_work_dir)
+        nftw(cfg.work_dir, _bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+
+    FILE* out = (output_path) ? fopen(output_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "nfbench: Failed to open %s for writing.\n", output_path);
+        return EXIT_FAILURE;
+    }
+    Report_Write(&report, out);
+    if (out != stdout)
+        fclose(out);
+
+    i32 status = EXIT_SUCCESS;
+    if (baseline_path) {
+        Report baseline;
+        if (Report_Load(&baseline, baseline_path) != 0) {
+            fprintf(stderr, "nfbench: Failed to read baseline %s.\n", baseline_path);
+            status = EXIT_FAILURE;
+        } else {
+            const usize regressions = Report_Compare(&report, &baseline, threshold_pct);
+            fprintf(stderr, "%zu regression(s) beyond %.1f%%.\n", regressions, threshold_pct);
+            if (regressions > 0)
+                status = EXIT_FAILURE;
+            Report_Dispose(&baseline);
+        }
+    }
+    Report_Dispose(&report);
+    return status;
+}
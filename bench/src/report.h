@@ -0,0 +1,162 @@
+#ifndef NETFS_BENCH_REPORT_H
+#define NETFS_BENCH_REPORT_H
+
+#include <stdnfs.h>
+#include "stats.h"
+
+#define REPORT_NAME_MAX 64
+
+// One measured number. value is the headline figure (MB/s, ops/s or ms), the percentiles
+// are the per operation latencies behind it.
+typedef struct _netfs_bench_result {
+    char name[REPORT_NAME_MAX];
+    char unit[16];
+    double value;
+    bool higher_is_better;
+    u64 samples;
+    u64 errors;
+    double p50_ms;
+    double p99_ms;
+    double p999_ms;
+} BenchResult;
+
+typedef struct _netfs_bench_report {
+    BenchResult* results;
+    usize count;
+    usize capacity;
+} Report;
+
+void Report_Init(Report* restrict r) {
+    r->capacity = 32;
+    r->count = 0;
+    r->results = (BenchResult*)malloc(sizeof(BenchResult) * r->capacity);
+}
+
+BenchResult* Report_Add(Report* restrict r, const char* restrict name, const char* restrict unit, const double value, const bool higher_is_better, Samples* restrict latencies, const u64 errors) {
+    if (r->count >= r->capacity) {
+        r->capacity *= 2;
+        r->results = (BenchResult*)realloc(r->results, sizeof(BenchResult) * r->capacity);
+    }
+    BenchResult* res = r->results + r->count++;
+    memset(res, 0, sizeof(BenchResult));
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    snprintf(res->unit, sizeof(res->unit), "%s", unit);
+    res->value = value;
+    res->higher_is_better = higher_is_better;
+    res->errors = errors;
+    if (latencies) {
+        res->samples = latencies->count;
+        res->p50_ms = Samples_PercentileMs(latencies, 50.0);
+        res->p99_ms = Samples_PercentileMs(latencies, 99.0);
+        res->p999_ms = Samples_PercentileMs(latencies, 99.9);
+    }
+
+    fprintf(stderr, "%-28s %12.2f %-5s p50 %9.3f ms  p99 %9.3f ms  p999 %9.3f ms  errors %llu\n",
+            res->name, res->value, res->unit, res->p50_ms, res->p99_ms, res->p999_ms, (unsigned long long)res->errors);
+    return res;
+}
+
+// Write the report as JSON. Every result sits on a line of its own, which is what
+// Report_Load() relies on to read a baseline back without a JSON parser.
+i32 Report_Write(const Report* restrict r, FILE* restrict fs) {
+    fputs("{\n  \"benchmark\": \"nfbench\",\n  \"version\": 1,\n  \"results\": [\n", fs);
+    for (usize i = 0; i < r->count; ++i) {
+        const BenchResult* res = r->results + i;
+        fprintf(fs,
+                "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.6g, \"higher_is_better\": %s, "
+                "\"samples\": %llu, \"errors\": %llu, \"p50_ms\": %.6g, \"p99_ms\": %.6g, \"p999_ms\": %.6g}%s\n",
+                res->name,
+                res->unit,
+                res->value,
+                (res->higher_is_better) ? "true" : "false",
+                (unsigned long long)res->samples,
+                (unsigned long long)res->errors,
+                res->p50_ms,
+                res->p99_ms,
+                res->p999_ms,
+                (i + 1 < r->count) ? "," : "");
+    }
+    fputs("  ]\n}\n", fs);
+    return (ferror(fs)) ? -1 : 0;
+}
+
+bool _report_read_number(const char* restrict line, const char* restrict key, double* restrict value) {
+    const char* p = strstr(line, key);
+    if (!p)
+        return false;
+    return sscanf(p + strlen(key), " : %lf", value) == 1;
+}
+
+// Read back a report written by Report_Write(). Returns -1 if the file can't be read.
+i32 Report_Load(Report* restrict r, const char* restrict path) {
+    FILE* fs = fopen(path, "r");
+    if (!fs)
+        return -1;
+
+    Report_Init(r);
+    char line[1024];
+    while (fgets(line, sizeof(line), fs)) {
+        const char* name = strstr(line, "\"name\": \"");
+        if (!name)
+            continue;
+        name += strlen("\"name\": \"");
+        const char* end = strchr(name, '"');
+        if (!end || end - name >= REPORT_NAME_MAX)
+            continue;
+
+        if (r->count >= r->capacity) {
+            r->capacity *= 2;
+            r->results = (BenchResult*)realloc(r->results, sizeof(BenchResult) * r->capacity);
+        }
+        BenchResult* res = r->results + r->count++;
+        memset(res, 0, sizeof(BenchResult));
+        memcpy(res->name, name, end - name);
+        res->higher_is_better = strstr(line, "\"higher_is_better\": true") != NULL;
+        _report_read_number(line, "\"value\"", &res->value);
+        _report_read_number(line, "\"p99_ms\"", &res->p99_ms);
+    }
+    fclose(fs);
+    return 0;
+}
+
+const BenchResult* _report_find(const Report* restrict r, const char* restrict name) {
+    for (usize i = 0; i < r->count; ++i) {
+        if (!strcmp(r->results[i].name, name))
+            return r->results + i;
+    }
+    return NULL;
+}
+
+// Compare against a baseline and print a line per shared result. A result regressed if its
+// value moved in the wrong direction, or its p99 latency grew, by more than threshold_pct.
+// Returns the number of regressions.
+usize Report_Compare(const Report* restrict current, const Report* restrict baseline, const double threshold_pct) {
+    usize regressions = 0;
+    fprintf(stderr, "%-28s %12s %12s %8s %10s\n", "benchmark", "baseline", "current", "change", "p99 change");
+    for (usize i = 0; i < current->count; ++i) {
+        const BenchResult* cur = current->results + i;
+        const BenchResult* base = _report_find(baseline, cur->name);
+        if (!base)
+            continue;
+
+        const double change = (base->value != 0.0) ? (cur->value - base->value) * 100.0 / base->value : 0.0;
+        const double p99_change = (base->p99_ms > 0.0) ? (cur->p99_ms - base->p99_ms) * 100.0 / base->p99_ms : 0.0;
+        const bool worse = (cur->higher_is_better) ? change < -threshold_pct : change > threshold_pct;
+        const bool slower = base->p99_ms > 0.0 && p99_change > threshold_pct;
+        if (worse || slower)
+            ++regressions;
+
+        fprintf(stderr, "%-28s %12.2f %12.2f %+7.1f%% %+9.1f%%%s\n",
+                cur->name, base->value, cur->value, change, p99_change,
+                (worse || slower) ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+void Report_Dispose(Report* restrict r) {
+    free(r->results);
+    r->results = NULL;
+    r->count = r->capacity = 0;
+}
+
+#endif // NETFS_BENCH_REPORT_H
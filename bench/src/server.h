@@ -0,0 +1,115 @@
+#ifndef NETFS_BENCH_SERVER_H
+#define NETFS_BENCH_SERVER_H
+
+// Runs nfserver as a child process on loopback for the duration of a benchmark.
+// POSIX only, like the benchmark itself.
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_time.h>
+#include <cs_systemio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define BENCH_SERVER_START_TIMEOUT_NS (5 * CTM_NS_PER_SEC)
+
+typedef struct _netfs_bench_server {
+    pid_t pid;
+    u16 port;
+} BenchServer;
+
+bool _bench_server_ready(const u16 port) {
+    const int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0)
+        return false;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const bool ready = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return ready;
+}
+
+// Start server_path serving root on port and wait until it accepts connections.
+// Returns -1 if it does not come up.
+i32 BenchServer_Start(BenchServer* restrict srv, const char* restrict server_path, const char* restrict root, const u16 port) {
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%hu", port);
+
+    srv->port = port;
+    srv->pid = fork();
+    if (srv->pid < 0) {
+        perror("nfbench: fork");
+        return -1;
+    }
+    if (srv->pid == 0) {
+        const int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+        execl(server_path, "nfserver", "-r", root, "-p", port_str, (char*)NULL);
+        _exit(127);
+    }
+
+    const u64 deadline = Time_NowNs() + BENCH_SERVER_START_TIMEOUT_NS;
+    while (Time_NowNs() < deadline) {
+        if (_bench_server_ready(port))
+            return 0;
+        if (waitpid(srv->pid, NULL, WNOHANG) == srv->pid) {
+            fprintf(stderr, "nfbench: %s exited during startup.\n", server_path);
+            srv->pid = 0;
+            return -1;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "nfbench: %s did not start listening on port %hu.\n", server_path, port);
+    kill(srv->pid, SIGKILL);
+    waitpid(srv->pid, NULL, 0);
+    srv->pid = 0;
+    return -1;
+}
+
+void BenchServer_Stop(BenchServer* restrict srv) {
+    if (srv->pid <= 0)
+        return;
+    kill(srv->pid, SIGINT);
+    waitpid(srv->pid, NULL, 0);
+    srv->pid = 0;
+}
+
+// Create path filled with size bytes of pseudo random data (incompressible, no holes).
+i32 Bench_CreateFile(const char* restrict path, const u64 size) {
+    FileHandle* f = File_Open(path, FileMode_Write);
+    if (!f)
+        return -1;
+
+    const usize buffer_size = 1024 * 1024;
+    u64* buffer = (u64*)malloc(buffer_size);
+    u64 x = 0x9e3779b97f4a7c15ull ^ size;
+    u64 offset = 0;
+    i32 res = 0;
+    while (offset < size) {
+        for (usize i = 0; i < buffer_size / sizeof(u64); ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            buffer[i] = x;
+        }
+        const usize n = (size - offset < buffer_size) ? (usize)(size - offset) : buffer_size;
+        if (File_WriteAt(f, (const u8*)buffer, n, offset) == CIO_FILE_ERROR) {
+            res = -1;
+            break;
+        }
+        offset += n;
+    }
+    free(buffer);
+    File_Close(f);
+    return res;
+}
+
+#endif // NETFS_BENCH_SERVER_H
@@ -0,0 +1,66 @@
+#ifndef NETFS_BENCH_STATS_H
+#define NETFS_BENCH_STATS_H
+
+#include <stdnfs.h>
+#include <cs_time.h>
+
+// Growable set of latency samples in nanoseconds.
+typedef struct _netfs_bench_samples {
+    u64* values;
+    usize count;
+    usize capacity;
+    bool _sorted;
+} Samples;
+
+void Samples_Init(Samples* restrict s) {
+    s->capacity = 256;
+    s->count = 0;
+    s->values = (u64*)malloc(sizeof(u64) * s->capacity);
+    s->_sorted = true;
+}
+
+void Samples_Add(Samples* restrict s, const u64 ns) {
+    if (s->count >= s->capacity) {
+        s->capacity *= 2;
+        s->values = (u64*)realloc(s->values, sizeof(u64) * s->capacity);
+    }
+    s->values[s->count++] = ns;
+    s->_sorted = false;
+}
+
+int _samples_compare(const void* a, const void* b) {
+    const u64 x = *(const u64*)a;
+    const u64 y = *(const u64*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile (0 < p <= 100) in milliseconds, 0 without samples.
+double Samples_PercentileMs(Samples* restrict s, const double p) {
+    if (s->count == 0)
+        return 0.0;
+    if (!s->_sorted) {
+        qsort(s->values, s->count, sizeof(u64), _samples_compare);
+        s->_sorted = true;
+    }
+    usize rank = (usize)(p / 100.0 * (double)s->count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > s->count)
+        rank = s->count;
+    return (double)s->values[rank - 1] / (double)CTM_NS_PER_MS;
+}
+
+u64 Samples_Sum(const Samples* restrict s) {
+    u64 sum = 0;
+    for (usize i = 0; i < s->count; ++i)
+        sum += s->values[i];
+    return sum;
+}
+
+void Samples_Dispose(Samples* restrict s) {
+    free(s->values);
+    s->values = NULL;
+    s->count = s->capacity = 0;
+}
+
+#endif // NETFS_BENCH_STATS_H
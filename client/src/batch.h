@@ -0,0 +1,257 @@
+#ifndef NETFS_CLIENT_BATCH_H
+#define NETFS_CLIENT_BATCH_H
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_socketpool.h>
+#include <cs_threads.h>
+#include <cs_time.h>
+#include "session.h"
+#include "commands.h"
+
+#define BATCH_MAX_JOBS 64
+// How often a command the server was too busy for is tried again.
+#define BATCH_MAX_RETRIES 5
+// Pool tag of a connection that asked for integrity checks, the low bits hold the mode the
+// server agreed to. The server keeps it for the connection, the next command need not ask.
+#define BATCH_INTEGRITY_KNOWN 0x80000000u
+
+// One line of the batch script.
+typedef struct _netfs_batch_op {
+    char* line;
+    char* command; // Copy of line for the report, parsing modifies line in place.
+    CommandResult result;
+    u32 retries;
+    bool done;
+} BatchOp;
+
+typedef struct _netfs_batch {
+    const ClientConfig* config;
+    SocketPool* pool;
+    BatchOp* ops;
+    usize ops_count;
+    usize ops_capacity;
+
+    Mutex* mutex;
+    usize next_op;
+} Batch;
+
+void _batch_add(Batch* restrict b, const char* restrict command) {
+    if (b->ops_count >= b->ops_capacity) {
+        b->ops_capacity = (b->ops_capacity) ? b->ops_capacity * 2 : 64;
+        b->ops = (BatchOp*)realloc(b->ops, sizeof(BatchOp) * b->ops_capacity);
+    }
+    BatchOp* op = b->ops + b->ops_count++;
+    op->line = strdup(command);
+    op->command = strdup(command);
+    memset(&op->result, 0, sizeof(op->result));
+    op->retries = 0;
+    op->done = false;
+}
+
+// Read the script, one command per line. Blank lines and lines starting with # are skipped,
+// exit ends the script and mget is split into one fget per file so the files are spread
+// over the jobs.
+void _batch_load(Batch* restrict b, FILE* restrict fs) {
+    char* buffer = NULL;
+    usize capacity = 0;
+    char* line;
+    while ((line = read_line(fs, &buffer, &capacity)) != NULL) {
+        while (*line == ' ' || *line == '\t')
+            ++line;
+        if (*line == 0 || *line == '#')
+            continue;
+        if (!strncmp(line, "exit", 4) && (line[4] == 0 || line[4] == ' ' || line[4] == '\t'))
+            break;
+
+        if (!strncmp(line, "mget", 4) && (line[4] == ' ' || line[4] == '\t')) {
+            char* save = NULL;
+            strtok_r(line, " \t", &save);
+            const char* file;
+            while ((file = strtok_r(NULL, " \t", &save)) != NULL) {
+                char command[CIO_PATH_MAX + 8];
+                snprintf(command, sizeof(command), "fget %s", file);
+                _batch_add(b, command);
+            }
+            continue;
+        }
+        _batch_add(b, line);
+    }
+    free(buffer);
+}
+
+// Every command checks a connection out of the pool and hands it back when done, a failed
+// command might have left a reply half read so its connection is dropped instead.
+// A command the server turned away as busy runs again on a new connection once the
+// server's retry delay passed.
+ThreadArg _batch_worker(ThreadArg args) {
+    Batch* b = (Batch*)args;
+#ifdef CSR_AVAILABLE
+    // Every job has a channel of its own, the rings have one reader and one writer.
+    MetadataChannel* metadata = (b->config->metadata_channel && b->config->local_path) ? MetadataChannel_Open(b->config) : NULL;
+#endif
+
+    for (;;) {
+        Mutex_Lock(b->mutex);
+        const usize index = b->next_op++;
+        Mutex_Unlock(b->mutex);
+        if (index >= b->ops_count)
+            break;
+
+        BatchOp* op = b->ops + index;
+        for (;;) {
+            u32 tag;
+            Socket* s = SocketPool_AcquireTagged(b->pool, &tag);
+            if (!s) {
+                fprintf(stderr, "Failed to connect to [%s:%hu].\n", b->pool->ep.address.str, b->pool->ep.port);
+#ifdef CSR_AVAILABLE
+                if (metadata)
+                    MetadataChannel_Dispose(metadata);
+#endif
+                return NULL;
+            }
+
+            Session* session = Session_New(s, b->config, false);
+            if (tag & BATCH_INTEGRITY_KNOWN) {
+                session->integrity = tag & ~BATCH_INTEGRITY_KNOWN;
+                session->integrity_known = true;
+            }
+#ifdef CSR_AVAILABLE
+            session->metadata = metadata;
+#endif
+            client_execute(session, op->line, &op->result);
+            tag = (session->integrity_known) ? BATCH_INTEGRITY_KNOWN | (session->integrity & ~BATCH_INTEGRITY_KNOWN) : 0;
+            Session_Dispose(session);
+            SocketPool_ReleaseTagged(b->pool, s, op->result.ok, tag);
+            if (op->result.ok || !op->result.retry_after_ms || op->retries >= BATCH_MAX_RETRIES)
+                break;
+            ++op->retries;
+            // Parsing split the line up, the command is still whole in the copy.
+            strcpy(op->line, op->command);
+            Time_SleepMs(op->result.retry_after_ms);
+        }
+        op->done = true;
+    }
+#ifdef CSR_AVAILABLE
+    if (metadata)
+        MetadataChannel_Dispose(metadata);
+#endif
+    return NULL;
+}
+
+int _batch_compare_u64(const void* a, const void* b) {
+    const u64 x = *(const u64*)a;
+    const u64 y = *(const u64*)b;
+    return (x > y) - (x < y);
+}
+
+// Print one line per operation and the totals, returns the number of failed operations.
+usize _batch_report(const Batch* restrict b, const u64 wall_ns) {
+    u64* latencies = (u64*)malloc(sizeof(u64) * (b->ops_count + 1));
+    usize latencies_count = 0;
+    usize failures = 0;
+    u64 total_bytes = 0;
+
+    puts("status      ms          bytes      MB/s  command");
+    for (usize i = 0; i < b->ops_count; ++i) {
+        const BatchOp* op = b->ops + i;
+        if (!op->done) {
+            ++failures;
+            printf("%-6s %9s %14s %9s  %s\n", "skip", "-", "-", "-", op->command);
+            continue;
+        }
+
+        const u64 ns = op->result.end_ns - op->result.start_ns;
+        const double seconds = (double)ns / (double)CTM_NS_PER_SEC;
+        latencies[latencies_count++] = ns;
+        total_bytes += op->result.bytes;
+        if (!op->result.ok)
+            ++failures;
+        printf("%-6s %9.2f %14llu %9.1f  %s\n",
+               (op->result.ok) ? "ok" : "FAIL",
+               (double)ns / (double)CTM_NS_PER_MS,
+               (unsigned long long)op->result.bytes,
+               (seconds > 0.0) ? (double)op->result.bytes / seconds / (1024.0 * 1024.0) : 0.0,
+               op->command);
+    }
+
+    qsort(latencies, latencies_count, sizeof(u64), _batch_compare_u64);
+    const double wall = (double)wall_ns / (double)CTM_NS_PER_SEC;
+    printf("\n%zu connections opened, %zu reused, %zu reaped\n",
+           b->pool->connects,
+           b->pool->reuses,
+           b->pool->reaped);
+    printf("%zu operations, %zu failed, %llu bytes in %.3fs (%.1f MB/s)\n",
+           b->ops_count,
+           failures,
+           (unsigned long long)total_bytes,
+           wall,
+           (wall > 0.0) ? (double)total_bytes / wall / (1024.0 * 1024.0) : 0.0);
+    if (latencies_count > 0) {
+        printf("latency ms: p50 %.2f, p99 %.2f, max %.2f\n",
+               (double)latencies[(latencies_count - 1) * 50 / 100] / (double)CTM_NS_PER_MS,
+               (double)latencies[(latencies_count - 1) * 99 / 100] / (double)CTM_NS_PER_MS,
+               (double)latencies[latencies_count - 1] / (double)CTM_NS_PER_MS);
+    }
+    free(latencies);
+    return failures;
+}
+
+// Run every command read from fs over up to jobs pooled connections to ep, then print the report.
+// Each job takes the next command as soon as it is done with its last one.
+// Returns the number of failed operations, operations that never ran (no connection left)
+// count as failed.
+usize Batch_Run(const ClientConfig* restrict config, const IPEndPoint ep, FILE* restrict fs, usize jobs) {
+    Batch b;
+    b.config = config;
+    b.ops = NULL;
+    b.ops_count = 0;
+    b.ops_capacity = 0;
+    b.next_op = 0;
+    _batch_load(&b, fs);
+
+    if (jobs < 1)
+        jobs = 1;
+    if (jobs > BATCH_MAX_JOBS)
+        jobs = BATCH_MAX_JOBS;
+    if (jobs > b.ops_count)
+        jobs = (b.ops_count > 0) ? b.ops_count : 1;
+
+    b.mutex = Mutex_New();
+    b.pool = SocketPool_New(ep, jobs, CSP_DEFAULT_IDLE_TIMEOUT_MS);
+    b.pool->options = config->socket_options;
+    b.pool->local_path = config->local_path;
+    SocketPool_Warm(b.pool, jobs);
+
+    Thread* workers[BATCH_MAX_JOBS];
+    const u64 start_ns = Time_NowNs();
+    for (usize i = 0; i < jobs; ++i) {
+        ThreadAttributes attr;
+        attr.args = (ThreadArg)&b;
+        attr.initial_stack_size = 0;
+        attr.detached = false;
+        attr.cpus = NULL;
+        attr.name = "nfc-batch";
+        attr.routine = _batch_worker;
+        workers[i] = Thread_New(&attr);
+    }
+    for (usize i = 0; i < jobs; ++i) {
+        if (workers[i]) {
+            Thread_Join(workers[i]);
+            Thread_Dispose(workers[i]);
+        }
+    }
+    const u64 wall_ns = Time_NowNs() - start_ns;
+
+    const usize failures = _batch_report(&b, wall_ns);
+    for (usize i = 0; i < b.ops_count; ++i) {
+        free(b.ops[i].line);
+        free(b.ops[i].command);
+    }
+    free(b.ops);
+    SocketPool_Dispose(b.pool);
+    Mutex_Dispose(b.mutex);
+    return failures;
+}
+
+#endif // NETFS_CLIENT_BATCH_H
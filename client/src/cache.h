@@ -0,0 +1,200 @@
+#ifndef NETFS_CLIENT_CACHE_H
+#define NETFS_CLIENT_CACHE_H
+
+#include <stdnfs.h>
+#include <cs_threads.h>
+#include <cs_systemio.h>
+#include <net_common.h>
+#include <net_transfer.h>
+
+#define CACHE_INDEX_FILE "index"
+#define CACHE_KEY_MAX (CIO_PATH_MAX + 64)
+
+// A fetched file, keyed by the server it came from and its path on that server.
+typedef struct _netfs_cache_entry {
+    char key[CACHE_KEY_MAX];
+    FileValidator validator;
+} CacheEntry;
+
+// Persistent client side cache of fetched files.
+// Every entry is stored as <dir>/<hash of key> and listed in <dir>/index,
+// a plain text file with one "size mtime hash key" line per entry.
+typedef struct _netfs_cache {
+    char dir[CIO_PATH_MAX];
+    CacheEntry* entries;
+    usize entries_count;
+    usize entries_capacity;
+    RWLock* lock; // Lookups share it, updates of the index take it exclusively.
+} Cache;
+
+// Default cache location: $NETFS_CACHE_DIR, $XDG_CACHE_HOME/netfs or ~/.cache/netfs.
+void Cache_DefaultDir(char* restrict buffer, const usize size) {
+    const char* dir = getenv("NETFS_CACHE_DIR");
+    if (dir && *dir) {
+        snprintf(buffer, size, "%s", dir);
+        return;
+    }
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir && *dir) {
+        snprintf(buffer, size, "%s/netfs", dir);
+        return;
+    }
+    dir = getenv("HOME");
+    snprintf(buffer, size, "%s/.cache/netfs", (dir) ? dir : ".");
+}
+
+void Cache_MakeKey(char* restrict key, const usize size, const char* restrict host, const u16 port, const char* restrict path) {
+    snprintf(key, size, "%s:%hu/%s", host, port, path);
+}
+
+void Cache_BlobPath(const Cache* restrict c, const char* restrict key, char* restrict buffer, const usize size) {
+    const u64 h = Hash_Fnv1a64(NET_HASH_SEED, (const u8*)key, strlen(key));
+    snprintf(buffer, size, "%s/%016llx", c->dir, (unsigned long long)h);
+}
+
+CacheEntry* _cache_find(Cache* restrict c, const char* restrict key) {
+    for (usize i = 0; i < c->entries_count; ++i) {
+        if (!strcmp(c->entries[i].key, key))
+            return c->entries + i;
+    }
+    return NULL;
+}
+
+// Rewrite the index next to the old one and rename it over, so a crash never leaves a torn index.
+// Expects the cache mutex to be held.
+i32 _cache_save_index(Cache* restrict c) {
+    char path[CIO_PATH_MAX + 16];
+    char tmp_path[CIO_PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/" CACHE_INDEX_FILE, c->dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/" CACHE_INDEX_FILE ".tmp", c->dir);
+
+    FILE* fs = fopen(tmp_path, "w");
+    if (!fs)
+        return CIO_FILE_ERROR;
+    for (usize i = 0; i < c->entries_count; ++i) {
+        const FileValidator* v = &c->entries[i].validator;
+        fprintf(fs, "%llu %lld %016llx %s\n",
+                (unsigned long long)v->size,
+                (long long)v->mtime,
+                (unsigned long long)v->hash,
+                c->entries[i].key);
+    }
+    if (fclose(fs) != 0 || rename(tmp_path, path) != 0)
+        return CIO_FILE_ERROR;
+    return CIO_FILE_SUCCESS;
+}
+
+Cache* Cache_Open(const char* restrict dir) {
+    if (Directory_Create(dir) == CIO_FILE_ERROR) {
+        fprintf(stderr, "Cache: Failed to create cache directory %s\n", dir);
+        return NULL;
+    }
+
+    Cache* c = (Cache*)malloc(sizeof(Cache));
+    snprintf(c->dir, sizeof(c->dir), "%s", dir);
+    c->entries_count = 0;
+    c->entries_capacity = 64;
+    c->entries = (CacheEntry*)malloc(sizeof(CacheEntry) * c->entries_capacity);
+    c->lock = RWLock_New();
+
+    char path[CIO_PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/" CACHE_INDEX_FILE, c->dir);
+    FILE* fs = fopen(path, "r");
+    if (fs) {
+        char line[CACHE_KEY_MAX + 128];
+        while (fgets(line, sizeof(line), fs)) {
+            unsigned long long size, hash;
+            long long mtime;
+            int key_offset = 0;
+            if (sscanf(line, "%llu %lld %llx %n", &size, &mtime, &hash, &key_offset) != 3 || key_offset == 0)
+                continue;
+            char* n = strchr(line, '\n');
+            if (n)
+                *n = 0;
+
+            if (c->entries_count >= c->entries_capacity) {
+                c->entries_capacity *= 2;
+                c->entries = (CacheEntry*)realloc(c->entries, sizeof(CacheEntry) * c->entries_capacity);
+            }
+            CacheEntry* e = c->entries + c->entries_count++;
+            snprintf(e->key, sizeof(e->key), "%s", line + key_offset);
+            e->validator.size = size;
+            e->validator.mtime = mtime;
+            e->validator.hash = hash;
+        }
+        fclose(fs);
+    }
+    return c;
+}
+
+void Cache_Close(Cache* restrict c) {
+    RWLock_Dispose(c->lock);
+    free(c->entries);
+    free(c);
+}
+
+// Look key up and make sure its blob is still intact, returns true and fills v on a hit.
+bool Cache_Lookup(Cache* restrict c, const char* restrict key, FileValidator* restrict v) {
+    RWLock_ReadLock(c->lock);
+    CacheEntry* e = _cache_find(c, key);
+    if (e)
+        *v = e->validator;
+    RWLock_ReadUnlock(c->lock);
+    if (!e)
+        return false;
+
+    char blob_path[CIO_PATH_MAX + 32];
+    Cache_BlobPath(c, key, blob_path, sizeof(blob_path));
+    FileHandle* blob = File_Open(blob_path, FileMode_Read);
+    if (!blob)
+        return false;
+    const bool intact = blob->size == v->size;
+    File_Close(blob);
+    return intact;
+}
+
+// Record a freshly fetched file, copying src_path into the cache.
+i32 Cache_Store(Cache* restrict c, const char* restrict key, const FileValidator* restrict v, const char* restrict src_path) {
+    char blob_path[CIO_PATH_MAX + 32];
+    Cache_BlobPath(c, key, blob_path, sizeof(blob_path));
+    if (File_Copy(src_path, blob_path) == CIO_FILE_ERROR)
+        return CIO_FILE_ERROR;
+
+    RWLock_WriteLock(c->lock);
+    CacheEntry* e = _cache_find(c, key);
+    if (!e) {
+        if (c->entries_count >= c->entries_capacity) {
+            c->entries_capacity *= 2;
+            c->entries = (CacheEntry*)realloc(c->entries, sizeof(CacheEntry) * c->entries_capacity);
+        }
+        e = c->entries + c->entries_count++;
+        snprintf(e->key, sizeof(e->key), "%s", key);
+    }
+    e->validator = *v;
+    i32 res = _cache_save_index(c);
+    RWLock_WriteUnlock(c->lock);
+    return res;
+}
+
+// The server confirmed the cached copy, remember its current size and mtime.
+i32 Cache_Touch(Cache* restrict c, const char* restrict key, const FileStat* restrict st) {
+    i32 res = CIO_FILE_SUCCESS;
+    RWLock_WriteLock(c->lock);
+    CacheEntry* e = _cache_find(c, key);
+    if (e && e->validator.mtime != st->mtime) {
+        e->validator.size = st->size;
+        e->validator.mtime = st->mtime;
+        res = _cache_save_index(c);
+    }
+    RWLock_WriteUnlock(c->lock);
+    return res;
+}
+
+// Copy the cached copy of key to dst_path.
+i32 Cache_Restore(Cache* restrict c, const char* restrict key, const char* restrict dst_path) {
+    char blob_path[CIO_PATH_MAX + 32];
+    Cache_BlobPath(c, key, blob_path, sizeof(blob_path));
+    return File_Copy(blob_path, dst_path);
+}
+
+#endif // NETFS_CLIENT_CACHE_H
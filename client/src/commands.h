@@ -0,0 +1,700 @@
+#ifndef NETFS_CLIENT_COMMANDS_H
+#define NETFS_CLIENT_COMMANDS_H
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_systemio.h>
+#include <cs_time.h>
+#include <net_common.h>
+#include <net_transfer.h>
+#include "cache.h"
+#include "download.h"
+#include "session.h"
+#include "udpget.h"
+#include "mcastget.h"
+
+#define DEF_LINE_SIZE 256
+#define DEF_ARG_COUNT 256
+#define DEF_READ_SIZE 4096
+
+// Outcome of one command, used for the batch summary.
+typedef struct _netfs_command_result {
+    bool ok;
+    u64 bytes;
+    u64 start_ns;
+    u64 end_ns;
+    u32 retry_after_ms; // The server was busy, try again after this long.
+} CommandResult;
+
+void parse_command(char* restrict str, const char*** args, usize* args_size, usize* arg_count) {
+    // Parse the command by splitting it into tokens seperated by space, tab and new line characters.
+    usize i = 0;
+    **args = strtok(str, " \t\n");
+    while (*(*args + i)) {
+        if (i >= *args_size / sizeof(char*) - 1) {
+            *args_size *= 2;
+            *args = (const char**)realloc(*args, *args_size);
+        }
+        *(*args + ++i) = strtok(NULL, " \t\n");
+    }
+    *arg_count = i;
+}
+
+// Read a whole line of any length into *buffer (grown as needed), without the new line.
+// Returns NULL at the end of the input.
+char* read_line(FILE* restrict fs, char** buffer, usize* capacity) {
+    if (!*buffer) {
+        *capacity = DEF_LINE_SIZE;
+        *buffer = (char*)malloc(*capacity);
+    }
+
+    usize length = 0;
+    for (;;) {
+        if (!fgets(*buffer + length, (int)(*capacity - length), fs)) {
+            if (length == 0)
+                return NULL;
+            break;
+        }
+        length += strlen(*buffer + length);
+        if (length > 0 && (*buffer)[length - 1] == '\n') {
+            (*buffer)[--length] = 0;
+            break;
+        }
+        *capacity *= 2;
+        *buffer = (char*)realloc(*buffer, *capacity);
+    }
+    if (length > 0 && (*buffer)[length - 1] == '\r')
+        (*buffer)[--length] = 0;
+    return *buffer;
+}
+
+// A reply of a type the command has no use for.
+void _client_unexpected_packet(const NetPacket* restrict packet) {
+    fprintf(stderr, "Unexpected packet type %u from server.\n", (unsigned)packet->header.id);
+}
+
+// Commands answered with a single Message (ls, stats): print it.
+void _client_simple_request(Session* restrict session, const NetPacketType type, const void* restrict payload, const usize payload_size,
+                            const char* restrict name, CommandResult* restrict result) {
+    NetPacket* request = NetPacket_New(type, (const u8*)payload, payload_size);
+    NetPacket* packet = Session_Exchange(session, request);
+    NetPacket_Dispose(request);
+    if (!packet) {
+        Session_ReportLost(session);
+        return;
+    }
+    if (packet->header.id == NetPacketType_Message) {
+        if (packet->header.size > 0)
+            fputs((const char*)packet->buffer, stdout);
+        result->ok = true;
+        result->bytes = packet->header.size;
+    } else if (packet->header.id == NetPacketType_Error) {
+        fprintf(stderr, "%s: %s\n", name, (const char*)packet->buffer);
+    }
+    NetPacket_Dispose(packet);
+}
+
+void client_ls(Session* restrict session, CommandResult* restrict result) {
+    _client_simple_request(session, NetPacketType_ListEntries, NULL, 0, "ls", result);
+}
+
+// Server metrics: totals, latency per request type and one section per connection.
+void client_stats(Session* restrict session, CommandResult* restrict result) {
+    _client_simple_request(session, NetPacketType_Stats, NULL, 0, "stats", result);
+}
+
+// Change the server's transmit limits, "-" or a missing value keeps a limit and 0 lifts it.
+void client_rate(Session* restrict session, const char* restrict global, const char* restrict per_connection, CommandResult* restrict result) {
+    RateLimits limits = {NET_RATE_UNCHANGED, NET_RATE_UNCHANGED};
+    if ((global && strcmp(global, "-") && !Net_ParseSize(global, &limits.global)) ||
+        (per_connection && strcmp(per_connection, "-") && !Net_ParseSize(per_connection, &limits.per_connection))) {
+        puts("Usage: rate [ global_rate | - ] [ per_connection_rate | - ] (bytes per second, e.g. 10M)");
+        return;
+    }
+    _client_simple_request(session, NetPacketType_SetRate, &limits, sizeof(limits), "rate", result);
+}
+
+// Print size bytes of remote from offset on (at most NET_READ_MAX), for small reads
+// that are not worth a download.
+void client_read(Session* restrict session, const char* restrict remote, const char* restrict offset, const char* restrict size,
+                 CommandResult* restrict result) {
+    FileRange range = {0, DEF_READ_SIZE};
+    if ((offset && !Net_ParseSize(offset, &range.offset)) || (size && !Net_ParseSize(size, &range.size))) {
+        puts("Usage: read [ remote_file ] [ offset ] [ size ] (e.g. read notes.txt 0 4K)");
+        return;
+    }
+    NetPacket* request = NetPacket_New(NetPacketType_FileReadRequest, (const u8*)remote, strlen(remote) + 1);
+    NetPacket_AddData(request, (const u8*)&range, sizeof(range));
+    NetPacket* packet = Session_Exchange(session, request);
+    NetPacket_Dispose(request);
+    if (!packet) {
+        Session_ReportLost(session);
+        return;
+    }
+    if (packet->header.id == NetPacketType_FileReadData) {
+        if (!session->config->quiet && packet->header.size > 0) {
+            fwrite(packet->buffer, 1, packet->header.size, stdout);
+            fflush(stdout);
+        }
+        result->ok = true;
+        result->bytes = packet->header.size;
+    } else if (packet->header.id == NetPacketType_Error) {
+        fprintf(stderr, "read %s: %s\n", remote, (const char*)packet->buffer);
+    }
+    NetPacket_Dispose(packet);
+}
+
+#ifdef CS_PLATFORM_UNIX
+// fget over a local connection: the server passes the open file instead of its contents and
+// we copy it ourselves, inside the kernel where the filesystem allows (copy_file_range).
+// No byte goes through the socket or the server. The cache is not involved, the source is local.
+void _client_fget_local(Session* restrict session, const char* restrict remote, const char* restrict local, CommandResult* restrict result) {
+    NetPacket* packet = NetPacket_New(NetPacketType_FileOpenRequest, (const u8*)remote, strlen(remote) + 1);
+    NetPacket_Send(session->socket, packet);
+    NetPacket_Dispose(packet);
+
+    packet = Session_NextPacket(session);
+    if (!packet) {
+        Session_ReportLost(session);
+        return;
+    }
+    if (packet->header.id == NetPacketType_Error) {
+        fprintf(stderr, "fget %s: %s\n", remote, (const char*)packet->buffer);
+    } else if (packet->header.id == NetPacketType_FileHandle) {
+        const int fd = Socket_TakeFd(session->socket);
+        FileHandle* src = (fd != -1) ? File_FromNative(fd) : NULL;
+        FileHandle* dst = (src) ? File_Open(local, FileMode_Write) : NULL;
+        const u64 start_ns = Time_NowNs();
+        if (!src) {
+            if (fd != -1)
+                close(fd);
+            fprintf(stderr, "fget %s: the server sent no file.\n", remote);
+        } else if (!dst) {
+            fprintf(stderr, "Failed to open file %s for writing.\n", local);
+        } else if (File_CopyContents(src, dst) == CIO_FILE_SUCCESS) {
+            result->ok = true;
+            result->bytes = src->size;
+            if (!session->config->quiet) {
+                const double elapsed = (double)(Time_NowNs() - start_ns) / (double)CTM_NS_PER_SEC;
+                printf("Copied %llu bytes in %.3fs (%.1f MB/s).\n",
+                       (unsigned long long)src->size,
+                       elapsed,
+                       (elapsed > 0.0) ? (double)src->size / elapsed / (1024.0 * 1024.0) : 0.0);
+            }
+        } else {
+            fprintf(stderr, "Copy of %s failed.\n", remote);
+        }
+        if (dst)
+            File_Close(dst);
+        if (src)
+            File_Close(src);
+    } else {
+        _client_unexpected_packet(packet);
+    }
+    NetPacket_Dispose(packet);
+}
+#endif
+
+// A checksummed download is only good if the server's FileDigest matches what arrived.
+bool _client_verify_download(Session* restrict session, const Download* restrict d, const char* restrict remote) {
+    if (!d->checksummed)
+        return true;
+    NetPacket* packet = Session_NextPacket(session);
+    FileDigest digest;
+    bool ok = false;
+    if (!packet) {
+        Session_ReportLost(session);
+    } else if (packet->header.id == NetPacketType_FileDigest && packet->header.size >= sizeof(digest)) {
+        memcpy(&digest, packet->buffer, sizeof(digest));
+        ok = digest.size == d->file_size && digest.crc32c == d->digest;
+        if (!ok)
+            fprintf(stderr, "\nfget %s: the file digest does not match, %s is damaged.\n", remote, d->path);
+    } else if (packet->header.id == NetPacketType_Error) {
+        fprintf(stderr, "\nfget %s: %s\n", remote, (const char*)packet->buffer);
+    }
+    NetPacket_Dispose(packet);
+    return ok;
+}
+
+// Fetch remote into local (defaults to the base name of remote).
+// With the cache enabled the request carries what we already have, so an unchanged
+// file costs one round trip and is restored from the cache instead.
+void client_fget(Session* restrict session, const char* restrict remote, const char* restrict local, CommandResult* restrict result) {
+    const ClientConfig* config = session->config;
+    if (!local) {
+        local = strrchr(remote, '/');
+        local = (local) ? local + 1 : remote;
+    }
+#ifdef CS_PLATFORM_UNIX
+    if (session->socket->family == AddressFamily_Local) {
+        _client_fget_local(session, remote, local, result);
+        return;
+    }
+#endif
+
+    char key[CACHE_KEY_MAX];
+    FileValidator cached;
+    bool has_cached = false;
+    if (config->cache) {
+        Cache_MakeKey(key, sizeof(key), config->host, config->port, remote);
+        has_cached = Cache_Lookup(config->cache, key, &cached);
+    }
+
+    Download* d = Download_New(local, &config->download_options);
+    d->checksummed = Session_Integrity(session) == NET_INTEGRITY_CRC32C;
+    Session_SetActiveDownload(session, d);
+
+    NetPacket* packet = NetPacket_New(NetPacketType_FileDownloadRequest, (const u8*)remote, strlen(remote) + 1);
+    if (has_cached)
+        NetPacket_AddData(packet, (const u8*)&cached, sizeof(cached));
+    NetPacket_Send(session->socket, packet);
+    NetPacket_Dispose(packet);
+
+    packet = Session_NextPacket(session);
+    if (!packet) {
+        Session_ReportLost(session);
+    } else if (packet->header.id == NetPacketType_Error) {
+        fprintf(stderr, "fget %s: %s\n", remote, (const char*)packet->buffer);
+    } else if (packet->header.id == NetPacketType_FileNotModified) {
+        const FileStat* st = (const FileStat*)packet->buffer;
+        if (Cache_Restore(config->cache, key, local) == CIO_FILE_SUCCESS) {
+            Cache_Touch(config->cache, key, st);
+            result->ok = true;
+            if (!config->quiet)
+                printf("%s is up to date, restored %llu bytes from the cache.\n", remote, (unsigned long long)st->size);
+        } else {
+            fprintf(stderr, "Failed to restore %s from the cache.\n", remote);
+        }
+    } else if (packet->header.id == NetPacketType_FileInfo) {
+        FileStat st = {0, 0};
+        memcpy(&st, packet->buffer, (packet->header.size < sizeof(st)) ? packet->header.size : sizeof(st));
+
+        if (!config->quiet)
+            printf("Download started, file size: %llu\n", (unsigned long long)st.size);
+        Download_Start(d, st.size);
+        Session_PumpDownload(session, d);
+        if (Download_Wait(d) == DownloadState_Finished && _client_verify_download(session, d, remote)) {
+            result->ok = true;
+            result->bytes = d->file_size;
+            if (!config->quiet) {
+                const double elapsed = (double)(d->end_ns - d->start_ns) / (double)CTM_NS_PER_SEC;
+                printf("\nDownload finished, %llu bytes in %.3fs (%.1f MB/s).\n",
+                       (unsigned long long)d->file_size,
+                       elapsed,
+                       Download_Throughput(d) / (1024.0 * 1024.0));
+            }
+            if (config->cache) {
+                FileValidator v = {st.size, st.mtime, d->hash};
+                if (Cache_Store(config->cache, key, &v, local) == CIO_FILE_ERROR)
+                    fprintf(stderr, "Failed to cache %s.\n", remote);
+            }
+        } else {
+            // If the server aborted, its reason is waiting in the queue. A stream that ran to its
+            // end is followed by the server's digest instead, which must not be taken for the
+            // reply to the next command.
+            NetPacket* error_packet = (d->checksummed && d->received_bytes >= d->file_size) ? Session_NextPacket(session)
+                                                                                          : NetPacketQueue_TryPop(session->queue);
+            if (error_packet && error_packet->header.id == NetPacketType_Error)
+                fprintf(stderr, "\nfget %s: %s\n", remote, (const char*)error_packet->buffer);
+            NetPacket_Dispose(error_packet);
+            fprintf(stderr, "Download of %s failed.\n", remote);
+        }
+    } else {
+        _client_unexpected_packet(packet);
+    }
+    NetPacket_Dispose(packet);
+    Session_SetActiveDownload(session, NULL);
+    Download_Dispose(d);
+}
+
+// Fetch remote into local over UDP (see net_udp.h), for long fat links a TCP stream cannot
+// fill. max_rate caps the server's send rate. The cache is not involved.
+void client_uget(Session* restrict session, const char* restrict remote, const char* restrict local, const char* restrict max_rate,
+                 CommandResult* restrict result) {
+    const ClientConfig* config = session->config;
+    if (!local) {
+        local = strrchr(remote, '/');
+        local = (local) ? local + 1 : remote;
+    }
+    u64 rate = 0;
+    if (max_rate && (!Net_ParseSize(max_rate, &rate) || rate > UINT32_MAX)) {
+        puts("Usage: uget [ remote_file ] [ local_file ] [ max_rate ] (bytes per second, e.g. 100M)");
+        return;
+    }
+    if (session->socket->family != AddressFamily_InterNetwork) {
+        fputs("uget needs a TCP connection.\n", stderr);
+        return;
+    }
+    UdpReceiver* r = UdpReceiver_New(&config->udp_impairment);
+    if (!r) {
+        fputs("Failed to open a UDP socket.\n", stderr);
+        return;
+    }
+    // Opened up front, once the server started sending it is too late to back out.
+    FileHandle* f = File_Open(local, FileMode_Write);
+    if (!f) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", local);
+        UdpReceiver_Dispose(r);
+        return;
+    }
+
+    UdpDownloadSetup setup = {UdpReceiver_Port(r), (u32)rate};
+    NetPacket* packet = NetPacket_New(NetPacketType_UdpDownloadRequest, (const u8*)remote, strlen(remote) + 1);
+    NetPacket_AddData(packet, (const u8*)&setup, sizeof(setup));
+    NetPacket_Send(session->socket, packet);
+    NetPacket_Dispose(packet);
+
+    packet = Session_NextPacket(session);
+    if (packet && packet->header.id == NetPacketType_UdpTransferInfo && packet->header.size >= sizeof(UdpTransferInfo)) {
+        UdpTransferInfo info;
+        memcpy(&info, packet->buffer, sizeof(info));
+        NetPacket_Dispose(packet);
+        packet = NULL;
+        if (!config->quiet)
+            printf("UDP download started, file size: %llu\n", (unsigned long long)info.size);
+
+        // The outcome comes over the connection once the server saw everything acknowledged.
+        const u64 start_ns = Time_NowNs();
+        bool lost = false;
+        bool receiving = UdpReceiver_Start(r, session->socket->remote_ep.address, &info, f);
+        while (receiving && !packet && !lost) {
+            receiving = UdpReceiver_Poll(r, 1);
+            packet = Session_TryNextPacket(session, &lost);
+        }
+        if (!receiving) {
+            // Closing the port makes the server give up right away.
+            UdpReceiver_Dispose(r);
+            r = NULL;
+            packet = Session_NextPacket(session);
+        }
+        const double elapsed = (double)(Time_NowNs() - start_ns) / (double)CTM_NS_PER_SEC;
+
+        if (packet && packet->header.id == NetPacketType_UdpTransferDone && r && UdpReceiver_Complete(r)) {
+            UdpTransferStats stats;
+            memset(&stats, 0, sizeof(stats));
+            memcpy(&stats, packet->buffer, (packet->header.size < sizeof(stats)) ? packet->header.size : sizeof(stats));
+            result->ok = true;
+            result->bytes = info.size;
+            if (!config->quiet) {
+                printf("Download finished, %llu bytes in %.3fs (%.1f MB/s).\n",
+                       (unsigned long long)info.size,
+                       elapsed,
+                       (elapsed > 0.0) ? (double)info.size / elapsed / (1024.0 * 1024.0) : 0.0);
+                printf("%llu datagrams sent, %llu retransmitted, %u timeouts, min rtt %u us, bandwidth estimate %.1f MB/s",
+                       (unsigned long long)stats.datagrams,
+                       (unsigned long long)stats.retransmitted,
+                       stats.timeouts,
+                       stats.min_rtt_us,
+                       (double)stats.bandwidth / (1024.0 * 1024.0));
+                if (r->dropped)
+                    printf(", %llu dropped on purpose", (unsigned long long)r->dropped);
+                puts(".");
+            }
+        } else if (packet && packet->header.id == NetPacketType_Error) {
+            fprintf(stderr, "uget %s: %s\n", remote, (const char*)packet->buffer);
+        } else if (!packet) {
+            Session_ReportLost(session);
+        } else {
+            fprintf(stderr, "Download of %s failed.\n", remote);
+        }
+    } else if (packet && packet->header.id == NetPacketType_Error) {
+        fprintf(stderr, "uget %s: %s\n", remote, (const char*)packet->buffer);
+    } else if (!packet) {
+        Session_ReportLost(session);
+    } else {
+        _client_unexpected_packet(packet);
+    }
+    NetPacket_Dispose(packet);
+    File_Close(f);
+    if (r)
+        UdpReceiver_Dispose(r);
+}
+
+// Read size bytes (at most NET_READ_MAX) of remote at offset into the same place of f.
+bool _client_read_into(Session* restrict session, const char* restrict remote, const u64 offset, const u64 size, FileHandle* restrict f) {
+    FileRange range = {offset, size};
+    NetPacket* request = NetPacket_New(NetPacketType_FileReadRequest, (const u8*)remote, strlen(remote) + 1);
+    NetPacket_AddData(request, (const u8*)&range, sizeof(range));
+    NetPacket* packet = Session_Exchange(session, request);
+    NetPacket_Dispose(request);
+    bool ok = false;
+    if (!packet) {
+        Session_ReportLost(session);
+    } else if (packet->header.id == NetPacketType_Error) {
+        fprintf(stderr, "read %s: %s\n", remote, (const char*)packet->buffer);
+    } else if (packet->header.id == NetPacketType_FileReadData && packet->header.size == size) {
+        ok = File_WriteAt(f, packet->buffer, (usize)size, offset) == (i64)size;
+        if (!ok)
+            fputs("Failed to write the repaired data.\n", stderr);
+    } else {
+        fprintf(stderr, "read %s: short read, the file changed on the server?\n", remote);
+    }
+    NetPacket_Dispose(packet);
+    return ok;
+}
+
+// Fetch remote into local from the server's multicast distribution (see net_mcast.h), what the
+// group did not deliver is read over the connection afterwards. The cache is not involved.
+void client_mcget(Session* restrict session, const char* restrict remote, const char* restrict local, CommandResult* restrict result) {
+    const ClientConfig* config = session->config;
+    if (!local) {
+        local = strrchr(remote, '/');
+        local = (local) ? local + 1 : remote;
+    }
+    if (session->socket->family != AddressFamily_InterNetwork) {
+        fputs("mcget needs a TCP connection.\n", stderr);
+        return;
+    }
+    FileHandle* f = File_Open(local, FileMode_Write);
+    if (!f) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", local);
+        return;
+    }
+
+    NetPacket* packet = NetPacket_New(NetPacketType_McastJoinRequest, (const u8*)remote, strlen(remote) + 1);
+    NetPacket_Send(session->socket, packet);
+    NetPacket_Dispose(packet);
+    packet = Session_NextPacket(session);
+    if (!packet) {
+        Session_ReportLost(session);
+        File_Close(f);
+        return;
+    }
+    if (packet->header.id != NetPacketType_McastInfo || packet->header.size < sizeof(McastInfo)) {
+        if (packet->header.id == NetPacketType_Error)
+            fprintf(stderr, "mcget %s: %s\n", remote, (const char*)packet->buffer);
+        NetPacket_Dispose(packet);
+        File_Close(f);
+        return;
+    }
+    McastInfo info;
+    memcpy(&info, packet->buffer, sizeof(info));
+    NetPacket_Dispose(packet);
+
+    // Listen on the interface our connection goes out of.
+    IPAddress iface = IPAddress_New(IPAddressType_IPv4LPStr);
+    socklen_t iface_size = sizeof(iface.ipv4_addr);
+    McastReceiver* r = NULL;
+    if (getsockname(session->socket->_native_handle, (struct sockaddr*)&iface.ipv4_addr, &iface_size) == 0)
+        r = McastReceiver_New(&info, iface, f, &config->udp_impairment);
+    if (!r) {
+        fprintf(stderr, "mcget %s: failed to join the multicast group.\n", remote);
+        File_Close(f);
+        return;
+    }
+    if (!config->quiet)
+        printf("Multicast download started, file size: %llu\n", (unsigned long long)info.size);
+
+    const u64 start_ns = Time_NowNs();
+    bool ok = true;
+    while (ok && !McastReceiver_Done(r))
+        ok = McastReceiver_Poll(r, 10);
+
+    u64 repaired = 0;
+    u32 seq = 0;
+    for (u32 missing; ok && (missing = McastReceiver_NextHole(r, &seq)) > 0;) {
+        // Holes close together are read as one range, reading a little again beats another round trip.
+        u32 end = seq + missing;
+        for (;;) {
+            u32 next = end;
+            const u32 more = McastReceiver_NextHole(r, &next);
+            if (!more || next - end > MCAST_REPAIR_GAP || (u64)(next + more - seq) * NET_UDP_PAYLOAD > NET_READ_MAX)
+                break;
+            end = next + more;
+        }
+        const u64 end_offset = ((u64)end * NET_UDP_PAYLOAD < info.size) ? (u64)end * NET_UDP_PAYLOAD : info.size;
+        for (u64 offset = (u64)seq * NET_UDP_PAYLOAD; ok && offset < end_offset;) {
+            const u64 size = (end_offset - offset < NET_READ_MAX) ? end_offset - offset : NET_READ_MAX;
+            ok = _client_read_into(session, remote, offset, size, f);
+            offset += size;
+            repaired += size;
+        }
+        seq = end;
+    }
+
+    if (ok) {
+        result->ok = true;
+        result->bytes = info.size;
+        if (!config->quiet) {
+            const double elapsed = (double)(Time_NowNs() - start_ns) / (double)CTM_NS_PER_SEC;
+            printf("Download finished, %llu bytes in %.3fs (%.1f MB/s): %u of %u datagrams from the group, %llu bytes repaired over the connection",
+                   (unsigned long long)info.size,
+                   elapsed,
+                   (elapsed > 0.0) ? (double)info.size / elapsed / (1024.0 * 1024.0) : 0.0,
+                   r->count,
+                   r->total,
+                   (unsigned long long)repaired);
+            if (r->dropped)
+                printf(", %llu datagrams dropped on purpose", (unsigned long long)r->dropped);
+            puts(".");
+        }
+    } else {
+        fprintf(stderr, "Download of %s failed.\n", remote);
+    }
+    McastReceiver_Dispose(r);
+    File_Close(f);
+}
+
+// Send local to the server as remote (defaults to the base name of local).
+void client_fup(Session* restrict session, const char* restrict local, const char* restrict remote, CommandResult* restrict result) {
+    if (!remote) {
+        remote = strrchr(local, '/');
+        remote = (remote) ? remote + 1 : local;
+    }
+
+    FileHandle* f = File_Open(local, FileMode_Read);
+    if (!f) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", local);
+        return;
+    }
+
+    FileStat st = {f->size, (i64)f->mtime};
+    const bool checksummed = Session_Integrity(session) == NET_INTEGRITY_CRC32C;
+    NetPacket* packet = NetPacket_New(NetPacketType_FileUploadRequest, (const u8*)remote, strlen(remote) + 1);
+    NetPacket_AddData(packet, (const u8*)&st, sizeof(st));
+    NetPacket_Send(session->socket, packet);
+    NetPacket_Dispose(packet);
+
+    packet = Session_NextPacket(session);
+    if (!packet || packet->header.id != NetPacketType_FileInfo) {
+        if (packet && packet->header.id == NetPacketType_Error)
+            fprintf(stderr, "fup %s: %s\n", local, (const char*)packet->buffer);
+        else if (!packet)
+            Session_ReportLost(session);
+        NetPacket_Dispose(packet);
+        File_Close(f);
+        return;
+    }
+    NetPacket_Dispose(packet);
+
+    if (!session->config->quiet)
+        printf("Upload started, file size: %llu\n", (unsigned long long)st.size);
+
+    File_Advise(f, 0, 0, FileAdvice_Sequential);
+    ChunkSizer sizer;
+    ChunkSizer_Init(&sizer, session->socket);
+    usize buffer_size = 0;
+    u8* buffer = NULL;
+    u64 offset = 0;
+    u32 digest = 0;
+    while (offset < st.size) {
+        const usize chunk_size = ChunkSizer_Next(&sizer);
+        if (chunk_size > buffer_size) {
+            buffer_size = chunk_size;
+            buffer = (u8*)realloc(buffer, buffer_size);
+        }
+        const i64 read_bytes = File_ReadAt(f, buffer, chunk_size, offset);
+        if (read_bytes <= 0) {
+            fprintf(stderr, "Failed to read %s.\n", local);
+            break;
+        }
+        NetPacket data_packet = {{NetPacketType_FileUploadData, (usize)read_bytes}, buffer};
+        if (checksummed) {
+            const u32 checksum = Crc32c_Update(0, buffer, (usize)read_bytes);
+            digest = Crc32c_Combine(digest, checksum, (u64)read_bytes);
+            if (NetPacket_SendWithChecksum(session->socket, &data_packet, checksum) == CS_SOCKET_ERROR)
+                break;
+        } else if (NetPacket_Send(session->socket, &data_packet) == CS_SOCKET_ERROR) {
+            break;
+        }
+        ChunkSizer_Update(&sizer, session->socket, (usize)read_bytes);
+        offset += (u64)read_bytes;
+    }
+    free(buffer);
+    File_Close(f);
+
+    // A short upload never completes on the server, there is no reply to wait for.
+    if (offset < st.size)
+        return;
+    if (checksummed) {
+        FileDigest file_digest = {st.size, digest, 0};
+        NetPacket digest_packet = {{NetPacketType_FileDigest, sizeof(file_digest)}, (u8*)&file_digest};
+        NetPacket_Send(session->socket, &digest_packet);
+    }
+
+    packet = Session_NextPacket(session);
+    if (packet && packet->header.id == NetPacketType_Message) {
+        result->ok = true;
+        result->bytes = st.size;
+        if (!session->config->quiet)
+            fputs((const char*)packet->buffer, stdout);
+    } else if (packet && packet->header.id == NetPacketType_Error) {
+        fprintf(stderr, "fup %s: %s\n", local, (const char*)packet->buffer);
+    } else if (!packet) {
+        Session_ReportLost(session);
+    }
+    NetPacket_Dispose(packet);
+}
+
+// Run one command line against the session.
+// Returns false for exit and for lines that are not commands (result->ok stays false).
+bool client_execute(Session* restrict session, char* restrict line, CommandResult* restrict result) {
+    usize args_size = DEF_ARG_COUNT * sizeof(char*);
+    usize arg_count = 0;
+    const char** cmd_args = (const char**)malloc(args_size);
+
+    memset(result, 0, sizeof(CommandResult));
+    result->start_ns = Time_NowNs();
+
+    bool known = true;
+    parse_command(line, &cmd_args, &args_size, &arg_count);
+    if (arg_count == 0) {
+        known = false;
+    } else if (!strcmp(cmd_args[0], "ls")) {
+        client_ls(session, result);
+    } else if (!strcmp(cmd_args[0], "stats")) {
+        client_stats(session, result);
+    } else if (!strcmp(cmd_args[0], "rate")) {
+        client_rate(session, (arg_count > 1) ? cmd_args[1] : NULL, (arg_count > 2) ? cmd_args[2] : NULL, result);
+    } else if (!strcmp(cmd_args[0], "read")) {
+        if (arg_count < 2)
+            puts("Usage: read [ remote_file ] [ offset ] [ size ]");
+        else
+            client_read(session, cmd_args[1], (arg_count > 2) ? cmd_args[2] : NULL, (arg_count > 3) ? cmd_args[3] : NULL, result);
+    } else if (!strcmp(cmd_args[0], "fget")) {
+        if (arg_count < 2)
+            puts("Usage: fget [ remote_file ] [ local_file ]");
+        else
+            client_fget(session, cmd_args[1], (arg_count > 2) ? cmd_args[2] : NULL, result);
+    } else if (!strcmp(cmd_args[0], "uget")) {
+        if (arg_count < 2)
+            puts("Usage: uget [ remote_file ] [ local_file ] [ max_rate ]");
+        else
+            client_uget(session, cmd_args[1], (arg_count > 2) ? cmd_args[2] : NULL, (arg_count > 3) ? cmd_args[3] : NULL, result);
+    } else if (!strcmp(cmd_args[0], "mcget")) {
+        if (arg_count < 2)
+            puts("Usage: mcget [ remote_file ] [ local_file ]");
+        else
+            client_mcget(session, cmd_args[1], (arg_count > 2) ? cmd_args[2] : NULL, result);
+    } else if (!strcmp(cmd_args[0], "mget")) {
+        // Interactively files are fetched one after the other, batch mode splits
+        // mget into single fgets up front so they run in parallel.
+        result->ok = arg_count > 1;
+        for (usize i = 1; i < arg_count; ++i) {
+            CommandResult file_result;
+            memset(&file_result, 0, sizeof(file_result));
+            client_fget(session, cmd_args[i], NULL, &file_result);
+            result->ok = result->ok && file_result.ok;
+            result->bytes += file_result.bytes;
+        }
+    } else if (!strcmp(cmd_args[0], "fup")) {
+        if (arg_count < 2)
+            puts("Usage: fup [ local_file ] [ remote_file ]");
+        else
+            client_fup(session, cmd_args[1], (arg_count > 2) ? cmd_args[2] : NULL, result);
+    } else if (!strcmp(cmd_args[0], "exit")) {
+        Socket_Shutdown(session->socket, CS_SD_BOTH);
+        Socket_Close(session->socket);
+        known = false;
+    } else {
+        fprintf(stderr, "Unknown command: %s\n", cmd_args[0]);
+        known = false;
+    }
+
+    result->end_ns = Time_NowNs();
+    result->retry_after_ms = session->retry_after_ms;
+    free(cmd_args);
+    return known;
+}
+
+#endif // NETFS_CLIENT_COMMANDS_H
@@ -0,0 +1,359 @@
+#ifndef NETFS_CLIENT_DOWNLOAD_H
+#define NETFS_CLIENT_DOWNLOAD_H
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_threads.h>
+#include <cs_systemio.h>
+#include <cs_time.h>
+#include <net_common.h>
+#include <net_transfer.h>
+
+// Upper bound of received chunks waiting for the writer. Once all buffers are in flight
+// the receiving thread stops reading the socket, which pushes back on the server.
+#define DOWNLOAD_MAX_IN_FLIGHT 8
+#define DOWNLOAD_MAX_QUEUED (DOWNLOAD_MAX_IN_FLIGHT * 2)
+#define DOWNLOAD_PROGRESS_INTERVAL_NS (100 * CTM_NS_PER_MS)
+
+typedef struct _netfs_download_options {
+    bool direct_io;   // Write aligned chunks with O_DIRECT, bypassing the page cache.
+    bool preallocate; // fallocate() the whole file before the first write.
+    bool quiet;       // Do not print a progress line.
+    bool hash;        // Compute the content hash (Hash_Fnv1a64) while writing.
+} DownloadOptions;
+
+typedef enum _netfs_download_state {
+    DownloadState_Pending, // Waiting for the FileInfo reply.
+    DownloadState_Running,
+    DownloadState_Finished,
+    DownloadState_Failed
+} DownloadState;
+
+// A received chunk waiting for the writer, buffer is -1 for a hole.
+typedef struct _netfs_download_chunk {
+    i32 buffer;
+    u64 offset;
+    u64 size;
+} DownloadChunk;
+
+// Download of one file, split in two stages: the thread reading the socket lands
+// payloads directly in pooled buffers (Download_AcquireBuffer/Download_Submit) and
+// a dedicated writer thread pwrite()s them at their offsets, so a slow disk and the
+// network overlap instead of stalling each other.
+typedef struct _netfs_download {
+    char path[CIO_PATH_MAX];
+    DownloadOptions options;
+    DownloadState state;
+    FileHandle* file;
+    FileHandle* direct_file;
+    u64 file_size;
+    u64 received_bytes;
+    u64 written_bytes;
+    u64 hash;
+    u64 start_ns;
+    u64 end_ns;
+    // Set before the request goes out if the server checksums the data (SetIntegrity),
+    // digest is then the CRC32C of what was received, kept by the receiving thread.
+    bool checksummed;
+    u32 digest;
+
+    bool _stream_done;
+    u8* _buffers[DOWNLOAD_MAX_IN_FLIGHT];
+    usize _buffer_capacity[DOWNLOAD_MAX_IN_FLIGHT];
+    i32 _free_buffers[DOWNLOAD_MAX_IN_FLIGHT];
+    usize _free_count;
+    DownloadChunk _chunks[DOWNLOAD_MAX_QUEUED];
+    usize _chunks_head;
+    usize _chunks_count;
+    Mutex* _mutex;
+    CondVar* _cond;
+    Thread* _writer;
+} Download;
+
+// Buffers are aligned for O_DIRECT.
+u8* _download_alloc(const usize size) {
+#ifdef CS_PLATFORM_NT
+    return (u8*)_aligned_malloc(size, CIO_DIRECT_ALIGNMENT);
+#else
+    void* p = NULL;
+    if (posix_memalign(&p, CIO_DIRECT_ALIGNMENT, size) != 0)
+        return NULL;
+    return (u8*)p;
+#endif
+}
+
+void _download_free(u8* restrict p) {
+#ifdef CS_PLATFORM_NT
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+Download* Download_New(const char* restrict path, const DownloadOptions* restrict options) {
+    Download* d = (Download*)malloc(sizeof(Download));
+    memset(d, 0, sizeof(Download));
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    d->options = *options;
+    d->state = DownloadState_Pending;
+    d->hash = NET_HASH_SEED;
+    for (i32 i = 0; i < DOWNLOAD_MAX_IN_FLIGHT; ++i)
+        d->_free_buffers[d->_free_count++] = i;
+    d->_mutex = Mutex_New();
+    d->_cond = CondVar_New();
+    return d;
+}
+
+// Expects the mutex to be held.
+void _download_set_finished(Download* restrict d) {
+    if (d->file_size > 0 && File_Truncate(d->file, d->file_size) == CIO_FILE_ERROR) {
+        d->state = DownloadState_Failed;
+    } else {
+        d->state = DownloadState_Finished;
+    }
+    d->end_ns = Time_NowNs();
+    CondVar_Broadcast(d->_cond);
+}
+
+ThreadArg _download_writer(ThreadArg args) {
+    Download* d = (Download*)args;
+
+    Mutex_Lock(d->_mutex);
+    while (d->state == DownloadState_Running) {
+        if (d->_chunks_count == 0) {
+            CondVar_Wait(d->_cond, d->_mutex);
+            continue;
+        }
+        const DownloadChunk chunk = d->_chunks[d->_chunks_head];
+        d->_chunks_head = (d->_chunks_head + 1) % DOWNLOAD_MAX_QUEUED;
+        --d->_chunks_count;
+        Mutex_Unlock(d->_mutex);
+
+        // The disk write happens outside the lock, the receiver keeps filling other buffers meanwhile.
+        bool ok = true;
+        if (chunk.buffer >= 0) {
+            u8* buffer = d->_buffers[chunk.buffer];
+            FileHandle* f = d->file;
+            if (d->direct_file && chunk.offset % CIO_DIRECT_ALIGNMENT == 0 && chunk.size % CIO_DIRECT_ALIGNMENT == 0)
+                f = d->direct_file;
+            ok = File_WriteAt(f, buffer, (usize)chunk.size, chunk.offset) == (i64)chunk.size;
+            if (d->options.hash)
+                d->hash = Hash_Fnv1a64(d->hash, buffer, (usize)chunk.size);
+        } else if (d->options.hash) {
+            d->hash = Hash_Fnv1a64Zeroes(d->hash, chunk.size);
+        }
+
+        Mutex_Lock(d->_mutex);
+        if (chunk.buffer >= 0)
+            d->_free_buffers[d->_free_count++] = chunk.buffer;
+        d->written_bytes += chunk.size;
+        if (!ok) {
+            fprintf(stderr, "Failed to write %s.\n", d->path);
+            d->state = DownloadState_Failed;
+        } else if (d->written_bytes >= d->file_size) {
+            _download_set_finished(d);
+        }
+        CondVar_Broadcast(d->_cond);
+    }
+    Mutex_Unlock(d->_mutex);
+    return NULL;
+}
+
+// The server accepted the request, open the destination and start the writer.
+i32 Download_Start(Download* restrict d, const u64 file_size) {
+    Mutex_Lock(d->_mutex);
+    d->file_size = file_size;
+    d->start_ns = Time_NowNs();
+    d->file = File_Open(d->path, FileMode_Write);
+    if (!d->file) {
+        fprintf(stderr, "Failed to open %s for writing.\n", d->path);
+        d->state = DownloadState_Failed;
+        CondVar_Broadcast(d->_cond);
+        Mutex_Unlock(d->_mutex);
+        return CIO_FILE_ERROR;
+    }
+
+    if (d->options.preallocate && file_size > 0 && File_Allocate(d->file, 0, file_size) == CIO_FILE_ERROR)
+        fprintf(stderr, "Could not preallocate %s, continuing without.\n", d->path);
+    if (d->options.direct_io) {
+        d->direct_file = File_OpenDirect(d->path);
+        if (!d->direct_file)
+            fprintf(stderr, "Direct I/O is not available for %s, continuing without.\n", d->path);
+    }
+
+    if (file_size == 0) {
+        d->_stream_done = true;
+        _download_set_finished(d);
+        Mutex_Unlock(d->_mutex);
+        return CIO_FILE_SUCCESS;
+    }
+
+    d->state = DownloadState_Running;
+    ThreadAttributes attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.args = (ThreadArg)d;
+    attr.routine = _download_writer;
+    attr.detached = false;
+    attr.name = "nfc-writer";
+    d->_writer = Thread_New(&attr);
+    CondVar_Broadcast(d->_cond);
+    Mutex_Unlock(d->_mutex);
+    return CIO_FILE_SUCCESS;
+}
+
+// Called by the receiving thread for every data chunk. Blocks until a buffer is free
+// and returns one that fits size bytes, or NULL if the download is not going to be
+// written (the payload then has to be skipped with Download_Skip()).
+u8* Download_AcquireBuffer(Download* restrict d, const usize size, i32* restrict index) {
+    Mutex_Lock(d->_mutex);
+    while (d->state == DownloadState_Pending || (d->state == DownloadState_Running && d->_free_count == 0))
+        CondVar_Wait(d->_cond, d->_mutex);
+    if (d->state != DownloadState_Running) {
+        Mutex_Unlock(d->_mutex);
+        return NULL;
+    }
+
+    *index = d->_free_buffers[--d->_free_count];
+    Mutex_Unlock(d->_mutex);
+
+    // Only the receiving thread touches a buffer between acquire and submit.
+    if (d->_buffer_capacity[*index] < size) {
+        _download_free(d->_buffers[*index]);
+        d->_buffer_capacity[*index] = (size + CIO_DIRECT_ALIGNMENT - 1) & ~(usize)(CIO_DIRECT_ALIGNMENT - 1);
+        d->_buffers[*index] = _download_alloc(d->_buffer_capacity[*index]);
+    }
+    return d->_buffers[*index];
+}
+
+// Expects the mutex to be held.
+void _download_push_chunk(Download* restrict d, const i32 buffer, const u64 size) {
+    DownloadChunk* chunk = d->_chunks + (d->_chunks_head + d->_chunks_count++) % DOWNLOAD_MAX_QUEUED;
+    chunk->buffer = buffer;
+    chunk->offset = d->received_bytes;
+    chunk->size = size;
+    d->received_bytes += size;
+    if (d->received_bytes >= d->file_size)
+        d->_stream_done = true;
+    CondVar_Broadcast(d->_cond);
+}
+
+// Hand a filled buffer over to the writer, it lands right after the previous chunk.
+void Download_Submit(Download* restrict d, const i32 index, const usize size) {
+    Mutex_Lock(d->_mutex);
+    _download_push_chunk(d, index, size);
+    Mutex_Unlock(d->_mutex);
+}
+
+// A sparse region of size bytes, nothing is written for it.
+void Download_SubmitHole(Download* restrict d, const u64 size) {
+    Mutex_Lock(d->_mutex);
+    while (d->state == DownloadState_Pending || (d->state == DownloadState_Running && d->_chunks_count >= DOWNLOAD_MAX_QUEUED))
+        CondVar_Wait(d->_cond, d->_mutex);
+    if (d->state == DownloadState_Running) {
+        _download_push_chunk(d, -1, size);
+    } else {
+        d->received_bytes += size;
+        if (d->received_bytes >= d->file_size)
+            d->_stream_done = true;
+        CondVar_Broadcast(d->_cond);
+    }
+    Mutex_Unlock(d->_mutex);
+}
+
+// A chunk was received but thrown away because the download already failed.
+void Download_Skip(Download* restrict d, const usize size) {
+    Mutex_Lock(d->_mutex);
+    d->received_bytes += size;
+    if (d->received_bytes >= d->file_size)
+        d->_stream_done = true;
+    CondVar_Broadcast(d->_cond);
+    Mutex_Unlock(d->_mutex);
+}
+
+// A chunk of size bytes in buffer index arrived damaged (its checksum did not match), the
+// download fails and the rest of the stream is thrown away.
+void Download_Corrupt(Download* restrict d, const i32 index, const usize size) {
+    Mutex_Lock(d->_mutex);
+    fprintf(stderr, "\nChecksum mismatch in %s at offset %llu.\n", d->path, (unsigned long long)d->received_bytes);
+    d->_free_buffers[d->_free_count++] = index;
+    d->received_bytes += size;
+    if (d->received_bytes >= d->file_size)
+        d->_stream_done = true;
+    if (d->state != DownloadState_Finished)
+        d->state = DownloadState_Failed;
+    CondVar_Broadcast(d->_cond);
+    Mutex_Unlock(d->_mutex);
+}
+
+// The server will not send any more data (error reply or disconnect).
+void Download_EndStream(Download* restrict d) {
+    Mutex_Lock(d->_mutex);
+    d->_stream_done = true;
+    if (d->state != DownloadState_Finished)
+        d->state = DownloadState_Failed;
+    CondVar_Broadcast(d->_cond);
+    Mutex_Unlock(d->_mutex);
+}
+
+// True once the server sent the whole file or stopped sending.
+bool Download_StreamDone(Download* restrict d) {
+    Mutex_Lock(d->_mutex);
+    const bool done = d->_stream_done;
+    Mutex_Unlock(d->_mutex);
+    return done;
+}
+
+// Bytes per second written to disk so far.
+double Download_Throughput(const Download* restrict d) {
+    const u64 end = (d->end_ns) ? d->end_ns : Time_NowNs();
+    const u64 elapsed = (end > d->start_ns) ? end - d->start_ns : 1;
+    return (double)d->written_bytes * (double)CTM_NS_PER_SEC / (double)elapsed;
+}
+
+// Block until the file is completely written or the download failed and the
+// server stopped sending, printing progress along the way.
+DownloadState Download_Wait(Download* restrict d) {
+    u64 last_progress_ns = 0;
+    Mutex_Lock(d->_mutex);
+    while (!(d->state == DownloadState_Finished || (d->state == DownloadState_Failed && d->_stream_done))) {
+        CondVar_Wait(d->_cond, d->_mutex);
+
+        const u64 now = Time_NowNs();
+        if (!d->options.quiet && now - last_progress_ns >= DOWNLOAD_PROGRESS_INTERVAL_NS) {
+            last_progress_ns = now;
+            printf("\rProgress: %5.1f%% %8.1f MB/s   ",
+                   (d->file_size) ? (double)d->written_bytes * 100.0 / (double)d->file_size : 100.0,
+                   Download_Throughput(d) / (1024.0 * 1024.0));
+            fflush(stdout);
+        }
+    }
+    const DownloadState state = d->state;
+    Mutex_Unlock(d->_mutex);
+
+    if (d->_writer) {
+        CondVar_Broadcast(d->_cond);
+        Thread_Join(d->_writer);
+        Thread_Dispose(d->_writer);
+        d->_writer = NULL;
+    }
+    return state;
+}
+
+void Download_Dispose(Download* restrict d) {
+    if (d->_writer) {
+        Download_EndStream(d);
+        Thread_Join(d->_writer);
+        Thread_Dispose(d->_writer);
+    }
+    if (d->direct_file)
+        File_Close(d->direct_file);
+    if (d->file)
+        File_Close(d->file);
+    for (usize i = 0; i < DOWNLOAD_MAX_IN_FLIGHT; ++i)
+        _download_free(d->_buffers[i]);
+    CondVar_Dispose(d->_cond);
+    Mutex_Dispose(d->_mutex);
+    free(d);
+}
+
+#endif // NETFS_CLIENT_DOWNLOAD_H
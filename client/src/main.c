@@ -3,127 +3,34 @@
 #include <cs_threads.h>
 #include <cs_systemio.h>
 #include <net_common.h>
-
-#define BUFFER_SIZE 64
-#define DEF_ARG_COUNT 256
-
-NetPacketQueue* g_packet_queue = NULL;
-
-void parse_command(char* restrict str, const char*** args, usize* args_size, usize* arg_count) {
-    // Parse the command by splitting it into tokens seperated by space, tab and new line characters.
-    i32 i = 0;
-    **args = strtok(str, " \t\n");
-    while (*(*args + i)) {
-        if (i >= *args_size / sizeof(char*) - 1) {
-            *args_size *= 2;
-            *args = (const char**)realloc(*args, *args_size);
-        }
-        *(*args + ++i) = strtok(NULL, " \t\n");
-    }
-    *arg_count = i;
-}
+#include <net_transfer.h>
+#include "cache.h"
+#include "download.h"
+#include "session.h"
+#include "commands.h"
+#include "batch.h"
 
 ThreadArg net_server_handler(ThreadArg args) {
-    Socket* s = (Socket*)args;
-
-    char* buffer = (char*)malloc(BUFFER_SIZE);
-    usize arg_count = DEF_ARG_COUNT;
-    usize args_size = arg_count * sizeof(char*);
-    const char** cmd_args = (const char**)malloc(args_size);
+    Session* session = (Session*)args;
 
-    usize sent_bytes = 0;
-    while (s->connected) {
+    char* buffer = NULL;
+    usize capacity = 0;
+    while (session->socket->connected) {
         printf("> ");
-
-        char* f = fgets(buffer, BUFFER_SIZE, stdin);
-        if (f == NULL || *f == '\n')
-            continue;
-
-        char* n = strrchr(buffer, '\n');
-        *n = 0;
-
-        parse_command(buffer, &cmd_args, &args_size, &arg_count);
-
-        if (!strcmp(cmd_args[0], "ls")) {
-            NetPacket* packet = NetPacket_New(NetPacketType_ListEntries, NULL, 0);
-            NetPacket_Send(s, packet);
-            NetPacket_Dispose(packet);
-        } else if (!strcmp(cmd_args[0], "fget")) {
-            NetPacket* packet = NetPacket_New(NetPacketType_FileDownloadRequest, NULL, 0);
-            NetPacket_AddData(packet, (u8*)cmd_args[1], strlen(cmd_args[1]) + 1);
-            NetPacket_Send(s, packet);
-            NetPacket_Dispose(packet);
-
-            packet = NULL;
-            while ((packet = NetPacketQueue_TryPop(g_packet_queue)) == NULL) ;
-            if (packet) {
-                if (packet->header.id == NetPacketType_Error) {
-                    printf("Received an error from the server: %s\n", (const char*)packet->buffer);
-                } else if (packet->header.id == NetPacketType_FileInfo) {
-                    const usize file_size = *(usize*)packet->buffer;
-                    usize bytes_received = 0;
-
-                    bool error = false;
-                    printf("Download started, file size: %zu\n", file_size);
-                    char file_name[2048];
-                    strcpy(file_name, cmd_args[1]);
-                    strcat(file_name, ".__b");
-                    FILE* fs = fopen(file_name, "w");
-                    if (fs) {
-                        while (bytes_received < file_size) {
-                            NetPacket* file_packet = NULL;
-                            while ((file_packet = NetPacketQueue_TryPop(g_packet_queue)) == NULL) ;
-                            if (file_packet->header.id == NetPacketType_FileDownloadData) {
-                                bytes_received += file_packet->header.size;
-                                fwrite(file_packet->buffer, bytes_received, 1, fs);
-                                NetPacket_Dispose(file_packet);
-                                printf("\rProgress: %f   ", (bytes_received / file_size) * 100.0);
-                            } else if (file_packet->header.id == NetPacketType_Error) {
-                                fprintf(stderr, "File download error: %s\n", (const char*)file_packet->buffer);
-                                error = true;
-                                break;
-                            }
-                        }
-                        if (!error)
-                            puts("\nDownload finished.");
-                        else
-                            puts("\nDownload failed.");
-                        fclose(fs);
-                    }
-                } else {
-                    puts("What the fuck did i just receive?");
-                }
-            } else {
-                fputs("Received a null packet\n", stderr);
-            }
-            NetPacket_Dispose(packet);
-        } else if (!strcmp(cmd_args[0], "fup")) {
-            NetPacket* packet = NetPacket_New(NetPacketType_FileUploadRequest, NULL, 0);
-            NetPacket_AddData(packet, (u8*)cmd_args[1], strlen(cmd_args[1]) + 1);
-
-            usize file_size;
-            FILE* fs = fopen(cmd_args[1], "r");
-            if (fs) {
-                fseek(fs, 0, SEEK_SET);
-                file_size = ftell(fs);
-                fclose(fs);
-            } else {
-                fprintf(stderr, "Failed to open file %s for reading.\n", cmd_args[1]);
-                NetPacket_Dispose(packet);
-                continue;
-            }
-
-            printf("File: %s Size: %zu\n", cmd_args[1], file_size);
-            NetPacket_AddData(packet, (u8*)file_size, sizeof(usize));
-            NetPacket_Send(s, packet);
-            NetPacket_Dispose(packet);
-        } else if (!strcmp(cmd_args[0], "exit")) {
-            Socket_Shutdown(s, CS_SD_BOTH);
-            Socket_Close(s);
+        fflush(stdout);
+
+        char* line = read_line(stdin, &buffer, &capacity);
+        if (line == NULL) {
+            // End of input, leave like exit would.
+            Socket_Shutdown(session->socket, CS_SD_BOTH);
+            Socket_Close(session->socket);
+            break;
         }
+
+        CommandResult result;
+        client_execute(session, line, &result);
     }
 
-    free(cmd_args);
     free(buffer);
     return NULL;
 }
@@ -132,58 +39,158 @@ i32 main(const i32 argc, const char* argv[]) {
     u16 port = 0;
     const char* ipv4 = NULL;
 
-    if (argc > 1) {
+    bool use_cache = true;
+    char cache_dir[CIO_PATH_MAX];
+    Cache_DefaultDir(cache_dir, sizeof(cache_dir));
+
+    const char* batch_path = NULL;
+    usize jobs = 1;
+    const char* trace_path = NULL;
+
+    ClientConfig config;
+    memset(&config, 0, sizeof(config));
+    config.socket_options = SocketOptions_Default();
+    config.integrity = true;
+
+    if (argc > 2) {
         ipv4 = argv[1];
         port = atoi(argv[2]);
+        for (i32 i = 3; i < argc; ++i) {
+            if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+                snprintf(cache_dir, sizeof(cache_dir), "%s", argv[++i]);
+            } else if (!strcmp(argv[i], "-n")) {
+                use_cache = false;
+            } else if (!strcmp(argv[i], "-d")) {
+                config.download_options.direct_io = true;
+            } else if (!strcmp(argv[i], "-K")) {
+                config.integrity = false;
+            } else if (!strcmp(argv[i], "-a")) {
+                config.download_options.preallocate = true;
+            } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+                batch_path = argv[++i];
+            } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+                jobs = atoi(argv[++i]);
+            } else if (!strcmp(argv[i], "-L") && i + 1 < argc) {
+                config.local_path = argv[++i];
+            } else if (!strcmp(argv[i], "-m")) {
+                config.metadata_channel = true;
+            } else if (!strcmp(argv[i], "-I") && i + 1 < argc) {
+                if (!UdpImpairment_Parse(&config.udp_impairment, argv[++i])) {
+                    fputs("Bad impairment, expected loss_percent[:delay_ms] like 2 or 0.5:40.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+            } else if (!strcmp(argv[i], "-T") && i + 1 < argc) {
+                trace_path = argv[++i];
+            } else if (!strcmp(argv[i], "-O") && i + 1 < argc) {
+                if (!Net_ParseSocketOptions(argv[++i], &config.socket_options)) {
+                    fputs("Bad socket options, expected a list like nodelay=1,rcvbuf=4M,connect_timeout=2000.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
     } else {
-        puts("Usage: nfc [ IPv4 ] [ port ]");
+        puts("Usage: nfc [ IPv4 ] [ port ] [ -c cache_dir ] [ -n (no cache) ] [ -d (direct I/O) ] [ -a (preallocate) ]\n"
+             "           [ -K (no checksums on fget and fup) ]\n"
+             "           [ -b script_file (batch mode, - for stdin) ] [ -j jobs (parallel batch connections) ]\n"
+             "           [ -T trace_file (dumped on SIGUSR1) ] [ -L local_socket_path (server on this host) ]\n"
+             "           [ -m (with -L: ls, stats and read over shared memory) ]\n"
+             "           [ -I loss_percent[:delay_ms] (uget, mcget: drop incoming datagrams and delay acks, for testing) ]\n"
+             "           [ -O socket_options (nodelay, sndbuf, rcvbuf, keepalive, busypoll, connect_timeout, send_timeout, recv_timeout) ]");
         return 0;
     }
+    config.host = ipv4;
+    config.port = port;
+
+    if (trace_path) {
+#ifdef CS_TRACE
+        if (Trace_DumpOnSignal(SIGUSR1, trace_path) != 0)
+            fputs("Failed to enable tracing.\n", stderr);
+#else
+        fputs("Built without tracing, -T is ignored (configure with -DNETFS_TRACE=ON).\n", stderr);
+#endif
+    }
 
-    CSSocket_Init();
+    if (use_cache) {
+        config.cache = Cache_Open(cache_dir);
+        if (!config.cache)
+            fputs("Continuing without a cache.\n", stderr);
+        config.download_options.hash = config.cache != NULL;
+    }
 
-    g_packet_queue = NetPacketQueue_New();
+    CSSocket_Init();
 
-    Socket* server = Socket_New(AddressFamily_InterNetwork, SocketType_Stream, ProtocolType_Tcp);
     IPEndPoint ep = IPEndPoint_New(IPAddress_Parse(ipv4), AddressFamily_InterNetwork, port);
-    if (Socket_Connect(server, ep) == CS_SOCKET_ERROR) {
-        fprintf(stderr, "Failed to connect to [%s:%hu].\n", ep.address.str, ep.port);
-        exit(EXIT_FAILURE);
+
+    if (batch_path) {
+        FILE* fs = (!strcmp(batch_path, "-")) ? stdin : fopen(batch_path, "r");
+        if (!fs) {
+            fprintf(stderr, "Failed to open batch file %s.\n", batch_path);
+            exit(EXIT_FAILURE);
+        }
+        config.quiet = true;
+        config.download_options.quiet = true;
+
+        const usize failures = Batch_Run(&config, ep, fs, jobs);
+        if (fs != stdin)
+            fclose(fs);
+        if (config.cache)
+            Cache_Close(config.cache);
+        return (failures > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    Socket* server = NULL;
+#ifdef CS_PLATFORM_UNIX
+    if (config.local_path) {
+        server = Socket_New(AddressFamily_Local, SocketType_Stream, ProtocolType_Default);
+        Socket_ApplyOptions(server, &config.socket_options);
+        if (Socket_ConnectLocal(server, config.local_path) == CS_SOCKET_ERROR) {
+            fprintf(stderr, "Failed to connect to %s.\n", config.local_path);
+            exit(EXIT_FAILURE);
+        }
+        printf("Connected to %s.\n", config.local_path);
+    }
+#endif
+    if (!server) {
+        server = Socket_New(AddressFamily_InterNetwork, SocketType_Stream, ProtocolType_Tcp);
+        Socket_ApplyOptions(server, &config.socket_options);
+        if (Socket_Connect(server, ep) == CS_SOCKET_ERROR) {
+            fprintf(stderr, "Failed to connect to [%s:%hu].\n", ep.address.str, ep.port);
+            exit(EXIT_FAILURE);
+        }
+        printf("Connected to [%s:%hu].\n", ep.address.str, ep.port);
     }
-    printf("Connected to [%s:%hu].\n", ep.address.str, ep.port);
+
+    Session* session = Session_New(server, &config, true);
+#ifdef CSR_AVAILABLE
+    MetadataChannel* metadata = NULL;
+    if (config.metadata_channel && config.local_path) {
+        metadata = MetadataChannel_Open(&config);
+        if (metadata)
+            puts("ls, stats and read go through shared memory.");
+        session->metadata = metadata;
+    }
+#endif
 
     ThreadAttributes attr;
-    attr.args = (ThreadArg)server;
+    attr.args = (ThreadArg)session;
     attr.initial_stack_size = 0;
     attr.detached = false;
+    attr.cpus = NULL;
+    attr.name = "nfc-shell";
     attr.routine = net_server_handler;
     Thread* server_handler = Thread_New(&attr);
 
-    while (server->connected) {
-        NetPacket* recv_packet = NetPacket_Receive(server);
-
-        if (!recv_packet)
-            continue;
-
-        switch (recv_packet->header.id) {
-            case NetPacketType_Message:
-                printf("\n%s", (const char*)recv_packet->buffer);
-                NetPacket_Dispose(recv_packet);
-                break;
-            default:
-                //printf("Received packet. Type: %s\n", NetPacket_GetTypeStr(recv_packet));
-                if (!NetPacketQueue_TryAdd(g_packet_queue, recv_packet)) {
-                    fputs("Failed to add packet to the queue.\n", stderr);
-                    NetPacket_Dispose(recv_packet);
-                }
-                //puts("Placed into the queue.");
-                break;
-        }
-    }
+    Session_RunReceiver(session);
 
-    NetPacketQueue_Dispose(g_packet_queue);
     Thread_Join(server_handler);
     Thread_Dispose(server_handler);
+    Session_Dispose(session);
+#ifdef CSR_AVAILABLE
+    if (metadata)
+        MetadataChannel_Dispose(metadata);
+#endif
     Socket_Dispose(server);
+    if (config.cache)
+        Cache_Close(config.cache);
     return 0;
 }
@@ -0,0 +1,176 @@
+#ifndef NETFS_CLIENT_MCASTGET_H
+#define NETFS_CLIENT_MCASTGET_H
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_systemio.h>
+#include <cs_time.h>
+#include <net_mcast.h>
+
+// Receiving side of mcget, see net_mcast.h. Listens on the group until it has every datagram,
+// saw the end of its first full pass or heard nothing for NET_MCAST_IDLE_MS, whatever is
+// missing then is left to the caller to read over unicast (McastReceiver_NextHole()).
+
+// Holes at most this many datagrams apart are repaired with one read.
+#define MCAST_REPAIR_GAP 32
+
+typedef struct _netfs_mcast_receiver {
+    Socket* socket;
+    FileHandle* file;
+    u64 size;
+    u32 total;
+    u32 transfer_id;
+    u32 first_pass;
+
+    u8* received;    // One bit per datagram of the file.
+    u32 count;       // Distinct datagrams that arrived.
+    u64 duplicates;
+    u64 dropped;     // By the impairment.
+    bool pass_over;  // The end marker of first_pass or a later pass arrived.
+    u64 deadline_ns; // Stop listening when nothing arrived by then.
+
+    UdpImpairment impairment;
+
+    u8 datagrams[NET_UDP_BATCH][NET_MCAST_DATAGRAM_MAX];
+    u8 stage[NET_UDP_BATCH * NET_UDP_PAYLOAD];
+} McastReceiver;
+
+// Join the group of info on the interface with address iface, datagrams go to file.
+// NULL on failure. impairment (drops only) may be NULL.
+McastReceiver* McastReceiver_New(const McastInfo* restrict info, const IPAddress iface, FileHandle* restrict file,
+                                 const UdpImpairment* restrict impairment) {
+    Socket* s = Socket_New(AddressFamily_InterNetwork, SocketType_Dgram, ProtocolType_Udp);
+    if (!s)
+        return NULL;
+    IPAddress group = IPAddress_New(IPAddressType_IPv4LPStr);
+    memset(&group.ipv4_addr, 0, sizeof(group.ipv4_addr));
+    group.ipv4_addr.sin_addr.s_addr = info->group;
+    inet_ntop(AF_INET, &group.ipv4_addr.sin_addr, group.str, sizeof(group.str));
+    // Bound to the group itself, other traffic to the port stays out.
+    Socket_SetReuseAddress(s, true);
+    if (Socket_Bind(s, IPEndPoint_New(group, AddressFamily_InterNetwork, (u16)info->port)) == CS_SOCKET_ERROR ||
+        Socket_JoinMulticast(s, group, iface) == CS_SOCKET_ERROR) {
+        Socket_Dispose(s);
+        return NULL;
+    }
+    Socket_SetBufferSizes(s, NET_UDP_SOCKET_BUFFER, NET_UDP_SOCKET_BUFFER);
+
+    McastReceiver* r = (McastReceiver*)malloc(sizeof(McastReceiver));
+    memset(r, 0, offsetof(McastReceiver, datagrams));
+    r->socket = s;
+    r->file = file;
+    r->size = info->size;
+    r->total = Udp_DatagramCount(info->size);
+    r->transfer_id = info->transfer_id;
+    r->first_pass = info->first_pass;
+    r->received = (u8*)calloc((usize)r->total / 8 + 1, 1);
+    // The first pass may still be gathering joins.
+    r->deadline_ns = Time_NowNs() + (u64)(NET_MCAST_GATHER_MS + NET_MCAST_IDLE_MS) * CTM_NS_PER_MS;
+    if (impairment)
+        r->impairment = *impairment;
+    return r;
+}
+
+void McastReceiver_Dispose(McastReceiver* restrict r) {
+    free(r->received);
+    Socket_Dispose(r->socket);
+    free(r);
+}
+
+bool McastReceiver_Has(const McastReceiver* restrict r, const u32 seq) {
+    return (r->received[seq / 8] >> (seq % 8)) & 1;
+}
+
+// Nothing more to expect from the group.
+bool McastReceiver_Done(const McastReceiver* restrict r) {
+    return r->count == r->total || r->pass_over || Time_NowNs() >= r->deadline_ns;
+}
+
+bool _mcast_receiver_write(McastReceiver* restrict r, const u32 first, const u32 count) {
+    const u64 offset = (u64)first * NET_UDP_PAYLOAD;
+    const usize length = (r->size - offset < (u64)count * NET_UDP_PAYLOAD) ? (usize)(r->size - offset) : count * NET_UDP_PAYLOAD;
+    if (File_WriteAt(r->file, r->stage, length, offset) != (i64)length) {
+        fputs("Failed to write the received data.\n", stderr);
+        return false;
+    }
+    return true;
+}
+
+bool _mcast_receiver_process(McastReceiver* restrict r, const Datagram* restrict batch, const i32 count) {
+    u32 run_first = 0;
+    u32 run_count = 0;
+    for (i32 i = 0; i < count; ++i) {
+        McastDataHeader header;
+        if (batch[i].size < sizeof(header))
+            continue;
+        memcpy(&header, batch[i].buffer, sizeof(header));
+        if (header.transfer_id != r->transfer_id || header.seq > r->total)
+            continue;
+        if (header.seq == r->total) {
+            if (header.pass >= r->first_pass)
+                r->pass_over = true;
+            continue;
+        }
+        const u64 offset = (u64)header.seq * NET_UDP_PAYLOAD;
+        const usize expected = (r->size - offset < NET_UDP_PAYLOAD) ? (usize)(r->size - offset) : NET_UDP_PAYLOAD;
+        if (batch[i].size != sizeof(header) + expected)
+            continue;
+        if (UdpImpairment_Drop(&r->impairment)) {
+            ++r->dropped;
+            continue;
+        }
+        if (McastReceiver_Has(r, header.seq)) {
+            ++r->duplicates;
+            continue;
+        }
+
+        if (run_count && (header.seq != run_first + run_count || run_count == NET_UDP_BATCH)) {
+            if (!_mcast_receiver_write(r, run_first, run_count))
+                return false;
+            run_count = 0;
+        }
+        if (!run_count)
+            run_first = header.seq;
+        memcpy(r->stage + (usize)run_count * NET_UDP_PAYLOAD, batch[i].buffer + sizeof(header), expected);
+        ++run_count;
+        r->received[header.seq / 8] |= (u8)(1u << (header.seq % 8));
+        ++r->count;
+    }
+    return !run_count || _mcast_receiver_write(r, run_first, run_count);
+}
+
+// Wait up to timeout_ms for datagrams and take in what is there. False if the file could
+// not be written.
+bool McastReceiver_Poll(McastReceiver* restrict r, const i32 timeout_ms) {
+    Socket_Poll(r->socket, POLLIN, timeout_ms);
+    Datagram batch[NET_UDP_BATCH];
+    for (;;) {
+        for (u32 i = 0; i < NET_UDP_BATCH; ++i) {
+            batch[i].buffer = r->datagrams[i];
+            batch[i].size = NET_MCAST_DATAGRAM_MAX;
+        }
+        const i32 received = Socket_ReceiveBatch(r->socket, batch, NET_UDP_BATCH);
+        if (received <= 0)
+            return true;
+        r->deadline_ns = Time_NowNs() + (u64)NET_MCAST_IDLE_MS * CTM_NS_PER_MS;
+        if (!_mcast_receiver_process(r, batch, received))
+            return false;
+        if (received < NET_UDP_BATCH)
+            return true;
+    }
+}
+
+// Next run of missing datagrams at or after *seq: sets *seq to its start and returns its
+// length, 0 if nothing is missing from there on.
+u32 McastReceiver_NextHole(const McastReceiver* restrict r, u32* restrict seq) {
+    u32 first = *seq;
+    while (first < r->total && McastReceiver_Has(r, first))
+        ++first;
+    u32 end = first;
+    while (end < r->total && !McastReceiver_Has(r, end))
+        ++end;
+    *seq = first;
+    return end - first;
+}
+
+#endif // NETFS_CLIENT_MCASTGET_H
@@ -0,0 +1,371 @@
+#ifndef NETFS_CLIENT_SESSION_H
+#define NETFS_CLIENT_SESSION_H
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_threads.h>
+#include <cs_trace.h>
+#include <net_common.h>
+#include <net_udp.h>
+#include "cache.h"
+#include "download.h"
+
+// Settings shared by every session of one nfclient run.
+typedef struct _netfs_client_config {
+    const char* host;
+    u16 port;
+    const char* local_path; // Connect through this local socket instead, NULL for TCP.
+    bool metadata_channel;  // With local_path: ls, stats and read over shared memory.
+    Cache* cache;
+    DownloadOptions download_options;
+    SocketOptions socket_options;
+    UdpImpairment udp_impairment; // Simulated loss and delay for uget (-I), none if zeroed.
+    bool integrity; // Ask for checksummed fget and fup (SetIntegrity), off with -K.
+    bool quiet; // Batch mode: no progress lines and no per-command chatter.
+} ClientConfig;
+
+#ifdef CSR_AVAILABLE
+// A connection to the server's local socket switched over to a shared memory channel
+// (ShmOpen). Requests the channel serves never touch a socket, this one stays open only so
+// the server notices when we go away.
+typedef struct _netfs_metadata_channel {
+    Socket* socket;
+    ShmChannel* channel;
+} MetadataChannel;
+
+MetadataChannel* MetadataChannel_Open(const ClientConfig* restrict config) {
+    Socket* s = Socket_New(AddressFamily_Local, SocketType_Stream, ProtocolType_Default);
+    Socket_ApplyOptions(s, &config->socket_options);
+    if (Socket_ConnectLocal(s, config->local_path) == CS_SOCKET_ERROR) {
+        fprintf(stderr, "Failed to connect to %s.\n", config->local_path);
+        Socket_Dispose(s);
+        return NULL;
+    }
+
+    NetPacket request = {{NetPacketType_ShmOpen, 0}, NULL};
+    NetPacket* reply = (NetPacket_Send(s, &request) != CS_SOCKET_ERROR) ? NetPacket_Receive(s) : NULL;
+    ShmChannel* ch = NULL;
+    if (reply && reply->header.id == NetPacketType_ShmChannel) {
+        const int fd = Socket_TakeFd(s);
+        ch = (fd != -1) ? ShmChannel_Attach(fd) : NULL;
+    } else if (reply && reply->header.id == NetPacketType_Error) {
+        fprintf(stderr, "Shared memory channel: %s\n", (const char*)reply->buffer);
+    } else {
+        fputs("Shared memory channel: the server did not offer one.\n", stderr);
+    }
+    NetPacket_Dispose(reply);
+    if (!ch) {
+        Socket_Dispose(s);
+        return NULL;
+    }
+
+    MetadataChannel* m = (MetadataChannel*)malloc(sizeof(MetadataChannel));
+    m->socket = s;
+    m->channel = ch;
+    return m;
+}
+
+void MetadataChannel_Dispose(MetadataChannel* restrict m) {
+    ShmChannel_Dispose(m->channel);
+    Socket_Dispose(m->socket);
+    free(m);
+}
+
+// Requests the server answers over the channel, everything else stays on the session's socket.
+bool _metadata_channel_serves(const NetPacketType type) {
+    return type == NetPacketType_ListEntries || type == NetPacketType_Stats || type == NetPacketType_FileReadRequest;
+}
+#endif
+
+// One connection to the server.
+// A threaded session has a receiver thread (Session_RunReceiver) reading the socket and
+// queueing replies while another thread runs commands, that is how the interactive shell
+// works. Otherwise the thread running commands reads the socket itself, which is what
+// batch workers do since they have nothing else to wait for.
+// Either way file data never goes through the queue, it is received straight into the
+// active download.
+typedef struct _netfs_session {
+    Socket* socket;
+    const ClientConfig* config;
+    NetPacketQueue* queue;
+    bool threaded;
+    // Set once the server turned the connection away (Busy): how long it asked us to stay away.
+    u32 retry_after_ms;
+    // Integrity checks the server agreed to (SetIntegrity), asked for before the first transfer.
+    // The server keeps them for the connection, batch mode hands them on with pooled ones.
+    u32 integrity;
+    bool integrity_known;
+#ifdef CSR_AVAILABLE
+    // Not owned, several sessions of one thread may share it. NULL to use the socket only.
+    MetadataChannel* metadata;
+#endif
+
+    // Set by the receiver whenever it queued a packet or the connection closed.
+    Event* _queue_event;
+    Download* _active_download;
+} Session;
+
+Session* Session_New(Socket* restrict s, const ClientConfig* restrict config, const bool threaded) {
+    Session* session = (Session*)malloc(sizeof(Session));
+    session->socket = s;
+    session->config = config;
+    session->queue = NetPacketQueue_New();
+    session->threaded = threaded;
+    session->retry_after_ms = 0;
+    session->integrity = NET_INTEGRITY_NONE;
+    session->integrity_known = false;
+#ifdef CSR_AVAILABLE
+    session->metadata = NULL;
+#endif
+    session->_queue_event = Event_New(false);
+    session->_active_download = NULL;
+    return session;
+}
+
+// The socket is not owned by the session and stays open.
+void Session_Dispose(Session* restrict session) {
+    NetPacket* packet;
+    while ((packet = NetPacketQueue_TryPop(session->queue)) != NULL)
+        NetPacket_Dispose(packet);
+    NetPacketQueue_Dispose(session->queue);
+    Event_Dispose(session->_queue_event);
+    free(session);
+}
+
+// Register d as the download file data belongs to. Has to happen before the
+// request is sent since data can arrive right behind the reply.
+void Session_SetActiveDownload(Session* restrict session, Download* restrict d) {
+    Atomic_Store(&session->_active_download, d, CT_RELEASE);
+}
+
+Download* Session_GetActiveDownload(Session* restrict session) {
+    return Atomic_Load(&session->_active_download, CT_ACQUIRE);
+}
+
+// Receive the payload of a FileDownloadData/FileDownloadHole packet straight into the download pipeline.
+i32 _session_receive_download(Session* restrict session, Download* restrict d, const PacketHeader* restrict header) {
+    Socket* s = session->socket;
+    if (header->id == NetPacketType_FileDownloadHole) {
+        u64 hole_size = 0;
+        if (header->size != sizeof(hole_size) || Socket_ReceiveAll(s, (u8*)&hole_size, sizeof(hole_size), 0) == CS_SOCKET_ERROR)
+            return CS_SOCKET_ERROR;
+        if (d->checksummed)
+            d->digest = Crc32c_Zeroes(d->digest, hole_size);
+        Download_SubmitHole(d, hole_size);
+        return CS_SOCKET_SUCCESS;
+    }
+
+    // A checksummed chunk ends in the checksum of the bytes before it.
+    usize size = header->size;
+    if (d->checksummed) {
+        if (size < NET_CHECKSUM_SIZE)
+            return CS_SOCKET_ERROR;
+        size -= NET_CHECKSUM_SIZE;
+    }
+    i32 index = 0;
+    u8* buffer = Download_AcquireBuffer(d, size, &index);
+    if (!buffer) {
+        if (NetPacket_DiscardPayload(s, header) == CS_SOCKET_ERROR)
+            return CS_SOCKET_ERROR;
+        Download_Skip(d, size);
+        return CS_SOCKET_SUCCESS;
+    }
+    if (size > 0 && Socket_ReceiveAll(s, buffer, size, 0) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    if (d->checksummed) {
+        u32 checksum = 0;
+        if (Socket_ReceiveAll(s, (u8*)&checksum, NET_CHECKSUM_SIZE, 0) == CS_SOCKET_ERROR)
+            return CS_SOCKET_ERROR;
+        if (Crc32c_Update(0, buffer, size) != checksum) {
+            Download_Corrupt(d, index, size);
+            return CS_SOCKET_SUCCESS;
+        }
+        d->digest = Crc32c_Combine(d->digest, checksum, size);
+    }
+    Download_Submit(d, index, size);
+    return CS_SOCKET_SUCCESS;
+}
+
+// The server is too loaded to take us on and closes the connection, note when to come back.
+void _session_busy(Session* restrict session, const PacketHeader* restrict header) {
+    NetPacket* packet = NetPacket_ReceivePayload(session->socket, header);
+    u32 retry_after_ms = NET_BUSY_DEFAULT_RETRY_MS;
+    const char* reason = "busy";
+    if (packet && packet->header.size >= sizeof(BusyNotice)) {
+        retry_after_ms = ((const BusyNotice*)packet->buffer)->retry_after_ms;
+        if (packet->header.size > sizeof(BusyNotice) && packet->buffer[packet->header.size - 1] == 0)
+            reason = (const char*)packet->buffer + sizeof(BusyNotice);
+    }
+    fprintf(stderr, "Server busy (%s), retry in %u ms.\n", reason, retry_after_ms);
+    session->retry_after_ms = (retry_after_ms) ? retry_after_ms : 1;
+    NetPacket_Dispose(packet);
+    Socket_Close(session->socket);
+}
+
+// Read one packet off the socket. File data is fed to the active download (or dropped
+// if there is none) and NULL is returned with *data set, anything else is returned.
+// Returns NULL with *data unset once the connection is gone, a Busy notice ends it too.
+NetPacket* _session_receive(Session* restrict session, bool* restrict data) {
+    *data = false;
+    PacketHeader header;
+    if (NetPacket_ReceiveHeader(session->socket, &header) == CS_SOCKET_ERROR)
+        return NULL;
+
+    if (header.id == NetPacketType_Busy) {
+        _session_busy(session, &header);
+        return NULL;
+    }
+    if (header.id == NetPacketType_FileDownloadData || header.id == NetPacketType_FileDownloadHole) {
+        *data = true;
+        Download* d = Session_GetActiveDownload(session);
+        if (!d) {
+            if (NetPacket_DiscardPayload(session->socket, &header) == CS_SOCKET_ERROR)
+                *data = false;
+            return NULL;
+        }
+        if (_session_receive_download(session, d, &header) == CS_SOCKET_ERROR) {
+            Download_EndStream(d);
+            *data = false;
+        }
+        return NULL;
+    }
+    return NetPacket_ReceivePayload(session->socket, &header);
+}
+
+// Queue a reply for the thread running commands. An error also ends the download in
+// progress, it is queued first so whoever waits on the download finds the reason.
+void _session_queue(Session* restrict session, NetPacket* restrict packet) {
+    const bool is_error = packet->header.id == NetPacketType_Error;
+    if (!NetPacketQueue_TryAdd(session->queue, packet)) {
+        fputs("Failed to add packet to the queue.\n", stderr);
+        NetPacket_Dispose(packet);
+    }
+    if (session->threaded)
+        Event_Set(session->_queue_event);
+    if (is_error) {
+        Download* d = Session_GetActiveDownload(session);
+        if (d)
+            Download_EndStream(d);
+    }
+}
+
+// Receiver loop of a threaded session, returns once the connection is closed.
+void Session_RunReceiver(Session* restrict session) {
+    while (session->socket->connected) {
+        bool data = false;
+        NetPacket* packet = _session_receive(session, &data);
+        if (packet)
+            _session_queue(session, packet);
+        else if (!data)
+            break;
+    }
+
+    Download* d = Session_GetActiveDownload(session);
+    if (d)
+        Download_EndStream(d);
+    Event_Set(session->_queue_event);
+}
+
+// Next reply from the server (never file data), NULL if the connection is gone.
+NetPacket* Session_NextPacket(Session* restrict session) {
+    NetPacket* packet = NetPacketQueue_TryPop(session->queue);
+    if (packet)
+        return packet;
+
+    if (session->threaded) {
+        // The event may still be set from a packet that was taken without waiting, then we
+        // just look at the queue once more.
+        TRACE_BEGIN(wait);
+        while ((packet = NetPacketQueue_TryPop(session->queue)) == NULL) {
+            if (!session->socket->connected)
+                break;
+            Event_Wait(session->_queue_event, CT_INFINITE);
+        }
+        TRACE_END(wait, "queue_wait");
+        return (packet) ? packet : NetPacketQueue_TryPop(session->queue);
+    }
+
+    for (;;) {
+        bool data = false;
+        packet = _session_receive(session, &data);
+        if (packet || !data)
+            return packet;
+    }
+}
+
+// Next reply if one has arrived already, NULL otherwise. *lost is set once the connection is gone.
+NetPacket* Session_TryNextPacket(Session* restrict session, bool* restrict lost) {
+    *lost = false;
+    NetPacket* packet = NetPacketQueue_TryPop(session->queue);
+    if (packet)
+        return packet;
+    if (session->threaded) {
+        // Look once more, the receiver may have queued a last packet before it stopped.
+        *lost = !session->socket->connected;
+        return NetPacketQueue_TryPop(session->queue);
+    }
+    const i32 readable = Socket_WaitReadable(session->socket, 0);
+    if (readable == 0)
+        return NULL;
+    packet = (readable > 0) ? Session_NextPacket(session) : NULL;
+    *lost = packet == NULL;
+    return packet;
+}
+
+// Send a request answered by a single packet (no file data) and return the reply, NULL if
+// the connection is gone. Goes through the metadata channel if there is one that serves it.
+NetPacket* Session_Exchange(Session* restrict session, NetPacket* restrict request) {
+#ifdef CSR_AVAILABLE
+    if (session->metadata && _metadata_channel_serves(request->header.id)) {
+        if (NetPacket_SendShm(session->metadata->channel, request) == CS_SOCKET_ERROR)
+            return NULL;
+        return NetPacket_ReceiveShm(session->metadata->channel);
+    }
+#endif
+    if (NetPacket_Send(session->socket, request) == CS_SOCKET_ERROR)
+        return NULL;
+    return Session_NextPacket(session);
+}
+
+// Integrity checks for fget and fup on this connection, asked for once if the config wants them.
+// Nothing is checked if the server turned them down or did not answer with a mode.
+u32 Session_Integrity(Session* restrict session) {
+    if (session->integrity_known || !session->config->integrity)
+        return session->integrity;
+    session->integrity_known = true;
+    IntegrityMode mode = {NET_INTEGRITY_CRC32C};
+    NetPacket request = {{NetPacketType_SetIntegrity, sizeof(mode)}, (u8*)&mode};
+    NetPacket* reply = Session_Exchange(session, &request);
+    if (reply && reply->header.id == NetPacketType_SetIntegrity && reply->header.size >= sizeof(mode)) {
+        memcpy(&mode, reply->buffer, sizeof(mode));
+        session->integrity = mode.mode;
+    }
+    NetPacket_Dispose(reply);
+    return session->integrity;
+}
+
+// Wait until the server has sent all of d. A receiver thread does the actual work in
+// threaded sessions, synchronous ones read the socket here.
+void Session_PumpDownload(Session* restrict session, Download* restrict d) {
+    if (session->threaded)
+        return;
+
+    while (!Download_StreamDone(d)) {
+        bool data = false;
+        NetPacket* packet = _session_receive(session, &data);
+        if (packet) {
+            _session_queue(session, packet);
+        } else if (!data) {
+            Download_EndStream(d);
+            break;
+        }
+    }
+}
+
+// Tell the user the connection dropped, unless the server said why (Busy) already.
+void Session_ReportLost(Session* restrict session) {
+    if (!session->retry_after_ms)
+        fputs("Connection lost.\n", stderr);
+}
+
+#endif // NETFS_CLIENT_SESSION_H
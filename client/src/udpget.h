@@ -0,0 +1,215 @@
+#ifndef NETFS_CLIENT_UDPGET_H
+#define NETFS_CLIENT_UDPGET_H
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_systemio.h>
+#include <cs_time.h>
+#include <net_udp.h>
+
+// Receiving side of a uget, see net_udp.h. Datagrams are written where they belong as they
+// come in, consecutive ones of a batch with a single write, and every batch is answered
+// with one ack. While nothing comes in the last ack is repeated every UDP_ACK_IDLE_MS so a
+// lost one does not stall the sender until its timeout.
+
+#define UDP_ACK_IDLE_MS 5
+// Acks held back by an impairment delay, enough for a long delay at a high rate.
+#define UDP_DELAY_LINE_CAPACITY 4096
+
+typedef struct _netfs_udp_receiver {
+    Socket* socket;
+    FileHandle* file;
+    u64 size;
+    u32 total;
+    u32 transfer_id;
+
+    u8* received;      // One bit per datagram of the file.
+    u32 cumulative;    // Every datagram below arrived.
+    u32 highest;       // One past the highest that arrived.
+    u32 count;         // Distinct datagrams that arrived.
+    u64 echo_ns;       // sent_ns of the newest arrival, for the next ack.
+    u64 duplicates;
+    u64 dropped;       // By the impairment.
+    u64 last_ack_ns;
+    u64 last_data_ns;
+
+    UdpImpairment impairment;
+    UdpDelayLine* delay; // NULL without an impairment delay.
+
+    u8 datagrams[NET_UDP_BATCH][NET_UDP_DATAGRAM_MAX];
+    u8 stage[NET_UDP_BATCH * NET_UDP_PAYLOAD];
+    u8 ack[NET_UDP_ACK_MAX];
+} UdpReceiver;
+
+// A receiver listening on a port of its own (UdpReceiver_Port()), NULL on failure.
+// impairment may be NULL.
+UdpReceiver* UdpReceiver_New(const UdpImpairment* restrict impairment) {
+    Socket* s = Socket_New(AddressFamily_InterNetwork, SocketType_Dgram, ProtocolType_Udp);
+    if (!s)
+        return NULL;
+    if (Socket_Bind(s, IPEndPoint_New(IPAddress_New(IPAddressType_Any), AddressFamily_InterNetwork, 0)) == CS_SOCKET_ERROR) {
+        Socket_Dispose(s);
+        return NULL;
+    }
+    Socket_SetBufferSizes(s, NET_UDP_SOCKET_BUFFER, NET_UDP_SOCKET_BUFFER);
+
+    UdpReceiver* r = (UdpReceiver*)malloc(sizeof(UdpReceiver));
+    memset(r, 0, offsetof(UdpReceiver, datagrams));
+    r->socket = s;
+    if (impairment)
+        r->impairment = *impairment;
+    if (r->impairment.delay_ms)
+        r->delay = UdpDelayLine_New(UDP_DELAY_LINE_CAPACITY, NET_UDP_ACK_MAX);
+    return r;
+}
+
+void UdpReceiver_Dispose(UdpReceiver* restrict r) {
+    if (r->delay)
+        UdpDelayLine_Dispose(r->delay);
+    free(r->received);
+    Socket_Dispose(r->socket);
+    free(r);
+}
+
+u16 UdpReceiver_Port(const UdpReceiver* restrict r) {
+    return r->socket->local_ep.port;
+}
+
+// The server announced the transfer (info), its datagrams come from server's address at
+// info->port and go to file. Datagrams that arrived before are still waiting in the socket.
+bool UdpReceiver_Start(UdpReceiver* restrict r, const IPAddress server, const UdpTransferInfo* restrict info, FileHandle* restrict file) {
+    if (Socket_Connect(r->socket, IPEndPoint_New(server, AddressFamily_InterNetwork, (u16)info->port)) == CS_SOCKET_ERROR)
+        return false;
+    r->file = file;
+    r->size = info->size;
+    r->total = Udp_DatagramCount(info->size);
+    r->transfer_id = info->transfer_id;
+    r->received = (u8*)calloc((usize)r->total / 8 + 2, 1);
+    r->last_ack_ns = r->last_data_ns = Time_NowNs();
+    return true;
+}
+
+bool UdpReceiver_Complete(const UdpReceiver* restrict r) {
+    return r->cumulative >= r->total;
+}
+
+bool _udp_receiver_has(const UdpReceiver* restrict r, const u32 seq) {
+    return (r->received[seq / 8] >> (seq % 8)) & 1;
+}
+
+void _udp_receiver_send_ack(UdpReceiver* restrict r, const u64 now) {
+    UdpAckHeader ack = {r->transfer_id, r->cumulative, r->highest, 0, r->echo_ns};
+    const u32 span = r->highest - r->cumulative;
+    ack.sack_size = ((span < NET_UDP_WINDOW) ? span + 7 : NET_UDP_WINDOW) / 8;
+    // The bitmap starts at cumulative, which need not be on a byte boundary of received.
+    const u32 base = r->cumulative / 8;
+    const u32 shift = r->cumulative % 8;
+    const u32 limit = r->total / 8 + 1;
+    u8* sack = r->ack + sizeof(ack);
+    for (u32 i = 0; i < ack.sack_size; ++i) {
+        const u32 low = (base + i <= limit) ? r->received[base + i] : 0;
+        const u32 high = (base + i + 1 <= limit) ? r->received[base + i + 1] : 0;
+        sack[i] = (u8)((low | (high << 8)) >> shift);
+    }
+    memcpy(r->ack, &ack, sizeof(ack));
+    r->echo_ns = 0;
+    r->last_ack_ns = now;
+
+    const usize size = sizeof(ack) + ack.sack_size;
+    if (r->delay) {
+        UdpDelayLine_Push(r->delay, r->ack, size, now + (u64)r->impairment.delay_ms * CTM_NS_PER_MS);
+        return;
+    }
+    Datagram d = {r->ack, size};
+    Socket_SendBatch(r->socket, &d, 1);
+}
+
+bool _udp_receiver_write(UdpReceiver* restrict r, const u32 first, const u32 count) {
+    const u64 offset = (u64)first * NET_UDP_PAYLOAD;
+    const usize length = (r->size - offset < (u64)count * NET_UDP_PAYLOAD) ? (usize)(r->size - offset) : count * NET_UDP_PAYLOAD;
+    if (File_WriteAt(r->file, r->stage, length, offset) != (i64)length) {
+        fputs("Failed to write the received data.\n", stderr);
+        return false;
+    }
+    return true;
+}
+
+// Take in one batch of datagrams, returns false if they could not be written.
+bool _udp_receiver_process(UdpReceiver* restrict r, const Datagram* restrict batch, const i32 count) {
+    u32 run_first = 0;
+    u32 run_count = 0;
+    for (i32 i = 0; i < count; ++i) {
+        UdpDataHeader header;
+        if (batch[i].size < sizeof(header))
+            continue;
+        memcpy(&header, batch[i].buffer, sizeof(header));
+        if (header.transfer_id != r->transfer_id || header.seq >= r->total)
+            continue;
+        const u64 offset = (u64)header.seq * NET_UDP_PAYLOAD;
+        const usize expected = (r->size - offset < NET_UDP_PAYLOAD) ? (usize)(r->size - offset) : NET_UDP_PAYLOAD;
+        if (batch[i].size != sizeof(header) + expected)
+            continue;
+        if (UdpImpairment_Drop(&r->impairment)) {
+            ++r->dropped;
+            continue;
+        }
+        r->echo_ns = header.sent_ns;
+        if (_udp_receiver_has(r, header.seq)) {
+            ++r->duplicates;
+            continue;
+        }
+
+        // Consecutive datagrams are written together.
+        if (run_count && (header.seq != run_first + run_count || run_count == NET_UDP_BATCH)) {
+            if (!_udp_receiver_write(r, run_first, run_count))
+                return false;
+            run_count = 0;
+        }
+        if (!run_count)
+            run_first = header.seq;
+        memcpy(r->stage + (usize)run_count * NET_UDP_PAYLOAD, batch[i].buffer + sizeof(header), expected);
+        ++run_count;
+
+        r->received[header.seq / 8] |= (u8)(1u << (header.seq % 8));
+        ++r->count;
+        if (header.seq >= r->highest)
+            r->highest = header.seq + 1;
+    }
+    if (run_count && !_udp_receiver_write(r, run_first, run_count))
+        return false;
+    while (r->cumulative < r->total && _udp_receiver_has(r, r->cumulative))
+        ++r->cumulative;
+    return true;
+}
+
+// Wait up to timeout_ms for datagrams, take in what is there and ack it. Returns false
+// if the file could not be written.
+bool UdpReceiver_Poll(UdpReceiver* restrict r, const i32 timeout_ms) {
+    Socket_Poll(r->socket, POLLIN, timeout_ms);
+    Datagram batch[NET_UDP_BATCH];
+    for (;;) {
+        for (u32 i = 0; i < NET_UDP_BATCH; ++i) {
+            batch[i].buffer = r->datagrams[i];
+            batch[i].size = NET_UDP_DATAGRAM_MAX;
+        }
+        // Errors are ICMP reports on earlier acks, the server's timeout decides.
+        const i32 received = Socket_ReceiveBatch(r->socket, batch, NET_UDP_BATCH);
+        if (received <= 0)
+            break;
+        const u64 now = Time_NowNs();
+        r->last_data_ns = now;
+        if (!_udp_receiver_process(r, batch, received))
+            return false;
+        _udp_receiver_send_ack(r, now);
+        if (received < NET_UDP_BATCH)
+            break;
+    }
+    const u64 now = Time_NowNs();
+    if (now - r->last_ack_ns >= UDP_ACK_IDLE_MS * CTM_NS_PER_MS)
+        _udp_receiver_send_ack(r, now);
+    if (r->delay)
+        UdpDelayLine_Flush(r->delay, r->socket, now);
+    return true;
+}
+
+#endif // NETFS_CLIENT_UDPGET_H
@@ -0,0 +1,108 @@
+#ifndef CROSSPLATFORM_HISTOGRAM_H
+#define CROSSPLATFORM_HISTOGRAM_H
+
+// Log-linear histogram in the spirit of HdrHistogram.
+// Every power of two range is split into CH_SUB_BUCKETS / 2 linear buckets, so any recorded
+// value is reported within 1/64 (~1.6%) of what was recorded, over the full range from 1 to
+// CH_MAX_VALUE at a fixed 18 KB per histogram. Larger values are clamped.
+//
+// A histogram has a single writer. Counters are updated with relaxed atomic stores so other
+// threads may read (Histogram_Merge, Histogram_Percentile) while it is being written to,
+// seeing a slightly stale but never torn view.
+
+#include <stdint.h>
+#include <string.h>
+
+#define CH_SUB_BUCKET_BITS 7
+#define CH_SUB_BUCKETS (1u << CH_SUB_BUCKET_BITS)
+#define CH_MAX_VALUE_BITS 40
+#define CH_MAX_VALUE ((1ull << CH_MAX_VALUE_BITS) - 1)
+#define CH_BUCKETS (CH_SUB_BUCKETS + (CH_MAX_VALUE_BITS - CH_SUB_BUCKET_BITS) * (CH_SUB_BUCKETS / 2))
+
+typedef struct _ch_histogram {
+    uint64_t counts[CH_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} Histogram;
+
+void Histogram_Reset(Histogram* restrict h) {
+    memset(h, 0, sizeof(Histogram));
+    h->min = UINT64_MAX;
+}
+
+uint32_t _ch_index(uint64_t value) {
+    if (value > CH_MAX_VALUE)
+        value = CH_MAX_VALUE;
+    if (value < CH_SUB_BUCKETS)
+        return (uint32_t)value;
+    // Shift the value down until it fits [SUB_BUCKETS / 2, SUB_BUCKETS), the shift picks the
+    // power of two range and what is left the linear bucket inside it.
+    const uint32_t msb = 63 - (uint32_t)__builtin_clzll(value);
+    const uint32_t shift = msb - (CH_SUB_BUCKET_BITS - 1);
+    return CH_SUB_BUCKETS + (shift - 1) * (CH_SUB_BUCKETS / 2) + (uint32_t)((value >> shift) - CH_SUB_BUCKETS / 2);
+}
+
+// Highest value that lands in bucket index.
+uint64_t _ch_value(const uint32_t index) {
+    if (index < CH_SUB_BUCKETS)
+        return index;
+    const uint32_t shift = (index - CH_SUB_BUCKETS) / (CH_SUB_BUCKETS / 2) + 1;
+    const uint64_t sub = (index - CH_SUB_BUCKETS) % (CH_SUB_BUCKETS / 2) + CH_SUB_BUCKETS / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+void Histogram_Record(Histogram* restrict h, const uint64_t value) {
+    const uint32_t i = _ch_index(value);
+    __atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value < h->min)
+        __atomic_store_n(&h->min, value, __ATOMIC_RELAXED);
+    if (value > h->max)
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+// Add everything recorded in src to dst.
+void Histogram_Merge(Histogram* restrict dst, const Histogram* restrict src) {
+    for (uint32_t i = 0; i < CH_BUCKETS; ++i)
+        dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    const uint64_t min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+    const uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (min < dst->min)
+        dst->min = min;
+    if (max > dst->max)
+        dst->max = max;
+}
+
+// Value at percentile p (0 < p <= 100), 0 if nothing was recorded.
+uint64_t Histogram_Percentile(const Histogram* restrict h, const double p) {
+    const uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < CH_BUCKETS; ++i) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            // Never report more than was actually recorded.
+            const uint64_t value = _ch_value(i);
+            const uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            return (value < max) ? value : max;
+        }
+    }
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+double Histogram_Mean(const Histogram* restrict h) {
+    const uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    return (total) ? (double)__atomic_load_n(&h->sum, __ATOMIC_RELAXED) / (double)total : 0.0;
+}
+
+#endif // CROSSPLATFORM_HISTOGRAM_H
@@ -0,0 +1,303 @@
+#ifndef CROSSPLATFORM_LOG_H
+#define CROSSPLATFORM_LOG_H
+
+// Asynchronous logging. POSIX only.
+// Every thread formats into a ring of its own, a background thread drains all rings
+// and writes them out in batches (Info and below to stdout, Warn and Error to stderr).
+// A full ring drops the message and counts it, logging never blocks the caller.
+// Rings of exited threads are handed on to new ones, so there are as many as threads ever
+// logged at once. Past the first CLG_FULL_RINGS they are small, a server running thousands
+// of threads does not hold a full ring for each.
+// Until Log_Start is called (and after Log_Stop) messages are written synchronously.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cs_time.h"
+
+#define CLG_RING_RECORDS 1024
+#define CLG_FULL_RINGS 64
+#define CLG_SMALL_RING_RECORDS 64
+#define CLG_RECORD_SIZE 240
+#define CLG_MAX_RINGS 4096
+#define CLG_FLUSH_INTERVAL_NS (10 * CTM_NS_PER_MS)
+#define CLG_BATCH_SIZE (64 * 1024)
+#define CLG_DRAIN_MAX 16384
+#define CLG_PREFIX_SIZE 32
+
+typedef enum _clg_level {
+    LogLevel_Debug,
+    LogLevel_Info,
+    LogLevel_Warn,
+    LogLevel_Error,
+    LogLevel_None
+} LogLevel;
+
+typedef struct _clg_record {
+    uint64_t time_ns;
+    uint8_t level;
+    uint8_t length;
+    char text[CLG_RECORD_SIZE];
+} LogRecord;
+
+// Single producer (the owning thread), single consumer (the flusher).
+typedef struct _clg_ring {
+    uint64_t head;    // Written by the producer.
+    uint64_t tail;    // Written by the flusher.
+    uint64_t dropped; // Written by the producer.
+    uint32_t capacity;
+    struct _clg_ring* next_free;
+    LogRecord records[];
+} LogRing;
+
+static LogLevel _clg_g_level = LogLevel_Info;
+static volatile uint8_t _clg_g_running = 0;
+static LogRing* _clg_g_rings[CLG_MAX_RINGS];
+static uint32_t _clg_g_ring_count = 0;
+static LogRing* _clg_g_free_rings = NULL;
+static uint64_t _clg_g_dropped_reported = 0;
+static pthread_mutex_t _clg_g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t _clg_g_key;
+static pthread_once_t _clg_g_key_once = PTHREAD_ONCE_INIT;
+static pthread_t _clg_g_flusher;
+static __thread LogRing* _clg_t_ring = NULL;
+
+const char* LogLevel_Name(const LogLevel level) {
+    static const char* names[] = {"debug", "info", "warn", "error"};
+    return (level < LogLevel_None) ? names[level] : "?";
+}
+
+// "debug", "info", "warn" or "error", LogLevel_None if it is none of them.
+LogLevel LogLevel_Parse(const char* restrict str) {
+    for (uint32_t i = 0; i < LogLevel_None; ++i) {
+        if (!strcmp(str, LogLevel_Name((LogLevel)i)))
+            return (LogLevel)i;
+    }
+    return LogLevel_None;
+}
+
+void Log_SetLevel(const LogLevel level) {
+    _clg_g_level = level;
+}
+
+void _clg_release_ring(void* ring) {
+    LogRing* r = (LogRing*)ring;
+    _clg_t_ring = NULL;
+    pthread_mutex_lock(&_clg_g_mutex);
+    r->next_free = _clg_g_free_rings;
+    _clg_g_free_rings = r;
+    pthread_mutex_unlock(&_clg_g_mutex);
+}
+
+void _clg_create_key() {
+    pthread_key_create(&_clg_g_key, _clg_release_ring);
+}
+
+// Slow path, once per thread. A ring left behind by an exited thread is taken over as it
+// is, records it still holds are drained as usual: it only ever has one producer at a time.
+LogRing* _clg_thread_ring() {
+    pthread_once(&_clg_g_key_once, _clg_create_key);
+
+    pthread_mutex_lock(&_clg_g_mutex);
+    LogRing* ring = _clg_g_free_rings;
+    if (ring) {
+        _clg_g_free_rings = ring->next_free;
+    } else if (_clg_g_ring_count < CLG_MAX_RINGS) {
+        const uint32_t capacity = (_clg_g_ring_count < CLG_FULL_RINGS) ? CLG_RING_RECORDS : CLG_SMALL_RING_RECORDS;
+        ring = (LogRing*)calloc(1, sizeof(LogRing) + sizeof(LogRecord) * capacity);
+        if (ring) {
+            ring->capacity = capacity;
+            _clg_g_rings[_clg_g_ring_count++] = ring;
+        }
+    }
+    pthread_mutex_unlock(&_clg_g_mutex);
+
+    if (ring)
+        pthread_setspecific(_clg_g_key, ring);
+    return ring;
+}
+
+// "HH:MM:SS.mmm level " in front of every line.
+int32_t _clg_prefix(char* restrict buffer, const uint64_t wall_ns, const LogLevel level) {
+    const time_t seconds = (time_t)(wall_ns / CTM_NS_PER_SEC);
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    return snprintf(buffer, CLG_PREFIX_SIZE, "%02d:%02d:%02d.%03u %-5s ",
+                    tm.tm_hour, tm.tm_min, tm.tm_sec,
+                    (unsigned)(wall_ns % CTM_NS_PER_SEC / CTM_NS_PER_MS),
+                    LogLevel_Name(level));
+}
+
+void Log_Write(const LogLevel level, const char* restrict fmt, ...) {
+    if (level < _clg_g_level)
+        return;
+
+    va_list args;
+    if (!__atomic_load_n(&_clg_g_running, __ATOMIC_ACQUIRE)) {
+        FILE* fs = (level >= LogLevel_Warn) ? stderr : stdout;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        char prefix[CLG_PREFIX_SIZE];
+        _clg_prefix(prefix, (uint64_t)ts.tv_sec * CTM_NS_PER_SEC + (uint64_t)ts.tv_nsec, level);
+        fputs(prefix, fs);
+        va_start(args, fmt);
+        vfprintf(fs, fmt, args);
+        va_end(args);
+        return;
+    }
+
+    LogRing* ring = _clg_t_ring;
+    if (!ring) {
+        ring = _clg_t_ring = _clg_thread_ring();
+        if (!ring)
+            return;
+    }
+    const uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->capacity) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Formatted here, on the caller's thread, so arguments may be short lived.
+    // Anything longer than a record is cut, keeping the line break at the end.
+    LogRecord* r = ring->records + head % ring->capacity;
+    va_start(args, fmt);
+    const int32_t length = vsnprintf(r->text, sizeof(r->text), fmt, args);
+    va_end(args);
+    if (length >= (int32_t)sizeof(r->text)) {
+        r->length = (uint8_t)(sizeof(r->text) - 1);
+        const size_t fmt_length = strlen(fmt);
+        if (fmt_length && fmt[fmt_length - 1] == '\n')
+            r->text[r->length - 1] = '\n';
+    } else {
+        r->length = (length < 0) ? 0 : (uint8_t)length;
+    }
+    r->level = (uint8_t)level;
+    r->time_ns = Time_NowNs();
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void _clg_flush_buffer(FILE* fs, char* restrict buffer, size_t* restrict length) {
+    if (*length == 0)
+        return;
+    fwrite(buffer, 1, *length, fs);
+    fflush(fs);
+    *length = 0;
+}
+
+int _clg_compare_records(const void* a, const void* b) {
+    const uint64_t ta = (*(const LogRecord* const*)a)->time_ns;
+    const uint64_t tb = (*(const LogRecord* const*)b)->time_ns;
+    return (ta > tb) - (ta < tb);
+}
+
+// Drain every ring once, returns the number of records written.
+// Records of all threads are merged in the order they were written.
+uint64_t _clg_drain(char* restrict out, char* restrict err, const LogRecord** restrict batch) {
+    size_t out_length = 0, err_length = 0;
+    uint64_t count = 0, dropped = 0;
+
+    pthread_mutex_lock(&_clg_g_mutex);
+    const uint32_t ring_count = _clg_g_ring_count;
+    pthread_mutex_unlock(&_clg_g_mutex);
+
+    // Taken before the records are released, a ring that is full right now is emptied
+    // over the next rounds.
+    uint64_t* tails = (uint64_t*)malloc(sizeof(uint64_t) * (ring_count + 1));
+    for (uint32_t i = 0; i < ring_count; ++i) {
+        LogRing* ring = _clg_g_rings[i];
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        for (; tail < head && count < CLG_DRAIN_MAX; ++tail)
+            batch[count++] = ring->records + tail % ring->capacity;
+        tails[i] = tail;
+    }
+    qsort(batch, count, sizeof(LogRecord*), _clg_compare_records);
+
+    // Records carry the monotonic time they were written, shifted onto the wall clock here.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const uint64_t now_ns = Time_NowNs();
+    const uint64_t wall_now_ns = (uint64_t)ts.tv_sec * CTM_NS_PER_SEC + (uint64_t)ts.tv_nsec;
+    for (uint64_t i = 0; i < count; ++i) {
+        const LogRecord* r = batch[i];
+        const uint8_t is_err = r->level >= LogLevel_Warn;
+        char* buffer = (is_err) ? err : out;
+        size_t* length = (is_err) ? &err_length : &out_length;
+        if (*length + CLG_RECORD_SIZE + CLG_PREFIX_SIZE > CLG_BATCH_SIZE)
+            _clg_flush_buffer((is_err) ? stderr : stdout, buffer, length);
+
+        const uint64_t age_ns = (now_ns > r->time_ns) ? now_ns - r->time_ns : 0;
+        *length += _clg_prefix(buffer + *length, wall_now_ns - age_ns, (LogLevel)r->level);
+        memcpy(buffer + *length, r->text, r->length);
+        *length += r->length;
+    }
+    for (uint32_t i = 0; i < ring_count; ++i)
+        __atomic_store_n(&_clg_g_rings[i]->tail, tails[i], __ATOMIC_RELEASE);
+    free(tails);
+
+    if (dropped > _clg_g_dropped_reported) {
+        if (err_length + 128 > CLG_BATCH_SIZE)
+            _clg_flush_buffer(stderr, err, &err_length);
+        err_length += snprintf(err + err_length, 128, "CS_Log: %llu messages dropped, the log could not keep up.\n",
+                               (unsigned long long)(dropped - _clg_g_dropped_reported));
+        _clg_g_dropped_reported = dropped;
+    }
+    _clg_flush_buffer(stdout, out, &out_length);
+    _clg_flush_buffer(stderr, err, &err_length);
+    return count;
+}
+
+void* _clg_flusher(void* args) {
+    (void)args;
+    char* out = (char*)malloc(CLG_BATCH_SIZE);
+    char* err = (char*)malloc(CLG_BATCH_SIZE);
+    const LogRecord** batch = (const LogRecord**)malloc(sizeof(LogRecord*) * CLG_DRAIN_MAX);
+    while (__atomic_load_n(&_clg_g_running, __ATOMIC_ACQUIRE)) {
+        // Sleep only when there was nothing to write, a busy log is drained back to back.
+        if (_clg_drain(out, err, batch) == 0) {
+            struct timespec ts = {0, (long)CLG_FLUSH_INTERVAL_NS};
+            nanosleep(&ts, NULL);
+        }
+    }
+    // Whatever is still queued, bounded in case other threads keep logging.
+    for (uint32_t i = 0; i < 16 && _clg_drain(out, err, batch) > 0; ++i)
+        ;
+    free(batch);
+    free(out);
+    free(err);
+    return NULL;
+}
+
+// Start the flusher thread, from then on Log_Write only copies into the caller's ring.
+int32_t Log_Start() {
+    if (_clg_g_running)
+        return 0;
+    _clg_g_running = 1;
+    if (pthread_create(&_clg_g_flusher, NULL, _clg_flusher, NULL) != 0) {
+        _clg_g_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Write out everything still queued and go back to synchronous logging.
+void Log_Stop() {
+    if (!_clg_g_running)
+        return;
+    __atomic_store_n(&_clg_g_running, 0, __ATOMIC_RELEASE);
+    pthread_join(_clg_g_flusher, NULL);
+}
+
+#define LOG_DEBUG(...) Log_Write(LogLevel_Debug, __VA_ARGS__)
+#define LOG_INFO(...) Log_Write(LogLevel_Info, __VA_ARGS__)
+#define LOG_WARN(...) Log_Write(LogLevel_Warn, __VA_ARGS__)
+#define LOG_ERROR(...) Log_Write(LogLevel_Error, __VA_ARGS__)
+
+#endif // CROSSPLATFORM_LOG_H
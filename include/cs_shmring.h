@@ -0,0 +1,328 @@
+#ifndef CROSSPLATFORM_SHMRING_H
+#define CROSSPLATFORM_SHMRING_H
+
+// Shared memory channel between two processes on the same host (Linux only).
+// A memfd holds a pair of single producer, single consumer byte rings, one per direction.
+// The side that creates it hands the descriptor to its peer (over a local socket), which
+// maps it as well. Bytes move with plain loads and stores: a side that finds nothing to
+// read (or no room to write) spins for a short busy poll window and only then sleeps on a
+// futex in the shared mapping, and the other side only makes the wake up call when a
+// sleeper announced itself. Back to back exchanges therefore never enter the kernel.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "cs_threads.h"
+#include "cs_time.h"
+
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#define CSR_AVAILABLE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+
+#define CSR_SUCCESS 0
+#define CSR_TIMEOUT 1
+#define CSR_ERROR -1
+
+#define CSR_MAGIC 0x5253464eu // "NFSR"
+#define CSR_DEFAULT_CAPACITY (256 * 1024)
+#define CSR_MIN_CAPACITY 4096
+#define CSR_MAX_CAPACITY (64 * 1024 * 1024)
+#define CSR_DEFAULT_SPIN_NS (50 * CTM_NS_PER_US)
+// Read and Write give up once the peer made no progress for this long.
+#define CSR_DEFAULT_TIMEOUT_MS 10000
+// Sleepers look at the closed flag at least this often, a peer that died never sets it.
+#define CSR_WAIT_SLICE_MS 100
+#define CSR_CACHE_LINE 64
+
+// Control block of one ring. Each half is only written by one side and has a cache line
+// of its own, head and tail never share one.
+typedef struct _csr_ring {
+    // Written by the producer.
+    uint64_t head;              // Bytes written so far.
+    uint32_t data_seq;          // Bumped to wake the consumer, the futex word it sleeps on.
+    uint32_t producer_waiting;
+    uint8_t _pad0[CSR_CACHE_LINE - 16];
+    // Written by the consumer.
+    uint64_t tail;              // Bytes read so far.
+    uint32_t space_seq;         // Bumped to wake the producer.
+    uint32_t consumer_waiting;
+    uint8_t _pad1[CSR_CACHE_LINE - 16];
+} _csr_ring;
+
+// Start of the mapping, the data of rings[0] and rings[1] follows (capacity bytes each).
+typedef struct _csr_header {
+    uint32_t magic;
+    uint32_t capacity;          // Of each ring, a power of two.
+    uint32_t closed;            // Set by whichever side leaves first.
+    uint8_t _pad[CSR_CACHE_LINE - 12];
+    _csr_ring rings[2];         // [0] from the creator, [1] to the creator.
+} _csr_header;
+
+typedef struct _csr_channel {
+    int fd;
+    uint8_t* base;
+    size_t map_size;
+    uint32_t capacity;
+    _csr_ring* tx;
+    uint8_t* tx_data;
+    _csr_ring* rx;
+    uint8_t* rx_data;
+    uint32_t* closed;
+    uint64_t spin_ns;           // Busy poll window before sleeping, 0 sleeps right away.
+    uint32_t timeout_ms;
+    // Our own indices, published to the mapping but never read back from it: the peer can
+    // write anything there. Only the peer's indices are read and those are checked.
+    uint64_t tx_head;
+    uint64_t rx_tail;
+} ShmChannel;
+
+// The mapping is shared between processes, so these are not the private futexes cs_threads uses.
+void _csr_futex_wait(uint32_t* addr, const uint32_t expected, const uint32_t timeout_ms) {
+    struct timespec ts = {(time_t)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000000};
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, &ts, NULL, 0);
+}
+
+void _csr_futex_wake(uint32_t* addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+ShmChannel* _csr_map(const int fd, const size_t map_size, const uint8_t creator) {
+    uint8_t* base = (uint8_t*)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Shared memory channel: mmap failed (%d).\n", errno);
+        return NULL;
+    }
+    _csr_header* h = (_csr_header*)base;
+    ShmChannel* ch = (ShmChannel*)malloc(sizeof(ShmChannel));
+    ch->fd = fd;
+    ch->base = base;
+    ch->map_size = map_size;
+    ch->capacity = h->capacity;
+    ch->closed = &h->closed;
+    uint8_t* data = base + sizeof(_csr_header);
+    ch->tx = h->rings + ((creator) ? 0 : 1);
+    ch->tx_data = data + (size_t)((creator) ? 0 : 1) * ch->capacity;
+    ch->rx = h->rings + ((creator) ? 1 : 0);
+    ch->rx_data = data + (size_t)((creator) ? 1 : 0) * ch->capacity;
+    // Spinning on a single cpu only keeps the peer from running.
+    ch->spin_ns = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? CSR_DEFAULT_SPIN_NS : 0;
+    ch->timeout_ms = CSR_DEFAULT_TIMEOUT_MS;
+    ch->tx_head = 0;
+    ch->rx_tail = 0;
+    return ch;
+}
+
+// New channel with rings of at least capacity bytes (0 for the default), pass ch->fd to the peer.
+ShmChannel* ShmChannel_Create(size_t capacity) {
+    if (capacity == 0)
+        capacity = CSR_DEFAULT_CAPACITY;
+    if (capacity < CSR_MIN_CAPACITY)
+        capacity = CSR_MIN_CAPACITY;
+    if (capacity > CSR_MAX_CAPACITY)
+        capacity = CSR_MAX_CAPACITY;
+    size_t rounded = CSR_MIN_CAPACITY;
+    while (rounded < capacity)
+        rounded <<= 1;
+
+    const int fd = memfd_create("cs_shmring", MFD_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Shared memory channel: memfd_create failed (%d).\n", errno);
+        return NULL;
+    }
+    const size_t map_size = sizeof(_csr_header) + 2 * rounded;
+    if (ftruncate(fd, (off_t)map_size) == -1) {
+        fprintf(stderr, "Shared memory channel: ftruncate failed (%d).\n", errno);
+        close(fd);
+        return NULL;
+    }
+    // A fresh memfd reads as zeros, only the header needs filling in.
+    _csr_header* h = (_csr_header*)mmap(NULL, sizeof(_csr_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if ((void*)h == MAP_FAILED) {
+        fprintf(stderr, "Shared memory channel: mmap failed (%d).\n", errno);
+        close(fd);
+        return NULL;
+    }
+    h->capacity = (uint32_t)rounded;
+    h->magic = CSR_MAGIC;
+    munmap(h, sizeof(_csr_header));
+
+    ShmChannel* ch = _csr_map(fd, map_size, true);
+    if (!ch)
+        close(fd);
+    return ch;
+}
+
+// Map the channel behind fd, as received from its creator. Takes ownership of fd, also on failure.
+ShmChannel* ShmChannel_Attach(const int fd) {
+    struct stat st;
+    _csr_header h;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(_csr_header) ||
+        pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || h.magic != CSR_MAGIC ||
+        h.capacity < CSR_MIN_CAPACITY || h.capacity > CSR_MAX_CAPACITY || (h.capacity & (h.capacity - 1)) ||
+        (size_t)st.st_size < sizeof(_csr_header) + 2 * (size_t)h.capacity) {
+        fprintf(stderr, "Shared memory channel: not a channel.\n");
+        close(fd);
+        return NULL;
+    }
+    ShmChannel* ch = _csr_map(fd, sizeof(_csr_header) + 2 * (size_t)h.capacity, false);
+    if (!ch)
+        close(fd);
+    return ch;
+}
+
+// Tell the peer this side is done, whatever it waits for fails once the ring it reads is drained.
+void ShmChannel_Close(ShmChannel* restrict ch) {
+    if (Atomic_Exchange(ch->closed, 1, CT_SEQ_CST))
+        return;
+    Atomic_FetchAdd(&ch->tx->data_seq, 1, CT_RELEASE);
+    Atomic_FetchAdd(&ch->rx->space_seq, 1, CT_RELEASE);
+    _csr_futex_wake(&ch->tx->data_seq);
+    _csr_futex_wake(&ch->rx->space_seq);
+}
+
+void ShmChannel_Dispose(ShmChannel* restrict ch) {
+    ShmChannel_Close(ch);
+    munmap(ch->base, ch->map_size);
+    close(ch->fd);
+    free(ch);
+}
+
+// Also true when the peer's index is out of range, the caller then finds out and fails.
+uint8_t _csr_ready(ShmChannel* restrict ch, _csr_ring* restrict r, const uint8_t for_data) {
+    if (for_data)
+        return Atomic_Load(&r->head, CT_ACQUIRE) != ch->rx_tail;
+    return ch->tx_head - Atomic_Load(&r->tail, CT_ACQUIRE) != ch->capacity;
+}
+
+// Wait for data in r (for_data) or room in it: spin for the busy poll window, then
+// announce the wait and sleep until the other side bumps the sequence word.
+int32_t _csr_wait(ShmChannel* restrict ch, _csr_ring* restrict r, const uint8_t for_data, const uint32_t timeout_ms) {
+    if (_csr_ready(ch, r, for_data))
+        return CSR_SUCCESS;
+    const uint64_t start_ns = Time_NowNs();
+    while (ch->spin_ns && Time_NowNs() - start_ns < ch->spin_ns) {
+        for (uint32_t i = 0; i < 32; ++i)
+            Atomic_Pause();
+        if (_csr_ready(ch, r, for_data))
+            return CSR_SUCCESS;
+        if (Atomic_Load(ch->closed, CT_ACQUIRE))
+            return CSR_ERROR;
+    }
+
+    uint32_t* seq = (for_data) ? &r->data_seq : &r->space_seq;
+    uint32_t* waiting = (for_data) ? &r->consumer_waiting : &r->producer_waiting;
+    for (;;) {
+        const uint32_t expected = Atomic_Load(seq, CT_ACQUIRE);
+        Atomic_Store(waiting, 1, CT_RELAXED);
+        // Pairs with the fence in _csr_signal(): either this sees the other side's update
+        // or the other side sees the waiting flag and bumps seq.
+        Atomic_Fence(CT_SEQ_CST);
+        if (_csr_ready(ch, r, for_data)) {
+            Atomic_Store(waiting, 0, CT_RELAXED);
+            return CSR_SUCCESS;
+        }
+        if (Atomic_Load(ch->closed, CT_ACQUIRE)) {
+            Atomic_Store(waiting, 0, CT_RELAXED);
+            return CSR_ERROR;
+        }
+        const uint64_t elapsed_ms = (Time_NowNs() - start_ns) / CTM_NS_PER_MS;
+        if (timeout_ms != CT_INFINITE && elapsed_ms >= timeout_ms) {
+            Atomic_Store(waiting, 0, CT_RELAXED);
+            return CSR_TIMEOUT;
+        }
+        uint32_t slice_ms = CSR_WAIT_SLICE_MS;
+        if (timeout_ms != CT_INFINITE && timeout_ms - elapsed_ms < slice_ms)
+            slice_ms = (uint32_t)(timeout_ms - elapsed_ms);
+        _csr_futex_wait(seq, expected, slice_ms);
+    }
+}
+
+// Wake the side waiting on r for data (for_data) or room, if it sleeps.
+void _csr_signal(_csr_ring* restrict r, const uint8_t for_data) {
+    Atomic_Fence(CT_SEQ_CST);
+    uint32_t* waiting = (for_data) ? &r->consumer_waiting : &r->producer_waiting;
+    if (!Atomic_Load(waiting, CT_RELAXED))
+        return;
+    uint32_t* seq = (for_data) ? &r->data_seq : &r->space_seq;
+    Atomic_FetchAdd(seq, 1, CT_RELEASE);
+    _csr_futex_wake(seq);
+}
+
+// Write all of data, waiting for room as the peer reads. With more set the peer is not
+// woken for the tail end, another write follows right away (like MSG_MORE).
+int32_t ShmChannel_Write(ShmChannel* restrict ch, const void* data, size_t size, const uint8_t more) {
+    _csr_ring* r = ch->tx;
+    const uint8_t* src = (const uint8_t*)data;
+    const size_t mask = ch->capacity - 1;
+    while (size > 0) {
+        if (Atomic_Load(ch->closed, CT_ACQUIRE) || _csr_wait(ch, r, false, ch->timeout_ms) != CSR_SUCCESS)
+            return CSR_ERROR;
+        const uint64_t head = ch->tx_head;
+        const uint64_t used = head - Atomic_Load(&r->tail, CT_ACQUIRE);
+        // The peer claims to have read what was never written: it is broken or hostile.
+        if (used > ch->capacity) {
+            ShmChannel_Close(ch);
+            return CSR_ERROR;
+        }
+        const size_t room = ch->capacity - (size_t)used;
+        const size_t n = (size < room) ? size : room;
+        const size_t at = (size_t)head & mask;
+        const size_t first = (n < ch->capacity - at) ? n : ch->capacity - at;
+        memcpy(ch->tx_data + at, src, first);
+        memcpy(ch->tx_data, src + first, n - first);
+        ch->tx_head = head + n;
+        Atomic_Store(&r->head, ch->tx_head, CT_RELEASE);
+        src += n;
+        size -= n;
+        // Whatever does not fit needs the reader to make room, it cannot wait for the rest.
+        if (size > 0 || !more)
+            _csr_signal(r, true);
+    }
+    return CSR_SUCCESS;
+}
+
+// Read exactly size bytes, waiting for the peer to write them.
+int32_t ShmChannel_Read(ShmChannel* restrict ch, void* buffer, size_t size) {
+    _csr_ring* r = ch->rx;
+    uint8_t* dst = (uint8_t*)buffer;
+    const size_t mask = ch->capacity - 1;
+    while (size > 0) {
+        if (_csr_wait(ch, r, true, ch->timeout_ms) != CSR_SUCCESS)
+            return CSR_ERROR;
+        const uint64_t tail = ch->rx_tail;
+        const uint64_t written = Atomic_Load(&r->head, CT_ACQUIRE) - tail;
+        // More than the ring holds: the peer is broken or hostile.
+        if (written > ch->capacity) {
+            ShmChannel_Close(ch);
+            return CSR_ERROR;
+        }
+        const size_t available = (size_t)written;
+        const size_t n = (size < available) ? size : available;
+        const size_t at = (size_t)tail & mask;
+        const size_t first = (n < ch->capacity - at) ? n : ch->capacity - at;
+        memcpy(dst, ch->rx_data + at, first);
+        memcpy(dst + first, ch->rx_data, n - first);
+        ch->rx_tail = tail + n;
+        Atomic_Store(&r->tail, ch->rx_tail, CT_RELEASE);
+        dst += n;
+        size -= n;
+        _csr_signal(r, false);
+    }
+    return CSR_SUCCESS;
+}
+
+// Wait up to timeout_ms (CT_INFINITE to not give up) for something to read.
+// CSR_SUCCESS, CSR_TIMEOUT or CSR_ERROR once the peer closed and everything was read.
+int32_t ShmChannel_WaitReadable(ShmChannel* restrict ch, const uint32_t timeout_ms) {
+    return _csr_wait(ch, ch->rx, true, timeout_ms);
+}
+
+#endif
+
+#endif // CROSSPLATFORM_SHMRING_H
@@ -0,0 +1,220 @@
+#ifndef CROSSPLATFORM_SOCKETPOOL_H
+#define CROSSPLATFORM_SOCKETPOOL_H
+
+// Pool of TCP (or local) connections to a single endpoint.
+// Connections are checked out for one request/reply exchange at a time and handed back
+// afterwards, so back to back operations reuse an established connection instead of
+// paying for a handshake each. Idle connections are health checked before they are handed
+// out and closed once they have been idle for longer than the idle timeout.
+// Every connection carries a tag for the user, for what was agreed on it with the peer and
+// has to be known again the next time it is checked out (SocketPool_AcquireTagged()).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "cs_sockets.h"
+#include "cs_threads.h"
+#include "cs_time.h"
+
+#define CSP_DEFAULT_IDLE_TIMEOUT_MS 30000
+
+typedef struct _csp_idle_socket {
+    Socket* socket;
+    uint64_t idle_since_ns;
+    uint32_t tag;
+} _csp_idle_socket;
+
+typedef struct _csp_socket_pool {
+    IPEndPoint ep;
+    const char* local_path;   // Connect to this local socket instead of ep, NULL for TCP.
+    size_t max_sockets;       // Open connections, checked out or idle, never exceed this.
+    uint64_t idle_timeout_ns;
+    uint8_t fast_open;        // Connect with TCP Fast Open where available.
+    SocketOptions options;    // Applied to every new connection.
+
+    // Statistics, for reporting how well the pool works.
+    size_t connects;
+    size_t reuses;
+    size_t reaped;
+
+    _csp_idle_socket* _idle; // Stack, the most recently used connection is on top.
+    size_t _idle_count;
+    size_t _open;
+    Mutex* _mutex;
+    CondVar* _available;
+} SocketPool;
+
+// Constructor for SocketPool. No connection is opened until SocketPool_Warm() or SocketPool_Acquire().
+SocketPool* SocketPool_New(IPEndPoint ep, const size_t max_sockets, const uint32_t idle_timeout_ms) {
+    SocketPool* pool = (SocketPool*)malloc(sizeof(SocketPool));
+    pool->ep = ep;
+    pool->local_path = NULL;
+    pool->max_sockets = (max_sockets > 0) ? max_sockets : 1;
+    pool->idle_timeout_ns = (uint64_t)idle_timeout_ms * CTM_NS_PER_MS;
+    pool->fast_open = true;
+    pool->options = SocketOptions_Default();
+    pool->connects = 0;
+    pool->reuses = 0;
+    pool->reaped = 0;
+    pool->_idle = (_csp_idle_socket*)malloc(sizeof(_csp_idle_socket) * pool->max_sockets);
+    pool->_idle_count = 0;
+    pool->_open = 0;
+    pool->_mutex = Mutex_New();
+    pool->_available = CondVar_New();
+    return pool;
+}
+
+Socket* _csp_connect(SocketPool* restrict pool) {
+#ifdef CS_PLATFORM_UNIX
+    if (pool->local_path) {
+        Socket* s = Socket_New(AddressFamily_Local, SocketType_Stream, ProtocolType_Default);
+        if (!s)
+            return NULL;
+        Socket_ApplyOptions(s, &pool->options);
+        if (Socket_ConnectLocal(s, pool->local_path) == CS_SOCKET_ERROR) {
+            Socket_Dispose(s);
+            return NULL;
+        }
+        return s;
+    }
+#endif
+    Socket* s = Socket_New(AddressFamily_InterNetwork, SocketType_Stream, ProtocolType_Tcp);
+    if (!s)
+        return NULL;
+    // Buffer sizes have to be in place before the handshake.
+    Socket_ApplyOptions(s, &pool->options);
+    const int32_t res = (pool->fast_open) ? Socket_ConnectFastOpen(s, pool->ep) : Socket_Connect(s, pool->ep);
+    if (res == CS_SOCKET_ERROR) {
+        Socket_Dispose(s);
+        return NULL;
+    }
+    return s;
+}
+
+// Close idle connections that timed out or went bad, the oldest are at the bottom of the stack.
+// Expects the pool mutex to be held.
+void _csp_reap(SocketPool* restrict pool, const uint64_t now) {
+    size_t kept = 0;
+    for (size_t i = 0; i < pool->_idle_count; ++i) {
+        _csp_idle_socket* idle = pool->_idle + i;
+        if (now - idle->idle_since_ns > pool->idle_timeout_ns || !Socket_IsHealthy(idle->socket)) {
+            Socket_Dispose(idle->socket);
+            --pool->_open;
+            ++pool->reaped;
+            continue;
+        }
+        pool->_idle[kept++] = *idle;
+    }
+    pool->_idle_count = kept;
+}
+
+// Open connections until count of them are idle in the pool (bounded by max_sockets).
+// Returns the number of idle connections afterwards.
+size_t SocketPool_Warm(SocketPool* restrict pool, const size_t count) {
+    Mutex_Lock(pool->_mutex);
+    while (pool->_idle_count < count && pool->_open < pool->max_sockets) {
+        ++pool->_open;
+        Mutex_Unlock(pool->_mutex);
+        Socket* s = _csp_connect(pool);
+        Mutex_Lock(pool->_mutex);
+        if (!s) {
+            --pool->_open;
+            break;
+        }
+        ++pool->connects;
+        pool->_idle[pool->_idle_count].socket = s;
+        pool->_idle[pool->_idle_count].idle_since_ns = Time_NowNs();
+        pool->_idle[pool->_idle_count].tag = 0;
+        ++pool->_idle_count;
+    }
+    const size_t idle_count = pool->_idle_count;
+    CondVar_Broadcast(pool->_available);
+    Mutex_Unlock(pool->_mutex);
+    return idle_count;
+}
+
+// Check a connection out of the pool: a healthy idle one if there is any, a new one if the
+// pool has room, otherwise wait until one is released. Returns NULL if connecting fails.
+// *tag is what the connection was released with, 0 for a new one.
+Socket* SocketPool_AcquireTagged(SocketPool* restrict pool, uint32_t* restrict tag) {
+    *tag = 0;
+    Mutex_Lock(pool->_mutex);
+    for (;;) {
+        _csp_reap(pool, Time_NowNs());
+        if (pool->_idle_count > 0) {
+            const _csp_idle_socket* idle = pool->_idle + --pool->_idle_count;
+            Socket* s = idle->socket;
+            *tag = idle->tag;
+            ++pool->reuses;
+            Mutex_Unlock(pool->_mutex);
+            return s;
+        }
+        if (pool->_open < pool->max_sockets)
+            break;
+        CondVar_Wait(pool->_available, pool->_mutex);
+    }
+
+    // Connect without holding the lock, the slot is reserved.
+    ++pool->_open;
+    Mutex_Unlock(pool->_mutex);
+    Socket* s = _csp_connect(pool);
+    Mutex_Lock(pool->_mutex);
+    if (s) {
+        ++pool->connects;
+    } else {
+        --pool->_open;
+        CondVar_Signal(pool->_available);
+    }
+    Mutex_Unlock(pool->_mutex);
+    return s;
+}
+
+Socket* SocketPool_Acquire(SocketPool* restrict pool) {
+    uint32_t tag;
+    return SocketPool_AcquireTagged(pool, &tag);
+}
+
+// Hand a connection back with a tag for whoever checks it out next. Only pass reusable as
+// true if the last exchange on it completed, a connection with a half read reply or a half
+// sent request is closed instead.
+void SocketPool_ReleaseTagged(SocketPool* restrict pool, Socket* restrict s, const uint8_t reusable, const uint32_t tag) {
+    const uint8_t keep = reusable && Socket_IsHealthy(s);
+    if (!keep)
+        Socket_Dispose(s);
+
+    Mutex_Lock(pool->_mutex);
+    if (keep) {
+        pool->_idle[pool->_idle_count].socket = s;
+        pool->_idle[pool->_idle_count].idle_since_ns = Time_NowNs();
+        pool->_idle[pool->_idle_count].tag = tag;
+        ++pool->_idle_count;
+    } else {
+        --pool->_open;
+    }
+    CondVar_Signal(pool->_available);
+    Mutex_Unlock(pool->_mutex);
+}
+
+void SocketPool_Release(SocketPool* restrict pool, Socket* restrict s, const uint8_t reusable) {
+    SocketPool_ReleaseTagged(pool, s, reusable, 0);
+}
+
+// Close idle connections that have been idle for longer than the idle timeout or went bad.
+// Acquire does this on its own, call it to trim a pool that has not been used for a while.
+void SocketPool_Reap(SocketPool* restrict pool) {
+    Mutex_Lock(pool->_mutex);
+    _csp_reap(pool, Time_NowNs());
+    Mutex_Unlock(pool->_mutex);
+}
+
+// Destructor for SocketPool. Every connection has to be released before.
+void SocketPool_Dispose(SocketPool* restrict pool) {
+    for (size_t i = 0; i < pool->_idle_count; ++i)
+        Socket_Dispose(pool->_idle[i].socket);
+    CondVar_Dispose(pool->_available);
+    Mutex_Dispose(pool->_mutex);
+    free(pool->_idle);
+    free(pool);
+}
+
+#endif // CROSSPLATFORM_SOCKETPOOL_H
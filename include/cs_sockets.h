@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
+#include "cs_time.h"
 
 #define true 1
 #define false 0
@@ -44,6 +45,13 @@ typedef uintptr_t socket_t;
 #define CS_SD_BOTH SD_BOTH
 #define CS_SD_READ SD_RECEIVE
 #define CS_SD_WRITE SD_SEND
+#define CS_POLL(fds, count, timeout_ms) WSAPoll(fds, count, timeout_ms)
+#define CS_ERROR_WOULD_BLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+#define CS_ERROR_INTERRUPTED() (WSAGetLastError() == WSAEINTR)
+#define CS_ERROR_IN_PROGRESS() (WSAGetLastError() == WSAEWOULDBLOCK)
+// No per call non-blocking flag, deadlines need a non-blocking socket (Socket_SetBlocking()).
+#define CS_MSG_DONTWAIT 0
+#define CS_MSG_NOSIGNAL 0
 
 #elif defined(__linux__) || defined(__APPLE__)
 #define CS_PLATFORM_UNIX
@@ -54,6 +62,12 @@ typedef uintptr_t socket_t;
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
 
 // A socket is a signed pointer in Linux sockets.
 typedef intptr_t socket_t;
@@ -67,11 +81,32 @@ typedef intptr_t socket_t;
 #define CS_SD_BOTH SHUT_RDWR
 #define CS_SD_READ SHUT_TRD
 #define CS_SD_WRITE SHUT_WR
+#define CS_POLL(fds, count, timeout_ms) poll(fds, count, timeout_ms)
+#define CS_ERROR_WOULD_BLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+#define CS_ERROR_INTERRUPTED() (errno == EINTR)
+#define CS_ERROR_IN_PROGRESS() (errno == EINPROGRESS)
+#define CS_MSG_DONTWAIT MSG_DONTWAIT
+// A peer that went away must fail the send, not kill the process with SIGPIPE.
+// macOS has no MSG_NOSIGNAL, Socket_New() sets SO_NOSIGPIPE there instead.
+#ifdef MSG_NOSIGNAL
+#define CS_MSG_NOSIGNAL MSG_NOSIGNAL
+#else
+#define CS_MSG_NOSIGNAL 0
+#endif
 #endif
 
+// Socket_Receive()/Socket_Send() on a non-blocking socket (or with CS_MSG_DONTWAIT) that
+// would have to wait. The socket stays open.
+#define CS_SOCKET_WOULD_BLOCK -2
+
 // Address family enum abstraction layer.
+// Local (AF_UNIX) sockets connect processes on the same host through a path, see
+// Socket_BindLocal()/Socket_ConnectLocal(), and can pass open descriptors along.
 typedef enum _cs_address_family {
-    AddressFamily_InterNetwork = AF_INET
+    AddressFamily_InterNetwork = AF_INET,
+#ifdef CS_PLATFORM_UNIX
+    AddressFamily_Local = AF_UNIX
+#endif
 } AddressFamily;
 
 // Socket type enum abstraction layer.
@@ -83,6 +118,7 @@ typedef enum _cs_socket_type {
 
 // Socket protocol type abstraction layer.
 typedef enum _cs_protocol_type {
+    ProtocolType_Default = 0, // The only protocol of the family, what local sockets use.
     ProtocolType_Tcp = IPPROTO_TCP,
     ProtocolType_Udp = IPPROTO_UDP
 } ProtocolType;
@@ -101,8 +137,11 @@ typedef enum _cs_ip_address_type {
 // address string and the native address handler.
 typedef struct _cs_ip_address {
     IPAddressType type;
-    struct sockaddr_in ipv4_addr;
-    struct sockaddr_in6 ipv6_addr;
+    // Only the one matching type is used, every Socket carries two of these.
+    union {
+        struct sockaddr_in ipv4_addr;
+        struct sockaddr_in6 ipv6_addr;
+    };
     char str[CS_IPV6_MAX];
 } IPAddress;
 
@@ -156,8 +195,12 @@ typedef struct _cs_ip_endpoint {
 // local endpoint: What endpoint is the socket listening on.
 // remote endpoint: What endpoint is the socket connected to.
 // connected: If the socket is still connected to the remote.
-// timeout: How long to wait when connecting.
+// non_blocking: Set by Socket_SetBlocking().
+// timeout: How long to wait when connecting in milliseconds, 0 leaves it to the OS.
+// send_timeout, receive_timeout: Deadline of a whole Socket_SendAll()/Socket_ReceiveAll() in milliseconds, 0 for none.
+// bytes_sent, bytes_received: Traffic through Socket_Send/Socket_Receive so far.
 // _native_socket: Native socket handler, the user is not supposed to interact with this field.
+// _passed_fd: Descriptor that came along with received data (local sockets), see Socket_TakeFd().
 typedef struct _cs_socket {
     AddressFamily family;
     SocketType stype;
@@ -165,9 +208,17 @@ typedef struct _cs_socket {
     IPEndPoint local_ep;
     IPEndPoint remote_ep;
     uint8_t connected;
-    uint16_t timeout;
+    uint8_t non_blocking;
+    uint32_t timeout;
+    uint32_t send_timeout;
+    uint32_t receive_timeout;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
 
     socket_t _native_handle;
+#ifdef CS_PLATFORM_UNIX
+    int _passed_fd;
+#endif
 } Socket;
 
 // So I don't forget to initialize.
@@ -221,7 +272,15 @@ Socket* Socket_New(const AddressFamily family, const SocketType stype, const Pro
     s->stype = stype;
     s->ptype = ptype;
     s->connected = false;
+    s->non_blocking = false;
     s->timeout = 5000;
+    s->send_timeout = 0;
+    s->receive_timeout = 0;
+    s->bytes_sent = 0;
+    s->bytes_received = 0;
+#ifdef CS_PLATFORM_UNIX
+    s->_passed_fd = -1;
+#endif
     
     s->_native_handle = CS_INVALID_SOCKET;
     s->_native_handle = socket(s->family, s->stype, s->ptype);
@@ -231,6 +290,10 @@ Socket* Socket_New(const AddressFamily family, const SocketType stype, const Pro
         free(s);
         return NULL;
     }
+#ifdef SO_NOSIGPIPE
+    const int32_t no_sigpipe = 1;
+    setsockopt(s->_native_handle, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&no_sigpipe, sizeof(no_sigpipe));
+#endif
     return s;
 }
 
@@ -248,6 +311,9 @@ int32_t Socket_From(Socket* restrict s, const AddressFamily family, const Socket
     s->ptype = ptype;
     s->connected = false;
     s->timeout = 5000;
+#ifdef CS_PLATFORM_UNIX
+    s->_passed_fd = -1;
+#endif
 
     s->_native_handle = CS_INVALID_SOCKET;
     s->_native_handle = socket(s->family, s->stype, s->ptype);
@@ -255,6 +321,10 @@ int32_t Socket_From(Socket* restrict s, const AddressFamily family, const Socket
         CS_CLOSE_SOCKET(s->_native_handle);
         return CS_SOCKET_ERROR;
     }
+#ifdef SO_NOSIGPIPE
+    const int32_t no_sigpipe = 1;
+    setsockopt(s->_native_handle, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&no_sigpipe, sizeof(no_sigpipe));
+#endif
     return CS_SOCKET_SUCCESS;
 }
 
@@ -265,8 +335,17 @@ void Socket_Dispose(Socket* restrict s) {
         return;
     }
 
-    shutdown(s->_native_handle, CS_SD_BOTH);
-    CS_CLOSE_SOCKET(s->_native_handle);
+    // The handle may already be closed (Socket_Close() or a failed send/receive), closing it
+    // again could close an unrelated descriptor that reused the number.
+    if (s->_native_handle != CS_INVALID_SOCKET) {
+        shutdown(s->_native_handle, CS_SD_BOTH);
+        CS_CLOSE_SOCKET(s->_native_handle);
+    }
+#ifdef CS_PLATFORM_UNIX
+    // Nobody took it, it would leak.
+    if (s->_passed_fd != -1)
+        close(s->_passed_fd);
+#endif
     memset(s, 0, sizeof(Socket));
     free(s);
 }
@@ -287,8 +366,11 @@ int32_t Socket_Close(Socket* restrict s) {
         return CS_SOCKET_ERROR;
     }
 
+    if (s->_native_handle == CS_INVALID_SOCKET)
+        return CS_SOCKET_SUCCESS;
     if (CS_CLOSE_SOCKET(s->_native_handle) == CS_SOCKET_ERROR)
         return CS_SOCKET_ERROR;
+    s->_native_handle = CS_INVALID_SOCKET;
     s->connected = false;
     return CS_SOCKET_SUCCESS;
 }
@@ -334,8 +416,15 @@ int32_t Socket_Bind(Socket* restrict s, IPEndPoint ep) {
         fputs("CS_Sockets: Failed to bind socket.\n", stderr);
         perror("native error");
         CS_CLOSE_SOCKET(s->_native_handle);
+        s->_native_handle = CS_INVALID_SOCKET;
         return CS_SOCKET_ERROR;
     }
+    // Port 0 binds whatever port is free, note which one that is.
+    if (s->local_ep.port == 0 && addr_size == sizeof(s->local_ep.address.ipv4_addr)) {
+        socklen_t bound_size = (socklen_t)addr_size;
+        if (getsockname(s->_native_handle, (struct sockaddr*)server_addr, &bound_size) != CS_SOCKET_ERROR)
+            s->local_ep.port = ntohs(s->local_ep.address.ipv4_addr.sin_port);
+    }
     return CS_SOCKET_SUCCESS;
 }
 
@@ -349,13 +438,67 @@ int32_t Socket_Listen(Socket* restrict s, const size_t max_clients) {
     if (listen(s->_native_handle, max_clients) == CS_SOCKET_ERROR) {
         fputs("CS_Socket: Listening failed.\n", stderr);
         CS_CLOSE_SOCKET(s->_native_handle);
+        s->_native_handle = CS_INVALID_SOCKET;
         return CS_SOCKET_ERROR;
     }
     return CS_SOCKET_SUCCESS;
 }
 
-// Try to connection to an endpoint.
-// TODO: Implement timeout system.
+// Switch the socket between blocking and non-blocking mode. In non-blocking mode Socket_Receive()
+// and Socket_Send() return CS_SOCKET_WOULD_BLOCK instead of waiting, Socket_ReceiveAll() and
+// Socket_SendAll() still complete (or time out) by waiting in poll().
+int32_t Socket_SetBlocking(Socket* restrict s, const int32_t blocking) {
+#ifdef CS_PLATFORM_NT
+    u_long mode = (blocking) ? 0 : 1;
+    if (ioctlsocket(s->_native_handle, FIONBIO, &mode) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+#else
+    const int flags = fcntl(s->_native_handle, F_GETFL, 0);
+    if (flags == -1 || fcntl(s->_native_handle, F_SETFL, (blocking) ? flags & ~O_NONBLOCK : flags | O_NONBLOCK) == -1)
+        return CS_SOCKET_ERROR;
+#endif
+    s->non_blocking = !blocking;
+    return CS_SOCKET_SUCCESS;
+}
+
+// Wait up to timeout_ms (-1 forever, 0 to just check) for any of events (POLLIN, POLLOUT)
+// on the socket. Returns the events that happened, hang ups and errors included,
+// 0 on timeout or CS_SOCKET_ERROR.
+int32_t Socket_Poll(Socket* restrict s, const int16_t events, const int32_t timeout_ms) {
+    struct pollfd fd;
+    fd.fd = s->_native_handle;
+    fd.events = events;
+    fd.revents = 0;
+    int32_t res;
+    do {
+        res = CS_POLL(&fd, 1, timeout_ms);
+    } while (res == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+    if (res == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return (res > 0) ? fd.revents : 0;
+}
+
+// Socket_Poll() until deadline_ns (Time_NowNs() clock, 0 waits forever).
+int32_t _cs_poll_until(Socket* restrict s, const int16_t events, const uint64_t deadline_ns) {
+    if (!deadline_ns)
+        return Socket_Poll(s, events, -1);
+    const uint64_t now = Time_NowNs();
+    if (now >= deadline_ns)
+        return 0;
+    // Round up, waking a little late beats spinning on a 0 ms poll.
+    const uint64_t remaining_ms = (deadline_ns - now + CTM_NS_PER_MS - 1) / CTM_NS_PER_MS;
+    return Socket_Poll(s, events, (remaining_ms > INT32_MAX) ? INT32_MAX : (int32_t)remaining_ms);
+}
+
+// Give up on a connection whose stream can no longer be trusted.
+void _cs_drop(Socket* restrict s) {
+    s->connected = false;
+    if (s->_native_handle != CS_INVALID_SOCKET)
+        CS_CLOSE_SOCKET(s->_native_handle);
+    s->_native_handle = CS_INVALID_SOCKET;
+}
+
+// Try to connection to an endpoint, giving up after s->timeout milliseconds (if set).
 int32_t Socket_Connect(Socket* restrict s, IPEndPoint ep) {
     if (!_cs_g_initialized) {
         fputs("CS_Sockets not initialized.\n", stderr);
@@ -363,10 +506,29 @@ int32_t Socket_Connect(Socket* restrict s, IPEndPoint ep) {
     }
 
     s->remote_ep = ep;
+    // With a timeout connect in non-blocking mode and wait for the handshake in poll().
+    const uint8_t was_non_blocking = s->non_blocking;
+    if (s->timeout && !was_non_blocking && Socket_SetBlocking(s, false) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
     int32_t res = connect(
             s->_native_handle,
             (struct sockaddr*)&s->remote_ep.address.ipv4_addr,
             sizeof(s->remote_ep.address.ipv4_addr));
+    if (res == CS_SOCKET_ERROR && s->timeout && CS_ERROR_IN_PROGRESS()) {
+        const int32_t ready = Socket_Poll(s, POLLOUT, (int32_t)s->timeout);
+        int32_t error = 0;
+        socklen_t error_len = sizeof(error);
+        if (ready == 0) {
+            error = ETIMEDOUT;
+        } else if (ready == CS_SOCKET_ERROR ||
+                   getsockopt(s->_native_handle, SOL_SOCKET, SO_ERROR, (char*)&error, &error_len) == CS_SOCKET_ERROR) {
+            error = errno;
+        }
+        res = (error == 0) ? CS_SOCKET_SUCCESS : CS_SOCKET_ERROR;
+        errno = error;
+    }
+    if (s->timeout && !was_non_blocking)
+        Socket_SetBlocking(s, true);
     if (res == CS_SOCKET_ERROR) {
         fputs("CS_Sockets: Connection with the remote failed.\n", stderr);
         perror("native error");
@@ -386,7 +548,8 @@ Socket* Socket_Accept(Socket* restrict s) {
     Socket* client = (Socket*)malloc(sizeof(Socket));
     memcpy(client, s, sizeof(Socket));
 
-    socklen_t addr_len = sizeof(client->remote_ep.address.ipv4_addr);
+    // Room for an IPv6 peer, the address union is as large as its largest member.
+    socklen_t addr_len = sizeof(client->remote_ep.address.ipv6_addr);
     client->_native_handle = accept(
         s->_native_handle,
         (struct sockaddr*)&client->remote_ep.address.ipv4_addr,
@@ -400,12 +563,71 @@ Socket* Socket_Accept(Socket* restrict s) {
 
 	// Resolve the client endpoint.
     client->connected = true;
+    // Timeouts carry over from the listening socket, non-blocking mode does not.
+    client->non_blocking = false;
+    client->bytes_sent = 0;
+    client->bytes_received = 0;
+#ifdef CS_PLATFORM_UNIX
+    client->_passed_fd = -1;
+    // Local peers have no address worth showing, usually not even a path.
+    if (s->family == AddressFamily_Local) {
+        memset(&client->remote_ep.address.ipv4_addr, 0, sizeof(client->remote_ep.address.ipv4_addr));
+        client->remote_ep.addressFamily = AddressFamily_Local;
+        client->remote_ep.port = 0;
+        strcpy(client->remote_ep.address.str, "local");
+        return client;
+    }
+#endif
     client->remote_ep.addressFamily = client->remote_ep.address.ipv4_addr.sin_family;
     client->remote_ep.port = client->remote_ep.address.ipv4_addr.sin_port;
-    strcpy(client->remote_ep.address.str, inet_ntoa(client->remote_ep.address.ipv4_addr.sin_addr));
+    char* str = client->remote_ep.address.str;
+    if (client->remote_ep.address.ipv4_addr.sin_family != AF_INET6)
+        strcpy(str, inet_ntoa(client->remote_ep.address.ipv4_addr.sin_addr));
+    else if (!inet_ntop(AF_INET6, &client->remote_ep.address.ipv6_addr.sin6_addr, str, CS_IPV6_MAX))
+        strcpy(str, "?");
     return client;
 }
 
+#ifdef CS_PLATFORM_UNIX
+// recv() on a local socket that keeps a descriptor passed along with the data in s->_passed_fd.
+int32_t _cs_receive_local(Socket* restrict s, uint8_t* restrict buffer, const size_t buffer_size, const int32_t flags) {
+    struct iovec iov = {buffer, buffer_size};
+    union {
+        struct cmsghdr header;
+        uint8_t space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+#ifdef MSG_CMSG_CLOEXEC
+    const int32_t call_flags = flags | MSG_CMSG_CLOEXEC;
+#else
+    const int32_t call_flags = flags;
+#endif
+
+    ssize_t res;
+    do {
+        res = recvmsg(s->_native_handle, &msg, call_flags);
+    } while (res == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+    if (res <= 0)
+        return (int32_t)res;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+            continue;
+        int fd;
+        memcpy(&fd, CMSG_DATA(c), sizeof(fd));
+        // Only the last one is kept, one the caller never asked for must not leak.
+        if (s->_passed_fd != -1)
+            close(s->_passed_fd);
+        s->_passed_fd = fd;
+    }
+    return (int32_t)res;
+}
+#endif
+
 // Try and receive data from the Socket, shut the socket down if receive fails indicating that the client has disconnected.
 // If successful, return the amount of bytes received.
 int32_t Socket_Receive(Socket* restrict s, uint8_t* restrict buffer, const size_t buffer_size, const int32_t flags) {
@@ -414,12 +636,23 @@ int32_t Socket_Receive(Socket* restrict s, uint8_t* restrict buffer, const size_
         return CS_SOCKET_ERROR;
     }
 
-    int32_t received_bytes = recv(s->_native_handle, buffer, buffer_size, flags);
+    int32_t received_bytes;
+#ifdef CS_PLATFORM_UNIX
+    // A descriptor passed along would be dropped by recv(), see Socket_SendWithFd().
+    if (s->family == AddressFamily_Local) {
+        received_bytes = _cs_receive_local(s, buffer, buffer_size, flags);
+    } else
+#endif
+    do {
+        received_bytes = recv(s->_native_handle, buffer, buffer_size, flags);
+    } while (received_bytes == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+    if (received_bytes == CS_SOCKET_ERROR && CS_ERROR_WOULD_BLOCK())
+        return CS_SOCKET_WOULD_BLOCK;
     if (received_bytes == 0 || received_bytes == CS_SOCKET_ERROR) {
-        s->connected = false;
-        CS_CLOSE_SOCKET(s->_native_handle);
+        _cs_drop(s);
         return CS_SOCKET_ERROR;
     }
+    s->bytes_received += received_bytes;
     return received_bytes;
 }
 
@@ -431,12 +664,551 @@ int32_t Socket_Send(Socket* restrict s, const uint8_t* restrict buffer, const si
         return CS_SOCKET_ERROR;
     }
     
-    int32_t sent_bytes = send(s->_native_handle, buffer, buffer_size, flags);
+    int32_t sent_bytes;
+    do {
+        sent_bytes = send(s->_native_handle, buffer, buffer_size, flags | CS_MSG_NOSIGNAL);
+    } while (sent_bytes == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+    if (sent_bytes == CS_SOCKET_ERROR && CS_ERROR_WOULD_BLOCK())
+        return CS_SOCKET_WOULD_BLOCK;
     if (sent_bytes == CS_SOCKET_ERROR) {
-        s->connected = false;
-        CS_CLOSE_SOCKET(s->_native_handle);
+        _cs_drop(s);
+    } else {
+        s->bytes_sent += sent_bytes;
     }
     return sent_bytes;
 }
 
+// Keep receiving until the whole buffer is filled or deadline_ns (Time_NowNs() clock, 0 for none)
+// passes, a single recv() may return less than asked for. Returns the amount of bytes received or
+// CS_SOCKET_ERROR if the remote disconnected halfway. A timeout closes the socket like any other
+// failure since part of a message may already have been consumed.
+int32_t Socket_ReceiveAllUntil(Socket* restrict s, uint8_t* restrict buffer, const size_t buffer_size, const int32_t flags, const uint64_t deadline_ns) {
+    // With a deadline no single recv() may block, poll() does the waiting.
+    const int32_t call_flags = (deadline_ns) ? flags | CS_MSG_DONTWAIT : flags;
+    size_t received_bytes = 0;
+    while (received_bytes < buffer_size) {
+        int32_t res = Socket_Receive(s, buffer + received_bytes, buffer_size - received_bytes, call_flags);
+        if (res == CS_SOCKET_WOULD_BLOCK) {
+            if (_cs_poll_until(s, POLLIN, deadline_ns) <= 0) {
+                _cs_drop(s);
+                return CS_SOCKET_ERROR;
+            }
+            continue;
+        }
+        if (res == CS_SOCKET_ERROR)
+            return CS_SOCKET_ERROR;
+        received_bytes += res;
+    }
+    return (int32_t)received_bytes;
+}
+
+// Keep sending until the whole buffer has been handed to the kernel or deadline_ns passes.
+// Returns the amount of bytes sent or CS_SOCKET_ERROR, a timeout closes the socket.
+int32_t Socket_SendAllUntil(Socket* restrict s, const uint8_t* restrict buffer, const size_t buffer_size, const int32_t flags, const uint64_t deadline_ns) {
+    const int32_t call_flags = (deadline_ns) ? flags | CS_MSG_DONTWAIT : flags;
+    size_t sent_bytes = 0;
+    while (sent_bytes < buffer_size) {
+        int32_t res = Socket_Send(s, buffer + sent_bytes, buffer_size - sent_bytes, call_flags);
+        if (res == CS_SOCKET_WOULD_BLOCK) {
+            if (_cs_poll_until(s, POLLOUT, deadline_ns) <= 0) {
+                _cs_drop(s);
+                return CS_SOCKET_ERROR;
+            }
+            continue;
+        }
+        if (res == CS_SOCKET_ERROR)
+            return CS_SOCKET_ERROR;
+        sent_bytes += res;
+    }
+    return (int32_t)sent_bytes;
+}
+
+// Keep receiving until the whole buffer is filled, within s->receive_timeout if set.
+// Returns the amount of bytes received or CS_SOCKET_ERROR if the remote disconnected halfway.
+int32_t Socket_ReceiveAll(Socket* restrict s, uint8_t* restrict buffer, const size_t buffer_size, const int32_t flags) {
+    const uint64_t deadline_ns = (s->receive_timeout) ? Time_NowNs() + s->receive_timeout * CTM_NS_PER_MS : 0;
+    return Socket_ReceiveAllUntil(s, buffer, buffer_size, flags, deadline_ns);
+}
+
+// Keep sending until the whole buffer has been handed to the kernel, within s->send_timeout if set.
+// Returns the amount of bytes sent or CS_SOCKET_ERROR.
+int32_t Socket_SendAll(Socket* restrict s, const uint8_t* restrict buffer, const size_t buffer_size, const int32_t flags) {
+    const uint64_t deadline_ns = (s->send_timeout) ? Time_NowNs() + s->send_timeout * CTM_NS_PER_MS : 0;
+    return Socket_SendAllUntil(s, buffer, buffer_size, flags, deadline_ns);
+}
+
+// Size of the kernel send buffer of the socket in bytes.
+int32_t Socket_GetSendBufferSize(Socket* restrict s) {
+    int32_t size = 0;
+    socklen_t size_len = sizeof(size);
+    if (getsockopt(s->_native_handle, SOL_SOCKET, SO_SNDBUF, (char*)&size, &size_len) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return size;
+}
+
+// Smoothed round trip time of a connected TCP socket in microseconds.
+// Only Linux exposes this (TCP_INFO), elsewhere CS_SOCKET_ERROR is returned and the caller has to guess.
+int32_t Socket_GetRoundTripTime(Socket* restrict s, uint32_t* restrict rtt_us) {
+#ifdef __linux__
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if (getsockopt(s->_native_handle, IPPROTO_TCP, TCP_INFO, &info, &info_len) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    *rtt_us = info.tcpi_rtt;
+    return CS_SOCKET_SUCCESS;
+#else
+    return CS_SOCKET_ERROR;
+#endif
+}
+
+// Turn Nagle's algorithm off (or back on). Request/reply protocols that send a header and a
+// payload in separate writes otherwise stall on the peer's delayed ACK for every reply.
+int32_t Socket_SetNoDelay(Socket* restrict s, const int32_t enable) {
+    if (setsockopt(s->_native_handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&enable, sizeof(enable)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+}
+
+// Let a listening socket accept data in the SYN of clients that hold a Fast Open cookie,
+// queue_length bounds the connections that are pending the rest of their handshake.
+// Call before Socket_Listen(). Fails quietly (CS_SOCKET_ERROR) where TCP Fast Open is not available.
+int32_t Socket_SetFastOpen(Socket* restrict s, const int32_t queue_length) {
+#ifdef TCP_FASTOPEN
+    if (setsockopt(s->_native_handle, IPPROTO_TCP, TCP_FASTOPEN, (const char*)&queue_length, sizeof(queue_length)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+#else
+    return CS_SOCKET_ERROR;
+#endif
+}
+
+// Like Socket_Connect() but with TCP Fast Open where the kernel supports it: once the server
+// has handed out a cookie, connect() returns right away and the first send goes out with the SYN,
+// saving a round trip. Falls back to a regular connect otherwise.
+int32_t Socket_ConnectFastOpen(Socket* restrict s, IPEndPoint ep) {
+#ifdef TCP_FASTOPEN_CONNECT
+    const int32_t enable = 1;
+    setsockopt(s->_native_handle, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (const char*)&enable, sizeof(enable));
+#endif
+    return Socket_Connect(s, ep);
+}
+
+// Check that an idle connection is still usable without blocking: the remote has not closed it
+// and has not sent anything we did not ask for. Any pending data makes the connection unusable
+// for a new request/reply exchange, so it counts as unhealthy too.
+int32_t Socket_IsHealthy(Socket* restrict s) {
+    if (!s->connected)
+        return false;
+
+    const int32_t res = Socket_Poll(s, POLLIN, 0);
+    if (res == CS_SOCKET_ERROR)
+        return false;
+    // Readable means either data or the remote hung up, neither is healthy for an idle connection.
+    return res == 0;
+}
+
+// Wait up to timeout_ms (0 to just check) for s to become readable, i.e. data arrived or the
+// remote hung up. Returns true if readable, false on timeout, CS_SOCKET_ERROR on failure.
+int32_t Socket_WaitReadable(Socket* restrict s, const int32_t timeout_ms) {
+    const int32_t res = Socket_Poll(s, POLLIN, timeout_ms);
+    if (res == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return res > 0;
+}
+
+// One datagram of a batch. size is the length to send, or the room in buffer when receiving,
+// which Socket_ReceiveBatch() replaces with the length received.
+typedef struct _cs_datagram {
+    uint8_t* buffer;
+    size_t size;
+} Datagram;
+
+// Send up to count datagrams on a connected datagram socket, in one sendmmsg() where available.
+// Returns how many went out (the rest can be retried), CS_SOCKET_WOULD_BLOCK if none could
+// without blocking or CS_SOCKET_ERROR. Datagram sockets stay usable after an error (an ICMP
+// port unreachable for example), unlike streams they are not dropped.
+int32_t Socket_SendBatch(Socket* restrict s, const Datagram* restrict datagrams, const size_t count) {
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    struct mmsghdr messages[64];
+    struct iovec iovs[64];
+    const size_t n = (count < 64) ? count : 64;
+    memset(messages, 0, sizeof(struct mmsghdr) * n);
+    for (size_t i = 0; i < n; ++i) {
+        iovs[i].iov_base = datagrams[i].buffer;
+        iovs[i].iov_len = datagrams[i].size;
+        messages[i].msg_hdr.msg_iov = iovs + i;
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    int32_t sent;
+    do {
+        sent = sendmmsg(s->_native_handle, messages, (unsigned int)n, CS_MSG_NOSIGNAL);
+    } while (sent == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+    if (sent == CS_SOCKET_ERROR)
+        return (CS_ERROR_WOULD_BLOCK()) ? CS_SOCKET_WOULD_BLOCK : CS_SOCKET_ERROR;
+    for (int32_t i = 0; i < sent; ++i)
+        s->bytes_sent += messages[i].msg_len;
+    return sent;
+#else
+    int32_t sent = 0;
+    for (; (size_t)sent < count; ++sent) {
+        int32_t res;
+        do {
+            res = send(s->_native_handle, (const char*)datagrams[sent].buffer, datagrams[sent].size, CS_MSG_NOSIGNAL);
+        } while (res == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+        if (res == CS_SOCKET_ERROR) {
+            if (sent > 0)
+                break;
+            return (CS_ERROR_WOULD_BLOCK()) ? CS_SOCKET_WOULD_BLOCK : CS_SOCKET_ERROR;
+        }
+        s->bytes_sent += res;
+    }
+    return sent;
+#endif
+}
+
+// Receive up to count datagrams without waiting (poll() first), in one recvmmsg() where available.
+// Returns how many arrived with their sizes set, CS_SOCKET_WOULD_BLOCK if none was waiting
+// or CS_SOCKET_ERROR.
+int32_t Socket_ReceiveBatch(Socket* restrict s, Datagram* restrict datagrams, const size_t count) {
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    struct mmsghdr messages[64];
+    struct iovec iovs[64];
+    const size_t n = (count < 64) ? count : 64;
+    memset(messages, 0, sizeof(struct mmsghdr) * n);
+    for (size_t i = 0; i < n; ++i) {
+        iovs[i].iov_base = datagrams[i].buffer;
+        iovs[i].iov_len = datagrams[i].size;
+        messages[i].msg_hdr.msg_iov = iovs + i;
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    int32_t received;
+    do {
+        received = recvmmsg(s->_native_handle, messages, (unsigned int)n, MSG_DONTWAIT, NULL);
+    } while (received == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+    if (received == CS_SOCKET_ERROR)
+        return (CS_ERROR_WOULD_BLOCK()) ? CS_SOCKET_WOULD_BLOCK : CS_SOCKET_ERROR;
+    for (int32_t i = 0; i < received; ++i) {
+        datagrams[i].size = messages[i].msg_len;
+        s->bytes_received += messages[i].msg_len;
+    }
+    return received;
+#else
+    int32_t received = 0;
+    for (; (size_t)received < count; ++received) {
+        int32_t res;
+        do {
+            res = recv(s->_native_handle, (char*)datagrams[received].buffer, datagrams[received].size, CS_MSG_DONTWAIT);
+        } while (res == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+        if (res == CS_SOCKET_ERROR) {
+            if (received > 0)
+                break;
+            return (CS_ERROR_WOULD_BLOCK()) ? CS_SOCKET_WOULD_BLOCK : CS_SOCKET_ERROR;
+        }
+        datagrams[received].size = (size_t)res;
+        s->bytes_received += res;
+    }
+    return received;
+#endif
+}
+
+// Native IPv4 address of addr in network order, constructed ones (IPAddressType_Any) included.
+uint32_t _cs_ipv4_address(const IPAddress* restrict addr) {
+    return (addr->type == IPAddressType_IPv4LPStr) ? addr->ipv4_addr.sin_addr.s_addr : (uint32_t)addr->type;
+}
+
+// Join the IPv4 multicast group on the interface with address iface (IPAddressType_Any lets
+// the kernel pick one), datagrams sent to the group then arrive on s.
+int32_t Socket_JoinMulticast(Socket* restrict s, const IPAddress group, const IPAddress iface) {
+    struct ip_mreq request;
+    request.imr_multiaddr.s_addr = _cs_ipv4_address(&group);
+    request.imr_interface.s_addr = _cs_ipv4_address(&iface);
+    if (setsockopt(s->_native_handle, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&request, sizeof(request)) == CS_SOCKET_ERROR) {
+        perror("CS_Sockets: Failed to join multicast group");
+        return CS_SOCKET_ERROR;
+    }
+    return CS_SOCKET_SUCCESS;
+}
+
+// Send multicast out of the interface with address iface, at most ttl routers far. With loop
+// set listeners on this host get a copy as well.
+int32_t Socket_SetMulticast(Socket* restrict s, const IPAddress iface, const int32_t ttl, const int32_t loop) {
+    struct in_addr addr;
+    addr.s_addr = _cs_ipv4_address(&iface);
+    const uint8_t ttl_value = (uint8_t)ttl;
+    const uint8_t loop_value = (uint8_t)(loop != 0);
+    if (setsockopt(s->_native_handle, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&addr, sizeof(addr)) == CS_SOCKET_ERROR ||
+        setsockopt(s->_native_handle, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl_value, sizeof(ttl_value)) == CS_SOCKET_ERROR ||
+        setsockopt(s->_native_handle, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop_value, sizeof(loop_value)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+}
+
+// Let several sockets bind the same address and port, multicast receivers on one host all
+// get their copy that way. Call before Socket_Bind().
+int32_t Socket_SetReuseAddress(Socket* restrict s, const int32_t enable) {
+    if (setsockopt(s->_native_handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&enable, sizeof(enable)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+}
+
+// Keep at most bytes of not yet sent data queued in the kernel, sends block (or the socket
+// stops being writable) beyond that. Whatever is written next then goes out after at most
+// that much, instead of after the whole send buffer. Linux and macOS only, CS_SOCKET_ERROR elsewhere.
+int32_t Socket_SetNotSentLowat(Socket* restrict s, const int32_t bytes) {
+#ifdef TCP_NOTSENT_LOWAT
+    if (setsockopt(s->_native_handle, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char*)&bytes, sizeof(bytes)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+#else
+    return CS_SOCKET_ERROR;
+#endif
+}
+
+// Request kernel send and receive buffers of the given sizes in bytes, 0 leaves one as it is.
+// Long fat links need buffers of at least bandwidth x round trip time to keep the pipe full.
+// Set them before Socket_Listen()/Socket_Connect(), the TCP window scale is fixed by the handshake.
+int32_t Socket_SetBufferSizes(Socket* restrict s, const int32_t send_size, const int32_t receive_size) {
+    if (send_size > 0 && setsockopt(s->_native_handle, SOL_SOCKET, SO_SNDBUF, (const char*)&send_size, sizeof(send_size)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    if (receive_size > 0 && setsockopt(s->_native_handle, SOL_SOCKET, SO_RCVBUF, (const char*)&receive_size, sizeof(receive_size)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+}
+
+// Size of the kernel receive buffer of the socket in bytes.
+int32_t Socket_GetReceiveBufferSize(Socket* restrict s) {
+    int32_t size = 0;
+    socklen_t size_len = sizeof(size);
+    if (getsockopt(s->_native_handle, SOL_SOCKET, SO_RCVBUF, (char*)&size, &size_len) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return size;
+}
+
+// Probe a connection after idle_s seconds of silence, every interval_s seconds, and drop it after
+// count unanswered probes. idle_s 0 turns keepalive off, interval_s/count 0 keep the OS defaults.
+// Only the on/off switch is portable, the timings are applied where the OS exposes them.
+int32_t Socket_SetKeepAlive(Socket* restrict s, const int32_t idle_s, const int32_t interval_s, const int32_t count) {
+    const int32_t enable = idle_s > 0;
+    if (setsockopt(s->_native_handle, SOL_SOCKET, SO_KEEPALIVE, (const char*)&enable, sizeof(enable)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    if (!enable)
+        return CS_SOCKET_SUCCESS;
+#if defined(TCP_KEEPIDLE)
+    setsockopt(s->_native_handle, IPPROTO_TCP, TCP_KEEPIDLE, (const char*)&idle_s, sizeof(idle_s));
+#elif defined(TCP_KEEPALIVE)
+    setsockopt(s->_native_handle, IPPROTO_TCP, TCP_KEEPALIVE, (const char*)&idle_s, sizeof(idle_s));
+#endif
+#ifdef TCP_KEEPINTVL
+    if (interval_s > 0)
+        setsockopt(s->_native_handle, IPPROTO_TCP, TCP_KEEPINTVL, (const char*)&interval_s, sizeof(interval_s));
+#endif
+#ifdef TCP_KEEPCNT
+    if (count > 0)
+        setsockopt(s->_native_handle, IPPROTO_TCP, TCP_KEEPCNT, (const char*)&count, sizeof(count));
+#endif
+    return CS_SOCKET_SUCCESS;
+}
+
+// Busy poll the device queue for up to usec microseconds in blocking receives before sleeping,
+// trading CPU for latency. Linux only (and may need CAP_NET_ADMIN to raise), CS_SOCKET_ERROR elsewhere.
+int32_t Socket_SetBusyPoll(Socket* restrict s, const int32_t usec) {
+#ifdef SO_BUSY_POLL
+    if (setsockopt(s->_native_handle, SOL_SOCKET, SO_BUSY_POLL, (const char*)&usec, sizeof(usec)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+#else
+    return CS_SOCKET_ERROR;
+#endif
+}
+
+// Let several sockets bind the same address and port, the kernel spreads incoming connections
+// over all listeners bound that way. Call before Socket_Bind(). CS_SOCKET_ERROR where SO_REUSEPORT
+// is not available.
+int32_t Socket_SetReusePort(Socket* restrict s, const int32_t enable) {
+#ifdef SO_REUSEPORT
+    if (setsockopt(s->_native_handle, SOL_SOCKET, SO_REUSEPORT, (const char*)&enable, sizeof(enable)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+#else
+    return CS_SOCKET_ERROR;
+#endif
+}
+
+// Mark a listener as belonging to cpu: among SO_REUSEPORT listeners the kernel prefers the one
+// whose CPU handled the incoming packet, so a connection stays on the core that received it.
+// Linux only, CS_SOCKET_ERROR elsewhere.
+int32_t Socket_SetIncomingCpu(Socket* restrict s, const int32_t cpu) {
+#ifdef SO_INCOMING_CPU
+    if (setsockopt(s->_native_handle, SOL_SOCKET, SO_INCOMING_CPU, (const char*)&cpu, sizeof(cpu)) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+#else
+    return CS_SOCKET_ERROR;
+#endif
+}
+
+#ifdef CS_PLATFORM_UNIX
+// Fill addr with path, CS_SOCKET_ERROR if it does not fit.
+int32_t _cs_local_address(struct sockaddr_un* restrict addr, const char* restrict path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "CS_Sockets: Socket path %s is too long.\n", path);
+        return CS_SOCKET_ERROR;
+    }
+    strcpy(addr->sun_path, path);
+    return CS_SOCKET_SUCCESS;
+}
+
+// Bind a local socket to path, which must not exist yet (remove a stale one first).
+int32_t Socket_BindLocal(Socket* restrict s, const char* restrict path) {
+    struct sockaddr_un addr;
+    if (_cs_local_address(&addr, path) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    memset(&s->local_ep, 0, sizeof(s->local_ep));
+    s->local_ep.addressFamily = AddressFamily_Local;
+    snprintf(s->local_ep.address.str, sizeof(s->local_ep.address.str), "local");
+    if (bind(s->_native_handle, (struct sockaddr*)&addr, sizeof(addr)) == CS_SOCKET_ERROR) {
+        fprintf(stderr, "CS_Sockets: Failed to bind socket to %s.\n", path);
+        perror("native error");
+        CS_CLOSE_SOCKET(s->_native_handle);
+        s->_native_handle = CS_INVALID_SOCKET;
+        return CS_SOCKET_ERROR;
+    }
+    return CS_SOCKET_SUCCESS;
+}
+
+// Connect a local socket to the server listening on path.
+int32_t Socket_ConnectLocal(Socket* restrict s, const char* restrict path) {
+    struct sockaddr_un addr;
+    if (_cs_local_address(&addr, path) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    memset(&s->remote_ep, 0, sizeof(s->remote_ep));
+    s->remote_ep.addressFamily = AddressFamily_Local;
+    snprintf(s->remote_ep.address.str, sizeof(s->remote_ep.address.str), "local");
+    int32_t res;
+    do {
+        res = connect(s->_native_handle, (struct sockaddr*)&addr, sizeof(addr));
+    } while (res == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+    if (res == CS_SOCKET_ERROR) {
+        fprintf(stderr, "CS_Sockets: Connection with %s failed.\n", path);
+        perror("native error");
+        return CS_SOCKET_ERROR;
+    }
+    s->connected = true;
+    return CS_SOCKET_SUCCESS;
+}
+
+// Send buffer over a local socket with fd attached, the peer gets its own descriptor of the
+// same open file (Socket_TakeFd() after receiving the first byte of buffer). fd stays open here.
+// Returns the amount of bytes sent or CS_SOCKET_ERROR.
+int32_t Socket_SendWithFd(Socket* restrict s, const uint8_t* restrict buffer, const size_t buffer_size, const int fd) {
+    struct iovec iov = {(void*)buffer, buffer_size};
+    union {
+        struct cmsghdr header;
+        uint8_t space[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(fd));
+
+    ssize_t res;
+    do {
+        res = sendmsg(s->_native_handle, &msg, CS_MSG_NOSIGNAL);
+    } while (res == CS_SOCKET_ERROR && CS_ERROR_INTERRUPTED());
+    if (res == CS_SOCKET_ERROR) {
+        _cs_drop(s);
+        return CS_SOCKET_ERROR;
+    }
+    s->bytes_sent += (uint64_t)res;
+    // The descriptor went with the first byte, the rest is ordinary data.
+    if ((size_t)res < buffer_size && Socket_SendAll(s, buffer + res, buffer_size - (size_t)res, 0) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return (int32_t)buffer_size;
+}
+
+// The descriptor that arrived with data received so far, -1 if none did. The caller owns it.
+int Socket_TakeFd(Socket* restrict s) {
+    const int fd = s->_passed_fd;
+    s->_passed_fd = -1;
+    return fd;
+}
+
+// User and group of the process at the other end of a local socket, as of when it connected.
+int32_t Socket_GetPeerCredentials(Socket* restrict s, uint32_t* restrict uid, uint32_t* restrict gid) {
+#if defined(__linux__) && defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(s->_native_handle, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    *uid = (uint32_t)cred.uid;
+    *gid = (uint32_t)cred.gid;
+#else
+    uid_t peer_uid;
+    gid_t peer_gid;
+    if (getpeereid(s->_native_handle, &peer_uid, &peer_gid) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    *uid = (uint32_t)peer_uid;
+    *gid = (uint32_t)peer_gid;
+#endif
+    return CS_SOCKET_SUCCESS;
+}
+#endif
+
+// Tuning applied in one go by Socket_ApplyOptions(), see the setters above for what each does.
+// no_delay: 1 disables Nagle's algorithm, 0 keeps it, -1 leaves the socket as it is.
+// send_buffer, receive_buffer: Kernel buffer sizes in bytes, 0 for the OS default.
+// keepalive_idle_s: Seconds of silence before keepalive probes, 0 for no keepalive.
+// busy_poll_us: 0 for no busy polling.
+// connect_timeout, send_timeout, receive_timeout: Milliseconds, see Socket.
+typedef struct _cs_socket_options {
+    int32_t no_delay;
+    int32_t send_buffer;
+    int32_t receive_buffer;
+    int32_t keepalive_idle_s;
+    int32_t busy_poll_us;
+    uint32_t connect_timeout;
+    uint32_t send_timeout;
+    uint32_t receive_timeout;
+} SocketOptions;
+
+// Nagle off, everything else left to the OS, the usual 5 second connect timeout.
+SocketOptions SocketOptions_Default() {
+    SocketOptions o;
+    memset(&o, 0, sizeof(o));
+    o.no_delay = 1;
+    o.connect_timeout = 5000;
+    return o;
+}
+
+// Apply o to s. Options the platform (or a local socket) lacks are skipped, returns
+// CS_SOCKET_ERROR if any supported one was refused.
+int32_t Socket_ApplyOptions(Socket* restrict s, const SocketOptions* restrict o) {
+    int32_t res = CS_SOCKET_SUCCESS;
+    const int32_t tcp = s->ptype == ProtocolType_Tcp;
+    if (tcp && o->no_delay >= 0 && Socket_SetNoDelay(s, o->no_delay) == CS_SOCKET_ERROR)
+        res = CS_SOCKET_ERROR;
+    if (Socket_SetBufferSizes(s, o->send_buffer, o->receive_buffer) == CS_SOCKET_ERROR)
+        res = CS_SOCKET_ERROR;
+    if (tcp && o->keepalive_idle_s > 0 && Socket_SetKeepAlive(s, o->keepalive_idle_s, 0, 0) == CS_SOCKET_ERROR)
+        res = CS_SOCKET_ERROR;
+#ifdef SO_BUSY_POLL
+    if (tcp && o->busy_poll_us > 0 && Socket_SetBusyPoll(s, o->busy_poll_us) == CS_SOCKET_ERROR)
+        res = CS_SOCKET_ERROR;
+#endif
+    s->timeout = o->connect_timeout;
+    s->send_timeout = o->send_timeout;
+    s->receive_timeout = o->receive_timeout;
+    return res;
+}
+
 #endif // CROSSPLATFORM_SOCKETS_H
@@ -10,6 +10,7 @@
 #define DEF_DIR_ENTRY_COUNT 10
 #define CIO_FILE_ERROR -1
 #define CIO_FILE_SUCCESS 0
+#define CIO_DIRECT_ALIGNMENT 4096
 
 #define false 0
 #define true 1
@@ -34,6 +35,8 @@
 #elif defined(__linux__) || defined(__APPLE__)
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <limits.h>
 
@@ -191,6 +194,338 @@ void Directory_Close(DirectoryInfo* restrict d) {
     free(d);
 }
 
+// How a file should be opened.
+// Write creates the file if it does not exist and truncates it otherwise.
+typedef enum _cio_file_mode {
+    FileMode_Read,
+    FileMode_Write,
+    FileMode_ReadWrite
+} FileMode;
+
+// Access pattern hints passed down to the kernel page cache.
+typedef enum _cio_file_advice {
+    FileAdvice_Normal,
+    FileAdvice_Sequential,
+    FileAdvice_Random,
+    FileAdvice_WillNeed,
+    FileAdvice_DontNeed
+} FileAdvice;
+
+// Handle to an open file. Unlike FILE, all I/O is positional (no shared
+// file offset) so the same handle can be read from several places at once.
+typedef struct _cio_file_handle {
+#ifdef CIO_PLATFORM_UNIX
+    int _native_handle;
+#elif defined(CIO_PLATFORM_NT)
+    HANDLE _native_handle;
+#endif
+    uint64_t size;
+    time_t mtime;
+} FileHandle;
+
+FileHandle* File_Open(const char* restrict path, const FileMode mode) {
+    FileHandle* f = (FileHandle*)malloc(sizeof(FileHandle));
+#ifdef CIO_PLATFORM_UNIX
+    int flags = O_RDONLY;
+    if (mode == FileMode_Write)
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (mode == FileMode_ReadWrite)
+        flags = O_RDWR | O_CREAT;
+
+    f->_native_handle = open(path, flags, 0644);
+    if (f->_native_handle == -1) {
+        free(f);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(f->_native_handle, &st) == -1 || S_ISDIR(st.st_mode)) {
+        close(f->_native_handle);
+        free(f);
+        return NULL;
+    }
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+#elif defined(CIO_PLATFORM_NT)
+    DWORD access = GENERIC_READ;
+    DWORD disposition = OPEN_EXISTING;
+    if (mode == FileMode_Write) {
+        access = GENERIC_WRITE;
+        disposition = CREATE_ALWAYS;
+    } else if (mode == FileMode_ReadWrite) {
+        access = GENERIC_READ | GENERIC_WRITE;
+        disposition = OPEN_ALWAYS;
+    }
+
+    f->_native_handle = CreateFileA(path, access, FILE_SHARE_READ, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f->_native_handle == INVALID_HANDLE_VALUE) {
+        free(f);
+        return NULL;
+    }
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(f->_native_handle, &size);
+    f->size = (uint64_t)size.QuadPart;
+    f->mtime = 0;
+#endif
+    return f;
+}
+
+// Open an existing or new file for writing with the page cache bypassed (O_DIRECT).
+// Offsets, sizes and buffers used with this handle must be CIO_DIRECT_ALIGNMENT aligned.
+// Returns NULL where direct I/O is not available (other platforms, tmpfs, ...).
+FileHandle* File_OpenDirect(const char* restrict path) {
+#if defined(CIO_PLATFORM_UNIX) && defined(O_DIRECT)
+    FileHandle* f = (FileHandle*)malloc(sizeof(FileHandle));
+    f->_native_handle = open(path, O_WRONLY | O_CREAT | O_DIRECT, 0644);
+    if (f->_native_handle == -1) {
+        free(f);
+        return NULL;
+    }
+    struct stat st;
+    fstat(f->_native_handle, &st);
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+    return f;
+#else
+    return NULL;
+#endif
+}
+
+#ifdef CIO_PLATFORM_UNIX
+// Wrap a descriptor opened elsewhere (passed over a local socket, say), the handle owns it
+// from then on. Returns NULL for directories and bad descriptors, fd is left open then.
+FileHandle* File_FromNative(const int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || S_ISDIR(st.st_mode))
+        return NULL;
+    FileHandle* f = (FileHandle*)malloc(sizeof(FileHandle));
+    f->_native_handle = fd;
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+    return f;
+}
+#endif
+
+void File_Close(FileHandle* restrict f) {
+#ifdef CIO_PLATFORM_UNIX
+    close(f->_native_handle);
+#elif defined(CIO_PLATFORM_NT)
+    CloseHandle(f->_native_handle);
+#endif
+    free(f);
+}
+
+// Read up to size bytes starting at offset. Returns the amount of bytes read,
+// 0 at the end of the file and CIO_FILE_ERROR on failure.
+int64_t File_ReadAt(FileHandle* restrict f, void* restrict buffer, const size_t size, const uint64_t offset) {
+#ifdef CIO_PLATFORM_UNIX
+    ssize_t res;
+    do {
+        res = pread(f->_native_handle, buffer, size, (off_t)offset);
+    } while (res == -1 && errno == EINTR);
+    return (res == -1) ? CIO_FILE_ERROR : (int64_t)res;
+#elif defined(CIO_PLATFORM_NT)
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD read_bytes = 0;
+    if (!ReadFile(f->_native_handle, buffer, (DWORD)size, &read_bytes, &ov))
+        return (GetLastError() == ERROR_HANDLE_EOF) ? 0 : CIO_FILE_ERROR;
+    return (int64_t)read_bytes;
+#endif
+}
+
+// Write size bytes starting at offset. Returns the amount of bytes written or CIO_FILE_ERROR.
+int64_t File_WriteAt(FileHandle* restrict f, const void* restrict buffer, const size_t size, const uint64_t offset) {
+#ifdef CIO_PLATFORM_UNIX
+    size_t written_bytes = 0;
+    while (written_bytes < size) {
+        ssize_t res = pwrite(f->_native_handle, (const uint8_t*)buffer + written_bytes, size - written_bytes, (off_t)(offset + written_bytes));
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return CIO_FILE_ERROR;
+        }
+        written_bytes += (size_t)res;
+    }
+    if (offset + written_bytes > f->size)
+        f->size = offset + written_bytes;
+    return (int64_t)written_bytes;
+#elif defined(CIO_PLATFORM_NT)
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD written_bytes = 0;
+    if (!WriteFile(f->_native_handle, buffer, (DWORD)size, &written_bytes, &ov))
+        return CIO_FILE_ERROR;
+    if (offset + written_bytes > f->size)
+        f->size = offset + written_bytes;
+    return (int64_t)written_bytes;
+#endif
+}
+
+// Set the size of the file, extending it with a hole or cutting it short.
+int32_t File_Truncate(FileHandle* restrict f, const uint64_t size) {
+#ifdef CIO_PLATFORM_UNIX
+    if (ftruncate(f->_native_handle, (off_t)size) == -1)
+        return CIO_FILE_ERROR;
+#elif defined(CIO_PLATFORM_NT)
+    LARGE_INTEGER pos;
+    pos.QuadPart = (LONGLONG)size;
+    if (!SetFilePointerEx(f->_native_handle, pos, NULL, FILE_BEGIN) || !SetEndOfFile(f->_native_handle))
+        return CIO_FILE_ERROR;
+#endif
+    f->size = size;
+    return CIO_FILE_SUCCESS;
+}
+
+// Reserve disk space for the given range up front so the file is not fragmented
+// by many small extending writes and running out of space fails early.
+int32_t File_Allocate(FileHandle* restrict f, const uint64_t offset, const uint64_t length) {
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    if (fallocate(f->_native_handle, 0, (off_t)offset, (off_t)length) == -1)
+        return CIO_FILE_ERROR;
+#elif defined(CIO_PLATFORM_UNIX)
+    if (posix_fallocate(f->_native_handle, (off_t)offset, (off_t)length) != 0)
+        return CIO_FILE_ERROR;
+#else
+    return CIO_FILE_ERROR;
+#endif
+    if (offset + length > f->size)
+        f->size = offset + length;
+    return CIO_FILE_SUCCESS;
+}
+
+// Copy the contents of src into dst (opened for writing), both from the start.
+// On Linux the copy stays in the kernel (and may be a reflink on CoW filesystems).
+int32_t File_CopyContents(FileHandle* restrict src, FileHandle* restrict dst) {
+    int32_t result = CIO_FILE_SUCCESS;
+    uint64_t offset = 0;
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    while (offset < src->size) {
+        loff_t in_offset = (loff_t)offset;
+        loff_t out_offset = (loff_t)offset;
+        ssize_t res = copy_file_range(src->_native_handle, &in_offset, dst->_native_handle, &out_offset, src->size - offset, 0);
+        if (res <= 0)
+            break;
+        offset += (uint64_t)res;
+    }
+    if (offset > dst->size)
+        dst->size = offset;
+#endif
+    // Anything copy_file_range() could not do (old kernels, cross-filesystem) is copied by hand.
+    const size_t COPY_BUFFER_SIZE = 1024 * 1024;
+    uint8_t* buffer = (uint8_t*)malloc(COPY_BUFFER_SIZE);
+    while (offset < src->size) {
+        int64_t read_bytes = File_ReadAt(src, buffer, COPY_BUFFER_SIZE, offset);
+        if (read_bytes <= 0 || File_WriteAt(dst, buffer, (size_t)read_bytes, offset) != read_bytes) {
+            result = CIO_FILE_ERROR;
+            break;
+        }
+        offset += (uint64_t)read_bytes;
+    }
+    free(buffer);
+    return result;
+}
+
+// Copy the contents of src into dst, creating or truncating dst.
+int32_t File_Copy(const char* restrict src_path, const char* restrict dst_path) {
+    FileHandle* src = File_Open(src_path, FileMode_Read);
+    if (!src)
+        return CIO_FILE_ERROR;
+    FileHandle* dst = File_Open(dst_path, FileMode_Write);
+    if (!dst) {
+        File_Close(src);
+        return CIO_FILE_ERROR;
+    }
+    const int32_t result = File_CopyContents(src, dst);
+    File_Close(dst);
+    File_Close(src);
+    return result;
+}
+
+// Tell the kernel how the given range is going to be accessed, a length of 0 means until the end of the file.
+// This is purely a hint, platforms without an equivalent just ignore it.
+int32_t File_Advise(FileHandle* restrict f, const uint64_t offset, const uint64_t length, const FileAdvice advice) {
+#if defined(CIO_PLATFORM_UNIX) && defined(POSIX_FADV_SEQUENTIAL)
+    static const int advice_map[] = {
+        POSIX_FADV_NORMAL,
+        POSIX_FADV_SEQUENTIAL,
+        POSIX_FADV_RANDOM,
+        POSIX_FADV_WILLNEED,
+        POSIX_FADV_DONTNEED};
+    if (posix_fadvise(f->_native_handle, (off_t)offset, (off_t)length, advice_map[advice]) != 0)
+        return CIO_FILE_ERROR;
+#endif
+    return CIO_FILE_SUCCESS;
+}
+
+// Start reading the given range into the page cache in the background so a
+// later File_ReadAt() on it does not block on the disk.
+int32_t File_Readahead(FileHandle* restrict f, const uint64_t offset, const uint64_t length) {
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    if (readahead(f->_native_handle, (off64_t)offset, (size_t)length) == -1)
+        return CIO_FILE_ERROR;
+    return CIO_FILE_SUCCESS;
+#else
+    return File_Advise(f, offset, length, FileAdvice_WillNeed);
+#endif
+}
+
+// Offset of the first byte of data at or after offset, skipping holes in sparse files.
+// Returns the file size if only a hole remains. Filesystems without hole
+// reporting treat the whole file as data, so offset is returned as is.
+int64_t File_SeekData(FileHandle* restrict f, const uint64_t offset) {
+#if defined(CIO_PLATFORM_UNIX) && defined(SEEK_DATA)
+    off_t res = lseek(f->_native_handle, (off_t)offset, SEEK_DATA);
+    if (res == -1)
+        return (errno == ENXIO) ? (int64_t)f->size : (int64_t)offset;
+    return (int64_t)res;
+#else
+    return (int64_t)offset;
+#endif
+}
+
+// Offset of the first hole at or after offset, the end of the file counts as a hole.
+int64_t File_SeekHole(FileHandle* restrict f, const uint64_t offset) {
+#if defined(CIO_PLATFORM_UNIX) && defined(SEEK_HOLE)
+    off_t res = lseek(f->_native_handle, (off_t)offset, SEEK_HOLE);
+    if (res == -1)
+        return (int64_t)f->size;
+    return (int64_t)res;
+#else
+    return (int64_t)f->size;
+#endif
+}
+
+// Create a directory along with any missing parents, existing directories are not an error.
+int32_t Directory_Create(const char* restrict path) {
+    char t_path[CIO_PATH_MAX];
+    strncpy(t_path, path, sizeof(t_path) - 1);
+    t_path[sizeof(t_path) - 1] = 0;
+
+    for (char* p = t_path + 1; ; ++p) {
+        const char c = *p;
+        if (c != '/' && c != '\\' && c != 0)
+            continue;
+        *p = 0;
+#ifdef CIO_PLATFORM_UNIX
+        if (mkdir(t_path, 0755) == -1 && errno != EEXIST)
+            return CIO_FILE_ERROR;
+#elif defined(CIO_PLATFORM_NT)
+        if (!CreateDirectoryA(t_path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+            return CIO_FILE_ERROR;
+#endif
+        if (c == 0)
+            break;
+        *p = c;
+    }
+    return CIO_FILE_SUCCESS;
+}
+
 int32_t File_GetCurrentDirectory(char* buffer, const size_t size) {
 #ifdef CIO_PLATFORM_UNIX
     if (!getcwd(buffer, size)) {
@@ -0,0 +1,317 @@
+#ifndef CROSSPLATFORM_THREADPOOL_H
+#define CROSSPLATFORM_THREADPOOL_H
+
+// Fixed size pool of worker threads for blocking work (disk reads, stat, hashing) that
+// should not hold up the thread that needs the result until it actually needs it.
+//
+// Every worker owns a deque of tasks. Tasks submitted from outside the pool are spread
+// round robin over the deques, tasks submitted by a worker go onto its own. A worker takes
+// from the back of its own deque (the most recent task, whose data is most likely still
+// in cache) and when that is empty steals from the front of another worker's. Idle workers
+// sleep until something is submitted.
+//
+// A task either hands its result to a ThreadPoolFuture the submitter waits on, or to a
+// completion callback that runs on the worker right after the task.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "cs_threads.h"
+
+#define CTP_DEQUE_INITIAL_CAPACITY 64
+// Deque locks are held for a push or pop only, spin a little before sleeping on one.
+#define CTP_DEQUE_SPIN 100
+
+// Called on the worker with the task's result.
+typedef void (*ThreadPoolCallback)(ThreadArg result, ThreadArg callback_args);
+
+// Result of a submitted task, see ThreadPoolFuture_Wait().
+typedef struct _ctp_future {
+    ThreadArg result;
+    uint8_t done;
+    Mutex* _mutex;
+    CondVar* _cond;
+} ThreadPoolFuture;
+
+typedef struct _ctp_task {
+    ThreadRoutine routine;
+    ThreadArg args;
+    ThreadPoolCallback callback;
+    ThreadArg callback_args;
+    ThreadPoolFuture* future;
+} _ctp_task;
+
+// Ring buffer, grows when full. Guarded by its own mutex, the owner and thieves only
+// ever hold it for a push or a pop.
+typedef struct _ctp_deque {
+    _ctp_task* tasks;
+    size_t capacity;
+    size_t head; // Front, where thieves take from.
+    size_t count;
+    Mutex* mutex;
+} _ctp_deque;
+
+struct _ctp_thread_pool;
+
+typedef struct _ctp_worker {
+    struct _ctp_thread_pool* pool;
+    size_t index;
+    _ctp_deque deque;
+    Thread* thread;
+    uint64_t rng; // Picks the first victim to steal from.
+} _ctp_worker;
+
+// Counters, see ThreadPool_GetStats().
+typedef struct _ctp_stats {
+    size_t workers;
+    size_t queued;      // Tasks waiting in the deques right now.
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t stolen;    // Tasks a worker took from another worker's deque.
+} ThreadPoolStats;
+
+typedef struct _ctp_thread_pool {
+    size_t worker_count;
+    _ctp_worker* workers;
+
+    size_t queued;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t stolen;
+    size_t next_worker; // Round robin target of outside submissions.
+
+    uint8_t stopping;
+    size_t sleepers;
+    Mutex* sleep_mutex;
+    CondVar* sleep_cond;
+} ThreadPool;
+
+// Worker the calling thread is, NULL outside of any pool.
+static __thread _ctp_worker* _ctp_t_worker = NULL;
+
+void _ctp_deque_push_back(_ctp_deque* restrict d, const _ctp_task* restrict task) {
+    Mutex_Lock(d->mutex);
+    if (d->count == d->capacity) {
+        const size_t capacity = d->capacity * 2;
+        _ctp_task* tasks = (_ctp_task*)malloc(sizeof(_ctp_task) * capacity);
+        for (size_t i = 0; i < d->count; ++i)
+            tasks[i] = d->tasks[(d->head + i) % d->capacity];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->capacity = capacity;
+        d->head = 0;
+    }
+    d->tasks[(d->head + d->count) % d->capacity] = *task;
+    ++d->count;
+    Mutex_Unlock(d->mutex);
+}
+
+uint8_t _ctp_deque_pop_back(_ctp_deque* restrict d, _ctp_task* restrict task) {
+    Mutex_Lock(d->mutex);
+    const uint8_t found = d->count > 0;
+    if (found)
+        *task = d->tasks[(d->head + --d->count) % d->capacity];
+    Mutex_Unlock(d->mutex);
+    return found;
+}
+
+uint8_t _ctp_deque_pop_front(_ctp_deque* restrict d, _ctp_task* restrict task) {
+    Mutex_Lock(d->mutex);
+    const uint8_t found = d->count > 0;
+    if (found) {
+        *task = d->tasks[d->head];
+        d->head = (d->head + 1) % d->capacity;
+        --d->count;
+    }
+    Mutex_Unlock(d->mutex);
+    return found;
+}
+
+// Next task for w: its own newest one, otherwise the oldest of some other worker.
+uint8_t _ctp_take(_ctp_worker* restrict w, _ctp_task* restrict task) {
+    ThreadPool* pool = w->pool;
+    if (_ctp_deque_pop_back(&w->deque, task))
+        return true;
+    // xorshift, only has to spread thieves over the victims.
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    const size_t first = (size_t)(w->rng % pool->worker_count);
+    for (size_t i = 0; i < pool->worker_count; ++i) {
+        _ctp_worker* victim = pool->workers + (first + i) % pool->worker_count;
+        if (victim != w && _ctp_deque_pop_front(&victim->deque, task)) {
+            __atomic_add_fetch(&pool->stolen, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+
+void _ctp_run(ThreadPool* restrict pool, _ctp_task* restrict task) {
+    const ThreadArg result = task->routine(task->args);
+    if (task->callback)
+        task->callback(result, task->callback_args);
+    if (task->future) {
+        ThreadPoolFuture* f = task->future;
+        Mutex_Lock(f->_mutex);
+        f->result = result;
+        __atomic_store_n(&f->done, true, __ATOMIC_RELEASE);
+        CondVar_Broadcast(f->_cond);
+        Mutex_Unlock(f->_mutex);
+    }
+    __atomic_add_fetch(&pool->completed, 1, __ATOMIC_RELAXED);
+}
+
+ThreadArg _ctp_worker_main(ThreadArg args) {
+    _ctp_worker* w = (_ctp_worker*)args;
+    ThreadPool* pool = w->pool;
+    _ctp_t_worker = w;
+    for (;;) {
+        _ctp_task task;
+        if (_ctp_take(w, &task)) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            _ctp_run(pool, &task);
+            continue;
+        }
+
+        // Announce we are going to sleep before the last look at queued, a submitter bumps
+        // queued before looking at sleepers, so one of us always sees the other.
+        Mutex_Lock(pool->sleep_mutex);
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 && !pool->stopping)
+            CondVar_Wait(pool->sleep_cond, pool->sleep_mutex);
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        const uint8_t stop = pool->stopping && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0;
+        Mutex_Unlock(pool->sleep_mutex);
+        if (stop)
+            break;
+    }
+    _ctp_t_worker = NULL;
+    return NULL;
+}
+
+// Constructor for ThreadPool, worker_count 0 means one per CPU. Workers are named name (may be NULL).
+ThreadPool* ThreadPool_New(size_t worker_count, const char* restrict name) {
+    if (worker_count == 0)
+        worker_count = Thread_CpuCount();
+
+    ThreadPool* pool = (ThreadPool*)malloc(sizeof(ThreadPool));
+    memset(pool, 0, sizeof(ThreadPool));
+    pool->worker_count = worker_count;
+    pool->sleep_mutex = Mutex_New();
+    pool->sleep_cond = CondVar_New();
+    pool->workers = (_ctp_worker*)malloc(sizeof(_ctp_worker) * worker_count);
+    memset(pool->workers, 0, sizeof(_ctp_worker) * worker_count);
+    for (size_t i = 0; i < worker_count; ++i) {
+        _ctp_worker* w = pool->workers + i;
+        w->pool = pool;
+        w->index = i;
+        w->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        w->deque.capacity = CTP_DEQUE_INITIAL_CAPACITY;
+        w->deque.tasks = (_ctp_task*)malloc(sizeof(_ctp_task) * w->deque.capacity);
+        w->deque.mutex = Mutex_NewAdaptive(CTP_DEQUE_SPIN);
+    }
+    // Start workers only once every deque exists, they steal from each other right away.
+    for (size_t i = 0; i < worker_count; ++i) {
+        ThreadAttributes attr;
+        attr.args = (ThreadArg)(pool->workers + i);
+        attr.initial_stack_size = 0;
+        attr.detached = false;
+        attr.routine = _ctp_worker_main;
+        attr.cpus = NULL;
+        attr.name = name;
+        pool->workers[i].thread = Thread_New(&attr);
+    }
+    return pool;
+}
+
+void _ctp_submit(ThreadPool* restrict pool, const _ctp_task* restrict task) {
+    _ctp_worker* w = _ctp_t_worker;
+    if (!w || w->pool != pool) {
+        const size_t index = __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED) % pool->worker_count;
+        w = pool->workers + index;
+    }
+    // Count the task before it becomes visible so queued never dips below zero.
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->submitted, 1, __ATOMIC_RELAXED);
+    _ctp_deque_push_back(&w->deque, task);
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        Mutex_Lock(pool->sleep_mutex);
+        CondVar_Signal(pool->sleep_cond);
+        Mutex_Unlock(pool->sleep_mutex);
+    }
+}
+
+// Run routine(args) on the pool, then callback(result, callback_args) if callback is set.
+void ThreadPool_Post(ThreadPool* restrict pool, ThreadRoutine routine, ThreadArg args, ThreadPoolCallback callback, ThreadArg callback_args) {
+    _ctp_task task = {routine, args, callback, callback_args, NULL};
+    _ctp_submit(pool, &task);
+}
+
+// Run routine(args) on the pool. The future has to be waited on (or polled until done)
+// and disposed by the caller.
+ThreadPoolFuture* ThreadPool_Submit(ThreadPool* restrict pool, ThreadRoutine routine, ThreadArg args) {
+    ThreadPoolFuture* f = (ThreadPoolFuture*)malloc(sizeof(ThreadPoolFuture));
+    f->result = NULL;
+    f->done = false;
+    f->_mutex = Mutex_New();
+    f->_cond = CondVar_New();
+    _ctp_task task = {routine, args, NULL, NULL, f};
+    _ctp_submit(pool, &task);
+    return f;
+}
+
+uint8_t ThreadPoolFuture_IsDone(ThreadPoolFuture* restrict f) {
+    return __atomic_load_n(&f->done, __ATOMIC_ACQUIRE);
+}
+
+// Block until the task finished and return its result.
+ThreadArg ThreadPoolFuture_Wait(ThreadPoolFuture* restrict f) {
+    if (!ThreadPoolFuture_IsDone(f)) {
+        Mutex_Lock(f->_mutex);
+        while (!f->done)
+            CondVar_Wait(f->_cond, f->_mutex);
+        Mutex_Unlock(f->_mutex);
+    }
+    return f->result;
+}
+
+// Destructor for ThreadPoolFuture, waits for the task if it is still running.
+void ThreadPoolFuture_Dispose(ThreadPoolFuture* restrict f) {
+    ThreadPoolFuture_Wait(f);
+    CondVar_Dispose(f->_cond);
+    Mutex_Dispose(f->_mutex);
+    free(f);
+}
+
+void ThreadPool_GetStats(ThreadPool* restrict pool, ThreadPoolStats* restrict stats) {
+    stats->workers = pool->worker_count;
+    stats->queued = __atomic_load_n(&pool->queued, __ATOMIC_RELAXED);
+    stats->submitted = __atomic_load_n(&pool->submitted, __ATOMIC_RELAXED);
+    stats->completed = __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+    stats->stolen = __atomic_load_n(&pool->stolen, __ATOMIC_RELAXED);
+}
+
+// Destructor for ThreadPool. Tasks already submitted still run, nothing may be submitted
+// from now on except by those tasks.
+void ThreadPool_Dispose(ThreadPool* restrict pool) {
+    Mutex_Lock(pool->sleep_mutex);
+    pool->stopping = true;
+    CondVar_Broadcast(pool->sleep_cond);
+    Mutex_Unlock(pool->sleep_mutex);
+    for (size_t i = 0; i < pool->worker_count; ++i) {
+        Thread_Join(pool->workers[i].thread);
+        Thread_Dispose(pool->workers[i].thread);
+    }
+    for (size_t i = 0; i < pool->worker_count; ++i) {
+        free(pool->workers[i].deque.tasks);
+        Mutex_Dispose(pool->workers[i].deque.mutex);
+    }
+    CondVar_Dispose(pool->sleep_cond);
+    Mutex_Dispose(pool->sleep_mutex);
+    free(pool->workers);
+    free(pool);
+}
+
+#endif // CROSSPLATFORM_THREADPOOL_H
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
 
 #define false 0
 #define true 1
@@ -45,6 +46,18 @@
 #endif
 
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#include <sched.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+// Event and Semaphore sleep on the counter itself instead of a mutex and condition variable.
+#define CT_FUTEX
+#endif
 
 // gcc and clang shenanigans.
 #if defined(__clang__) || defined(__GNUC__)
@@ -53,10 +66,152 @@
 
 #endif
 
+// Timeout of the *_Wait functions that never gives up, timeouts are in milliseconds.
+#define CT_INFINITE UINT32_MAX
+
+// Atomics on plain integers and pointers, with C11 memory ordering.
+// Atomic_CompareExchange() takes a pointer to the expected value and updates it on failure.
+// Atomic_Pause() goes in the body of spin loops.
+#if defined(__clang__) || defined(__GNUC__)
+#define CT_RELAXED __ATOMIC_RELAXED
+#define CT_ACQUIRE __ATOMIC_ACQUIRE
+#define CT_RELEASE __ATOMIC_RELEASE
+#define CT_ACQ_REL __ATOMIC_ACQ_REL
+#define CT_SEQ_CST __ATOMIC_SEQ_CST
+
+#define Atomic_Load(ptr, order) __atomic_load_n((ptr), (order))
+#define Atomic_Store(ptr, value, order) __atomic_store_n((ptr), (value), (order))
+#define Atomic_Exchange(ptr, value, order) __atomic_exchange_n((ptr), (value), (order))
+#define Atomic_FetchAdd(ptr, value, order) __atomic_fetch_add((ptr), (value), (order))
+#define Atomic_FetchSub(ptr, value, order) __atomic_fetch_sub((ptr), (value), (order))
+#define Atomic_FetchOr(ptr, value, order) __atomic_fetch_or((ptr), (value), (order))
+#define Atomic_FetchAnd(ptr, value, order) __atomic_fetch_and((ptr), (value), (order))
+#define Atomic_CompareExchange(ptr, expected, desired, order) \
+	__atomic_compare_exchange_n((ptr), (expected), (desired), false, (order), CT_RELAXED)
+#define Atomic_Fence(order) __atomic_thread_fence(order)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define Atomic_Pause() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define Atomic_Pause() __asm__ __volatile__("yield")
+#else
+#define Atomic_Pause() ((void)0)
+#endif
+
+#elif defined(_MSC_VER)
+// x86 and x64 only. Interlocked operations are full barriers and plain loads and stores
+// already have acquire and release semantics there, so the orders only matter for the
+// compiler and seq_cst stores.
+#include <intrin.h>
+
+#define CT_RELAXED 0
+#define CT_ACQUIRE 2
+#define CT_RELEASE 3
+#define CT_ACQ_REL 4
+#define CT_SEQ_CST 5
+
+int64_t _ct_msvc_exchange(volatile void* ptr, const int64_t value, const size_t size) {
+	if (size == 8)
+		return _InterlockedExchange64((volatile __int64*)ptr, value);
+	return _InterlockedExchange((volatile long*)ptr, (long)value);
+}
+
+int64_t _ct_msvc_fetch_add(volatile void* ptr, const int64_t value, const size_t size) {
+	if (size == 8)
+		return _InterlockedExchangeAdd64((volatile __int64*)ptr, value);
+	return _InterlockedExchangeAdd((volatile long*)ptr, (long)value);
+}
+
+int64_t _ct_msvc_fetch_or(volatile void* ptr, const int64_t value, const size_t size) {
+	if (size == 8)
+		return _InterlockedOr64((volatile __int64*)ptr, value);
+	return _InterlockedOr((volatile long*)ptr, (long)value);
+}
+
+int64_t _ct_msvc_fetch_and(volatile void* ptr, const int64_t value, const size_t size) {
+	if (size == 8)
+		return _InterlockedAnd64((volatile __int64*)ptr, value);
+	return _InterlockedAnd((volatile long*)ptr, (long)value);
+}
+
+uint8_t _ct_msvc_compare_exchange(volatile void* ptr, void* expected, const int64_t desired, const size_t size) {
+	if (size == 8) {
+		const __int64 old = _InterlockedCompareExchange64((volatile __int64*)ptr, desired, *(__int64*)expected);
+		if (old == *(__int64*)expected)
+			return true;
+		*(__int64*)expected = old;
+		return false;
+	}
+	const long old = _InterlockedCompareExchange((volatile long*)ptr, (long)desired, *(long*)expected);
+	if (old == *(long*)expected)
+		return true;
+	*(long*)expected = old;
+	return false;
+}
+
+#define Atomic_Load(ptr, order) (_ReadWriteBarrier(), *(volatile __typeof__(*(ptr))*)(ptr))
+#define Atomic_Store(ptr, value, order) \
+	((order) == CT_SEQ_CST ? (void)_ct_msvc_exchange((ptr), (int64_t)(value), sizeof(*(ptr))) \
+	                       : (void)(_ReadWriteBarrier(), *(volatile __typeof__(*(ptr))*)(ptr) = (value)))
+#define Atomic_Exchange(ptr, value, order) _ct_msvc_exchange((ptr), (int64_t)(value), sizeof(*(ptr)))
+#define Atomic_FetchAdd(ptr, value, order) _ct_msvc_fetch_add((ptr), (int64_t)(value), sizeof(*(ptr)))
+#define Atomic_FetchSub(ptr, value, order) _ct_msvc_fetch_add((ptr), -(int64_t)(value), sizeof(*(ptr)))
+#define Atomic_FetchOr(ptr, value, order) _ct_msvc_fetch_or((ptr), (int64_t)(value), sizeof(*(ptr)))
+#define Atomic_FetchAnd(ptr, value, order) _ct_msvc_fetch_and((ptr), (int64_t)(value), sizeof(*(ptr)))
+#define Atomic_CompareExchange(ptr, expected, desired, order) \
+	_ct_msvc_compare_exchange((ptr), (expected), (int64_t)(desired), sizeof(*(ptr)))
+#define Atomic_Fence(order) ((order) == CT_SEQ_CST ? MemoryBarrier() : _ReadWriteBarrier())
+#define Atomic_Pause() _mm_pause()
+#endif
+
+// Milliseconds on a clock that never jumps.
+uint64_t _ct_now_ms() {
+#ifdef CT_PLATFORM_NT
+	return (uint64_t)GetTickCount64();
+#elif defined(CT_PLATFORM_UNIX)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+uint64_t _ct_deadline(const uint32_t timeout_ms) {
+	return (timeout_ms == CT_INFINITE) ? UINT64_MAX : _ct_now_ms() + timeout_ms;
+}
+
+// Time left until deadline into *remaining_ms, false once it passed.
+uint8_t _ct_remaining(const uint64_t deadline, uint32_t* restrict remaining_ms) {
+	if (deadline == UINT64_MAX) {
+		*remaining_ms = CT_INFINITE;
+		return true;
+	}
+	const uint64_t now = _ct_now_ms();
+	if (now >= deadline)
+		return false;
+	*remaining_ms = (uint32_t)(deadline - now);
+	return true;
+}
+
+#ifdef CT_FUTEX
+// Sleep while *addr is expected, for at most timeout_ms. Returns false on timeout, wake
+// ups can be spurious.
+uint8_t _ct_futex_wait(uint32_t* restrict addr, const uint32_t expected, const uint32_t timeout_ms) {
+	struct timespec ts = {(time_t)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000000};
+	const long res = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, (timeout_ms == CT_INFINITE) ? NULL : &ts, NULL, 0);
+	return !(res == -1 && errno == ETIMEDOUT);
+}
+
+void _ct_futex_wake(uint32_t* restrict addr, const int32_t count) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#endif
+
 // Enum representing operation result when working with a Mutex.
 typedef enum _cs_mutex_result {
 	MutexResult_Success,
-	MutexResult_Error
+	MutexResult_Error,
+	MutexResult_Busy,   // Mutex_TryLock() found the mutex locked.
+	MutexResult_Timeout // A timed wait gave up.
 } MutexResult;
 
 // Mutex struct.
@@ -66,11 +221,13 @@ typedef struct _ct_mutex {
 #elif defined(CT_PLATFORM_UNIX)
 	pthread_mutex_t _native_mutex;
 #endif
+	uint32_t _spin_count;
 } Mutex;
 
 // Constructor for Mutex.
 Mutex* Mutex_New() {
 	Mutex* mut = (Mutex*)malloc(sizeof(Mutex));
+	mut->_spin_count = 0;
 #ifdef CT_PLATFORM_NT
 	mut->_native_mutex = CreateMutex(NULL, FALSE, NULL);
 	if (!mut->_native_mutex) {
@@ -90,8 +247,38 @@ Mutex* Mutex_New() {
 	return mut;
 }
 
+// Constructor for a Mutex that tries spin_count times to get the lock before the thread
+// goes to sleep. Pays off for short critical sections under contention, where the owner
+// is likely done before sleeping and being woken again would be.
+Mutex* Mutex_NewAdaptive(const uint32_t spin_count) {
+	Mutex* mut = Mutex_New();
+	if (mut)
+		mut->_spin_count = spin_count;
+	return mut;
+}
+
+// Lock the mutex if it is free, MutexResult_Busy if it is not.
+MutexResult Mutex_TryLock(Mutex* restrict m) {
+#ifdef CT_PLATFORM_NT
+	const uint32_t ret = WaitForSingleObject(m->_native_mutex, 0);
+	if (ret == WAIT_OBJECT_0)
+		return MutexResult_Success;
+	return (ret == WAIT_TIMEOUT) ? MutexResult_Busy : MutexResult_Error;
+#elif defined(CT_PLATFORM_UNIX)
+	const int32_t ret = pthread_mutex_trylock(&m->_native_mutex);
+	if (!ret)
+		return MutexResult_Success;
+	return (ret == EBUSY) ? MutexResult_Busy : MutexResult_Error;
+#endif
+}
+
 // Try and lock the mutex and return the operation result.
 MutexResult Mutex_Lock(Mutex* restrict m) {
+	for (uint32_t i = 0; i < m->_spin_count; ++i) {
+		if (Mutex_TryLock(m) == MutexResult_Success)
+			return MutexResult_Success;
+		Atomic_Pause();
+	}
 #ifdef CT_PLATFORM_NT
 	uint32_t ret = WaitForSingleObject(m->_native_mutex, INFINITE);
 #elif defined(CT_PLATFORM_UNIX)
@@ -128,6 +315,447 @@ void Mutex_Dispose(Mutex* restrict m) {
 	free(m);
 }
 
+// Condition variable, always used together with a locked Mutex.
+typedef struct _ct_condvar {
+#ifdef CT_PLATFORM_NT
+	// Mutex is a kernel object on Windows which native condition variables can't wait on,
+	// so waiters park on a semaphore instead. Signal with the mutex held.
+	HANDLE _native_semaphore;
+	long _waiters;
+#elif defined(CT_PLATFORM_UNIX)
+	pthread_cond_t _native_cond;
+#endif
+} CondVar;
+
+// Constructor for CondVar.
+CondVar* CondVar_New() {
+	CondVar* cv = (CondVar*)malloc(sizeof(CondVar));
+#ifdef CT_PLATFORM_NT
+	cv->_waiters = 0;
+	cv->_native_semaphore = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+	if (!cv->_native_semaphore) {
+		fputs("CS_Threads: Condition variable creation failed.\n", stderr);
+		free(cv);
+		return NULL;
+	}
+#elif defined(CT_PLATFORM_UNIX)
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+#ifdef __linux__
+	// Timed waits measure against a clock that does not jump with the wall clock.
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+	const int32_t ret = pthread_cond_init(&cv->_native_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ret != 0) {
+		fputs("CS_Threads: Condition variable creation failed.\n", stderr);
+		perror("native error");
+		free(cv);
+		return NULL;
+	}
+#endif
+	return cv;
+}
+
+// Atomically unlock m and sleep until signaled, m is locked again on return.
+// Wake ups can be spurious, always wait in a loop checking the actual condition.
+MutexResult CondVar_Wait(CondVar* restrict cv, Mutex* restrict m) {
+#ifdef CT_PLATFORM_NT
+	++cv->_waiters;
+	SignalObjectAndWait(m->_native_mutex, cv->_native_semaphore, INFINITE, FALSE);
+	return Mutex_Lock(m);
+#elif defined(CT_PLATFORM_UNIX)
+	if (pthread_cond_wait(&cv->_native_cond, &m->_native_mutex) != 0)
+		return MutexResult_Error;
+	return MutexResult_Success;
+#endif
+}
+
+// Like CondVar_Wait() but gives up after timeout_ms with MutexResult_Timeout, m is locked
+// again either way.
+MutexResult CondVar_TimedWait(CondVar* restrict cv, Mutex* restrict m, const uint32_t timeout_ms) {
+	if (timeout_ms == CT_INFINITE)
+		return CondVar_Wait(cv, m);
+#ifdef CT_PLATFORM_NT
+	++cv->_waiters;
+	const DWORD ret = SignalObjectAndWait(m->_native_mutex, cv->_native_semaphore, timeout_ms, FALSE);
+	if (Mutex_Lock(m) != MutexResult_Success)
+		return MutexResult_Error;
+	if (ret == WAIT_OBJECT_0)
+		return MutexResult_Success;
+	// A signal may have counted us out after the timeout, then its wake up is ours to take.
+	if (WaitForSingleObject(cv->_native_semaphore, 0) == WAIT_OBJECT_0)
+		return MutexResult_Success;
+	--cv->_waiters;
+	return MutexResult_Timeout;
+#elif defined(__APPLE__)
+	struct timespec relative = {(time_t)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000000};
+	const int32_t ret = pthread_cond_timedwait_relative_np(&cv->_native_cond, &m->_native_mutex, &relative);
+#elif defined(CT_PLATFORM_UNIX)
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000;
+	}
+	const int32_t ret = pthread_cond_timedwait(&cv->_native_cond, &m->_native_mutex, &deadline);
+#endif
+#ifdef CT_PLATFORM_UNIX
+	if (ret == ETIMEDOUT)
+		return MutexResult_Timeout;
+	return (ret == 0) ? MutexResult_Success : MutexResult_Error;
+#endif
+}
+
+// Wake up one waiter.
+void CondVar_Signal(CondVar* restrict cv) {
+#ifdef CT_PLATFORM_NT
+	if (cv->_waiters > 0) {
+		--cv->_waiters;
+		ReleaseSemaphore(cv->_native_semaphore, 1, NULL);
+	}
+#elif defined(CT_PLATFORM_UNIX)
+	pthread_cond_signal(&cv->_native_cond);
+#endif
+}
+
+// Wake up all waiters.
+void CondVar_Broadcast(CondVar* restrict cv) {
+#ifdef CT_PLATFORM_NT
+	if (cv->_waiters > 0) {
+		ReleaseSemaphore(cv->_native_semaphore, cv->_waiters, NULL);
+		cv->_waiters = 0;
+	}
+#elif defined(CT_PLATFORM_UNIX)
+	pthread_cond_broadcast(&cv->_native_cond);
+#endif
+}
+
+// Destructor for CondVar.
+void CondVar_Dispose(CondVar* restrict cv) {
+#ifdef CT_PLATFORM_NT
+	CloseHandle(cv->_native_semaphore);
+#elif defined(CT_PLATFORM_UNIX)
+	pthread_cond_destroy(&cv->_native_cond);
+#endif
+	free(cv);
+}
+
+// Lock that any number of readers can hold at once, or a single writer.
+// Waiting writers keep new readers out where the platform allows it, so a steady stream
+// of readers does not starve them.
+typedef struct _ct_rwlock {
+#ifdef CT_PLATFORM_NT
+	SRWLOCK _native_lock;
+#elif defined(CT_PLATFORM_UNIX)
+	pthread_rwlock_t _native_lock;
+#endif
+} RWLock;
+
+// Constructor for RWLock.
+RWLock* RWLock_New() {
+	RWLock* l = (RWLock*)malloc(sizeof(RWLock));
+#ifdef CT_PLATFORM_NT
+	InitializeSRWLock(&l->_native_lock);
+#elif defined(CT_PLATFORM_UNIX)
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#if defined(__linux__) && defined(_GNU_SOURCE)
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	const int32_t ret = pthread_rwlock_init(&l->_native_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	if (ret != 0) {
+		fputs("CS_Threads: Read-write lock creation failed.\n", stderr);
+		free(l);
+		return NULL;
+	}
+#endif
+	return l;
+}
+
+MutexResult RWLock_ReadLock(RWLock* restrict l) {
+#ifdef CT_PLATFORM_NT
+	AcquireSRWLockShared(&l->_native_lock);
+	return MutexResult_Success;
+#elif defined(CT_PLATFORM_UNIX)
+	return (pthread_rwlock_rdlock(&l->_native_lock) == 0) ? MutexResult_Success : MutexResult_Error;
+#endif
+}
+
+MutexResult RWLock_ReadUnlock(RWLock* restrict l) {
+#ifdef CT_PLATFORM_NT
+	ReleaseSRWLockShared(&l->_native_lock);
+	return MutexResult_Success;
+#elif defined(CT_PLATFORM_UNIX)
+	return (pthread_rwlock_unlock(&l->_native_lock) == 0) ? MutexResult_Success : MutexResult_Error;
+#endif
+}
+
+MutexResult RWLock_WriteLock(RWLock* restrict l) {
+#ifdef CT_PLATFORM_NT
+	AcquireSRWLockExclusive(&l->_native_lock);
+	return MutexResult_Success;
+#elif defined(CT_PLATFORM_UNIX)
+	return (pthread_rwlock_wrlock(&l->_native_lock) == 0) ? MutexResult_Success : MutexResult_Error;
+#endif
+}
+
+MutexResult RWLock_WriteUnlock(RWLock* restrict l) {
+#ifdef CT_PLATFORM_NT
+	ReleaseSRWLockExclusive(&l->_native_lock);
+	return MutexResult_Success;
+#elif defined(CT_PLATFORM_UNIX)
+	return (pthread_rwlock_unlock(&l->_native_lock) == 0) ? MutexResult_Success : MutexResult_Error;
+#endif
+}
+
+// Destructor for RWLock.
+void RWLock_Dispose(RWLock* restrict l) {
+#ifdef CT_PLATFORM_UNIX
+	pthread_rwlock_destroy(&l->_native_lock);
+#endif
+	free(l);
+}
+
+// Flag threads can wait on until another thread sets it.
+// A manual reset event stays set and lets every waiter through until Event_Reset(), an
+// auto reset event lets exactly one waiter through per Event_Set() and is clear again after.
+// Setting an event nobody waits on costs a single atomic exchange.
+typedef struct _ct_event {
+#ifdef CT_PLATFORM_NT
+	HANDLE _native_event;
+#elif defined(CT_FUTEX)
+	uint32_t _state; // 1 while set, the futex word.
+	uint32_t _waiters;
+	uint8_t _manual_reset;
+#elif defined(CT_PLATFORM_UNIX)
+	uint32_t _state;
+	uint8_t _manual_reset;
+	Mutex* _mutex;
+	CondVar* _cond;
+#endif
+} Event;
+
+// Constructor for Event, initially clear.
+Event* Event_New(const uint8_t manual_reset) {
+	Event* e = (Event*)malloc(sizeof(Event));
+#ifdef CT_PLATFORM_NT
+	e->_native_event = CreateEvent(NULL, manual_reset ? TRUE : FALSE, FALSE, NULL);
+	if (!e->_native_event) {
+		fputs("CS_Threads: Event creation failed.\n", stderr);
+		free(e);
+		return NULL;
+	}
+#elif defined(CT_FUTEX)
+	e->_state = 0;
+	e->_waiters = 0;
+	e->_manual_reset = manual_reset;
+#elif defined(CT_PLATFORM_UNIX)
+	e->_state = 0;
+	e->_manual_reset = manual_reset;
+	e->_mutex = Mutex_New();
+	e->_cond = CondVar_New();
+#endif
+	return e;
+}
+
+void Event_Set(Event* restrict e) {
+#ifdef CT_PLATFORM_NT
+	SetEvent(e->_native_event);
+#elif defined(CT_FUTEX)
+	// Waiters count themselves before their last look at the state, so either they see it
+	// set or we see them.
+	if (Atomic_Exchange(&e->_state, 1, CT_SEQ_CST) == 0 && Atomic_Load(&e->_waiters, CT_SEQ_CST) > 0)
+		_ct_futex_wake(&e->_state, (e->_manual_reset) ? INT32_MAX : 1);
+#elif defined(CT_PLATFORM_UNIX)
+	Mutex_Lock(e->_mutex);
+	e->_state = 1;
+	if (e->_manual_reset)
+		CondVar_Broadcast(e->_cond);
+	else
+		CondVar_Signal(e->_cond);
+	Mutex_Unlock(e->_mutex);
+#endif
+}
+
+void Event_Reset(Event* restrict e) {
+#ifdef CT_PLATFORM_NT
+	ResetEvent(e->_native_event);
+#elif defined(CT_FUTEX)
+	Atomic_Store(&e->_state, 0, CT_RELEASE);
+#elif defined(CT_PLATFORM_UNIX)
+	Mutex_Lock(e->_mutex);
+	e->_state = 0;
+	Mutex_Unlock(e->_mutex);
+#endif
+}
+
+// Wait up to timeout_ms (CT_INFINITE for no limit) for the event to be set.
+// Returns MutexResult_Timeout if it was not.
+MutexResult Event_Wait(Event* restrict e, const uint32_t timeout_ms) {
+#ifdef CT_PLATFORM_NT
+	const DWORD ret = WaitForSingleObject(e->_native_event, (timeout_ms == CT_INFINITE) ? INFINITE : timeout_ms);
+	if (ret == WAIT_OBJECT_0)
+		return MutexResult_Success;
+	return (ret == WAIT_TIMEOUT) ? MutexResult_Timeout : MutexResult_Error;
+#elif defined(CT_FUTEX)
+	const uint64_t deadline = _ct_deadline(timeout_ms);
+	for (;;) {
+		if (e->_manual_reset) {
+			if (Atomic_Load(&e->_state, CT_ACQUIRE))
+				return MutexResult_Success;
+		} else {
+			uint32_t expected = 1;
+			if (Atomic_CompareExchange(&e->_state, &expected, 0, CT_ACQUIRE))
+				return MutexResult_Success;
+		}
+		uint32_t remaining_ms;
+		if (!_ct_remaining(deadline, &remaining_ms))
+			return MutexResult_Timeout;
+		Atomic_FetchAdd(&e->_waiters, 1, CT_SEQ_CST);
+		_ct_futex_wait(&e->_state, 0, remaining_ms);
+		Atomic_FetchSub(&e->_waiters, 1, CT_RELAXED);
+	}
+#elif defined(CT_PLATFORM_UNIX)
+	const uint64_t deadline = _ct_deadline(timeout_ms);
+	MutexResult res = MutexResult_Success;
+	Mutex_Lock(e->_mutex);
+	while (!e->_state) {
+		uint32_t remaining_ms;
+		if (!_ct_remaining(deadline, &remaining_ms)) {
+			res = MutexResult_Timeout;
+			break;
+		}
+		CondVar_TimedWait(e->_cond, e->_mutex, remaining_ms);
+	}
+	if (res == MutexResult_Success && !e->_manual_reset)
+		e->_state = 0;
+	Mutex_Unlock(e->_mutex);
+	return res;
+#endif
+}
+
+// Destructor for Event.
+void Event_Dispose(Event* restrict e) {
+#ifdef CT_PLATFORM_NT
+	CloseHandle(e->_native_event);
+#elif defined(CT_PLATFORM_UNIX) && !defined(CT_FUTEX)
+	CondVar_Dispose(e->_cond);
+	Mutex_Dispose(e->_mutex);
+#endif
+	free(e);
+}
+
+// Counting semaphore. Like Event, posting to one nobody waits on never enters the kernel.
+typedef struct _ct_semaphore {
+#ifdef CT_PLATFORM_NT
+	HANDLE _native_semaphore;
+#elif defined(CT_FUTEX)
+	uint32_t _count; // The futex word.
+	uint32_t _waiters;
+#elif defined(CT_PLATFORM_UNIX)
+	uint32_t _count;
+	Mutex* _mutex;
+	CondVar* _cond;
+#endif
+} Semaphore;
+
+// Constructor for Semaphore.
+Semaphore* Semaphore_New(const uint32_t initial_count) {
+	Semaphore* sem = (Semaphore*)malloc(sizeof(Semaphore));
+#ifdef CT_PLATFORM_NT
+	sem->_native_semaphore = CreateSemaphore(NULL, (LONG)initial_count, LONG_MAX, NULL);
+	if (!sem->_native_semaphore) {
+		fputs("CS_Threads: Semaphore creation failed.\n", stderr);
+		free(sem);
+		return NULL;
+	}
+#elif defined(CT_FUTEX)
+	sem->_count = initial_count;
+	sem->_waiters = 0;
+#elif defined(CT_PLATFORM_UNIX)
+	sem->_count = initial_count;
+	sem->_mutex = Mutex_New();
+	sem->_cond = CondVar_New();
+#endif
+	return sem;
+}
+
+// Add count to the semaphore, letting as many waiters through.
+void Semaphore_Post(Semaphore* restrict sem, const uint32_t count) {
+#ifdef CT_PLATFORM_NT
+	ReleaseSemaphore(sem->_native_semaphore, (LONG)count, NULL);
+#elif defined(CT_FUTEX)
+	Atomic_FetchAdd(&sem->_count, count, CT_SEQ_CST);
+	if (Atomic_Load(&sem->_waiters, CT_SEQ_CST) > 0)
+		_ct_futex_wake(&sem->_count, (count < INT32_MAX) ? (int32_t)count : INT32_MAX);
+#elif defined(CT_PLATFORM_UNIX)
+	Mutex_Lock(sem->_mutex);
+	sem->_count += count;
+	if (count == 1)
+		CondVar_Signal(sem->_cond);
+	else
+		CondVar_Broadcast(sem->_cond);
+	Mutex_Unlock(sem->_mutex);
+#endif
+}
+
+// Take one from the semaphore, waiting up to timeout_ms (CT_INFINITE for no limit, 0 to
+// only try) for it to become positive. Returns MutexResult_Timeout if it did not.
+MutexResult Semaphore_Wait(Semaphore* restrict sem, const uint32_t timeout_ms) {
+#ifdef CT_PLATFORM_NT
+	const DWORD ret = WaitForSingleObject(sem->_native_semaphore, (timeout_ms == CT_INFINITE) ? INFINITE : timeout_ms);
+	if (ret == WAIT_OBJECT_0)
+		return MutexResult_Success;
+	return (ret == WAIT_TIMEOUT) ? MutexResult_Timeout : MutexResult_Error;
+#elif defined(CT_FUTEX)
+	const uint64_t deadline = _ct_deadline(timeout_ms);
+	for (;;) {
+		uint32_t count = Atomic_Load(&sem->_count, CT_RELAXED);
+		while (count > 0) {
+			if (Atomic_CompareExchange(&sem->_count, &count, count - 1, CT_ACQUIRE))
+				return MutexResult_Success;
+		}
+		uint32_t remaining_ms;
+		if (!_ct_remaining(deadline, &remaining_ms))
+			return MutexResult_Timeout;
+		Atomic_FetchAdd(&sem->_waiters, 1, CT_SEQ_CST);
+		_ct_futex_wait(&sem->_count, 0, remaining_ms);
+		Atomic_FetchSub(&sem->_waiters, 1, CT_RELAXED);
+	}
+#elif defined(CT_PLATFORM_UNIX)
+	const uint64_t deadline = _ct_deadline(timeout_ms);
+	MutexResult res = MutexResult_Success;
+	Mutex_Lock(sem->_mutex);
+	while (sem->_count == 0) {
+		uint32_t remaining_ms;
+		if (!_ct_remaining(deadline, &remaining_ms)) {
+			res = MutexResult_Timeout;
+			break;
+		}
+		CondVar_TimedWait(sem->_cond, sem->_mutex, remaining_ms);
+	}
+	if (res == MutexResult_Success)
+		--sem->_count;
+	Mutex_Unlock(sem->_mutex);
+	return res;
+#endif
+}
+
+// Destructor for Semaphore.
+void Semaphore_Dispose(Semaphore* restrict sem) {
+#ifdef CT_PLATFORM_NT
+	CloseHandle(sem->_native_semaphore);
+#elif defined(CT_PLATFORM_UNIX) && !defined(CT_FUTEX)
+	CondVar_Dispose(sem->_cond);
+	Mutex_Dispose(sem->_mutex);
+#endif
+	free(sem);
+}
+
 // Enum representing if a thread is attached or detached.
 // Attached meaning the thread should be disposed by the main thread
 // otherwise the thread manages itself.
@@ -142,17 +770,101 @@ typedef enum _ct_thread_result {
 	ThreadResult_Error
 } ThreadResult;
 
+#define CT_MAX_CPUS 1024
+// Longest thread name kept, including the terminator (the Linux limit).
+#define CT_THREAD_NAME_MAX 16
+
+// Set of CPUs a thread may run on.
+typedef struct _ct_cpu_set {
+	uint64_t bits[CT_MAX_CPUS / 64];
+} CpuSet;
+
+void CpuSet_Zero(CpuSet* restrict set) {
+	for (size_t i = 0; i < CT_MAX_CPUS / 64; ++i)
+		set->bits[i] = 0;
+}
+
+void CpuSet_Add(CpuSet* restrict set, const uint32_t cpu) {
+	if (cpu < CT_MAX_CPUS)
+		set->bits[cpu / 64] |= 1ull << (cpu % 64);
+}
+
+uint8_t CpuSet_Contains(const CpuSet* restrict set, const uint32_t cpu) {
+	return cpu < CT_MAX_CPUS && (set->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+// Number of CPUs online, at least 1.
+uint32_t Thread_CpuCount() {
+#ifdef CT_PLATFORM_NT
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (info.dwNumberOfProcessors > 0) ? (uint32_t)info.dwNumberOfProcessors : 1;
+#elif defined(CT_PLATFORM_UNIX)
+	const long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0) ? (uint32_t)count : 1;
+#endif
+}
+
+// CPU the calling thread is running on right now, -1 where the OS does not tell.
+int32_t Thread_CurrentCpu() {
+#ifdef CT_PLATFORM_NT
+	return (int32_t)GetCurrentProcessorNumber();
+#elif defined(__linux__) && defined(_GNU_SOURCE)
+	return sched_getcpu();
+#else
+	return -1;
+#endif
+}
+
+// Restrict the calling thread to the CPUs in set. Windows only honours the first 64 CPUs,
+// macOS has no affinity at all (ThreadResult_Error).
+ThreadResult Thread_SetCurrentAffinity(const CpuSet* restrict set) {
+#ifdef CT_PLATFORM_NT
+	return (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)set->bits[0]) != 0) ? ThreadResult_Success : ThreadResult_Error;
+#elif defined(__linux__) && defined(_GNU_SOURCE)
+	cpu_set_t native_set;
+	CPU_ZERO(&native_set);
+	for (uint32_t cpu = 0; cpu < CT_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+		if (CpuSet_Contains(set, cpu))
+			CPU_SET(cpu, &native_set);
+	}
+	return (pthread_setaffinity_np(pthread_self(), sizeof(native_set), &native_set) == 0) ? ThreadResult_Success : ThreadResult_Error;
+#else
+	return ThreadResult_Error;
+#endif
+}
+
+// Name the calling thread for debuggers, top -H and the like. Names longer than
+// CT_THREAD_NAME_MAX - 1 characters are cut.
+ThreadResult Thread_SetCurrentName(const char* restrict name) {
+	char short_name[CT_THREAD_NAME_MAX];
+	snprintf(short_name, sizeof(short_name), "%s", name);
+#if defined(__linux__) && defined(_GNU_SOURCE)
+	return (pthread_setname_np(pthread_self(), short_name) == 0) ? ThreadResult_Success : ThreadResult_Error;
+#elif defined(__APPLE__)
+	return (pthread_setname_np(short_name) == 0) ? ThreadResult_Success : ThreadResult_Error;
+#else
+	return ThreadResult_Error;
+#endif
+}
+
 typedef unsigned long ThreadID;
 typedef void* ThreadArg;
 typedef ThreadArg (*ThreadRoutine)(ThreadArg);
 
 // Struct representing thread attributes such as the initial stack size,
 // the routine to execute, arguments to pass and detached state.
+// initial_stack_size: Stack size in bytes, 0 for the platform default.
+// cpus: CPUs the thread is pinned to, NULL to run anywhere.
+// name: Thread name (see Thread_SetCurrentName()), NULL to leave it unnamed.
+// Both are copied, they only have to live until Thread_New() returns.
 typedef struct _ct_thread_attributes {
 	size_t initial_stack_size;
 	ThreadRoutine routine;
 	ThreadArg args;
 	uint8_t detached;
+	const CpuSet* cpus;
+	const char* name;
 } ThreadAttributes;
 
 // Our main Thread object.
@@ -174,6 +886,9 @@ struct _ct_thread_routine_info {
 	ThreadRoutine routine;
 	ThreadArg args_ptr;
 	Thread* owner;
+	uint8_t pinned;
+	CpuSet cpus;
+	char name[CT_THREAD_NAME_MAX];
 };
 
 // Forward declare Thread_Dispose() for the bootstrap function.
@@ -198,9 +913,17 @@ stdcall
 _ct_thread_routine_bootstrap
 (void* restrict args) {
 	struct _ct_thread_routine_info* info = (struct _ct_thread_routine_info*)args;
+	// The thread places itself, that works the same with pthreads and WinThreads.
+	if (info->pinned)
+		Thread_SetCurrentAffinity(&info->cpus);
+	if (info->name[0])
+		Thread_SetCurrentName(info->name);
 	ThreadArg result = info->routine(info->args_ptr);
-    if (info->owner->_detached)
+	// A joinable thread's owner lives until it is joined, a detached one's goes with it.
+	if (info->owner->_detached)
 		Thread_Dispose(info->owner);
+	else
+		info->owner->result_ptr = result;
 	free(info);
 #ifdef CT_PLATFORM_NT
 	return 0;
@@ -222,13 +945,18 @@ Thread* Thread_New(ThreadAttributes* restrict attribs) {
 	info->owner = thd;
 	info->routine = attribs->routine;
 	info->args_ptr = attribs->args;
+	info->pinned = attribs->cpus != NULL;
+	if (attribs->cpus)
+		info->cpus = *attribs->cpus;
+	snprintf(info->name, sizeof(info->name), "%s", (attribs->name) ? attribs->name : "");
 #ifdef CT_PLATFORM_NT
 	thd->_native_thread = CreateThread(
 		NULL, 
 		attribs->initial_stack_size, 
 		_ct_thread_routine_bootstrap, 
 		(void*)info,
-		0,
+		// Reserve initial_stack_size instead of only committing that much up front.
+		(attribs->initial_stack_size > 0) ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0,
 		&thd->id
 	);
 
@@ -242,17 +970,32 @@ Thread* Thread_New(ThreadAttributes* restrict attribs) {
 	pthread_attr_t attr;
 
 	pthread_attr_init(&attr);
-	pthread_attr_setstacksize(&attr, attribs->initial_stack_size);
+	// 0 keeps the platform default (usually 8 MB). Anything else is rounded up to whole
+	// pages and the minimum the platform allows, and gets a guard page below it so an
+	// overflow faults instead of running into the next thread's stack.
+	if (attribs->initial_stack_size > 0) {
+		const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+		size_t stack_size = (attribs->initial_stack_size + page_size - 1) / page_size * page_size;
+		if (stack_size < (size_t)PTHREAD_STACK_MIN)
+			stack_size = (size_t)PTHREAD_STACK_MIN;
+		pthread_attr_setstacksize(&attr, stack_size);
+		pthread_attr_setguardsize(&attr, page_size);
+	}
 
 	// WinThreads doesn't have this idea of having a detached thread, or you could say
 	// by default threads on Windows are already detached.
 	if (attribs->detached)
 		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-	pthread_create(&thd->_native_thread, &attr, &_ct_thread_routine_bootstrap, (void*)info);
-	thd->id = (ThreadID)thd->_native_thread;
-
+	const int res = pthread_create(&thd->_native_thread, &attr, &_ct_thread_routine_bootstrap, (void*)info);
 	pthread_attr_destroy(&attr);
+	if (res != 0) {
+		fputs("CS_Threads: Native thread creation failed.\n", stderr);
+		free(thd);
+		free(info);
+		return NULL;
+	}
+	thd->id = (ThreadID)thd->_native_thread;
 #endif
 	return thd;
 }
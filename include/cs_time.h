@@ -0,0 +1,51 @@
+#ifndef CROSSPLATFORM_TIME_H
+#define CROSSPLATFORM_TIME_H
+
+// Cross-platform Time
+// Monotonic clock for measuring intervals (throughput, latency, timeouts).
+// Never use it for wall-clock time, the epoch is unspecified.
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#define CTM_PLATFORM_NT
+
+#define WIN32_MEAN_AND_LEAN
+#include <windows.h>
+
+#elif defined(__linux__) || defined(__APPLE__)
+#define CTM_PLATFORM_UNIX
+
+#include <time.h>
+#endif
+
+#define CTM_NS_PER_US 1000ull
+#define CTM_NS_PER_MS 1000000ull
+#define CTM_NS_PER_SEC 1000000000ull
+
+// Nanoseconds elapsed since an unspecified point in the past.
+uint64_t Time_NowNs() {
+#ifdef CTM_PLATFORM_NT
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * (double)CTM_NS_PER_SEC / (double)freq.QuadPart);
+#elif defined(CTM_PLATFORM_UNIX)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * CTM_NS_PER_SEC + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Put the calling thread to sleep for at least ms milliseconds.
+void Time_SleepMs(const uint32_t ms) {
+#ifdef CTM_PLATFORM_NT
+    Sleep(ms);
+#elif defined(CTM_PLATFORM_UNIX)
+    struct timespec ts = {(time_t)(ms / 1000), (long)(ms % 1000) * (long)CTM_NS_PER_MS};
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+#endif
+}
+
+#endif // CROSSPLATFORM_TIME_H
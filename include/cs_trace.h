@@ -0,0 +1,207 @@
+#ifndef CROSSPLATFORM_TRACE_H
+#define CROSSPLATFORM_TRACE_H
+
+// Span tracing into per-thread rings, exported as Chrome trace_event JSON
+// (chrome://tracing, Perfetto). POSIX only.
+//
+// Built without CS_TRACE the TRACE_* macros expand to nothing. Built with it but not
+// enabled at runtime (Trace_Enable) every span costs a single branch.
+//
+//     TRACE_BEGIN(read);
+//     File_ReadAt(...);
+//     TRACE_END(read, "file_read");
+//
+// Every thread owns a ring of the last CTR_RING_EVENTS spans and is its only writer, so
+// recording takes no lock. Dumping reads the rings concurrently and drops whatever may
+// have been overwritten while it was reading.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cs_time.h"
+
+#define CTR_RING_EVENTS 8192
+#define CTR_MAX_RINGS 4096
+
+typedef struct _ctr_event {
+    const char* name; // Must be a string literal or otherwise outlive the trace.
+    uint64_t start_ns;
+    uint64_t duration_ns;
+} TraceEvent;
+
+typedef struct _ctr_ring {
+    TraceEvent events[CTR_RING_EVENTS];
+    uint64_t head;   // Events ever written, the next one goes to head % CTR_RING_EVENTS.
+    uint32_t tid;
+    uint8_t in_use;  // Owned by a live thread, rings of exited threads are handed out again.
+} TraceRing;
+
+static volatile uint8_t _ctr_g_enabled = 0;
+static TraceRing* _ctr_g_rings[CTR_MAX_RINGS];
+static uint32_t _ctr_g_ring_count = 0;
+static uint32_t _ctr_g_next_tid = 1;
+static pthread_mutex_t _ctr_g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t _ctr_g_key;
+static pthread_once_t _ctr_g_key_once = PTHREAD_ONCE_INIT;
+static __thread TraceRing* _ctr_t_ring = NULL;
+static const char* _ctr_g_dump_path = NULL;
+static int _ctr_g_dump_signal = 0;
+
+void _ctr_release_ring(void* ring) {
+    __atomic_store_n(&((TraceRing*)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void _ctr_create_key() {
+    pthread_key_create(&_ctr_g_key, _ctr_release_ring);
+}
+
+// Slow path, once per thread: reuse the ring of an exited thread or register a new one.
+TraceRing* _ctr_thread_ring() {
+    pthread_once(&_ctr_g_key_once, _ctr_create_key);
+    TraceRing* ring = NULL;
+
+    pthread_mutex_lock(&_ctr_g_mutex);
+    for (uint32_t i = 0; i < _ctr_g_ring_count && !ring; ++i) {
+        if (!__atomic_load_n(&_ctr_g_rings[i]->in_use, __ATOMIC_ACQUIRE))
+            ring = _ctr_g_rings[i];
+    }
+    if (!ring && _ctr_g_ring_count < CTR_MAX_RINGS) {
+        ring = (TraceRing*)calloc(1, sizeof(TraceRing));
+        if (ring)
+            _ctr_g_rings[_ctr_g_ring_count++] = ring;
+    }
+    if (ring) {
+        // The old owner's spans stay in the ring until overwritten, under the new tid.
+        ring->tid = _ctr_g_next_tid++;
+        __atomic_store_n(&ring->in_use, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&_ctr_g_mutex);
+
+    if (ring)
+        pthread_setspecific(_ctr_g_key, ring);
+    return ring;
+}
+
+void Trace_Enable(const uint8_t enable) {
+    _ctr_g_enabled = enable;
+}
+
+// Start of a span, 0 while tracing is disabled.
+uint64_t Trace_Begin() {
+    return (_ctr_g_enabled) ? Time_NowNs() : 0;
+}
+
+void Trace_End(const uint64_t start_ns, const char* name) {
+    if (!start_ns)
+        return;
+    TraceRing* ring = _ctr_t_ring;
+    if (!ring) {
+        ring = _ctr_t_ring = _ctr_thread_ring();
+        if (!ring)
+            return;
+    }
+    const uint64_t head = ring->head;
+    TraceEvent* e = ring->events + head % CTR_RING_EVENTS;
+    e->name = name;
+    e->start_ns = start_ns;
+    e->duration_ns = Time_NowNs() - start_ns;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Write every span still held by the rings to path as Chrome trace JSON.
+// Returns the number of spans written or -1 if the file could not be created.
+int64_t Trace_Dump(const char* restrict path) {
+    FILE* fs = fopen(path, "w");
+    if (!fs) {
+        perror("CS_Trace");
+        return -1;
+    }
+
+    fputs("{\"traceEvents\":[\n", fs);
+    const int pid = (int)getpid();
+    int64_t written = 0;
+    pthread_mutex_lock(&_ctr_g_mutex);
+    const uint32_t ring_count = _ctr_g_ring_count;
+    pthread_mutex_unlock(&_ctr_g_mutex);
+
+    TraceEvent* copy = (TraceEvent*)malloc(sizeof(TraceEvent) * CTR_RING_EVENTS);
+    for (uint32_t r = 0; r < ring_count; ++r) {
+        TraceRing* ring = _ctr_g_rings[r];
+        const uint32_t tid = ring->tid;
+        const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        const uint64_t first = (head > CTR_RING_EVENTS) ? head - CTR_RING_EVENTS : 0;
+        for (uint64_t i = first; i < head; ++i)
+            copy[i - first] = ring->events[i % CTR_RING_EVENTS];
+
+        // Anything the writer lapped while we were copying is torn, skip it. So is the slot of
+        // head_after, it may be filled in right now and holds span head_after - CTR_RING_EVENTS.
+        const uint64_t head_after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        const uint64_t valid = (head_after >= CTR_RING_EVENTS) ? head_after - CTR_RING_EVENTS + 1 : 0;
+        for (uint64_t i = (valid > first) ? valid : first; i < head; ++i) {
+            const TraceEvent* e = copy + (i - first);
+            fprintf(fs, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    (written > 0) ? ",\n" : "",
+                    e->name,
+                    pid,
+                    tid,
+                    (double)e->start_ns / 1000.0,
+                    (double)e->duration_ns / 1000.0);
+            ++written;
+        }
+    }
+    free(copy);
+
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", fs);
+    fclose(fs);
+    return written;
+}
+
+void* _ctr_dump_thread(void* args) {
+    (void)args;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, _ctr_g_dump_signal);
+    for (;;) {
+        int signo = 0;
+        if (sigwait(&set, &signo) != 0)
+            continue;
+        const int64_t written = Trace_Dump(_ctr_g_dump_path);
+        if (written >= 0)
+            fprintf(stderr, "CS_Trace: Wrote %lld spans to %s.\n", (long long)written, _ctr_g_dump_path);
+    }
+    return NULL;
+}
+
+// Enable tracing and dump to path every time signo arrives. Must be called before any
+// other thread is started: the signal is blocked for the calling thread and everything it
+// spawns afterwards so only the dump thread ever receives it.
+int32_t Trace_DumpOnSignal(const int signo, const char* restrict path) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        return -1;
+
+    _ctr_g_dump_signal = signo;
+    _ctr_g_dump_path = path;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, _ctr_dump_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    Trace_Enable(1);
+    return 0;
+}
+
+#ifdef CS_TRACE
+#define TRACE_BEGIN(span) const uint64_t _ctr_span_##span = Trace_Begin()
+#define TRACE_END(span, name) Trace_End(_ctr_span_##span, name)
+#else
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, name)
+#endif
+
+#endif // CROSSPLATFORM_TRACE_H
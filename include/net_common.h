@@ -4,12 +4,128 @@
 #include "stdnfs.h"
 #include "cs_sockets.h"
 #include "cs_threads.h"
+#include "cs_shmring.h"
 
 typedef struct _netfs_file_info {
     const char* name;
     size_t size;
 } FileInfo;
 
+// Payload of FileInfo, FileNotModified and FileHandle packets.
+typedef struct _netfs_file_stat {
+    u64 size;
+    i64 mtime;
+} FileStat;
+
+// Optional trailer of a FileDownloadRequest (after the NUL terminated name) describing
+// the copy the client already has. If it still matches, the server answers with
+// FileNotModified instead of sending the file again.
+typedef struct _netfs_file_validator {
+    u64 size;
+    i64 mtime;
+    u64 hash; // Content hash (Hash_Fnv1a64), 0 if unknown.
+} FileValidator;
+
+// Payload of a SetRate request, bytes per second. 0 lifts a limit, NET_RATE_UNCHANGED keeps it.
+#define NET_RATE_UNCHANGED UINT64_MAX
+typedef struct _netfs_rate_limits {
+    u64 global;
+    u64 per_connection;
+} RateLimits;
+
+// Payload of a Busy packet, followed by the NUL terminated reason. The server closes the
+// connection after sending it, the client should not reconnect before retry_after_ms.
+typedef struct _netfs_busy_notice {
+    u32 retry_after_ms;
+} BusyNotice;
+
+// Wait of a client that got a Busy notice it could not make sense of.
+#define NET_BUSY_DEFAULT_RETRY_MS 1000
+
+// Trailer of a FileReadRequest (after the NUL terminated name), the bytes wanted. The reply
+// is one FileReadData with at most NET_READ_MAX of them, fewer at the end of the file.
+typedef struct _netfs_file_range {
+    u64 offset;
+    u64 size;
+} FileRange;
+
+#define NET_READ_MAX (1024 * 1024)
+
+// Integrity checks of fget and fup, asked for with SetIntegrity and answered with the mode the
+// server put in effect. With NET_INTEGRITY_CRC32C every FileDownloadData and FileUploadData
+// payload ends in the CRC32C of the bytes before it (NET_CHECKSUM_SIZE), and a transfer that
+// went through is followed by a FileDigest of the whole file, holes included, from the side
+// that sent it. The receiver keeps the file only if both match.
+#define NET_INTEGRITY_NONE 0
+#define NET_INTEGRITY_CRC32C 1
+#define NET_CHECKSUM_SIZE sizeof(u32)
+
+// Payload of SetIntegrity, both ways.
+typedef struct _netfs_integrity_mode {
+    u32 mode;
+} IntegrityMode;
+
+// Payload of FileDigest.
+typedef struct _netfs_file_digest {
+    u64 size;
+    u32 crc32c;
+    u32 reserved;
+} FileDigest;
+
+// Parse a byte count or rate like "512", "64K", "10M" or "1G". Returns false if str is not one.
+bool Net_ParseSize(const char* restrict str, u64* restrict value) {
+    char* end = NULL;
+    *value = strtoull(str, &end, 10);
+    if (end == str)
+        return false;
+    switch (*end) {
+        case 'k': case 'K': *value <<= 10; ++end; break;
+        case 'm': case 'M': *value <<= 20; ++end; break;
+        case 'g': case 'G': *value <<= 30; ++end; break;
+        default: break;
+    }
+    return *end == 0;
+}
+
+// Parse comma separated socket settings like "nodelay=0,sndbuf=4M,keepalive=30" into o,
+// leaving settings that are not mentioned as they are. Returns false on anything unknown.
+//   nodelay=0|1  sndbuf=size  rcvbuf=size  keepalive=idle_s  busypoll=us
+//   connect_timeout=ms  send_timeout=ms  recv_timeout=ms
+bool Net_ParseSocketOptions(const char* restrict str, SocketOptions* restrict o) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", str);
+    char* save = NULL;
+    for (char* item = strtok_r(buffer, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char* value_str = strchr(item, '=');
+        u64 value = 0;
+        if (!value_str)
+            return false;
+        *value_str++ = 0;
+        if (!Net_ParseSize(value_str, &value) || value > INT32_MAX)
+            return false;
+
+        if (!strcmp(item, "nodelay"))
+            o->no_delay = value != 0;
+        else if (!strcmp(item, "sndbuf"))
+            o->send_buffer = (i32)value;
+        else if (!strcmp(item, "rcvbuf"))
+            o->receive_buffer = (i32)value;
+        else if (!strcmp(item, "keepalive"))
+            o->keepalive_idle_s = (i32)value;
+        else if (!strcmp(item, "busypoll"))
+            o->busy_poll_us = (i32)value;
+        else if (!strcmp(item, "connect_timeout"))
+            o->connect_timeout = (u32)value;
+        else if (!strcmp(item, "send_timeout"))
+            o->send_timeout = (u32)value;
+        else if (!strcmp(item, "recv_timeout"))
+            o->receive_timeout = (u32)value;
+        else
+            return false;
+    }
+    return true;
+}
+
 typedef enum _netfs_packet_header_type : uint8_t {
     NetPacketType_Message,
     NetPacketType_Error,
@@ -20,6 +136,24 @@ typedef enum _netfs_packet_header_type : uint8_t {
     NetPacketType_FileUploadRequest,
     NetPacketType_FileDownloadData,
     NetPacketType_FileUploadData,
+    NetPacketType_FileDownloadHole,
+    NetPacketType_FileNotModified,
+    NetPacketType_Stats,
+    NetPacketType_SetRate,
+    NetPacketType_Busy,
+    NetPacketType_FileOpenRequest,
+    NetPacketType_FileHandle,
+    NetPacketType_FileReadRequest,
+    NetPacketType_FileReadData,
+    NetPacketType_ShmOpen,
+    NetPacketType_ShmChannel,
+    NetPacketType_UdpDownloadRequest,
+    NetPacketType_UdpTransferInfo,
+    NetPacketType_UdpTransferDone,
+    NetPacketType_McastJoinRequest,
+    NetPacketType_McastInfo,
+    NetPacketType_SetIntegrity,
+    NetPacketType_FileDigest,
     NetPacketType_None
 } NetPacketType;
 
@@ -62,6 +196,24 @@ const char* NetPacket_GetTypeStr(const NetPacket* restrict p) {
         "NetPacketType_FileUploadRequest",
         "NetPacketType_FileDownloadData",
         "NetPacketType_FileUploadData",
+        "NetPacketType_FileDownloadHole",
+        "NetPacketType_FileNotModified",
+        "NetPacketType_Stats",
+        "NetPacketType_SetRate",
+        "NetPacketType_Busy",
+        "NetPacketType_FileOpenRequest",
+        "NetPacketType_FileHandle",
+        "NetPacketType_FileReadRequest",
+        "NetPacketType_FileReadData",
+        "NetPacketType_ShmOpen",
+        "NetPacketType_ShmChannel",
+        "NetPacketType_UdpDownloadRequest",
+        "NetPacketType_UdpTransferInfo",
+        "NetPacketType_UdpTransferDone",
+        "NetPacketType_McastJoinRequest",
+        "NetPacketType_McastInfo",
+        "NetPacketType_SetIntegrity",
+        "NetPacketType_FileDigest",
         "NetPacketType_None"};
     if ((size_t)p->header.id >= 0 && (size_t)p->header.id <= NetPacketType_None)
         return types_str[(size_t)p->header.id];
@@ -88,28 +240,51 @@ void NetPacket_Dispose(NetPacket* restrict p) {
     }
 }
 
-NetPacket* NetPacket_Receive(Socket* restrict s) {
-    NetPacket* incoming = NetPacket_New(NetPacketType_None, NULL, 0);
-    i32 res = Socket_Receive(s, (u8*)&incoming->header, sizeof(incoming->header), 0);
-    if (res == CS_SOCKET_ERROR) {
-lc0:
-        NetPacket_Dispose(incoming);
-        return NULL;
-    }
+// Receive only the header of the next packet, the caller decides where the payload goes.
+int32_t NetPacket_ReceiveHeader(Socket* restrict s, PacketHeader* restrict header) {
+    if (Socket_ReceiveAll(s, (u8*)header, sizeof(*header), 0) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+}
 
+// Receive the payload described by header into a newly allocated packet.
+NetPacket* NetPacket_ReceivePayload(Socket* restrict s, const PacketHeader* restrict header) {
+    NetPacket* incoming = NetPacket_New(NetPacketType_None, NULL, 0);
+    incoming->header = *header;
     if (incoming->header.size > 0) {
-        NetPacket_AddData(incoming, NULL, incoming->header.size);
-        res = Socket_Receive(s, incoming->buffer, incoming->header.size, 0);
-        if (res == CS_SOCKET_ERROR)
-            goto lc0;
+        incoming->buffer = (u8*)malloc(incoming->header.size);
+        if (Socket_ReceiveAll(s, incoming->buffer, incoming->header.size, 0) == CS_SOCKET_ERROR) {
+            NetPacket_Dispose(incoming);
+            return NULL;
+        }
     }
     return incoming;
 }
 
+// Read and throw away the payload described by header.
+int32_t NetPacket_DiscardPayload(Socket* restrict s, const PacketHeader* restrict header) {
+    u8 scratch[4096];
+    usize remaining = header->size;
+    while (remaining > 0) {
+        const usize n = (remaining < sizeof(scratch)) ? remaining : sizeof(scratch);
+        if (Socket_ReceiveAll(s, scratch, n, 0) == CS_SOCKET_ERROR)
+            return CS_SOCKET_ERROR;
+        remaining -= n;
+    }
+    return CS_SOCKET_SUCCESS;
+}
+
+NetPacket* NetPacket_Receive(Socket* restrict s) {
+    PacketHeader header;
+    if (NetPacket_ReceiveHeader(s, &header) == CS_SOCKET_ERROR)
+        return NULL;
+    return NetPacket_ReceivePayload(s, &header);
+}
+
 int32_t NetPacket_Send(Socket* restrict s, NetPacket* restrict p) {
-    i32 res = Socket_Send(s, (u8*)&p->header, sizeof(p->header), 0);
+    i32 res = Socket_SendAll(s, (u8*)&p->header, sizeof(p->header), 0);
     if (res != CS_SOCKET_ERROR) {
-        res = Socket_Send(s, p->buffer, p->header.size, 0);
+        res = Socket_SendAll(s, p->buffer, p->header.size, 0);
         if (res != CS_SOCKET_ERROR) {
             return CS_SOCKET_SUCCESS;
         }
@@ -117,9 +292,66 @@ int32_t NetPacket_Send(Socket* restrict s, NetPacket* restrict p) {
     return CS_SOCKET_ERROR;
 }
 
+// Send p with checksum (NET_CHECKSUM_SIZE bytes) appended to its payload, the header counts both.
+int32_t NetPacket_SendWithChecksum(Socket* restrict s, NetPacket* restrict p, const u32 checksum) {
+    PacketHeader header = {p->header.id, p->header.size + NET_CHECKSUM_SIZE};
+    if (Socket_SendAll(s, (u8*)&header, sizeof(header), 0) == CS_SOCKET_ERROR ||
+        Socket_SendAll(s, p->buffer, p->header.size, 0) == CS_SOCKET_ERROR ||
+        Socket_SendAll(s, (const u8*)&checksum, NET_CHECKSUM_SIZE, 0) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+}
+
+#ifdef CS_PLATFORM_UNIX
+// Send p over a local socket with the open file fd attached to it, the receiver finds its
+// copy of the descriptor with Socket_TakeFd() once the header is in.
+int32_t NetPacket_SendWithFd(Socket* restrict s, NetPacket* restrict p, const int fd) {
+    if (Socket_SendWithFd(s, (u8*)&p->header, sizeof(p->header), fd) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    if (Socket_SendAll(s, p->buffer, p->header.size, 0) == CS_SOCKET_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+}
+#endif
+
+#ifdef CSR_AVAILABLE
+// Packets over a shared memory channel, framed exactly as on a socket. A local client gets
+// the channel as the reply (ShmChannel, memfd attached) to a ShmOpen request, from then on
+// requests and replies go through its rings and the socket is only watched for hang ups.
+int32_t NetPacket_SendShm(ShmChannel* restrict ch, NetPacket* restrict p) {
+    if (ShmChannel_Write(ch, &p->header, sizeof(p->header), p->header.size > 0) == CSR_ERROR)
+        return CS_SOCKET_ERROR;
+    if (ShmChannel_Write(ch, p->buffer, p->header.size, false) == CSR_ERROR)
+        return CS_SOCKET_ERROR;
+    return CS_SOCKET_SUCCESS;
+}
+
+NetPacket* NetPacket_ReceiveShmPayload(ShmChannel* restrict ch, const PacketHeader* restrict header) {
+    NetPacket* incoming = NetPacket_New(NetPacketType_None, NULL, 0);
+    incoming->header = *header;
+    if (incoming->header.size > 0) {
+        incoming->buffer = (u8*)malloc(incoming->header.size);
+        if (ShmChannel_Read(ch, incoming->buffer, incoming->header.size) == CSR_ERROR) {
+            NetPacket_Dispose(incoming);
+            return NULL;
+        }
+    }
+    return incoming;
+}
+
+NetPacket* NetPacket_ReceiveShm(ShmChannel* restrict ch) {
+    PacketHeader header;
+    if (ShmChannel_Read(ch, &header, sizeof(header)) == CSR_ERROR)
+        return NULL;
+    return NetPacket_ReceiveShmPayload(ch, &header);
+}
+#endif
+
+// FIFO of packets backed by a growable ring buffer.
 typedef struct _netfs_packet_queue {
     NetPacket** _packets;
     usize _count;
+    usize _head;
     usize _available_packets;
     Mutex* _access_mutex;
 } NetPacketQueue;
@@ -128,6 +360,7 @@ NetPacketQueue* NetPacketQueue_New() {
     NetPacketQueue* q = (NetPacketQueue*)malloc(sizeof(NetPacketQueue));
     q->_count = 256;
     q->_packets = (NetPacket**)malloc(sizeof(NetPacket*) * q->_count);
+    q->_head = 0;
     q->_available_packets = 0;
     q->_access_mutex = Mutex_New();
     return q;
@@ -142,10 +375,16 @@ void NetPacketQueue_Dispose(NetPacketQueue* restrict q) {
 i32 NetPacketQueue_TryAdd(NetPacketQueue* restrict q, NetPacket* restrict p) {
     if (Mutex_Lock(q->_access_mutex) == MutexResult_Success) {
         if (q->_available_packets >= q->_count) {
+            // Unroll the ring into the new buffer so the oldest packet is at the front again.
+            NetPacket** packets = (NetPacket**)malloc(sizeof(NetPacket*) * q->_count * 2);
+            for (usize i = 0; i < q->_available_packets; ++i)
+                packets[i] = q->_packets[(q->_head + i) % q->_count];
+            free(q->_packets);
+            q->_packets = packets;
+            q->_head = 0;
             q->_count *= 2;
-            q->_packets = (NetPacket**)malloc(sizeof(NetPacket*) * q->_count);
         }
-        q->_packets[q->_available_packets++] = p;
+        q->_packets[(q->_head + q->_available_packets++) % q->_count] = p;
         Mutex_Unlock(q->_access_mutex);
         return 1;
     } else
@@ -158,7 +397,9 @@ NetPacket* NetPacketQueue_TryPop(NetPacketQueue* restrict q) {
             Mutex_Unlock(q->_access_mutex);
             return NULL;
         }
-        NetPacket* packet = q->_packets[--q->_available_packets];
+        NetPacket* packet = q->_packets[q->_head];
+        q->_head = (q->_head + 1) % q->_count;
+        --q->_available_packets;
         Mutex_Unlock(q->_access_mutex);
         return packet;
     } else
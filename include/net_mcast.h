@@ -0,0 +1,44 @@
+#ifndef NETFS_MCAST_H
+#define NETFS_MCAST_H
+
+#include "stdnfs.h"
+#include "cs_sockets.h"
+#include "net_udp.h"
+
+// Multicast distribution (mcget) of one file to many clients at once. A client asks over TCP
+// (McastJoinRequest) and is told where the file will be multicast (McastInfo). The server
+// gathers joins for a moment, then sends the file once to the group at a fixed rate, however
+// many are listening, and ends the pass with a few end markers. Clients that joined after
+// the pass began get another one. Whatever a client still misses once its pass is over, it
+// reads over its TCP connection (FileReadRequest), so the multicast itself needs no acks and
+// the server's egress does not grow with the number of receivers, only repairs do.
+
+#define NET_MCAST_DEFAULT_PORT 9443
+#define NET_MCAST_DEFAULT_RATE (50ull * 1024 * 1024)
+#define NET_MCAST_GATHER_MS 500     // Joins for this long after the first one share the first pass.
+#define NET_MCAST_END_MARKERS 3
+#define NET_MCAST_IDLE_MS 2000      // A receiver that hears nothing for this long stops listening.
+
+// Payload of McastInfo.
+typedef struct _netfs_mcast_info {
+    u64 size;
+    i64 mtime;
+    u32 transfer_id;
+    u32 group;       // IPv4 group address, network order.
+    u32 port;
+    u32 first_pass;  // The first pass the receiver sees from the start, it may stop after it.
+    u64 rate;        // Bytes per second the passes go out at.
+} McastInfo;
+
+// Precedes the file bytes of every multicast datagram, payloads are laid out as for uget.
+// An end marker has seq == the datagram count of the file and no payload.
+typedef struct _netfs_mcast_data_header {
+    u32 transfer_id;
+    u32 seq;
+    u32 pass;
+    u32 reserved;
+} McastDataHeader;
+
+#define NET_MCAST_DATAGRAM_MAX (sizeof(McastDataHeader) + NET_UDP_PAYLOAD)
+
+#endif // NETFS_MCAST_H
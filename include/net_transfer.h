@@ -0,0 +1,109 @@
+#ifndef NETFS_TRANSFER_H
+#define NETFS_TRANSFER_H
+
+#include "stdnfs.h"
+#include "cs_sockets.h"
+#include "cs_time.h"
+#include "cs_crc32c.h"
+
+// Bounds for the payload size of a single FileDownloadData/FileUploadData packet.
+// Small chunks waste time on per-packet overhead, huge ones only add latency.
+#define NET_CHUNK_MIN_SIZE (usize)(64 * 1024)
+#define NET_CHUNK_MAX_SIZE (usize)(8 * 1024 * 1024)
+
+// File data goes out in frames of at most this size, the server answers other requests
+// between frames so they never wait behind more than one frame (plus NET_NOTSENT_LOWAT
+// already queued in the kernel).
+#define NET_BULK_FRAME_SIZE (usize)(128 * 1024)
+#define NET_NOTSENT_LOWAT (128 * 1024)
+
+// A chunk should carry at least this much transfer time worth of data,
+// or one round trip if that is longer.
+#define NET_CHUNK_TARGET_NS (2 * CTM_NS_PER_MS)
+
+// Picks the size of the next chunk from the measured throughput, the round trip time
+// and the socket send buffer, so fast links get multi-megabyte chunks while slow ones
+// stay at NET_CHUNK_MIN_SIZE.
+typedef struct _netfs_chunk_sizer {
+    usize chunk_size;
+    usize socket_buffer_size;
+    u32 rtt_us;
+    double throughput; // Bytes per second, exponentially weighted.
+
+    u64 _last_update_ns;
+    u32 _updates;
+} ChunkSizer;
+
+void ChunkSizer_Init(ChunkSizer* restrict cs, Socket* restrict s) {
+    const i32 buffer_size = Socket_GetSendBufferSize(s);
+    cs->socket_buffer_size = (buffer_size > 0) ? (usize)buffer_size : 0;
+    cs->rtt_us = 0;
+    Socket_GetRoundTripTime(s, &cs->rtt_us);
+    cs->throughput = 0.0;
+    cs->_last_update_ns = Time_NowNs();
+    cs->_updates = 0;
+
+    // Start out big enough to keep half of the socket buffer busy.
+    cs->chunk_size = NET_CHUNK_MIN_SIZE;
+    while (cs->chunk_size < cs->socket_buffer_size / 2 && cs->chunk_size < NET_CHUNK_MAX_SIZE)
+        cs->chunk_size *= 2;
+}
+
+// Size of the next chunk to send.
+usize ChunkSizer_Next(const ChunkSizer* restrict cs) {
+    return cs->chunk_size;
+}
+
+// Account for bytes that have just been handed to the socket and adapt the chunk size.
+void ChunkSizer_Update(ChunkSizer* restrict cs, Socket* restrict s, const usize bytes) {
+    const u64 now = Time_NowNs();
+    const u64 elapsed = (now > cs->_last_update_ns) ? now - cs->_last_update_ns : 1;
+    cs->_last_update_ns = now;
+
+    const double sample = (double)bytes * (double)CTM_NS_PER_SEC / (double)elapsed;
+    cs->throughput = (cs->throughput == 0.0) ? sample : cs->throughput * 0.75 + sample * 0.25;
+
+    // The RTT moves slowly, there is no need to ask the kernel on every chunk.
+    if ((++cs->_updates & 15) == 0)
+        Socket_GetRoundTripTime(s, &cs->rtt_us);
+
+    u64 window_ns = (u64)cs->rtt_us * CTM_NS_PER_US;
+    if (window_ns < NET_CHUNK_TARGET_NS)
+        window_ns = NET_CHUNK_TARGET_NS;
+
+    double target = cs->throughput * (double)window_ns / (double)CTM_NS_PER_SEC;
+    if (target < (double)(cs->socket_buffer_size / 2))
+        target = (double)(cs->socket_buffer_size / 2);
+
+    // Step at most one power of two per chunk so a single stall (page cache miss,
+    // descheduled thread) does not collapse the chunk size.
+    if (target >= (double)(cs->chunk_size * 2) && cs->chunk_size < NET_CHUNK_MAX_SIZE)
+        cs->chunk_size *= 2;
+    else if (target < (double)(cs->chunk_size / 2) && cs->chunk_size > NET_CHUNK_MIN_SIZE)
+        cs->chunk_size /= 2;
+}
+
+#define NET_HASH_SEED 0xcbf29ce484222325ull
+
+// 64-bit FNV-1a, used as the content hash of cached files.
+// Feed the previous result back in as h to hash a file chunk by chunk, start with NET_HASH_SEED.
+u64 Hash_Fnv1a64(u64 h, const u8* restrict data, const usize size) {
+    for (usize i = 0; i < size; ++i) {
+        h ^= data[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Hash length zero bytes, what a hole in a sparse file reads back as.
+u64 Hash_Fnv1a64Zeroes(u64 h, u64 length) {
+    static const u8 zeroes[4096] = {0};
+    while (length > 0) {
+        const usize n = (length < sizeof(zeroes)) ? (usize)length : sizeof(zeroes);
+        h = Hash_Fnv1a64(h, zeroes, n);
+        length -= n;
+    }
+    return h;
+}
+
+#endif // NETFS_TRANSFER_H
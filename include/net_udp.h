@@ -0,0 +1,304 @@
+#ifndef NETFS_UDP_H
+#define NETFS_UDP_H
+
+#include "stdnfs.h"
+#include "cs_sockets.h"
+#include "cs_time.h"
+
+// Bulk downloads over UDP (uget), for long fat links where a single TCP stream cannot
+// fill the pipe. The request, the reply and the final outcome go over the TCP connection
+// as usual (UdpDownloadRequest, UdpTransferInfo, UdpTransferDone). The file itself goes as
+// sequence numbered datagrams from a UDP socket the server opens for the transfer, and the
+// client acknowledges with a cumulative sequence number plus a selective ack bitmap.
+// Holes the bitmap shows behind newer datagrams are sent again, so is everything still
+// unacknowledged when acks stop coming for a while. The send rate is paced by a
+// BBR style controller (UdpRate) from the measured delivery rate and round trip time
+// rather than by loss, so random loss on a long link does not throttle it.
+
+#define NET_UDP_PAYLOAD 1400          // File bytes per datagram, stays under a 1500 byte MTU.
+#define NET_UDP_BATCH 32              // Datagrams per sendmmsg()/recvmmsg().
+#define NET_UDP_WINDOW 8192           // Datagrams past the cumulative ack the sender may go, the span of the ack bitmap.
+#define NET_UDP_SACK_BYTES (NET_UDP_WINDOW / 8)
+#define NET_UDP_SOCKET_BUFFER (8 * 1024 * 1024)
+#define NET_UDP_IDLE_TIMEOUT_MS 10000 // The sender gives up after this long without progress.
+#define NET_UDP_REORDER 3             // Datagrams that may overtake one before it counts as lost.
+
+// Trailer of a UdpDownloadRequest (after the NUL terminated name): where the client listens.
+typedef struct _netfs_udp_download_setup {
+    u32 port;
+    u32 max_rate; // Bytes per second the client wants at most, 0 for no limit.
+} UdpDownloadSetup;
+
+// Payload of UdpTransferInfo, the datagrams follow right away.
+typedef struct _netfs_udp_transfer_info {
+    u64 size;
+    i64 mtime;
+    u32 transfer_id;
+    u32 port;     // The server's UDP port, acks go there.
+} UdpTransferInfo;
+
+// Payload of UdpTransferDone, sent once everything was acknowledged.
+typedef struct _netfs_udp_transfer_stats {
+    u64 datagrams;     // Sent, retransmissions included.
+    u64 retransmitted;
+    u64 bandwidth;     // Final bottleneck estimate, bytes per second.
+    u32 min_rtt_us;
+    u32 timeouts;
+} UdpTransferStats;
+
+// Precedes the file bytes of every data datagram, the payload of seq starts at seq * NET_UDP_PAYLOAD.
+typedef struct _netfs_udp_data_header {
+    u32 transfer_id;
+    u32 seq;
+    u64 sent_ns; // Sender's clock, echoed by the ack for a round trip sample.
+} UdpDataHeader;
+
+// Ack datagram: followed by sack_size bytes of bitmap, bit i set if cumulative + i arrived.
+typedef struct _netfs_udp_ack_header {
+    u32 transfer_id;
+    u32 cumulative;   // Every datagram below this one arrived.
+    u32 highest;      // One past the highest sequence number that arrived.
+    u32 sack_size;
+    u64 echo_ns;      // sent_ns of the newest datagram, 0 if none since the last ack.
+} UdpAckHeader;
+
+#define NET_UDP_DATAGRAM_MAX (sizeof(UdpDataHeader) + NET_UDP_PAYLOAD)
+#define NET_UDP_ACK_MAX (sizeof(UdpAckHeader) + NET_UDP_SACK_BYTES)
+
+// Datagrams in a file of size bytes.
+u32 Udp_DatagramCount(const u64 size) {
+    return (u32)((size + NET_UDP_PAYLOAD - 1) / NET_UDP_PAYLOAD);
+}
+
+// Rate control in the style of BBR: the bottleneck bandwidth is the highest delivery rate
+// of the last few rounds (a round lasts one minimum round trip), the pacing rate is that
+// times a gain. Startup doubles the rate every round until it stops growing, then the
+// queue it built is drained and the rate cycles around the estimate to probe for more.
+// The window caps what is in flight at twice the bandwidth delay product.
+#define UDP_BW_FILTER_ROUNDS 10
+#define UDP_MIN_RTT_WINDOW_NS (10 * CTM_NS_PER_SEC)
+#define UDP_MIN_ROUND_NS (500 * CTM_NS_PER_US)
+#define UDP_STARTUP_GAIN 2.885
+#define UDP_INITIAL_RATE (4.0 * 1024.0 * 1024.0)
+#define UDP_MIN_WINDOW (64 * NET_UDP_PAYLOAD)
+
+typedef enum _netfs_udp_rate_phase {
+    UdpRatePhase_Startup,
+    UdpRatePhase_Drain,
+    UdpRatePhase_ProbeBw
+} UdpRatePhase;
+
+typedef struct _netfs_udp_rate {
+    UdpRatePhase phase;
+    double btl_bw;                 // Bytes per second, 0 before the first round.
+    double bw_filter[UDP_BW_FILTER_ROUNDS];
+    u32 round;
+    u64 min_rtt_ns;                // UINT64_MAX before the first sample.
+    u64 min_rtt_stamp_ns;
+    u64 round_start_ns;
+    u64 round_delivered;
+    u64 round_lost;
+    double full_bw;                // Startup ends after 3 rounds without 25% growth over this.
+    u32 full_bw_rounds;
+    u32 cycle;
+    double pacing_gain;
+    double pacing_rate;            // Bytes per second.
+    double max_rate;               // 0 for no limit.
+} UdpRate;
+
+void UdpRate_Init(UdpRate* restrict r, const u64 max_rate) {
+    memset(r, 0, sizeof(UdpRate));
+    r->phase = UdpRatePhase_Startup;
+    r->min_rtt_ns = UINT64_MAX;
+    r->round_start_ns = Time_NowNs();
+    r->pacing_gain = UDP_STARTUP_GAIN;
+    r->max_rate = (double)max_rate;
+    r->pacing_rate = (r->max_rate > 0.0 && r->max_rate < UDP_INITIAL_RATE) ? r->max_rate : UDP_INITIAL_RATE;
+}
+
+void _udp_rate_set_pacing(UdpRate* restrict r) {
+    const double bw = (r->btl_bw > 0.0) ? r->btl_bw : UDP_INITIAL_RATE;
+    r->pacing_rate = bw * r->pacing_gain;
+    if (r->max_rate > 0.0 && r->pacing_rate > r->max_rate)
+        r->pacing_rate = r->max_rate;
+}
+
+void _udp_rate_end_round(UdpRate* restrict r, const u64 now) {
+    const u64 elapsed = now - r->round_start_ns;
+    r->bw_filter[r->round % UDP_BW_FILTER_ROUNDS] = (double)r->round_delivered * (double)CTM_NS_PER_SEC / (double)elapsed;
+    // Heavy loss means the rate overshoots what the path takes, let the estimate come down.
+    if (r->round_lost * 5 > r->round_delivered + r->round_lost) {
+        for (u32 i = 0; i < UDP_BW_FILTER_ROUNDS; ++i)
+            r->bw_filter[i] *= 0.85;
+    }
+    ++r->round;
+    r->btl_bw = 0.0;
+    for (u32 i = 0; i < UDP_BW_FILTER_ROUNDS; ++i) {
+        if (r->bw_filter[i] > r->btl_bw)
+            r->btl_bw = r->bw_filter[i];
+    }
+    r->round_start_ns = now;
+    r->round_delivered = 0;
+    r->round_lost = 0;
+
+    static const double cycle_gains[8] = {1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+    switch (r->phase) {
+        case UdpRatePhase_Startup:
+            if (r->btl_bw >= r->full_bw * 1.25) {
+                r->full_bw = r->btl_bw;
+                r->full_bw_rounds = 0;
+            } else if (++r->full_bw_rounds >= 3) {
+                r->phase = UdpRatePhase_Drain;
+                r->pacing_gain = 1.0 / UDP_STARTUP_GAIN;
+            }
+            break;
+        case UdpRatePhase_Drain:
+            r->phase = UdpRatePhase_ProbeBw;
+            r->cycle = 0;
+            r->pacing_gain = cycle_gains[0];
+            break;
+        case UdpRatePhase_ProbeBw:
+            r->cycle = (r->cycle + 1) % 8;
+            r->pacing_gain = cycle_gains[r->cycle];
+            break;
+    }
+}
+
+// An ack newly acknowledged delivered bytes and newly reported lost bytes as lost.
+// rtt_ns is the round trip sample it carried, 0 for none.
+void UdpRate_OnAck(UdpRate* restrict r, const u64 now, const u64 delivered, const u64 lost, const u64 rtt_ns) {
+    if (rtt_ns && (rtt_ns < r->min_rtt_ns || now - r->min_rtt_stamp_ns > UDP_MIN_RTT_WINDOW_NS)) {
+        r->min_rtt_ns = rtt_ns;
+        r->min_rtt_stamp_ns = now;
+    }
+    r->round_delivered += delivered;
+    r->round_lost += lost;
+    u64 round_ns = (r->min_rtt_ns != UINT64_MAX) ? r->min_rtt_ns : UDP_MIN_ROUND_NS;
+    if (round_ns < UDP_MIN_ROUND_NS)
+        round_ns = UDP_MIN_ROUND_NS;
+    if (now - r->round_start_ns >= round_ns && r->round_delivered > 0)
+        _udp_rate_end_round(r, now);
+    _udp_rate_set_pacing(r);
+}
+
+// Acks stopped coming: assume the path got a lot slower and start over from half the estimate.
+void UdpRate_OnTimeout(UdpRate* restrict r) {
+    for (u32 i = 0; i < UDP_BW_FILTER_ROUNDS; ++i)
+        r->bw_filter[i] *= 0.5;
+    r->btl_bw *= 0.5;
+    r->round_start_ns = Time_NowNs();
+    r->round_delivered = 0;
+    r->round_lost = 0;
+    _udp_rate_set_pacing(r);
+}
+
+// Bytes that may be in flight.
+u64 UdpRate_Window(const UdpRate* restrict r) {
+    if (r->btl_bw <= 0.0 || r->min_rtt_ns == UINT64_MAX)
+        return (u64)NET_UDP_WINDOW * NET_UDP_PAYLOAD;
+    const u64 window = (u64)(2.0 * r->btl_bw * (double)r->min_rtt_ns / (double)CTM_NS_PER_SEC);
+    return (window > UDP_MIN_WINDOW) ? window : UDP_MIN_WINDOW;
+}
+
+// In-process stand-in for a lossy, slow path (like tc netem) to test with on loopback:
+// drops a share of the datagrams that arrive and holds back what goes out for a delay.
+typedef struct _netfs_udp_impairment {
+    u32 loss_ppm;  // Dropped datagrams per million.
+    u32 delay_ms;
+    u64 rng;
+} UdpImpairment;
+
+// Parse "loss_percent[:delay_ms]", for example "2" or "0.5:40". False if str is not one.
+bool UdpImpairment_Parse(UdpImpairment* restrict imp, const char* restrict str) {
+    char* end = NULL;
+    const double loss = strtod(str, &end);
+    if (end == str || loss < 0.0 || loss > 100.0)
+        return false;
+    long delay = 0;
+    if (*end == ':') {
+        const char* delay_str = end + 1;
+        delay = strtol(delay_str, &end, 10);
+        if (end == delay_str || delay < 0)
+            return false;
+    }
+    if (*end != 0)
+        return false;
+    imp->loss_ppm = (u32)(loss * 10000.0);
+    imp->delay_ms = (u32)delay;
+    imp->rng = Time_NowNs() | 1;
+    return true;
+}
+
+bool UdpImpairment_Drop(UdpImpairment* restrict imp) {
+    if (imp->loss_ppm == 0)
+        return false;
+    // xorshift64, plenty for picking victims.
+    imp->rng ^= imp->rng << 13;
+    imp->rng ^= imp->rng >> 7;
+    imp->rng ^= imp->rng << 17;
+    return imp->rng % 1000000 < imp->loss_ppm;
+}
+
+// Datagrams held back until their release time, in order. A full line drops what is pushed,
+// like a router queue.
+typedef struct _netfs_udp_delay_line {
+    u8* storage;
+    u64* release_ns;
+    usize* sizes;
+    usize slot_size;
+    usize capacity;
+    usize head;
+    usize count;
+} UdpDelayLine;
+
+UdpDelayLine* UdpDelayLine_New(const usize capacity, const usize slot_size) {
+    UdpDelayLine* line = (UdpDelayLine*)malloc(sizeof(UdpDelayLine));
+    line->storage = (u8*)malloc(capacity * slot_size);
+    line->release_ns = (u64*)malloc(sizeof(u64) * capacity);
+    line->sizes = (usize*)malloc(sizeof(usize) * capacity);
+    line->slot_size = slot_size;
+    line->capacity = capacity;
+    line->head = 0;
+    line->count = 0;
+    return line;
+}
+
+void UdpDelayLine_Dispose(UdpDelayLine* restrict line) {
+    free(line->storage);
+    free(line->release_ns);
+    free(line->sizes);
+    free(line);
+}
+
+void UdpDelayLine_Push(UdpDelayLine* restrict line, const u8* restrict data, const usize size, const u64 release_ns) {
+    if (line->count >= line->capacity || size > line->slot_size)
+        return;
+    const usize slot = (line->head + line->count++) % line->capacity;
+    memcpy(line->storage + slot * line->slot_size, data, size);
+    line->sizes[slot] = size;
+    line->release_ns[slot] = release_ns;
+}
+
+// Send whatever is due by now on s.
+void UdpDelayLine_Flush(UdpDelayLine* restrict line, Socket* restrict s, const u64 now) {
+    Datagram batch[NET_UDP_BATCH];
+    for (;;) {
+        usize n = 0;
+        while (n < NET_UDP_BATCH && n < line->count) {
+            const usize slot = (line->head + n) % line->capacity;
+            if (line->release_ns[slot] > now)
+                break;
+            batch[n].buffer = line->storage + slot * line->slot_size;
+            batch[n].size = line->sizes[slot];
+            ++n;
+        }
+        if (n == 0)
+            return;
+        // What the socket does not take now is lost, as on a real path.
+        Socket_SendBatch(s, batch, n);
+        line->head = (line->head + n) % line->capacity;
+        line->count -= n;
+    }
+}
+
+#endif // NETFS_UDP_H
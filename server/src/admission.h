@@ -0,0 +1,315 @@
+#ifndef NETFS_SERVER_ADMISSION_H
+#define NETFS_SERVER_ADMISSION_H
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_threads.h>
+#include <cs_time.h>
+
+// Admission control for new connections.
+// A connection is admitted when every load signal leaves room for it: client slots,
+// transfers in progress, the backlog of the I/O pool and memory. Otherwise it waits in a
+// bounded queue until load drops, and one that finds the queue full or waits too long is
+// told to come back later with a Busy packet instead of being taken on and served badly.
+// Some of the slots can be reserved for priority clients (by source network), who also
+// skip the transfer and backlog limits.
+
+#define ADMISSION_MEMORY_HIGH_PERCENT 90
+#define ADMISSION_RETRY_BASE_MS 500
+#define ADMISSION_RETRY_MAX_MS 10000
+// Not every load signal announces when it drops, waiters look again this often.
+#define ADMISSION_POLL_MS 20
+
+// Load at the time of the decision.
+typedef struct _netfs_load_signals {
+    usize connections;
+    usize transfers;
+    usize io_queued;
+    usize memory_used;
+} LoadSignals;
+
+// Limits of 0 are not checked.
+typedef struct _netfs_admission_policy {
+    usize max_clients;
+    usize reserved;       // Slots of max_clients only priority clients get.
+    usize max_transfers;
+    usize max_io_queued;
+    usize memory_limit;
+    usize memory_per_connection;
+    u32 priority_network; // Host order, clients with address & mask == network have priority.
+    u32 priority_mask;    // 0 if there are no priority clients.
+} AdmissionPolicy;
+
+// Parse a priority network like "10.1.0.0/16" (a bare address is a /32).
+bool AdmissionPolicy_SetPriority(AdmissionPolicy* restrict p, const char* restrict network) {
+    char address[INET_ADDRSTRLEN];
+    const char* slash = strchr(network, '/');
+    const usize length = (slash) ? (usize)(slash - network) : strlen(network);
+    if (length >= sizeof(address))
+        return false;
+    memcpy(address, network, length);
+    address[length] = 0;
+
+    struct in_addr addr;
+    if (inet_pton(AF_INET, address, &addr) != 1)
+        return false;
+    const long bits = (slash) ? strtol(slash + 1, NULL, 10) : 32;
+    if (bits < 1 || bits > 32)
+        return false;
+    p->priority_mask = (bits == 32) ? UINT32_MAX : ~(UINT32_MAX >> bits);
+    p->priority_network = ntohl(addr.s_addr) & p->priority_mask;
+    return true;
+}
+
+bool Admission_IsPriority(const AdmissionPolicy* restrict p, const Socket* restrict client) {
+    if (p->priority_mask == 0)
+        return false;
+    return (ntohl(client->remote_ep.address.ipv4_addr.sin_addr.s_addr) & p->priority_mask) == p->priority_network;
+}
+
+// NULL if a client may be admitted under load, otherwise why not.
+const char* Admission_Check(const AdmissionPolicy* restrict p, const LoadSignals* restrict load, const bool priority) {
+    const usize slots = (priority || p->reserved >= p->max_clients) ? p->max_clients : p->max_clients - p->reserved;
+    if (load->connections >= slots)
+        return "server full";
+    if (p->memory_limit) {
+        // Ordinary clients stop short of the limit so the connections already in keep some room.
+        const usize limit = (priority) ? p->memory_limit : p->memory_limit / 100 * ADMISSION_MEMORY_HIGH_PERCENT;
+        if (load->memory_used + p->memory_per_connection > limit)
+            return "low on memory";
+    }
+    if (priority)
+        return NULL;
+    if (p->max_transfers && load->transfers >= p->max_transfers)
+        return "too many transfers in progress";
+    if (p->max_io_queued && load->io_queued >= p->max_io_queued)
+        return "disk backlog";
+    return NULL;
+}
+
+// How long a turned away client should stay away, longer the more are waiting already.
+// Jittered so they do not all come back at once.
+u32 Admission_RetryAfter(const usize waiting) {
+    u64 ms = (u64)ADMISSION_RETRY_BASE_MS * (1 + waiting / 16);
+    if (ms > ADMISSION_RETRY_MAX_MS)
+        ms = ADMISSION_RETRY_MAX_MS;
+    return (u32)(ms + (Time_NowNs() / CTM_NS_PER_US) % (ms / 4 + 1));
+}
+
+// A connection waiting to be admitted.
+typedef struct _netfs_waiting_client {
+    Socket* socket;
+    bool priority;
+    u64 deadline_ns;
+} WaitingClient;
+
+// Bounded FIFO of waiting connections, served by one thread that admits the head as soon
+// as load allows and turns it away once its deadline passed.
+typedef struct _netfs_admission_queue {
+    WaitingClient* entries;
+    usize capacity;
+    usize head;
+    usize count;
+    u32 timeout_ms;
+    Mutex* mutex;
+    CondVar* cond;
+} AdmissionQueue;
+
+AdmissionQueue* AdmissionQueue_New(const usize capacity, const u32 timeout_ms) {
+    AdmissionQueue* q = (AdmissionQueue*)malloc(sizeof(AdmissionQueue));
+    q->entries = (WaitingClient*)malloc(sizeof(WaitingClient) * capacity);
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->timeout_ms = timeout_ms;
+    q->mutex = Mutex_New();
+    q->cond = CondVar_New();
+    return q;
+}
+
+void AdmissionQueue_Dispose(AdmissionQueue* restrict q) {
+    for (usize i = 0; i < q->count; ++i)
+        Socket_Dispose(q->entries[(q->head + i) % q->capacity].socket);
+    CondVar_Dispose(q->cond);
+    Mutex_Dispose(q->mutex);
+    free(q->entries);
+    free(q);
+}
+
+usize AdmissionQueue_Length(AdmissionQueue* restrict q) {
+    return __atomic_load_n(&q->count, __ATOMIC_RELAXED);
+}
+
+// Queue a client, false if the queue is full.
+bool AdmissionQueue_Push(AdmissionQueue* restrict q, Socket* restrict socket, const bool priority) {
+    Mutex_Lock(q->mutex);
+    const bool room = q->count < q->capacity;
+    if (room) {
+        WaitingClient* w = q->entries + (q->head + q->count) % q->capacity;
+        w->socket = socket;
+        w->priority = priority;
+        w->deadline_ns = Time_NowNs() + (u64)q->timeout_ms * CTM_NS_PER_MS;
+        __atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELAXED);
+        CondVar_Signal(q->cond);
+    }
+    Mutex_Unlock(q->mutex);
+    return room;
+}
+
+// Block until the head of the queue can be admitted under the load measure() reports
+// (*reason NULL) or its wait is over (*reason says why it is still not admissible),
+// and hand it out. A priority client further back that can be admitted is handed out
+// ahead of the head.
+WaitingClient AdmissionQueue_Next(AdmissionQueue* restrict q, const AdmissionPolicy* restrict p,
+                                  void (*measure)(LoadSignals*), const char** reason) {
+    Mutex_Lock(q->mutex);
+    usize index = 0; // Of the client handed out, from the head.
+    for (;;) {
+        while (q->count == 0)
+            CondVar_Wait(q->cond, q->mutex);
+        const WaitingClient* w = q->entries + q->head;
+        LoadSignals load;
+        measure(&load);
+        *reason = Admission_Check(p, &load, w->priority);
+        const u64 now = Time_NowNs();
+        if (!*reason || now >= w->deadline_ns)
+            break;
+        // Priority clients do not wait behind others, the reserved slots are theirs.
+        if (!w->priority && !Admission_Check(p, &load, true)) {
+            for (index = 1; index < q->count && !q->entries[(q->head + index) % q->capacity].priority; ++index)
+                ;
+            if (index < q->count) {
+                *reason = NULL;
+                break;
+            }
+            index = 0;
+        }
+        u64 wait_ms = (w->deadline_ns - now) / CTM_NS_PER_MS + 1;
+        if (wait_ms > ADMISSION_POLL_MS)
+            wait_ms = ADMISSION_POLL_MS;
+        CondVar_TimedWait(q->cond, q->mutex, (u32)wait_ms);
+    }
+    const WaitingClient w = q->entries[(q->head + index) % q->capacity];
+    // Those ahead of it move up a place.
+    for (; index > 0; --index)
+        q->entries[(q->head + index) % q->capacity] = q->entries[(q->head + index - 1) % q->capacity];
+    q->head = (q->head + 1) % q->capacity;
+    __atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELAXED);
+    Mutex_Unlock(q->mutex);
+    return w;
+}
+
+// Load went down (a connection ended), have the head looked at again.
+void AdmissionQueue_Notify(AdmissionQueue* restrict q) {
+    if (AdmissionQueue_Length(q) == 0)
+        return;
+    Mutex_Lock(q->mutex);
+    CondVar_Signal(q->cond);
+    Mutex_Unlock(q->mutex);
+}
+
+// Sockets of turned away clients are closed here, off the accept path. Closing with a
+// request of the client unread resets the connection, and the reset can overtake the Busy
+// notice, so each one lingers with its write side shut down until the client closes too
+// or its deadline passes. One thread polls them all.
+#define ADMISSION_LINGER_MAX 256
+
+typedef struct _netfs_lingering_client {
+    Socket* socket;
+    u64 deadline_ns;
+} LingeringClient;
+
+typedef struct _netfs_turn_away_reaper {
+    LingeringClient entries[ADMISSION_LINGER_MAX];
+    usize count;
+    Mutex* mutex;
+    CondVar* cond;
+} TurnAwayReaper;
+
+TurnAwayReaper* TurnAwayReaper_New() {
+    TurnAwayReaper* r = (TurnAwayReaper*)malloc(sizeof(TurnAwayReaper));
+    r->count = 0;
+    r->mutex = Mutex_New();
+    r->cond = CondVar_New();
+    return r;
+}
+
+// Hand over a socket whose notice went out and whose write side is shut down. Closed right
+// away if too many linger already.
+void TurnAwayReaper_Add(TurnAwayReaper* restrict r, Socket* restrict socket, const u32 linger_ms) {
+    Mutex_Lock(r->mutex);
+    const bool room = r->count < ADMISSION_LINGER_MAX;
+    if (room) {
+        r->entries[r->count].socket = socket;
+        r->entries[r->count].deadline_ns = Time_NowNs() + (u64)linger_ms * CTM_NS_PER_MS;
+        ++r->count;
+        CondVar_Signal(r->cond);
+    }
+    Mutex_Unlock(r->mutex);
+    if (!room)
+        Socket_Dispose(socket);
+}
+
+// Read and drop what the client still sends, true once it closed or failed.
+bool _admission_drain(Socket* restrict s) {
+    u8 scratch[4096];
+    for (;;) {
+        const i32 res = Socket_Receive(s, scratch, sizeof(scratch), CS_MSG_DONTWAIT);
+        if (res <= 0)
+            return res != CS_SOCKET_WOULD_BLOCK;
+    }
+}
+
+// Thread routine, args is the TurnAwayReaper.
+ThreadArg TurnAwayReaper_Run(ThreadArg args) {
+    TurnAwayReaper* r = (TurnAwayReaper*)args;
+    struct pollfd fds[ADMISSION_LINGER_MAX];
+    bool done[ADMISSION_LINGER_MAX];
+    for (;;) {
+        // Only this thread removes entries, the first count stay put while it polls unlocked.
+        Mutex_Lock(r->mutex);
+        while (r->count == 0)
+            CondVar_Wait(r->cond, r->mutex);
+        const usize count = r->count;
+        u64 next_ns = r->entries[0].deadline_ns;
+        for (usize i = 0; i < count; ++i) {
+            fds[i].fd = r->entries[i].socket->_native_handle;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            if (r->entries[i].deadline_ns < next_ns)
+                next_ns = r->entries[i].deadline_ns;
+        }
+        Mutex_Unlock(r->mutex);
+
+        // Wake up for newcomers too, they are not in this poll.
+        const u64 now = Time_NowNs();
+        u64 wait_ms = (next_ns > now) ? (next_ns - now) / CTM_NS_PER_MS + 1 : 0;
+        if (wait_ms > ADMISSION_POLL_MS)
+            wait_ms = ADMISSION_POLL_MS;
+        CS_POLL(fds, (u32)count, (i32)wait_ms);
+        const u64 after = Time_NowNs();
+        for (usize i = 0; i < count; ++i) {
+            done[i] = after >= r->entries[i].deadline_ns;
+            if (!done[i] && fds[i].revents)
+                done[i] = _admission_drain(r->entries[i].socket);
+        }
+
+        Socket* closing[ADMISSION_LINGER_MAX];
+        usize closed = 0;
+        Mutex_Lock(r->mutex);
+        usize kept = 0;
+        for (usize i = 0; i < r->count; ++i) {
+            if (i < count && done[i])
+                closing[closed++] = r->entries[i].socket;
+            else
+                r->entries[kept++] = r->entries[i];
+        }
+        r->count = kept;
+        Mutex_Unlock(r->mutex);
+        for (usize i = 0; i < closed; ++i)
+            Socket_Dispose(closing[i]);
+    }
+    return NULL;
+}
+
+#endif // NETFS_SERVER_ADMISSION_H
@@ -0,0 +1,174 @@
+#ifndef NETFS_SERVER_CONNTABLE_H
+#define NETFS_SERVER_CONNTABLE_H
+
+#include <stdnfs.h>
+#include <cs_threads.h>
+
+// Growable table of connection slots.
+// Slots live in chunks that are allocated on demand and never move or go away before the
+// table does, so a pointer to an entry stays valid while its connection thread runs and the
+// table can be walked (stats) without a lock. Free slots form a lock-free stack: admitting
+// and releasing a connection is a single CAS, only adding a chunk takes a mutex.
+
+#define CONN_CHUNK_SLOTS 1024
+#define CONN_MAX_CHUNKS 1024
+#define CONN_CACHE_LINE 64
+
+// Precedes every entry. The generation is odd while the slot is in use.
+typedef struct _netfs_conn_slot {
+    u32 generation;
+    u32 next_free; // Index + 1 of the next free slot, 0 ends the stack.
+    u32 index;
+} ConnSlot;
+
+typedef struct _netfs_conn_table {
+    usize entry_size;
+    usize stride; // Slot header and entry, rounded up to a cache line.
+    u8* chunks[CONN_MAX_CHUNKS];
+    u32 chunk_count;
+    u64 free_head; // ABA tag << 32 | index + 1 of the top free slot.
+    usize active;
+    usize max_active;
+    Mutex* grow_mutex;
+} ConnTable;
+
+// Table of entries of entry_size bytes (zeroed when first handed out) admitting at most max_active at once.
+ConnTable* ConnTable_New(const usize entry_size, const usize max_active) {
+    ConnTable* t = (ConnTable*)malloc(sizeof(ConnTable));
+    memset(t, 0, sizeof(ConnTable));
+    t->entry_size = entry_size;
+    t->stride = (sizeof(ConnSlot) + entry_size + CONN_CACHE_LINE - 1) / CONN_CACHE_LINE * CONN_CACHE_LINE;
+    t->max_active = max_active;
+    t->grow_mutex = Mutex_New();
+    return t;
+}
+
+void ConnTable_Dispose(ConnTable* restrict t) {
+    for (u32 i = 0; i < t->chunk_count; ++i)
+        free(t->chunks[i]);
+    Mutex_Dispose(t->grow_mutex);
+    free(t);
+}
+
+ConnSlot* _conn_slot(ConnTable* restrict t, const u32 index) {
+    u8* chunk = __atomic_load_n(&t->chunks[index / CONN_CHUNK_SLOTS], __ATOMIC_ACQUIRE);
+    return (ConnSlot*)(chunk + (usize)(index % CONN_CHUNK_SLOTS) * t->stride);
+}
+
+void* _conn_entry(ConnSlot* restrict slot) {
+    return (u8*)slot + sizeof(ConnSlot);
+}
+
+ConnSlot* _conn_slot_of(void* entry) {
+    return (ConnSlot*)((u8*)entry - sizeof(ConnSlot));
+}
+
+// Push the chain first..last (linked through next_free) onto the free stack. first and
+// last are the same slot for a single one, so they must not be restrict.
+void _conn_push(ConnTable* restrict t, ConnSlot* first, ConnSlot* last) {
+    u64 head = __atomic_load_n(&t->free_head, __ATOMIC_ACQUIRE);
+    for (;;) {
+        __atomic_store_n(&last->next_free, (u32)head, __ATOMIC_RELAXED);
+        const u64 new_head = ((head >> 32) + 1) << 32 | (u64)(first->index + 1);
+        if (__atomic_compare_exchange_n(&t->free_head, &head, new_head, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            return;
+    }
+}
+
+ConnSlot* _conn_pop(ConnTable* restrict t) {
+    u64 head = __atomic_load_n(&t->free_head, __ATOMIC_ACQUIRE);
+    for (;;) {
+        const u32 top = (u32)head;
+        if (top == 0)
+            return NULL;
+        ConnSlot* slot = _conn_slot(t, top - 1);
+        // May be stale if another thread pops the slot meanwhile, the tag makes the CAS fail then.
+        const u32 next = __atomic_load_n(&slot->next_free, __ATOMIC_RELAXED);
+        const u64 new_head = ((head >> 32) + 1) << 32 | (u64)next;
+        if (__atomic_compare_exchange_n(&t->free_head, &head, new_head, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return slot;
+    }
+}
+
+// Add a chunk of free slots. Returns false once CONN_MAX_CHUNKS are in use.
+bool _conn_grow(ConnTable* restrict t) {
+    Mutex_Lock(t->grow_mutex);
+    // Someone else may have grown the table or released slots while we waited.
+    if ((u32)__atomic_load_n(&t->free_head, __ATOMIC_ACQUIRE) != 0) {
+        Mutex_Unlock(t->grow_mutex);
+        return true;
+    }
+    const u32 chunk_index = t->chunk_count;
+    if (chunk_index >= CONN_MAX_CHUNKS) {
+        Mutex_Unlock(t->grow_mutex);
+        return false;
+    }
+    u8* chunk = NULL;
+    if (posix_memalign((void**)&chunk, CONN_CACHE_LINE, t->stride * CONN_CHUNK_SLOTS) != 0) {
+        Mutex_Unlock(t->grow_mutex);
+        return false;
+    }
+    memset(chunk, 0, t->stride * CONN_CHUNK_SLOTS);
+    const u32 base = chunk_index * CONN_CHUNK_SLOTS;
+    for (u32 i = 0; i < CONN_CHUNK_SLOTS; ++i) {
+        ConnSlot* slot = (ConnSlot*)(chunk + (usize)i * t->stride);
+        slot->index = base + i;
+        slot->next_free = (i + 1 < CONN_CHUNK_SLOTS) ? base + i + 2 : 0;
+    }
+    __atomic_store_n(&t->chunks[chunk_index], chunk, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->chunk_count, chunk_index + 1, __ATOMIC_RELEASE);
+    _conn_push(t, (ConnSlot*)chunk, (ConnSlot*)(chunk + (usize)(CONN_CHUNK_SLOTS - 1) * t->stride));
+    Mutex_Unlock(t->grow_mutex);
+    return true;
+}
+
+// Admit a connection: returns its entry, or NULL if max_active are in use.
+// The entry keeps whatever its previous user left in it.
+void* ConnTable_Acquire(ConnTable* restrict t) {
+    const usize max_active = __atomic_load_n(&t->max_active, __ATOMIC_RELAXED);
+    if (__atomic_fetch_add(&t->active, 1, __ATOMIC_ACQ_REL) >= max_active) {
+        __atomic_sub_fetch(&t->active, 1, __ATOMIC_ACQ_REL);
+        return NULL;
+    }
+    ConnSlot* slot;
+    while ((slot = _conn_pop(t)) == NULL) {
+        if (!_conn_grow(t)) {
+            __atomic_sub_fetch(&t->active, 1, __ATOMIC_ACQ_REL);
+            return NULL;
+        }
+    }
+    __atomic_add_fetch(&slot->generation, 1, __ATOMIC_ACQ_REL);
+    return _conn_entry(slot);
+}
+
+// Give an entry from ConnTable_Acquire() back.
+void ConnTable_Release(ConnTable* restrict t, void* entry) {
+    ConnSlot* slot = _conn_slot_of(entry);
+    __atomic_add_fetch(&slot->generation, 1, __ATOMIC_ACQ_REL);
+    _conn_push(t, slot, slot);
+    __atomic_sub_fetch(&t->active, 1, __ATOMIC_ACQ_REL);
+}
+
+// Slots allocated so far, entries 0 to ConnTable_Capacity() - 1 can be walked with ConnTable_At().
+usize ConnTable_Capacity(ConnTable* restrict t) {
+    return (usize)__atomic_load_n(&t->chunk_count, __ATOMIC_ACQUIRE) * CONN_CHUNK_SLOTS;
+}
+
+// Entry of slot index whether or not it is in use, see ConnTable_InUse().
+void* ConnTable_At(ConnTable* restrict t, const usize index) {
+    return _conn_entry(_conn_slot(t, (u32)index));
+}
+
+bool ConnTable_InUse(ConnTable* restrict t, const usize index) {
+    return __atomic_load_n(&_conn_slot(t, (u32)index)->generation, __ATOMIC_ACQUIRE) & 1;
+}
+
+usize ConnTable_Active(ConnTable* restrict t) {
+    return __atomic_load_n(&t->active, __ATOMIC_RELAXED);
+}
+
+void ConnTable_SetMax(ConnTable* restrict t, const usize max_active) {
+    __atomic_store_n(&t->max_active, max_active, __ATOMIC_RELAXED);
+}
+
+#endif // NETFS_SERVER_CONNTABLE_H
@@ -1,41 +1,158 @@
 #include <cs_sockets.h>
 #include <cs_threads.h>
+#include <cs_threadpool.h>
 #include <cs_systemio.h>
+#include <cs_time.h>
+#include <cs_trace.h>
+#include <cs_log.h>
 #include <stdnfs.h>
 #include <net_common.h>
+#include <net_transfer.h>
+#include "metrics.h"
+#include "shaper.h"
+#include "conntable.h"
+#include "membudget.h"
+#include "admission.h"
+#include "udpsend.h"
+#include "mcast.h"
 
-#define MAX_CLIENTS 256
+#define DEF_MAX_CLIENTS 256
 #define BUFFER_SIZE 64
 #define DEF_ARG_COUNT 256
+#define READAHEAD_WINDOW_MIN (u64)(4 * 1024 * 1024)
+#define DEF_IO_WORKERS 4
+#define DEF_STACK_SIZE (usize)(256 * 1024)
+#define DEF_CONNECTION_BUDGET (usize)(32 * 1024 * 1024)
+// Charged for every connection up front: its socket and the stack pages its thread touches.
+#define MEM_CONNECTION_BASE (sizeof(Socket) + 32 * 1024)
+// How long a request waits for memory to free up elsewhere before it is turned down.
+#define MEM_WAIT_MS 1000
+#define DEF_WAIT_QUEUE 64
+#define DEF_WAIT_TIMEOUT_MS 2000
+// Backlog of the I/O pool, per worker, beyond which new clients have to wait.
+#define IO_QUEUED_PER_WORKER 32
+// How long the socket of a turned away client waits for the client to close after the notice.
+#define TURN_AWAY_LINGER_MS 100
+// How often a connection serving a shared memory channel looks whether its client hung up.
+#define RING_POLL_MS 100
+
+// Read of one download chunk handed to the I/O pool.
+typedef struct _netfs_chunk_read {
+    FileHandle* file;
+    u8* buffer;
+    usize size;
+    u64 offset;
+    i64 result;
+} ChunkRead;
+
+// Upload in progress, written to <name>.part and renamed once complete.
+typedef struct _netfs_upload {
+    FileHandle* file;
+    u64 size;
+    u64 offset;
+    bool checksummed; // Frames carry checksums and a FileDigest follows them.
+    u32 digest;       // CRC32C of what arrived so far.
+    char name[CIO_PATH_MAX];
+} Upload;
+
+// A queued fget and, once it reached the head of the queue, its transfer state.
+typedef struct _netfs_download_job {
+    NetPacket* request;
+    u64 start_ns;
+
+    FileHandle* file;
+    u64 size;
+    u64 offset;      // Next byte to read.
+    u64 data_end;    // End of the data region offset is in, holes start there.
+    u64 readahead_end;
+    ChunkSizer sizer;
+    bool checksummed; // Frames carry checksums and a FileDigest follows them.
+    u32 digest;       // CRC32C of what went out so far.
+
+    // Chunk read but not yet sent in full.
+    u8* buffer;
+    usize buffer_size;
+    usize buffer_length;
+    usize buffer_sent;
+
+    // Next chunk, read on the I/O pool while the one above goes out.
+    ThreadPoolFuture* prefetch;
+    ChunkRead prefetch_read;
+    usize prefetch_buffer_size;
+
+    struct _netfs_download_job* next;
+} DownloadJob;
 
 typedef struct _netfs_connection {
     Socket* socket;
     bool available;
-    usize id;
+    usize id; // Never reused, unlike slots.
     Thread* owning_thread;
     Mutex* mutex;
+
+    // Only allocated while an upload is in progress, most connections never upload.
+    Upload* upload;
+    MemAccount memory;
+
+    // Written only by the connection's thread, reported while metrics_attached is set.
+    MetricsShard metrics;
+    bool metrics_attached;
+
+    ShaperFlow shaper_flow;
+    // Integrity checks (SetIntegrity) of fgets started and fups begun from now on.
+    u32 integrity;
+
+    // fgets in the order they were requested, the head one is being sent.
+    DownloadJob* downloads;
+    DownloadJob* downloads_tail;
 } Connection;
 
+// A listening socket and the thread accepting on it. A sharded server (-A) has one per core,
+// all bound to the same port through SO_REUSEPORT, otherwise the main thread is the only one.
+typedef struct _netfs_acceptor {
+    Socket* listener;
+    usize index;
+    bool pinned; // The acceptor thread stays on cpus.
+    CpuSet cpus;
+    Thread* thread;
+} Acceptor;
+
 
-Socket* g_server = NULL;
-Connection* g_clients = NULL;
-usize g_client_count = 0;
-usize g_active_clients = 0;
-Thread** g_threads;
-Mutex* g_threads_mutex = NULL;
+Acceptor* g_acceptors = NULL;
+usize g_acceptor_count = 0;
+// Listener for clients on this host (-U), its connections are served like any other.
+Acceptor g_local_acceptor;
+const char* g_local_path = NULL;
+SocketOptions g_socket_options;
+ConnTable* g_connections = NULL;
+usize g_max_clients = DEF_MAX_CLIENTS;
+usize g_next_connection_id = 0;
 char g_root_dir[CIO_PATH_MAX];
 
-Connection* get_next_available_slot() {
-    Mutex_Lock(g_threads_mutex);
-    for (usize i = 0; i < g_client_count; ++i) {
-        if (!g_clients[i].available) {
-            Mutex_Unlock(g_threads_mutex);
-            return g_clients + i;
-        }
-    }
-    Mutex_Unlock(g_threads_mutex);
-    return NULL;
-}
+// Metrics of connections that have closed. g_metrics_mutex also guards attaching and
+// detaching connection shards, never the recording itself.
+MetricsShard g_metrics_retired;
+Mutex* g_metrics_mutex = NULL;
+u64 g_connections_total = 0;
+u32 g_metrics_interval_s = 0;
+
+Shaper* g_shaper = NULL;
+// Blocking file reads of downloads, NULL if disabled with -W 0.
+ThreadPool* g_io_pool = NULL;
+
+// Every connection's MemAccount draws from g_memory.
+MemBudget g_memory;
+usize g_connection_budget = DEF_CONNECTION_BUDGET;
+usize g_stack_size = DEF_STACK_SIZE;
+
+AdmissionPolicy g_admission;
+// Clients waiting for load to drop, NULL if they are turned away right away (-Q 0).
+AdmissionQueue* g_wait_queue = NULL;
+TurnAwayReaper* g_reaper = NULL; // Closes the sockets of turned away clients.
+usize g_active_transfers = 0; // Connections with downloads queued.
+// Multicast distribution (-C), NULL if it is off.
+McastDistributor* g_mcast = NULL;
+u64 g_turned_away = 0;
 
 void parse_command(char* restrict str, const char*** args, usize* args_size, usize* arg_count) {
     // Parse the command by splitting it into tokens seperated by space, tab and new line characters.
@@ -51,6 +168,1004 @@ void parse_command(char* restrict str, const char*** args, usize* args_size, usi
     *arg_count = i;
 }
 
+// Error reply carrying msg, counted against c.
+NetPacket* net_error_packet(Connection* c, const char* restrict msg) {
+    MetricsShard_RecordError(&c->metrics);
+    return NetPacket_New(NetPacketType_Error, (const u8*)msg, strlen(msg) + 1);
+}
+
+i32 net_send_error(Connection* c, const char* restrict msg) {
+    NetPacket* packet = net_error_packet(c, msg);
+    i32 res = NetPacket_Send(c->socket, packet);
+    NetPacket_Dispose(packet);
+    return res;
+}
+
+// Check whether the client's cached copy described by v is still current.
+// Matching size and mtime is enough, if only the mtime moved (fresh checkout, touch)
+// the content hash decides so an identical file is still not sent again.
+bool net_file_unchanged(FileHandle* restrict f, const FileValidator* restrict v) {
+    if (v->size != f->size)
+        return false;
+    if (v->mtime == (i64)f->mtime)
+        return true;
+    if (v->hash == 0)
+        return false;
+
+    const usize HASH_BUFFER_SIZE = 1024 * 1024;
+    u8* buffer = (u8*)malloc(HASH_BUFFER_SIZE);
+    u64 h = NET_HASH_SEED;
+    u64 offset = 0;
+    File_Advise(f, 0, 0, FileAdvice_Sequential);
+    while (offset < f->size) {
+        const i64 read_bytes = File_ReadAt(f, buffer, HASH_BUFFER_SIZE, offset);
+        if (read_bytes <= 0)
+            break;
+        h = Hash_Fnv1a64(h, buffer, (usize)read_bytes);
+        offset += (u64)read_bytes;
+    }
+    free(buffer);
+    return offset == f->size && h == v->hash;
+}
+
+// Names sent by clients are relative to the served root. Absolute paths and
+// anything climbing out of it through ".." are refused.
+bool net_path_is_safe(const char* restrict name) {
+    if (*name == 0 || *name == '/' || *name == '\\')
+        return false;
+    const char* p = name;
+    while (*p) {
+        const char* end = p + strcspn(p, "/\\");
+        if (end - p == 2 && p[0] == '.' && p[1] == '.')
+            return false;
+        p = (*end) ? end + 1 : end;
+    }
+    return true;
+}
+
+// Size of the NUL terminated name at the start of a request, 0 if the request is malformed.
+usize net_request_name_size(const NetPacket* restrict request) {
+    const char* name = (const char*)request->buffer;
+    const usize name_size = (name) ? strnlen(name, request->header.size) + 1 : 0;
+    if (name_size == 0 || name_size > request->header.size || !net_path_is_safe(name))
+        return 0;
+    return name_size;
+}
+
+// Queue the fget in request, it is answered by net_continue_download() in order with
+// the fgets before it. Takes ownership of request.
+void net_queue_download(Connection* c, NetPacket* request) {
+    // Charged together with the request payload before it was received.
+    DownloadJob* job = (DownloadJob*)malloc(sizeof(DownloadJob));
+    memset(job, 0, sizeof(DownloadJob));
+    job->request = request;
+    job->start_ns = Time_NowNs();
+    if (!c->downloads)
+        __atomic_add_fetch(&g_active_transfers, 1, __ATOMIC_RELAXED);
+    if (c->downloads_tail)
+        c->downloads_tail->next = job;
+    else
+        c->downloads = job;
+    c->downloads_tail = job;
+}
+
+void net_dispose_download(Connection* c, DownloadJob* job) {
+    // The read may still be running on the pool, it has to be done with file and buffer.
+    if (job->prefetch)
+        ThreadPoolFuture_Dispose(job->prefetch);
+    MemAccount_Release(&c->memory, sizeof(DownloadJob) + job->request->header.size + job->buffer_size + job->prefetch_buffer_size);
+    free(job->prefetch_read.buffer);
+    if (job->file)
+        File_Close(job->file);
+    free(job->buffer);
+    NetPacket_Dispose(job->request);
+    free(job);
+}
+
+// Open the file and send FileInfo (or FileNotModified, or an error).
+// Returns false if nothing follows.
+bool _download_start(Connection* c, DownloadJob* job) {
+    const NetPacket* request = job->request;
+    const char* name = (const char*)request->buffer;
+    const usize name_size = net_request_name_size(request);
+    if (name_size == 0) {
+        net_send_error(c, "Bad request");
+        return false;
+    }
+
+    FileHandle* f = File_Open(name, FileMode_Read);
+    if (!f) {
+        net_send_error(c, "File not found");
+        return false;
+    }
+
+    FileStat stat = {f->size, (i64)f->mtime};
+    if (request->header.size >= name_size + sizeof(FileValidator)) {
+        FileValidator validator;
+        memcpy(&validator, request->buffer + name_size, sizeof(validator));
+        if (net_file_unchanged(f, &validator)) {
+            NetPacket not_modified_packet = {{NetPacketType_FileNotModified, sizeof(stat)}, (u8*)&stat};
+            NetPacket_Send(c->socket, &not_modified_packet);
+            File_Close(f);
+            return false;
+        }
+    }
+
+    NetPacket info_packet = {{NetPacketType_FileInfo, sizeof(stat)}, (u8*)&stat};
+    if (NetPacket_Send(c->socket, &info_packet) == CS_SOCKET_ERROR) {
+        File_Close(f);
+        LOG_WARN("Download failed.\n");
+        return false;
+    }
+
+    job->file = f;
+    job->size = f->size;
+    job->checksummed = c->integrity == NET_INTEGRITY_CRC32C;
+    // We read front to back exactly once, let the kernel read ahead aggressively
+    // and keep an explicit window in flight ahead of the read position.
+    File_Advise(f, 0, 0, FileAdvice_Sequential);
+    job->readahead_end = (job->size < READAHEAD_WINDOW_MIN) ? job->size : READAHEAD_WINDOW_MIN;
+    File_Readahead(f, 0, job->readahead_end);
+    ChunkSizer_Init(&job->sizer, c->socket);
+    return job->size > 0;
+}
+
+// Charge bytes to c, waiting up to MEM_WAIT_MS for other connections to give memory back.
+bool net_charge_wait(Connection* c, const usize bytes) {
+    if (!MemAccount_Exceeds(&c->memory, bytes)) {
+        const u64 deadline_ns = Time_NowNs() + MEM_WAIT_MS * CTM_NS_PER_MS;
+        for (;;) {
+            const u64 seen = MemBudget_Releases(c->memory.budget);
+            if (MemAccount_Charge(&c->memory, bytes))
+                return true;
+            if (!MemBudget_WaitRelease(c->memory.budget, seen, deadline_ns))
+                break;
+        }
+    }
+    MemAccount_Refuse(&c->memory);
+    return false;
+}
+
+// Grow *buffer to size bytes and charge the growth to c. Under memory pressure a buffer
+// that already holds a minimum chunk stays as it is and a smaller chunk is read into it,
+// a smaller one is grown to a minimum chunk if wait and memory frees up in time.
+// Returns the size that can be read, 0 if not even a minimum chunk fits.
+usize net_grow_buffer(Connection* c, u8** buffer, usize* buffer_size, usize size, const bool wait) {
+    if (size <= *buffer_size)
+        return size;
+    if (!MemAccount_Charge(&c->memory, size - *buffer_size)) {
+        if (*buffer_size >= NET_CHUNK_MIN_SIZE)
+            return *buffer_size;
+        if (size > NET_CHUNK_MIN_SIZE)
+            size = NET_CHUNK_MIN_SIZE;
+        if (!wait || !net_charge_wait(c, size - *buffer_size))
+            return (wait) ? 0 : *buffer_size;
+    }
+    *buffer = (u8*)realloc(*buffer, size);
+    *buffer_size = size;
+    return size;
+}
+
+ThreadArg _download_read_task(ThreadArg args) {
+    ChunkRead* r = (ChunkRead*)args;
+    TRACE_BEGIN(read);
+    r->result = File_ReadAt(r->file, r->buffer, r->size, r->offset);
+    TRACE_END(read, "file_read");
+    return NULL;
+}
+
+// Start reading the chunk after the current one on the I/O pool. Only done within the
+// current data region, the next region's start is found on the connection's thread.
+void _download_prefetch(Connection* c, DownloadJob* job) {
+    if (!g_io_pool || job->offset >= job->data_end)
+        return;
+    usize chunk_size = ChunkSizer_Next(&job->sizer);
+    if (chunk_size > job->data_end - job->offset)
+        chunk_size = (usize)(job->data_end - job->offset);
+    ChunkRead* r = &job->prefetch_read;
+    // No memory for a second buffer, the next chunk is read when it is needed instead.
+    chunk_size = net_grow_buffer(c, &r->buffer, &job->prefetch_buffer_size, chunk_size, false);
+    if (chunk_size == 0)
+        return;
+    r->file = job->file;
+    r->size = chunk_size;
+    r->offset = job->offset;
+    r->result = 0;
+    job->prefetch = ThreadPool_Submit(g_io_pool, _download_read_task, r);
+}
+
+// Read the next chunk into the job's buffer, or send a hole marker for a sparse region.
+// Returns false on failure.
+bool _download_fill(Connection* c, DownloadJob* job) {
+    FileHandle* f = job->file;
+    if (job->offset >= job->data_end) {
+        const i64 data_start = File_SeekData(f, job->offset);
+        if ((u64)data_start > job->offset) {
+            u64 hole_size = (u64)data_start - job->offset;
+            NetPacket hole_packet = {{NetPacketType_FileDownloadHole, sizeof(hole_size)}, (u8*)&hole_size};
+            if (NetPacket_Send(c->socket, &hole_packet) == CS_SOCKET_ERROR)
+                return false;
+            if (job->checksummed)
+                job->digest = Crc32c_Zeroes(job->digest, hole_size);
+            job->offset = (u64)data_start;
+            return true;
+        }
+        job->data_end = (u64)File_SeekHole(f, job->offset);
+    }
+
+    i64 read_bytes;
+    usize chunk_size;
+    if (job->prefetch) {
+        // Usually done by now, the previous chunk took a while to send.
+        TRACE_BEGIN(wait);
+        ThreadPoolFuture_Dispose(job->prefetch);
+        TRACE_END(wait, "read_wait");
+        job->prefetch = NULL;
+        // Swap buffers, the one just sent takes the next prefetch.
+        u8* buffer = job->buffer;
+        const usize buffer_size = job->buffer_size;
+        job->buffer = job->prefetch_read.buffer;
+        job->buffer_size = job->prefetch_buffer_size;
+        job->prefetch_read.buffer = buffer;
+        job->prefetch_buffer_size = buffer_size;
+        chunk_size = job->prefetch_read.size;
+        read_bytes = job->prefetch_read.result;
+    } else {
+        chunk_size = ChunkSizer_Next(&job->sizer);
+        if (chunk_size > job->data_end - job->offset)
+            chunk_size = (usize)(job->data_end - job->offset);
+        chunk_size = net_grow_buffer(c, &job->buffer, &job->buffer_size, chunk_size, true);
+        if (chunk_size == 0) {
+            net_send_error(c, "Server is out of memory");
+            return false;
+        }
+        TRACE_BEGIN(read);
+        read_bytes = File_ReadAt(f, job->buffer, chunk_size, job->offset);
+        TRACE_END(read, "file_read");
+    }
+
+    const u64 readahead_window = (4 * (u64)chunk_size > READAHEAD_WINDOW_MIN) ? 4 * (u64)chunk_size : READAHEAD_WINDOW_MIN;
+    if (job->readahead_end < job->size && job->offset + readahead_window / 2 >= job->readahead_end) {
+        File_Readahead(f, job->readahead_end, readahead_window);
+        job->readahead_end += readahead_window;
+    }
+
+    if (read_bytes <= 0) {
+        net_send_error(c, "File read error");
+        return false;
+    }
+    job->buffer_length = (usize)read_bytes;
+    job->buffer_sent = 0;
+    job->offset += (u64)read_bytes;
+    _download_prefetch(c, job);
+    return true;
+}
+
+// Send the next frame of the download at the head of the queue, finishing it (and moving
+// on to the next one) when it is done. Big chunks are read at once but go out in frames
+// of at most NET_BULK_FRAME_SIZE so requests that come in meanwhile get their turn.
+void net_continue_download(Connection* c) {
+    DownloadJob* job = c->downloads;
+    bool more = false;
+    if (!job->file) {
+        more = _download_start(c, job);
+    } else if (job->buffer_sent == job->buffer_length) {
+        more = _download_fill(c, job) && (job->offset < job->size || job->buffer_length > 0);
+    } else {
+        usize frame_size = job->buffer_length - job->buffer_sent;
+        if (frame_size > NET_BULK_FRAME_SIZE)
+            frame_size = NET_BULK_FRAME_SIZE;
+        const usize shaped_size = Shaper_ChunkLimit(g_shaper);
+        if (shaped_size && frame_size > shaped_size)
+            frame_size = shaped_size;
+
+        // Send straight from the read buffer instead of copying it into a new packet.
+        NetPacket data_packet = {{NetPacketType_FileDownloadData, frame_size}, job->buffer + job->buffer_sent};
+        Shaper_Wait(g_shaper, &c->shaper_flow, frame_size);
+        i32 sent;
+        if (job->checksummed) {
+            const u32 checksum = Crc32c_Update(0, data_packet.buffer, frame_size);
+            job->digest = Crc32c_Combine(job->digest, checksum, frame_size);
+            TRACE_BEGIN(send);
+            sent = NetPacket_SendWithChecksum(c->socket, &data_packet, checksum);
+            TRACE_END(send, "send");
+        } else {
+            TRACE_BEGIN(send);
+            sent = NetPacket_Send(c->socket, &data_packet);
+            TRACE_END(send, "send");
+        }
+        if (sent == CS_SOCKET_ERROR) {
+            LOG_WARN("Download failed.\n");
+        } else {
+            ChunkSizer_Update(&job->sizer, c->socket, frame_size);
+            job->buffer_sent += frame_size;
+            if (job->buffer_sent == job->buffer_length)
+                job->buffer_length = job->buffer_sent = 0;
+            more = job->offset < job->size || job->buffer_length > 0;
+        }
+    }
+    if (more)
+        return;
+
+    // Only a download that went through is vouched for, the client gives up on the others.
+    if (job->checksummed && job->offset >= job->size && job->buffer_length == 0) {
+        FileDigest digest = {job->size, job->digest, 0};
+        NetPacket digest_packet = {{NetPacketType_FileDigest, sizeof(digest)}, (u8*)&digest};
+        NetPacket_Send(c->socket, &digest_packet);
+    }
+
+    // Latency of an fget covers the whole transfer, including the wait behind earlier ones.
+    MetricsShard_Record(&c->metrics, NetPacketType_FileDownloadRequest, Time_NowNs() - job->start_ns);
+    c->downloads = job->next;
+    if (!c->downloads) {
+        c->downloads_tail = NULL;
+        __atomic_sub_fetch(&g_active_transfers, 1, __ATOMIC_RELAXED);
+    }
+    net_dispose_download(c, job);
+}
+
+void net_dispose_upload(Connection* c) {
+    File_Close(c->upload->file);
+    free(c->upload);
+    c->upload = NULL;
+    MemAccount_Release(&c->memory, sizeof(Upload));
+}
+
+void net_abort_upload(Connection* c) {
+    char part_path[CIO_PATH_MAX + 8];
+    snprintf(part_path, sizeof(part_path), "%s.part", c->upload->name);
+    net_dispose_upload(c);
+    remove(part_path);
+}
+
+void net_finish_upload(Connection* c) {
+    char name[CIO_PATH_MAX];
+    char part_path[CIO_PATH_MAX + 8];
+    const u64 size = c->upload->size;
+    snprintf(name, sizeof(name), "%s", c->upload->name);
+    snprintf(part_path, sizeof(part_path), "%s.part", name);
+    net_dispose_upload(c);
+    if (rename(part_path, name) != 0) {
+        remove(part_path);
+        net_send_error(c, "Failed to store uploaded file");
+        return;
+    }
+
+    char msg[CIO_PATH_MAX + 64];
+    snprintf(msg, sizeof(msg), "Uploaded %s (%llu bytes)\n", name, (unsigned long long)size);
+    NetPacket* packet = NetPacket_New(NetPacketType_Message, (const u8*)msg, strlen(msg) + 1);
+    NetPacket_Send(c->socket, packet);
+    NetPacket_Dispose(packet);
+}
+
+// FileUploadRequest: NUL terminated name followed by the FileStat of the local file.
+// Acknowledged with FileInfo, after which the client streams FileUploadData packets.
+void net_begin_upload(Connection* c, const NetPacket* restrict request) {
+    const usize name_size = net_request_name_size(request);
+    if (name_size == 0 || request->header.size < name_size + sizeof(FileStat)) {
+        net_send_error(c, "Bad request");
+        return;
+    }
+    if (c->upload)
+        net_abort_upload(c);
+    if (!net_charge_wait(c, sizeof(Upload))) {
+        net_send_error(c, "Server is out of memory");
+        return;
+    }
+    c->upload = (Upload*)malloc(sizeof(Upload));
+
+    FileStat stat;
+    memcpy(&stat, request->buffer + name_size, sizeof(stat));
+    snprintf(c->upload->name, sizeof(c->upload->name), "%s", (const char*)request->buffer);
+
+    char part_path[CIO_PATH_MAX + 8];
+    snprintf(part_path, sizeof(part_path), "%s.part", c->upload->name);
+    c->upload->file = File_Open(part_path, FileMode_Write);
+    if (!c->upload->file) {
+        free(c->upload);
+        c->upload = NULL;
+        MemAccount_Release(&c->memory, sizeof(Upload));
+        net_send_error(c, "Failed to create file");
+        return;
+    }
+    c->upload->size = stat.size;
+    c->upload->offset = 0;
+    c->upload->checksummed = c->integrity == NET_INTEGRITY_CRC32C;
+    c->upload->digest = 0;
+
+    NetPacket ack_packet = {{NetPacketType_FileInfo, sizeof(stat)}, (u8*)&stat};
+    if (NetPacket_Send(c->socket, &ack_packet) == CS_SOCKET_ERROR) {
+        net_abort_upload(c);
+        return;
+    }
+    if (c->upload->size == 0 && !c->upload->checksummed)
+        net_finish_upload(c);
+}
+
+void net_receive_upload_data(Connection* c, const NetPacket* restrict data) {
+    // Data after a failed upload is dropped quietly, the client already got an error.
+    Upload* u = c->upload;
+    if (!u)
+        return;
+
+    usize size = data->header.size;
+    if (u->checksummed) {
+        u32 checksum = 0;
+        if (size < NET_CHECKSUM_SIZE) {
+            net_abort_upload(c);
+            net_send_error(c, "Bad request");
+            return;
+        }
+        size -= NET_CHECKSUM_SIZE;
+        memcpy(&checksum, data->buffer + size, NET_CHECKSUM_SIZE);
+        const u32 expected = Crc32c_Update(0, data->buffer, size);
+        if (checksum != expected) {
+            LOG_WARN("Upload of %s: checksum mismatch at offset %llu.\n", u->name, (unsigned long long)u->offset);
+            net_abort_upload(c);
+            net_send_error(c, "Upload checksum mismatch");
+            return;
+        }
+        u->digest = Crc32c_Combine(u->digest, checksum, size);
+    }
+    if (u->offset + size > u->size) {
+        net_abort_upload(c);
+        net_send_error(c, "Upload exceeds the announced size");
+        return;
+    }
+    if (File_WriteAt(u->file, data->buffer, size, u->offset) != (i64)size) {
+        net_abort_upload(c);
+        net_send_error(c, "File write error");
+        return;
+    }
+    u->offset += size;
+    // A checksummed upload waits for the client's FileDigest.
+    if (u->offset == u->size && !u->checksummed)
+        net_finish_upload(c);
+}
+
+// FileDigest closing a checksummed upload: the file is kept only if it matches what arrived.
+void net_receive_upload_digest(Connection* c, const NetPacket* restrict packet) {
+    Upload* u = c->upload;
+    if (!u)
+        return;
+    FileDigest digest;
+    if (!u->checksummed || packet->header.size < sizeof(digest) || u->offset != u->size) {
+        net_abort_upload(c);
+        net_send_error(c, "Bad request");
+        return;
+    }
+    memcpy(&digest, packet->buffer, sizeof(digest));
+    if (digest.size != u->size || digest.crc32c != u->digest) {
+        LOG_WARN("Upload of %s: the file digest does not match.\n", u->name);
+        net_abort_upload(c);
+        net_send_error(c, "Upload digest mismatch");
+        return;
+    }
+    net_finish_upload(c);
+}
+
+// SetIntegrity: turn integrity checks of later fgets and fups on or off, answered with the
+// mode now in effect. Unknown modes turn them off.
+void net_set_integrity(Connection* c, const NetPacket* restrict request) {
+    IntegrityMode mode = {NET_INTEGRITY_NONE};
+    if (request->header.size >= sizeof(mode))
+        memcpy(&mode, request->buffer, sizeof(mode));
+    if (mode.mode != NET_INTEGRITY_CRC32C)
+        mode.mode = NET_INTEGRITY_NONE;
+    c->integrity = mode.mode;
+    NetPacket reply = {{NetPacketType_SetIntegrity, sizeof(mode)}, (u8*)&mode};
+    NetPacket_Send(c->socket, &reply);
+}
+
+// Whether the client runs on this host: on the local socket as the server's user (or root),
+// or over loopback.
+bool net_is_local_peer(Socket* restrict s) {
+    if (s->family == AddressFamily_Local) {
+        u32 uid = 0;
+        u32 gid = 0;
+        return Socket_GetPeerCredentials(s, &uid, &gid) != CS_SOCKET_ERROR && (uid == 0 || uid == (u32)geteuid());
+    }
+    if (s->remote_ep.address.ipv4_addr.sin_family == AF_INET6) {
+        const struct in6_addr* addr = &s->remote_ep.address.ipv6_addr.sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(addr) || (IN6_IS_ADDR_V4MAPPED(addr) && addr->s6_addr[12] == 127);
+    }
+    return (ntohl(s->remote_ep.address.ipv4_addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+// SetRate: change the global and per connection limits, answered with the limits now in
+// effect. Only accepted from this host, i.e. by whoever runs the server.
+void net_set_rate(Connection* c, const NetPacket* restrict request) {
+    if (request->header.size < sizeof(RateLimits)) {
+        net_send_error(c, "Bad request");
+        return;
+    }
+    if (!net_is_local_peer(c->socket)) {
+        net_send_error(c, "Rate limits can only be changed locally");
+        return;
+    }
+
+    RateLimits limits;
+    memcpy(&limits, request->buffer, sizeof(limits));
+    Shaper_SetRates(g_shaper, limits.global, limits.per_connection);
+    Shaper_GetRates(g_shaper, &limits.global, &limits.per_connection);
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Rate limits: global %llu B/s, per connection %llu B/s (0 is unlimited)\n",
+             (unsigned long long)limits.global, (unsigned long long)limits.per_connection);
+    NetPacket* packet = NetPacket_New(NetPacketType_Message, (const u8*)msg, strlen(msg) + 1);
+    NetPacket_Send(c->socket, packet);
+    NetPacket_Dispose(packet);
+    LOG_INFO("%s", msg);
+}
+
+// Snapshot of the server wide totals and, if per_connection, of every live connection.
+NetPacket* metrics_snapshot(const bool per_connection) {
+    NetPacket* p = NetPacket_New(NetPacketType_Message, NULL, 0);
+    MetricsShard total;
+    memset(&total, 0, sizeof(total));
+
+    Mutex_Lock(g_metrics_mutex);
+    MetricsShard_Merge(&total, &g_metrics_retired);
+    // Slots never go away, a slot whose connection is closing is skipped by metrics_attached.
+    const usize capacity = ConnTable_Capacity(g_connections);
+    for (usize i = 0; i < capacity; ++i) {
+        Connection* c = (Connection*)ConnTable_At(g_connections, i);
+        if (c->metrics_attached)
+            MetricsShard_Merge(&total, &c->metrics);
+    }
+    Metrics_Append(p, "connections: %zu active, %llu total\n",
+                   ConnTable_Active(g_connections),
+                   (unsigned long long)g_connections_total);
+    Metrics_Append(p, "admission: %zu transfers, %zu waiting, %llu turned away\n",
+                   __atomic_load_n(&g_active_transfers, __ATOMIC_RELAXED),
+                   (g_wait_queue) ? AdmissionQueue_Length(g_wait_queue) : (usize)0,
+                   (unsigned long long)__atomic_load_n(&g_turned_away, __ATOMIC_RELAXED));
+    Metrics_Append(p, "memory: %.2f MB used, %.2f MB peak, %llu requests refused\n",
+                   (double)__atomic_load_n(&g_memory.used, __ATOMIC_RELAXED) / (1024.0 * 1024.0),
+                   (double)__atomic_load_n(&g_memory.peak, __ATOMIC_RELAXED) / (1024.0 * 1024.0),
+                   (unsigned long long)__atomic_load_n(&g_memory.refused, __ATOMIC_RELAXED));
+    Metrics_Format(p, &total);
+    if (g_io_pool) {
+        ThreadPoolStats pool_stats;
+        ThreadPool_GetStats(g_io_pool, &pool_stats);
+        Metrics_Append(p, "io pool: %zu workers, %zu queued, %llu done, %llu stolen\n",
+                       pool_stats.workers, pool_stats.queued,
+                       (unsigned long long)pool_stats.completed,
+                       (unsigned long long)pool_stats.stolen);
+    }
+
+    if (per_connection) {
+        for (usize i = 0; i < capacity; ++i) {
+            Connection* c = (Connection*)ConnTable_At(g_connections, i);
+            if (!c->metrics_attached)
+                continue;
+            Metrics_Append(p, "[%s:%hu] mem %.1f KB (peak %.1f KB), ",
+                           c->socket->remote_ep.address.str, c->socket->remote_ep.port,
+                           (double)__atomic_load_n(&c->memory.used, __ATOMIC_RELAXED) / 1024.0,
+                           (double)__atomic_load_n(&c->memory.peak, __ATOMIC_RELAXED) / 1024.0);
+            Metrics_Format(p, &c->metrics);
+        }
+    }
+    Mutex_Unlock(g_metrics_mutex);
+
+    MetricsShard_Dispose(&total);
+    return p;
+}
+
+void metrics_attach(Connection* c) {
+    Mutex_Lock(g_metrics_mutex);
+    c->metrics_attached = true;
+    ++g_connections_total;
+    Mutex_Unlock(g_metrics_mutex);
+}
+
+// Fold the connection's counters into the retired totals before its socket goes away.
+void metrics_detach(Connection* c) {
+    Mutex_Lock(g_metrics_mutex);
+    MetricsShard_Merge(&g_metrics_retired, &c->metrics);
+    MetricsShard_Reset(&c->metrics);
+    c->metrics_attached = false;
+    Mutex_Unlock(g_metrics_mutex);
+}
+
+// Stats: answered with a Message holding the totals and one section per live connection.
+void net_send_stats(Connection* c) {
+    NetPacket* p = metrics_snapshot(true);
+    NetPacket_Send(c->socket, p);
+    NetPacket_Dispose(p);
+}
+
+// Periodic dump enabled with -m.
+ThreadArg metrics_dump_thread(ThreadArg args) {
+    (void)args;
+    for (;;) {
+        sleep(g_metrics_interval_s);
+        NetPacket* p = metrics_snapshot(false);
+        fputs((const char*)p->buffer, stdout);
+        fflush(stdout);
+        NetPacket_Dispose(p);
+    }
+    return NULL;
+}
+
+// Whether the client at the other end of local socket s may read f itself. The server
+// checks on its behalf since the descriptor it passes carries the server's access.
+bool net_peer_may_read(Socket* restrict s, FileHandle* restrict f) {
+    u32 uid = 0;
+    u32 gid = 0;
+    struct stat st;
+    if (Socket_GetPeerCredentials(s, &uid, &gid) == CS_SOCKET_ERROR || fstat(f->_native_handle, &st) == -1)
+        return false;
+    if (uid == 0 || uid == (u32)geteuid())
+        return true;
+    if (uid == (u32)st.st_uid)
+        return (st.st_mode & S_IRUSR) != 0;
+    if (gid == (u32)st.st_gid)
+        return (st.st_mode & S_IRGRP) != 0;
+    return (st.st_mode & S_IROTH) != 0;
+}
+
+// FileOpenRequest from a client on this host: instead of the file's contents it gets the
+// open file itself (FileHandle with the descriptor attached) and reads it directly.
+void net_send_file_handle(Connection* c, const NetPacket* request) {
+    // Replies go out in request order, fgets queued before this one come first.
+    while (c->downloads && c->socket->connected)
+        net_continue_download(c);
+
+    if (c->socket->family != AddressFamily_Local) {
+        net_send_error(c, "File handles are only passed to local clients");
+        return;
+    }
+    const char* name = (const char*)request->buffer;
+    if (net_request_name_size(request) == 0) {
+        net_send_error(c, "Bad request");
+        return;
+    }
+    FileHandle* f = File_Open(name, FileMode_Read);
+    if (!f) {
+        net_send_error(c, "File not found");
+        return;
+    }
+    if (!net_peer_may_read(c->socket, f)) {
+        File_Close(f);
+        net_send_error(c, "Permission denied");
+        return;
+    }
+
+    FileStat stat = {f->size, (i64)f->mtime};
+    NetPacket handle_packet = {{NetPacketType_FileHandle, sizeof(stat)}, (u8*)&stat};
+    if (NetPacket_SendWithFd(c->socket, &handle_packet, f->_native_handle) == CS_SOCKET_ERROR)
+        LOG_WARN("Passing %s to client (%zu) failed.\n", name, c->id);
+    // The client holds its own reference now.
+    File_Close(f);
+}
+
+// Listing of cwd in a Message, or an Error. *charge is what the reply holds charged to c,
+// the caller releases it once the reply went out.
+NetPacket* net_list_entries(Connection* c, const char* restrict cwd, usize* charge) {
+    *charge = 0;
+    TRACE_BEGIN(directory);
+    DirectoryInfo* dirinf = Directory_Open(cwd);
+    TRACE_END(directory, "directory_open");
+    if (!dirinf)
+        return net_error_packet(c, "File not found");
+    // Index, type and size take well under 64 characters per line.
+    usize listing_size = 0;
+    for (usize i = 0; i < dirinf->entries_count; ++i)
+        listing_size += strlen(dirinf->entries[i].name) + 64;
+    if (!net_charge_wait(c, listing_size)) {
+        Directory_Close(dirinf);
+        return net_error_packet(c, "Server is out of memory");
+    }
+    *charge = listing_size;
+
+    NetPacket* send_packet = NetPacket_New(NetPacketType_Message, NULL, 0);
+    const usize DIR_BUFFER_SIZE = CIO_PATH_MAX + 1024;
+    char* dir_buffer = (char*)malloc(sizeof(char) * DIR_BUFFER_SIZE);
+    for (usize i = 0; i < dirinf->entries_count; ++i) {
+        memset(dir_buffer, 0, DIR_BUFFER_SIZE);
+        snprintf(
+            dir_buffer,
+            DIR_BUFFER_SIZE,
+            "[%zu] (%c) %zu\t%s\n",
+            i,
+            (dirinf->entries[i].type == EntryType_File) ? 'f' : 'd',
+            dirinf->entries[i].size,
+            dirinf->entries[i].name);
+        NetPacket_AddData(
+            send_packet,
+            (u8*)dir_buffer,
+            (i == dirinf->entries_count - 1) ? strlen(dir_buffer) + 1 : strlen(dir_buffer));
+    }
+    free(dir_buffer);
+    Directory_Close(dirinf);
+    return send_packet;
+}
+
+// FileReadRequest: up to NET_READ_MAX bytes of a file in one FileReadData, or an Error.
+// *charge is what the reply holds charged to c, as for net_list_entries().
+NetPacket* net_read_range(Connection* c, const NetPacket* restrict request, usize* charge) {
+    *charge = 0;
+    const usize name_size = net_request_name_size(request);
+    if (name_size == 0 || request->header.size < name_size + sizeof(FileRange))
+        return net_error_packet(c, "Bad request");
+    FileRange range;
+    memcpy(&range, request->buffer + name_size, sizeof(range));
+
+    FileHandle* f = File_Open((const char*)request->buffer, FileMode_Read);
+    if (!f)
+        return net_error_packet(c, "File not found");
+    u64 size = (range.offset < f->size) ? f->size - range.offset : 0;
+    if (size > range.size)
+        size = range.size;
+    if (size > NET_READ_MAX)
+        size = NET_READ_MAX;
+    if (!net_charge_wait(c, (usize)size)) {
+        File_Close(f);
+        return net_error_packet(c, "Server is out of memory");
+    }
+
+    NetPacket* reply = NetPacket_New(NetPacketType_FileReadData, NULL, 0);
+    if (size > 0) {
+        reply->buffer = (u8*)malloc((usize)size);
+        const i64 read_bytes = File_ReadAt(f, reply->buffer, (usize)size, range.offset);
+        if (read_bytes < 0) {
+            File_Close(f);
+            NetPacket_Dispose(reply);
+            MemAccount_Release(&c->memory, (usize)size);
+            return net_error_packet(c, "Read failed");
+        }
+        reply->header.size = (usize)read_bytes;
+    }
+    File_Close(f);
+    *charge = (usize)size;
+    return reply;
+}
+
+// UdpDownloadRequest: send the file over UDP (see net_udp.h) to the port the client named,
+// from a socket bound to the address the client reached us on. The outcome follows on the
+// connection once every datagram was acknowledged: UdpTransferDone, or an Error.
+void net_send_udp(Connection* c, const NetPacket* request) {
+    while (c->downloads && c->socket->connected)
+        net_continue_download(c);
+
+    if (c->socket->family != AddressFamily_InterNetwork) {
+        net_send_error(c, "UDP transfers need an IPv4 connection");
+        return;
+    }
+    const usize name_size = net_request_name_size(request);
+    if (name_size == 0 || request->header.size < name_size + sizeof(UdpDownloadSetup)) {
+        net_send_error(c, "Bad request");
+        return;
+    }
+    UdpDownloadSetup setup;
+    memcpy(&setup, request->buffer + name_size, sizeof(setup));
+    if (setup.port == 0 || setup.port > UINT16_MAX) {
+        net_send_error(c, "Bad request");
+        return;
+    }
+
+    FileHandle* f = File_Open((const char*)request->buffer, FileMode_Read);
+    if (!f) {
+        net_send_error(c, "File not found");
+        return;
+    }
+    if (!net_charge_wait(c, sizeof(UdpSender))) {
+        File_Close(f);
+        net_send_error(c, "Server is out of memory");
+        return;
+    }
+
+    IPAddress local;
+    memset(&local, 0, sizeof(local));
+    local.type = IPAddressType_IPv4LPStr;
+    socklen_t local_size = sizeof(local.ipv4_addr);
+    Socket* udp = Socket_New(AddressFamily_InterNetwork, SocketType_Dgram, ProtocolType_Udp);
+    if (!udp ||
+        getsockname(c->socket->_native_handle, (struct sockaddr*)&local.ipv4_addr, &local_size) != 0 ||
+        Socket_Bind(udp, IPEndPoint_New(local, AddressFamily_InterNetwork, 0)) == CS_SOCKET_ERROR ||
+        Socket_Connect(udp, IPEndPoint_New(c->socket->remote_ep.address, AddressFamily_InterNetwork, (u16)setup.port)) == CS_SOCKET_ERROR) {
+        if (udp)
+            Socket_Dispose(udp);
+        File_Close(f);
+        MemAccount_Release(&c->memory, sizeof(UdpSender));
+        net_send_error(c, "Failed to open a UDP socket");
+        return;
+    }
+    Socket_SetBufferSizes(udp, NET_UDP_SOCKET_BUFFER, NET_UDP_SOCKET_BUFFER);
+    File_Advise(f, 0, 0, FileAdvice_Sequential);
+
+    const u32 transfer_id = (u32)(Time_NowNs() ^ ((u64)c->id << 20)) | 1;
+    UdpSender* sender = UdpSender_New(udp, f, transfer_id, setup.max_rate);
+    UdpTransferInfo info = {f->size, (i64)f->mtime, transfer_id, udp->local_ep.port};
+    NetPacket info_packet = {{NetPacketType_UdpTransferInfo, sizeof(info)}, (u8*)&info};
+    if (NetPacket_Send(c->socket, &info_packet) != CS_SOCKET_ERROR) {
+        __atomic_add_fetch(&g_active_transfers, 1, __ATOMIC_RELAXED);
+        const bool done = UdpSender_Run(sender, c->socket, g_shaper, &c->shaper_flow);
+        __atomic_sub_fetch(&g_active_transfers, 1, __ATOMIC_RELAXED);
+        if (done) {
+            NetPacket done_packet = {{NetPacketType_UdpTransferDone, sizeof(sender->stats)}, (u8*)&sender->stats};
+            NetPacket_Send(c->socket, &done_packet);
+        } else {
+            LOG_WARN("UDP transfer to client (%zu) failed.\n", c->id);
+            net_send_error(c, "UDP transfer failed");
+        }
+    }
+    UdpSender_Dispose(sender);
+    File_Close(f);
+    MemAccount_Release(&c->memory, sizeof(UdpSender));
+}
+
+// McastJoinRequest: tell the client where its file will be multicast (McastInfo), starting
+// a transfer if there is none for it yet. Repairs come in later as FileReadRequests.
+void net_join_mcast(Connection* c, const NetPacket* request) {
+    while (c->downloads && c->socket->connected)
+        net_continue_download(c);
+
+    if (!g_mcast) {
+        net_send_error(c, "Multicast distribution is not enabled");
+        return;
+    }
+    if (c->socket->family != AddressFamily_InterNetwork) {
+        net_send_error(c, "Multicast needs an IPv4 connection");
+        return;
+    }
+    if (net_request_name_size(request) == 0) {
+        net_send_error(c, "Bad request");
+        return;
+    }
+    // The transfer goes out of the interface the client reached us on.
+    struct sockaddr_in local;
+    socklen_t local_size = sizeof(local);
+    if (getsockname(c->socket->_native_handle, (struct sockaddr*)&local, &local_size) != 0) {
+        net_send_error(c, "Failed to join");
+        return;
+    }
+    McastInfo info;
+    const char* error = McastDistributor_Join(g_mcast, (const char*)request->buffer, local.sin_addr.s_addr, &info);
+    if (error) {
+        net_send_error(c, error);
+        return;
+    }
+    NetPacket info_packet = {{NetPacketType_McastInfo, sizeof(info)}, (u8*)&info};
+    NetPacket_Send(c->socket, &info_packet);
+}
+
+#ifdef CSR_AVAILABLE
+// ShmOpen from a client on this host: hand it a shared memory channel (ShmChannel with the
+// memfd attached) and serve the requests it sends through the rings until it hangs up.
+// Only requests with a single reply are served there (ls, stats, read), the connection is
+// not used for anything else afterwards.
+void net_serve_channel(Connection* c, const char* restrict cwd) {
+    while (c->downloads && c->socket->connected)
+        net_continue_download(c);
+    if (c->socket->family != AddressFamily_Local) {
+        net_send_error(c, "Shared memory is only offered to local clients");
+        return;
+    }
+    ShmChannel* ch = ShmChannel_Create(0);
+    if (!ch) {
+        net_send_error(c, "Shared memory channel not available");
+        return;
+    }
+    if (!net_charge_wait(c, ch->map_size)) {
+        ShmChannel_Dispose(ch);
+        net_send_error(c, "Server is out of memory");
+        return;
+    }
+    NetPacket channel_packet = {{NetPacketType_ShmChannel, 0}, NULL};
+    if (NetPacket_SendWithFd(c->socket, &channel_packet, ch->fd) == CS_SOCKET_ERROR) {
+        MemAccount_Release(&c->memory, ch->map_size);
+        ShmChannel_Dispose(ch);
+        return;
+    }
+    LOG_INFO("Client (%zu) switched to a shared memory channel.\n", c->id);
+
+    for (;;) {
+        const i32 res = ShmChannel_WaitReadable(ch, RING_POLL_MS);
+        if (res == CSR_ERROR)
+            break;
+        if (res == CSR_TIMEOUT) {
+            // Nothing more comes over the socket, readable means the client went away.
+            if (Socket_WaitReadable(c->socket, 0) != false)
+                break;
+            Mutex_Lock(c->mutex);
+            const bool available = c->available;
+            Mutex_Unlock(c->mutex);
+            if (!available)
+                break;
+            continue;
+        }
+
+        PacketHeader header;
+        if (ShmChannel_Read(ch, &header, sizeof(header)) == CSR_ERROR)
+            break;
+        NetPacket* request = NULL;
+        NetPacket* reply = NULL;
+        if (net_charge_wait(c, header.size)) {
+            request = NetPacket_ReceiveShmPayload(ch, &header);
+            if (!request) {
+                MemAccount_Release(&c->memory, header.size);
+                break;
+            }
+        } else {
+            u8 scratch[4096];
+            usize remaining = header.size;
+            while (remaining > 0) {
+                const usize n = (remaining < sizeof(scratch)) ? remaining : sizeof(scratch);
+                if (ShmChannel_Read(ch, scratch, n) == CSR_ERROR)
+                    break;
+                remaining -= n;
+            }
+            if (remaining > 0)
+                break;
+            reply = net_error_packet(c, "Server is out of memory");
+        }
+
+        const u64 start_ns = Time_NowNs();
+        usize reply_charge = 0;
+        if (request) {
+            switch (request->header.id) {
+                case NetPacketType_ListEntries:
+                    reply = net_list_entries(c, cwd, &reply_charge);
+                    break;
+                case NetPacketType_Stats:
+                    reply = metrics_snapshot(true);
+                    break;
+                case NetPacketType_FileReadRequest:
+                    reply = net_read_range(c, request, &reply_charge);
+                    break;
+                default:
+                    reply = net_error_packet(c, "Not available over shared memory");
+                    break;
+            }
+        }
+        const i32 sent = NetPacket_SendShm(ch, reply);
+        if (request) {
+            MetricsShard_Record(&c->metrics, request->header.id, Time_NowNs() - start_ns);
+            MemAccount_Release(&c->memory, header.size);
+        }
+        MemAccount_Release(&c->memory, reply_charge);
+        NetPacket_Dispose(reply);
+        NetPacket_Dispose(request);
+        if (sent == CS_SOCKET_ERROR)
+            break;
+    }
+
+    MemAccount_Release(&c->memory, ch->map_size);
+    ShmChannel_Dispose(ch);
+    LOG_INFO("Client (%zu) [%s:%hu] disconnected.\n", c->id, c->socket->remote_ep.address.str, c->socket->remote_ep.port);
+    Socket_Close(c->socket);
+}
+#endif
+
+// Charge bytes for a request before its payload is received. Queued downloads go on
+// meanwhile, they are what frees memory on a connection that pipelines more requests
+// than its budget holds. False if the request has to be turned down.
+bool net_reserve_request(Connection* c, const usize bytes) {
+    if (MemAccount_Exceeds(&c->memory, bytes)) {
+        MemAccount_Refuse(&c->memory);
+        // The error must not cut into a download that is still going out.
+        while (c->downloads && c->socket->connected)
+            net_continue_download(c);
+        return false;
+    }
+    const u64 deadline_ns = Time_NowNs() + MEM_WAIT_MS * CTM_NS_PER_MS;
+    for (;;) {
+        const u64 seen = MemBudget_Releases(c->memory.budget);
+        if (MemAccount_Charge(&c->memory, bytes))
+            return true;
+        if (c->downloads && c->socket->connected) {
+            net_continue_download(c);
+            continue;
+        }
+        if (!MemBudget_WaitRelease(c->memory.budget, seen, deadline_ns)) {
+            MemAccount_Refuse(&c->memory);
+            return false;
+        }
+    }
+}
+
 ThreadArg net_connection_handler(ThreadArg args) {
     Connection* c = (Connection*)args;
     char cwd[CIO_PATH_MAX];
@@ -60,119 +1175,343 @@ ThreadArg net_connection_handler(ThreadArg args) {
            Mutex_Lock(c->mutex) != MutexResult_Error &&
            c->available &&
            Mutex_Unlock(c->mutex) != MutexResult_Error) {
-        NetPacket* recv_packet = NetPacket_Receive(c->socket);
+        // Downloads go out a frame at a time while no request is waiting, anything the
+        // client asks for meanwhile is answered between two frames.
+        if (c->downloads && Socket_WaitReadable(c->socket, 0) == false) {
+            net_continue_download(c);
+            continue;
+        }
+
+        // Waiting for the next request is idle time, only the payload counts as receiving.
+        PacketHeader header;
+        NetPacket* recv_packet = NULL;
+        usize charge = 0;
+        if (NetPacket_ReceiveHeader(c->socket, &header) != CS_SOCKET_ERROR) {
+            // An fget stays queued after dispatch, its job is paid for up front as well.
+            charge = header.size + ((header.id == NetPacketType_FileDownloadRequest) ? sizeof(DownloadJob) : 0);
+            if (!net_reserve_request(c, charge)) {
+                if (NetPacket_DiscardPayload(c->socket, &header) == CS_SOCKET_ERROR)
+                    break;
+                MetricsShard_RecordError(&c->metrics);
+                net_send_error(c, "Server is out of memory");
+                continue;
+            }
+            TRACE_BEGIN(receive);
+            recv_packet = NetPacket_ReceivePayload(c->socket, &header);
+            TRACE_END(receive, "receive");
+            if (!recv_packet)
+                MemAccount_Release(&c->memory, charge);
+        }
         if (!recv_packet) {
-            printf("Client (%zu) [%s:%hu] disconnected.\n", c->id, c->socket->remote_ep.address.str, c->socket->remote_ep.port);
+            LOG_INFO("Client (%zu) [%s:%hu] disconnected.\n", c->id, c->socket->remote_ep.address.str, c->socket->remote_ep.port);
             break;
         }
+        const u64 start_ns = Time_NowNs();
+        TRACE_BEGIN(dispatch);
 
         switch (recv_packet->header.id) {
             case NetPacketType_Message:
-                printf("Received message from [%s:%hu]: %s\n",
-                       c->socket->remote_ep.address.str,
-                       c->socket->remote_ep.port,
-                       (const char*)recv_packet->buffer);
+                LOG_INFO("Received message from [%s:%hu]: %s\n",
+                         c->socket->remote_ep.address.str,
+                         c->socket->remote_ep.port,
+                         (recv_packet->buffer) ? (const char*)recv_packet->buffer : "");
                 break;
             case NetPacketType_ListEntries: {
-                NetPacket* send_packet = NetPacket_New(NetPacketType_Message, NULL, 0);
-                DirectoryInfo* dirinf = Directory_Open(cwd);
-                if (dirinf) {
-                    const usize DIR_BUFFER_SIZE = CIO_PATH_MAX + 1024;
-                    char* dir_buffer = (char*)malloc(sizeof(char) * DIR_BUFFER_SIZE);
-                    for (usize i = 0; i < dirinf->entries_count; ++i) {
-                        memset(dir_buffer, 0, DIR_BUFFER_SIZE);
-                        snprintf(
-                            dir_buffer,
-                            DIR_BUFFER_SIZE,
-                            "[%zu] (%c) %zu\t%s\n",
-                            i,
-                            (dirinf->entries[i].type == EntryType_File) ? 'f' : 'd',
-                            dirinf->entries[i].size,
-                            dirinf->entries[i].name);
-                        NetPacket_AddData(
-                            send_packet,
-                            (u8*)dir_buffer,
-                            (i == dirinf->entries_count - 1) ? strlen(dir_buffer) + 1 : strlen(dir_buffer));
-                    }
-                    free(dir_buffer);
-                    Directory_Close(dirinf);
-                } else {
-                    send_packet->header.id = NetPacketType_Error;
-                    NetPacket_AddData(send_packet, (const u8*)"File not found", strlen("File not found") + 1);
-                }
+                usize listing_size = 0;
+                NetPacket* send_packet = net_list_entries(c, cwd, &listing_size);
+                TRACE_BEGIN(send);
                 NetPacket_Send(c->socket, send_packet);
+                TRACE_END(send, "send");
                 NetPacket_Dispose(send_packet);
+                MemAccount_Release(&c->memory, listing_size);
                 break;
             }
-            case NetPacketType_FileDownloadRequest: {
-                NetPacket* send_packet = NetPacket_New(NetPacketType_FileInfo, NULL, 0);
-                const char* name = (const char*)recv_packet->buffer;
-
-                FILE* fs = fopen(name, "rb");
-                if (fs) {
-                    fseek(fs, 0, SEEK_END);
-                    usize file_size = ftell(fs);
-                    fseek(fs, 0, SEEK_SET);
-
-                    send_packet->header.id = NetPacketType_FileInfo;
-                    NetPacket_AddData(send_packet, (u8*)&file_size, sizeof(file_size));
-                    i32 res = NetPacket_Send(c->socket, send_packet);
-                    NetPacket_Dispose(send_packet);
-                    if (res == CS_SOCKET_ERROR) {
-lc2:
-                        fputs("Download failed.\n", stderr);
-                        break;
-                    }
-
-                    const usize FILE_BUFFER_SIZE = 2048;
-                    usize bytes_sent = 0;
-                    u8* buffer = (u8*)malloc(FILE_BUFFER_SIZE);
-                    while (bytes_sent < file_size) {
-                        bytes_sent = fread(buffer, FILE_BUFFER_SIZE, 1, fs);
-                        if (bytes_sent == 0) {
-                            if (feof(fs))
-                                bytes_sent = file_size;
-                            else if (ferror(fs)) {
-                                send_packet = NetPacket_New(NetPacketType_Error, (const u8*)"File read error", strlen("File read error") + 1);
-                                res = NetPacket_Send(c->socket, send_packet);
-                                NetPacket_Dispose(send_packet);
-                                if (res == CS_SOCKET_ERROR) {
-                                    goto lc2;
-                                }
-                                break;
-                            }
-                        }
-                        send_packet = NetPacket_New(NetPacketType_FileDownloadData, buffer, bytes_sent);
-                        NetPacket_Send(c->socket, send_packet);
-                        NetPacket_Dispose(send_packet);
-                    }
-                    free(buffer);
-                } else {
-                    NetPacket_AddData(send_packet, (const u8*)"File not found", strlen("File not found") + 1);
-                    NetPacket_Send(c->socket, send_packet);
-                    NetPacket_Dispose(send_packet);
-                }
+            case NetPacketType_FileDownloadRequest:
+                net_queue_download(c, recv_packet);
+                recv_packet = NULL;
+                break;
+            case NetPacketType_FileUploadRequest:
+                net_begin_upload(c, recv_packet);
+                break;
+            case NetPacketType_FileUploadData:
+                net_receive_upload_data(c, recv_packet);
+                break;
+            case NetPacketType_FileDigest:
+                net_receive_upload_digest(c, recv_packet);
+                break;
+            case NetPacketType_SetIntegrity:
+                net_set_integrity(c, recv_packet);
+                break;
+            case NetPacketType_Stats:
+                net_send_stats(c);
+                break;
+            case NetPacketType_SetRate:
+                net_set_rate(c, recv_packet);
+                break;
+            case NetPacketType_FileOpenRequest:
+                net_send_file_handle(c, recv_packet);
+                break;
+            case NetPacketType_FileReadRequest: {
+                // Replies go out in request order, fgets queued before this one come first.
+                while (c->downloads && c->socket->connected)
+                    net_continue_download(c);
+                usize read_size = 0;
+                NetPacket* send_packet = net_read_range(c, recv_packet, &read_size);
+                NetPacket_Send(c->socket, send_packet);
+                NetPacket_Dispose(send_packet);
+                MemAccount_Release(&c->memory, read_size);
                 break;
             }
+            case NetPacketType_UdpDownloadRequest:
+                net_send_udp(c, recv_packet);
+                break;
+            case NetPacketType_McastJoinRequest:
+                net_join_mcast(c, recv_packet);
+                break;
+#ifdef CSR_AVAILABLE
+            case NetPacketType_ShmOpen:
+                net_serve_channel(c, cwd);
+                break;
+#endif
             default:
                 break;
         }
+        TRACE_END(dispatch, "dispatch");
+        // Queued downloads are recorded once they are done.
+        if (recv_packet)
+            MetricsShard_Record(&c->metrics, recv_packet->header.id, Time_NowNs() - start_ns);
+        MetricsShard_SetTraffic(&c->metrics, c->socket->bytes_received, c->socket->bytes_sent);
+        // A queued fget took its charge along with the packet.
+        if (recv_packet)
+            MemAccount_Release(&c->memory, charge);
         NetPacket_Dispose(recv_packet);
     }
 
+    if (c->upload)
+        net_abort_upload(c);
+    if (c->downloads)
+        __atomic_sub_fetch(&g_active_transfers, 1, __ATOMIC_RELAXED);
+    while (c->downloads) {
+        DownloadJob* next = c->downloads->next;
+        net_dispose_download(c, c->downloads);
+        c->downloads = next;
+    }
+    c->downloads_tail = NULL;
+    MemAccount_ReleaseAll(&c->memory);
+    metrics_detach(c);
     Socket_Dispose(c->socket);
-    c->id = 0;
     c->owning_thread = NULL;
     c->available = false;
-    --g_active_clients;
+    ConnTable_Release(g_connections, c);
+    if (g_wait_queue)
+        AdmissionQueue_Notify(g_wait_queue);
     return NULL;
 }
 
+void net_measure_load(LoadSignals* load) {
+    load->connections = ConnTable_Active(g_connections);
+    load->transfers = __atomic_load_n(&g_active_transfers, __ATOMIC_RELAXED);
+    load->memory_used = __atomic_load_n(&g_memory.used, __ATOMIC_RELAXED);
+    load->io_queued = 0;
+    if (g_io_pool) {
+        ThreadPoolStats pool_stats;
+        ThreadPool_GetStats(g_io_pool, &pool_stats);
+        load->io_queued = pool_stats.queued;
+    }
+}
+
+// Tell a client we cannot serve it now and when to try again, then close the connection.
+void net_turn_away(Socket* client, const char* restrict reason) {
+    const usize waiting = (g_wait_queue) ? AdmissionQueue_Length(g_wait_queue) : 0;
+    LOG_WARN("Client [%s:%hu] turned away: %s.\n", client->remote_ep.address.str, client->remote_ep.port, reason);
+    __atomic_add_fetch(&g_turned_away, 1, __ATOMIC_RELAXED);
+
+    BusyNotice notice = {Admission_RetryAfter(waiting)};
+    NetPacket* packet = NetPacket_New(NetPacketType_Busy, (const u8*)&notice, sizeof(notice));
+    NetPacket_AddData(packet, (const u8*)reason, strlen(reason) + 1);
+    // Neither the acceptor nor the admission thread waits on a client that does not read,
+    // a fresh socket buffer takes the notice whole or the client does without.
+    Socket_SetBlocking(client, false);
+    if (Socket_Send(client, (u8*)&packet->header, sizeof(packet->header), 0) == (i32)sizeof(packet->header))
+        Socket_Send(client, packet->buffer, packet->header.size, 0);
+    NetPacket_Dispose(packet);
+    if (!client->connected) {
+        Socket_Dispose(client);
+        return;
+    }
+    Socket_Shutdown(client, CS_SD_WRITE);
+    TurnAwayReaper_Add(g_reaper, client, TURN_AWAY_LINGER_MS);
+}
+
+// Hand an admitted client a slot and a thread. False if there is none after all (another
+// acceptor took the last one, the memory budget cannot carry it or no thread could be
+// started), the socket is then still the caller's to turn away.
+bool net_start_connection(Socket* new_client) {
+    Connection* conn = (Connection*)ConnTable_Acquire(g_connections);
+    if (!conn)
+        return false;
+    MemAccount_Init(&conn->memory, &g_memory, g_connection_budget);
+    if (!MemAccount_Charge(&conn->memory, MEM_CONNECTION_BASE)) {
+        MemAccount_Refuse(&conn->memory);
+        ConnTable_Release(g_connections, conn);
+        return false;
+    }
+    conn->socket = new_client;
+    conn->available = true;
+    // A receive timeout doubles as an idle timeout, the thread waits in a receive between requests.
+    Socket_ApplyOptions(new_client, &g_socket_options);
+    Socket_SetNotSentLowat(new_client, NET_NOTSENT_LOWAT);
+    conn->upload = NULL;
+    conn->downloads = NULL;
+    conn->downloads_tail = NULL;
+    memset(&conn->shaper_flow, 0, sizeof(conn->shaper_flow));
+    conn->integrity = NET_INTEGRITY_NONE;
+    conn->id = __atomic_fetch_add(&g_next_connection_id, 1, __ATOMIC_RELAXED);
+    // Slots are reused, so is their mutex.
+    if (!conn->mutex)
+        conn->mutex = Mutex_New();
+    metrics_attach(conn);
+
+    ThreadAttributes attr;
+    attr.args = (ThreadArg)conn;
+    attr.initial_stack_size = g_stack_size;
+    attr.routine = net_connection_handler;
+
+    // NOTE: We want our threads here to be detached, meaning they themselves will
+    // handle their disposal (lol) and resource deallocation after finishing execution.
+    // This is usually dangerous but we do not care because we are C programmers therefore ballsy,
+    // no but for real, the main thread does not depend on any of the child threads
+    // and we do not access them after creation (return value), or join them so this is safe.
+    // I do believe this is better than writing some form of a thread manager that manages
+    // client threads which itself is managed by the main thread.
+    attr.detached = true;
+    // Connection threads block in send and receive, pinning them to their acceptor's core
+    // would crowd them onto a few cores. The scheduler spreads them instead.
+    attr.cpus = NULL;
+    attr.name = "nfs-conn";
+
+    conn->owning_thread = Thread_New(&attr);
+    if (!conn->owning_thread) {
+        LOG_WARN("Client [%s:%hu]: failed to start its thread.\n", new_client->remote_ep.address.str, new_client->remote_ep.port);
+        metrics_detach(conn);
+        MemAccount_ReleaseAll(&conn->memory);
+        conn->socket = NULL;
+        conn->available = false;
+        ConnTable_Release(g_connections, conn);
+        return false;
+    }
+
+    LOG_INFO("Client (%zu) [%s:%hu] connected.\n", conn->id, new_client->remote_ep.address.str, new_client->remote_ep.port);
+    return true;
+}
+
+// Admit a freshly accepted client if load allows, otherwise queue it or turn it away.
+void net_accept(Socket* new_client) {
+    TRACE_BEGIN(accept);
+    const bool priority = Admission_IsPriority(&g_admission, new_client);
+    LoadSignals load;
+    net_measure_load(&load);
+    const char* reason = Admission_Check(&g_admission, &load, priority);
+    // Nobody jumps the queue except priority clients.
+    if (!reason && !priority && g_wait_queue && AdmissionQueue_Length(g_wait_queue) > 0)
+        reason = "clients waiting";
+    if (!reason && net_start_connection(new_client)) {
+        TRACE_END(accept, "accept");
+        return;
+    }
+    if (g_wait_queue && AdmissionQueue_Push(g_wait_queue, new_client, priority)) {
+        LOG_DEBUG("Client [%s:%hu] waits for admission (%s).\n", new_client->remote_ep.address.str, new_client->remote_ep.port,
+                  (reason) ? reason : "server full");
+    } else {
+        net_turn_away(new_client, (reason) ? reason : "server full");
+    }
+    TRACE_END(accept, "accept");
+}
+
+// Serves the wait queue: admits waiting clients as load drops, turns away those that waited too long.
+// args is the AdmissionQueue.
+ThreadArg net_admission_loop(ThreadArg args) {
+    AdmissionQueue* q = (AdmissionQueue*)args;
+    for (;;) {
+        const char* reason = NULL;
+        const WaitingClient w = AdmissionQueue_Next(q, &g_admission, net_measure_load, &reason);
+        if (!reason && net_start_connection(w.socket))
+            continue;
+        net_turn_away(w.socket, (reason) ? reason : "server full");
+    }
+    return NULL;
+}
+
+ThreadArg net_accept_loop(ThreadArg args) {
+    Acceptor* a = (Acceptor*)args;
+    bool running = true;
+    while (running) {
+        Socket* new_client = Socket_Accept(a->listener);
+        if (new_client)
+            net_accept(new_client);
+    }
+    return NULL;
+}
+
+// Open a's listening socket on port. Shared listeners are bound with SO_REUSEPORT.
+// The backlog has to hold every client the server may have to decide about at once, a
+// connection the kernel drops for lack of room only retries a second later.
+bool net_listen(Acceptor* a, const u16 port, const bool shared, const bool incoming_cpu, const i32 backlog) {
+    a->listener = Socket_New(AddressFamily_InterNetwork, SocketType_Stream, ProtocolType_Tcp);
+    if (!a->listener)
+        return false;
+    if (shared && Socket_SetReusePort(a->listener, true) == CS_SOCKET_ERROR) {
+        fputs("SO_REUSEPORT is not available, run without -A.\n", stderr);
+        return false;
+    }
+    // Steer connections whose packets arrive on this acceptor's core to it.
+    if (incoming_cpu && a->pinned) {
+        for (u32 cpu = 0; cpu < CT_MAX_CPUS; ++cpu) {
+            if (CpuSet_Contains(&a->cpus, cpu)) {
+                Socket_SetIncomingCpu(a->listener, (i32)cpu);
+                break;
+            }
+        }
+    }
+    // Accepted sockets start out with the listener's buffers, the window scale they
+    // advertise in the handshake depends on it.
+    Socket_SetBufferSizes(a->listener, g_socket_options.send_buffer, g_socket_options.receive_buffer);
+    IPEndPoint ep = IPEndPoint_New(IPAddress_New(IPAddressType_Any), AddressFamily_InterNetwork, port);
+    if (Socket_Bind(a->listener, ep) == CS_SOCKET_ERROR)
+        return false;
+
+    // Pooled clients reconnect often, let the ones holding a cookie skip a round trip.
+    Socket_SetFastOpen(a->listener, (i32)g_max_clients);
+    return Socket_Listen(a->listener, backlog) != CS_SOCKET_ERROR;
+}
+
+// Open a's listening socket at path for clients on this host. A socket file left behind
+// by an earlier run is replaced.
+bool net_listen_local(Acceptor* a, const char* restrict path, const i32 backlog) {
+    a->listener = Socket_New(AddressFamily_Local, SocketType_Stream, ProtocolType_Default);
+    if (!a->listener)
+        return false;
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (Socket_BindLocal(a->listener, path) == CS_SOCKET_ERROR)
+        return false;
+    return Socket_Listen(a->listener, backlog) != CS_SOCKET_ERROR;
+}
+
 void clean_man() {
-    Socket_Dispose(g_server);
-    free(g_clients);
-    free(g_threads);
-    Mutex_Dispose(g_threads_mutex);
+    Log_Stop();
+    if (g_local_acceptor.listener) {
+        Socket_Dispose(g_local_acceptor.listener);
+        unlink(g_local_path);
+    }
+    for (usize i = 0; i < g_acceptor_count; ++i) {
+        if (g_acceptors[i].listener)
+            Socket_Dispose(g_acceptors[i].listener);
+    }
+    free(g_acceptors);
+    if (g_connections)
+        ConnTable_Dispose(g_connections);
     CSSocket_Dispose();
 }
 
@@ -193,6 +1532,19 @@ i32 main(const i32 argc, const char* argv[]) {
     }
 
     u16 port = 0;
+    const char* trace_path = NULL;
+    u64 global_rate = 0;
+    u64 connection_rate = 0;
+    g_socket_options = SocketOptions_Default();
+    usize acceptor_count = 0;
+    bool incoming_cpu = false;
+    usize io_workers = DEF_IO_WORKERS;
+    u64 memory_limit = 0;
+    usize wait_queue_size = DEF_WAIT_QUEUE;
+    const char* mcast_group = NULL; // group[:port]
+    u64 mcast_rate = NET_MCAST_DEFAULT_RATE;
+    u32 wait_timeout_ms = DEF_WAIT_TIMEOUT_MS;
+    memset(&g_admission, 0, sizeof(g_admission));
     if (argc > 1) {
         for (usize i = 1; i < argc; ++i) {
             if (!strcmp(argv[i], "-r")) {
@@ -204,70 +1556,229 @@ i32 main(const i32 argc, const char* argv[]) {
                 }
             } else if (!strcmp(argv[i], "-p")) {
                 port = atoi(argv[++i]);
+            } else if (!strcmp(argv[i], "-m")) {
+                g_metrics_interval_s = atoi(argv[++i]);
+            } else if (!strcmp(argv[i], "-T")) {
+                trace_path = argv[++i];
+            } else if (!strcmp(argv[i], "-g") || !strcmp(argv[i], "-c")) {
+                u64* rate = (argv[i][1] == 'g') ? &global_rate : &connection_rate;
+                if (!Net_ParseSize(argv[++i], rate)) {
+                    fputs("Bad rate, expected bytes per second like 512K or 10M.\n", stderr);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (!strcmp(argv[i], "-l")) {
+                const LogLevel level = LogLevel_Parse(argv[++i]);
+                if (level == LogLevel_None) {
+                    fputs("Bad log level, expected debug, info, warn or error.\n", stderr);
+                    exit(EXIT_FAILURE);
+                }
+                Log_SetLevel(level);
+            } else if (!strcmp(argv[i], "-O")) {
+                if (!Net_ParseSocketOptions(argv[++i], &g_socket_options)) {
+                    fputs("Bad socket options, expected a list like nodelay=1,sndbuf=4M,keepalive=30,send_timeout=10000.\n", stderr);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (!strcmp(argv[i], "-A")) {
+                acceptor_count = atoi(argv[++i]);
+            } else if (!strcmp(argv[i], "-I")) {
+                incoming_cpu = true;
+            } else if (!strcmp(argv[i], "-C")) {
+                mcast_group = argv[++i];
+            } else if (!strcmp(argv[i], "-D")) {
+                if (!Net_ParseSize(argv[++i], &mcast_rate) || mcast_rate == 0) {
+                    fputs("Bad multicast rate, expected bytes per second like 100M.\n", stderr);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (!strcmp(argv[i], "-U")) {
+                g_local_path = argv[++i];
+            } else if (!strcmp(argv[i], "-S") || !strcmp(argv[i], "-B") || !strcmp(argv[i], "-G")) {
+                const char option = argv[i][1];
+                u64 size = 0;
+                if (!Net_ParseSize(argv[++i], &size)) {
+                    fputs("Bad size, expected bytes like 256K or 64M.\n", stderr);
+                    exit(EXIT_FAILURE);
+                }
+                if (option == 'S')
+                    g_stack_size = (usize)size;
+                else if (option == 'B')
+                    g_connection_budget = (usize)size;
+                else
+                    memory_limit = size;
+            } else if (!strcmp(argv[i], "-X")) {
+                g_admission.max_transfers = strtoull(argv[++i], NULL, 10);
+            } else if (!strcmp(argv[i], "-Q")) {
+                char* end = NULL;
+                wait_queue_size = strtoull(argv[++i], &end, 10);
+                if (*end == ':')
+                    wait_timeout_ms = (u32)strtoul(end + 1, NULL, 10);
+            } else if (!strcmp(argv[i], "-R")) {
+                g_admission.reserved = strtoull(argv[++i], NULL, 10);
+            } else if (!strcmp(argv[i], "-P")) {
+                if (!AdmissionPolicy_SetPriority(&g_admission, argv[++i])) {
+                    fputs("Bad priority network, expected an IPv4 prefix like 10.0.0.0/8.\n", stderr);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (!strcmp(argv[i], "-W")) {
+                io_workers = atoi(argv[++i]);
+            } else if (!strcmp(argv[i], "-M")) {
+                g_max_clients = strtoull(argv[++i], NULL, 10);
+                if (g_max_clients == 0) {
+                    fputs("Bad client limit.\n", stderr);
+                    exit(EXIT_FAILURE);
+                }
             }
         }
     } else {
-        puts("Usage: nfs -r [ root_dir ] -p [ port ]");
+        puts("Usage: nfs -r [ root_dir ] -p [ port ] [ -m metrics_interval_s ] [ -T trace_file (dumped on SIGUSR1) ]\n"
+             "           [ -l log_level (debug, info, warn, error) ] [ -g global_rate ] [ -c per_connection_rate ]\n"
+             "           [ -O socket_options (nodelay, sndbuf, rcvbuf, keepalive, busypoll, send_timeout, recv_timeout) ]\n"
+             "           [ -A acceptors (SO_REUSEPORT shards pinned to cores) ] [ -I (steer by SO_INCOMING_CPU) ]\n"
+             "           [ -M max_clients (default 256) ] [ -W io_workers (default 4, 0 reads on connection threads) ]\n"
+             "           [ -S connection_stack_size (default 256K) ] [ -B per_connection_memory (default 32M) ]\n"
+             "           [ -G global_memory (default unlimited) ] [ -X max_transfers ]\n"
+             "           [ -Q wait_queue[:timeout_ms] (default 64:2000, 0 turns clients away at once) ]\n"
+             "           [ -R reserved_slots -P priority_network (e.g. 10.0.0.0/8) ]\n"
+             "           [ -U local_socket_path (same host clients, files passed as descriptors) ]\n"
+             "           [ -C multicast_group[:port] (mcget, e.g. 239.255.77.1) ] [ -D multicast_rate (default 50M) ]");
         return 0;
     }
     if (port == 0) {
-        puts("Usage: nfs -r [ root_dir ] -p [ port ]");
+        puts("Usage: nfs -r [ root_dir ] -p [ port ] [ -m metrics_interval_s ] [ -T trace_file (dumped on SIGUSR1) ]\n"
+             "           [ -l log_level (debug, info, warn, error) ] [ -g global_rate ] [ -c per_connection_rate ]\n"
+             "           [ -O socket_options (nodelay, sndbuf, rcvbuf, keepalive, busypoll, send_timeout, recv_timeout) ]\n"
+             "           [ -A acceptors (SO_REUSEPORT shards pinned to cores) ] [ -I (steer by SO_INCOMING_CPU) ]\n"
+             "           [ -M max_clients (default 256) ] [ -W io_workers (default 4, 0 reads on connection threads) ]\n"
+             "           [ -S connection_stack_size (default 256K) ] [ -B per_connection_memory (default 32M) ]\n"
+             "           [ -G global_memory (default unlimited) ] [ -X max_transfers ]\n"
+             "           [ -Q wait_queue[:timeout_ms] (default 64:2000, 0 turns clients away at once) ]\n"
+             "           [ -R reserved_slots -P priority_network (e.g. 10.0.0.0/8) ]\n"
+             "           [ -U local_socket_path (same host clients, files passed as descriptors) ]\n"
+             "           [ -C multicast_group[:port] (mcget, e.g. 239.255.77.1) ] [ -D multicast_rate (default 50M) ]");
         return 0;
     }
 
-    g_server = Socket_New(AddressFamily_InterNetwork, SocketType_Stream, ProtocolType_Tcp);
-    IPEndPoint ep = IPEndPoint_New(IPAddress_New(IPAddressType_Any), AddressFamily_InterNetwork, port);
-    if (Socket_Bind(g_server, ep) == CS_SOCKET_ERROR) {
-        exit(EXIT_FAILURE);
+    if (trace_path) {
+#ifdef CS_TRACE
+        // Before any thread exists, they all inherit the blocked signal.
+        if (Trace_DumpOnSignal(SIGUSR1, trace_path) != 0)
+            fputs("Failed to enable tracing.\n", stderr);
+#else
+        fputs("Built without tracing, -T is ignored (configure with -DNETFS_TRACE=ON).\n", stderr);
+#endif
     }
+    // Connection threads only queue log lines, a flusher thread does the writing.
+    if (Log_Start() != 0)
+        fputs("Failed to start the log thread, logging synchronously.\n", stderr);
 
-    if (Socket_Listen(g_server, MAX_CLIENTS) == CS_SOCKET_ERROR) {
-        exit(EXIT_FAILURE);
+    // Sharded: one listener and acceptor thread per core (round robin if there are more),
+    // each pinned to its core. The connections it accepts are not.
+    const bool sharded = acceptor_count > 0;
+    const u32 cpu_count = Thread_CpuCount();
+    g_acceptor_count = (sharded) ? acceptor_count : 1;
+    g_acceptors = (Acceptor*)malloc(sizeof(Acceptor) * g_acceptor_count);
+    memset(g_acceptors, 0, sizeof(Acceptor) * g_acceptor_count);
+    for (usize i = 0; i < g_acceptor_count; ++i) {
+        Acceptor* a = g_acceptors + i;
+        a->index = i;
+        a->pinned = sharded;
+        CpuSet_Zero(&a->cpus);
+        CpuSet_Add(&a->cpus, (u32)(i % cpu_count));
+        if (!net_listen(a, port, sharded, incoming_cpu, (i32)(g_max_clients + wait_queue_size)))
+            exit(EXIT_FAILURE);
+    }
+    if (sharded)
+        LOG_INFO("Listening on 127.0.0.1:%hu with %zu acceptors on %u cores\n", port, g_acceptor_count, cpu_count);
+    else
+        LOG_INFO("Listening on 127.0.0.1:%hu\n", port);
+    if (g_local_path) {
+        if (!net_listen_local(&g_local_acceptor, g_local_path, (i32)(g_max_clients + wait_queue_size)))
+            exit(EXIT_FAILURE);
+        LOG_INFO("Listening on %s\n", g_local_path);
     }
-    printf("Listening on 127.0.0.1:%hu\n", ep.port);
 
-    g_client_count = MAX_CLIENTS;
-    g_clients = (Connection*)malloc(MAX_CLIENTS * sizeof(Connection));
-    memset(g_clients, 0, g_client_count * sizeof(Connection));
-    g_threads = (Thread**)malloc(sizeof(Thread*) * g_client_count);
-    g_threads_mutex = Mutex_New();
+    g_connections = ConnTable_New(sizeof(Connection), g_max_clients);
+    g_metrics_mutex = Mutex_New();
+    MemBudget_Init(&g_memory, (usize)memory_limit);
+    g_admission.max_clients = g_max_clients;
+    g_admission.max_io_queued = io_workers * IO_QUEUED_PER_WORKER;
+    g_admission.memory_limit = (usize)memory_limit;
+    g_admission.memory_per_connection = MEM_CONNECTION_BASE;
+    g_reaper = TurnAwayReaper_New();
+    ThreadAttributes reaper_attr;
+    reaper_attr.args = g_reaper;
+    reaper_attr.initial_stack_size = 0;
+    reaper_attr.detached = true;
+    reaper_attr.routine = TurnAwayReaper_Run;
+    reaper_attr.cpus = NULL;
+    reaper_attr.name = "nfs-reaper";
+    Thread_New(&reaper_attr);
+    if (wait_queue_size > 0) {
+        g_wait_queue = AdmissionQueue_New(wait_queue_size, wait_timeout_ms);
+        ThreadAttributes attr;
+        attr.args = g_wait_queue;
+        attr.initial_stack_size = 0;
+        attr.detached = true;
+        attr.routine = net_admission_loop;
+        attr.cpus = NULL;
+        attr.name = "nfs-admit";
+        Thread_New(&attr);
+    }
+    g_shaper = Shaper_New(global_rate, connection_rate);
+    if (mcast_group) {
+        char group[INET_ADDRSTRLEN + 8];
+        snprintf(group, sizeof(group), "%s", mcast_group);
+        char* colon = strchr(group, ':');
+        const u16 mcast_port = (colon) ? (u16)atoi(colon + 1) : NET_MCAST_DEFAULT_PORT;
+        if (colon)
+            *colon = 0;
+        g_mcast = McastDistributor_New(group, mcast_port, mcast_rate, g_shaper, &g_active_transfers);
+        if (!g_mcast) {
+            fprintf(stderr, "%s is not an IPv4 multicast group with %d more after it.\n", group, MCAST_GROUP_SLOTS - 1);
+            exit(EXIT_FAILURE);
+        }
+        LOG_INFO("Multicast distribution to %s:%hu at %llu bytes/s\n", group, mcast_port, (unsigned long long)mcast_rate);
+    }
+    if (io_workers > 0)
+        g_io_pool = ThreadPool_New(io_workers, "nfs-io");
 
-    bool running = true;
-    while (running) {
-        Socket* new_client = Socket_Accept(g_server);
-        if (new_client) {
-            Connection* conn = get_next_available_slot();
-            if (conn) {
-                conn->socket = new_client;
-                conn->available = true;
-                conn->id = g_active_clients++;
-                conn->mutex = Mutex_New();
-
-                ThreadAttributes attr;
-                attr.args = (ThreadArg)conn;
-                attr.initial_stack_size = 0;
-                attr.routine = net_connection_handler;
-
-                // NOTE: We want our threads here to be detached, meaning they themselves will
-                // handle their disposal (lol) and resource deallocation after finishing execution.
-                // This is usually dangerous but we do not care because we are C programmers therefore ballsy,
-                // no but for real, the main thread does not depend on any of the child threads
-                // and we do not access them after creation (return value), or join them so this is safe.
-                // I do believe this is better than writing some form of a thread manager that manages
-                // client threads which itself is managed by the main thread.
-                attr.detached = true;
-
-                conn->owning_thread = Thread_New(&attr);
-
-                printf("Client (%zu) [%s:%hu] connected.\n", conn->id, new_client->remote_ep.address.str, new_client->remote_ep.port);
-            } else {
-                printf("Client [%s:%hu] tried to connect but max connection capacity (%d) exceeded.\n", new_client->remote_ep.address.str, new_client->remote_ep.port, MAX_CLIENTS);
-
-                const char* error_msg = "Max connection capacity exceeded.\n";
-                Socket_Send(new_client, (const u8*)error_msg, strlen(error_msg) + 1, 0);
-                Socket_Dispose(new_client);
-            }
+    if (g_metrics_interval_s > 0) {
+        ThreadAttributes attr;
+        attr.args = NULL;
+        attr.initial_stack_size = 0;
+        attr.detached = true;
+        attr.routine = metrics_dump_thread;
+        attr.cpus = NULL;
+        attr.name = "nfs-metrics";
+        Thread_New(&attr);
+    }
+
+    if (g_local_acceptor.listener) {
+        ThreadAttributes attr;
+        attr.args = (ThreadArg)&g_local_acceptor;
+        attr.initial_stack_size = 0;
+        attr.detached = true;
+        attr.routine = net_accept_loop;
+        attr.cpus = NULL;
+        attr.name = "nfs-accept";
+        g_local_acceptor.thread = Thread_New(&attr);
+    }
+    if (g_acceptor_count == 1) {
+        if (g_acceptors->pinned && Thread_SetCurrentAffinity(&g_acceptors->cpus) != ThreadResult_Success)
+            LOG_WARN("Failed to pin the acceptor to its core.\n");
+        net_accept_loop(g_acceptors);
+    } else {
+        for (usize i = 0; i < g_acceptor_count; ++i) {
+            ThreadAttributes attr;
+            attr.args = (ThreadArg)(g_acceptors + i);
+            attr.initial_stack_size = 0;
+            attr.detached = false;
+            attr.routine = net_accept_loop;
+            attr.cpus = &g_acceptors[i].cpus;
+            attr.name = "nfs-accept";
+            g_acceptors[i].thread = Thread_New(&attr);
         }
+        for (usize i = 0; i < g_acceptor_count; ++i)
+            Thread_Join(g_acceptors[i].thread);
     }
 
     clean_man();
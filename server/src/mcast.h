@@ -0,0 +1,293 @@
+#ifndef NETFS_SERVER_MCAST_H
+#define NETFS_SERVER_MCAST_H
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_systemio.h>
+#include <cs_threads.h>
+#include <cs_time.h>
+#include <cs_log.h>
+#include <net_mcast.h>
+#include <time.h>
+#include "shaper.h"
+
+// Sending side of mcget, see net_mcast.h. Every file being distributed has one transfer with
+// a thread of its own that sends the passes, joins for the same file while it runs share it.
+// Transfers at once get groups of their own from the configured one on.
+
+#define MCAST_GROUP_SLOTS 256
+// Transfers at once, each is a thread and a share of the rate. Joins for other files fail
+// while this many run.
+#define MCAST_MAX_TRANSFERS 16
+#define MCAST_END_MARKER_GAP_MS 1
+// Behind schedule by more than this the pacing starts over instead of catching up in a burst.
+#define MCAST_MAX_LAG_NS (10 * CTM_NS_PER_MS)
+
+typedef struct _netfs_mcast_transfer {
+    struct _netfs_mcast_distributor* owner;
+    char name[CIO_PATH_MAX];
+    FileHandle* file;
+    u32 total;
+    u32 transfer_id;
+    u32 group;        // Network order.
+    u32 iface;        // Address of the interface to send from, network order.
+    u32 pass;
+    bool sending;     // pass has begun.
+    bool again;       // Someone joined after pass began and needs another one.
+    ShaperFlow shaper_flow;
+    struct _netfs_mcast_transfer* next;
+} McastTransfer;
+
+typedef struct _netfs_mcast_distributor {
+    Mutex* mutex;
+    McastTransfer* transfers;
+    u32 transfer_count;
+    u32 group_base;   // Host order.
+    u16 port;
+    u8 ttl;
+    u64 rate;
+    u32 next_slot;
+    u32 next_id;
+    Shaper* shaper;
+    usize* active_transfers; // Bumped while a pass is being sent.
+} McastDistributor;
+
+// Distribute to groups from group (an IPv4 multicast address) on, port. NULL if group or
+// any of the MCAST_GROUP_SLOTS - 1 addresses after it is not one.
+McastDistributor* McastDistributor_New(const char* restrict group, const u16 port, const u64 rate, Shaper* restrict shaper, usize* active_transfers) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, group, &addr) != 1 || !IN_MULTICAST(ntohl(addr.s_addr)) ||
+        !IN_MULTICAST(ntohl(addr.s_addr) + MCAST_GROUP_SLOTS - 1))
+        return NULL;
+    McastDistributor* d = (McastDistributor*)malloc(sizeof(McastDistributor));
+    memset(d, 0, sizeof(McastDistributor));
+    d->mutex = Mutex_New();
+    d->group_base = ntohl(addr.s_addr);
+    d->port = port;
+    d->ttl = 1;
+    d->rate = (rate) ? rate : NET_MCAST_DEFAULT_RATE;
+    d->next_id = (u32)Time_NowNs() | 1;
+    d->shaper = shaper;
+    d->active_transfers = active_transfers;
+    return d;
+}
+
+void _mcast_sleep_ns(const u64 ns) {
+    struct timespec ts = {(time_t)(ns / CTM_NS_PER_SEC), (long)(ns % CTM_NS_PER_SEC)};
+    nanosleep(&ts, NULL);
+}
+
+void _mcast_send_all(Socket* restrict s, const Datagram* restrict batch, const u32 count) {
+    for (u32 done = 0; done < count;) {
+        const i32 sent = Socket_SendBatch(s, batch + done, count - done);
+        if (sent == CS_SOCKET_WOULD_BLOCK) {
+            Socket_Poll(s, POLLOUT, 10);
+            continue;
+        }
+        // Whatever did not go out is repaired by the receivers.
+        if (sent == CS_SOCKET_ERROR)
+            return;
+        done += (u32)sent;
+    }
+}
+
+// Send the whole file once, paced at the distributor's rate, and mark the end of the pass.
+void _mcast_send_pass(McastTransfer* restrict t, Socket* restrict s, const u32 pass, u8* restrict datagrams, u8* restrict stage) {
+    McastDistributor* d = t->owner;
+    Datagram batch[NET_UDP_BATCH];
+    u64 next_send_ns = Time_NowNs();
+    for (u32 seq = 0; seq < t->total;) {
+        const u32 count = (t->total - seq < NET_UDP_BATCH) ? t->total - seq : NET_UDP_BATCH;
+        const u64 offset = (u64)seq * NET_UDP_PAYLOAD;
+        const usize length = (t->file->size - offset < (u64)count * NET_UDP_PAYLOAD) ? (usize)(t->file->size - offset) : count * NET_UDP_PAYLOAD;
+        if (File_ReadAt(t->file, stage, length, offset) != (i64)length) {
+            LOG_WARN("Multicast of %s: read failed, the pass ends early.\n", t->name);
+            break;
+        }
+        usize bytes = 0;
+        for (u32 i = 0; i < count; ++i) {
+            u8* datagram = datagrams + (usize)i * NET_MCAST_DATAGRAM_MAX;
+            const usize payload = (length - (usize)i * NET_UDP_PAYLOAD < NET_UDP_PAYLOAD) ? length - (usize)i * NET_UDP_PAYLOAD : NET_UDP_PAYLOAD;
+            McastDataHeader header = {t->transfer_id, seq + i, pass, 0};
+            memcpy(datagram, &header, sizeof(header));
+            memcpy(datagram + sizeof(header), stage + (usize)i * NET_UDP_PAYLOAD, payload);
+            batch[i].buffer = datagram;
+            batch[i].size = sizeof(header) + payload;
+            bytes += batch[i].size;
+        }
+        Shaper_Wait(d->shaper, &t->shaper_flow, bytes);
+        _mcast_send_all(s, batch, count);
+        seq += count;
+
+        next_send_ns += (u64)((double)bytes * (double)CTM_NS_PER_SEC / (double)d->rate);
+        const u64 now = Time_NowNs();
+        if (next_send_ns > now)
+            _mcast_sleep_ns(next_send_ns - now);
+        else if (now - next_send_ns > MCAST_MAX_LAG_NS)
+            next_send_ns = now;
+    }
+
+    McastDataHeader marker = {t->transfer_id, t->total, pass, 0};
+    Datagram end = {(u8*)&marker, sizeof(marker)};
+    for (u32 i = 0; i < NET_MCAST_END_MARKERS; ++i) {
+        Time_SleepMs(MCAST_END_MARKER_GAP_MS);
+        _mcast_send_all(s, &end, 1);
+    }
+}
+
+void _mcast_transfer_dispose(McastTransfer* restrict t) {
+    File_Close(t->file);
+    free(t);
+}
+
+// Sends passes until one ends that nobody joined late for, then retires the transfer.
+ThreadArg _mcast_sender(ThreadArg args) {
+    McastTransfer* t = (McastTransfer*)args;
+    McastDistributor* d = t->owner;
+
+    Socket* s = Socket_New(AddressFamily_InterNetwork, SocketType_Dgram, ProtocolType_Udp);
+    IPAddress iface = IPAddress_New(IPAddressType_IPv4LPStr);
+    memset(&iface.ipv4_addr, 0, sizeof(iface.ipv4_addr));
+    iface.ipv4_addr.sin_addr.s_addr = t->iface;
+    IPAddress group = iface;
+    group.ipv4_addr.sin_addr.s_addr = t->group;
+    if (!s ||
+        Socket_SetMulticast(s, iface, d->ttl, true) == CS_SOCKET_ERROR ||
+        Socket_Connect(s, IPEndPoint_New(group, AddressFamily_InterNetwork, d->port)) == CS_SOCKET_ERROR) {
+        LOG_WARN("Multicast of %s: failed to open the sending socket, receivers repair everything.\n", t->name);
+        if (s)
+            Socket_Dispose(s);
+        s = NULL;
+    } else {
+        Socket_SetBufferSizes(s, NET_UDP_SOCKET_BUFFER, NET_UDP_SOCKET_BUFFER);
+    }
+    u8* datagrams = (u8*)malloc(NET_UDP_BATCH * NET_MCAST_DATAGRAM_MAX);
+    u8* stage = (u8*)malloc(NET_UDP_BATCH * NET_UDP_PAYLOAD);
+    File_Advise(t->file, 0, 0, FileAdvice_Sequential);
+
+    Time_SleepMs(NET_MCAST_GATHER_MS);
+    Mutex_Lock(d->mutex);
+    for (;;) {
+        t->sending = true;
+        const u32 pass = t->pass;
+        Mutex_Unlock(d->mutex);
+
+        if (s) {
+            __atomic_add_fetch(d->active_transfers, 1, __ATOMIC_RELAXED);
+            _mcast_send_pass(t, s, pass, datagrams, stage);
+            __atomic_sub_fetch(d->active_transfers, 1, __ATOMIC_RELAXED);
+        }
+
+        Mutex_Lock(d->mutex);
+        if (!s || !t->again)
+            break;
+        t->again = false;
+        t->sending = false;
+        ++t->pass;
+    }
+    McastTransfer** link = &d->transfers;
+    while (*link != t)
+        link = &(*link)->next;
+    *link = t->next;
+    --d->transfer_count;
+    Mutex_Unlock(d->mutex);
+
+    LOG_INFO("Multicast of %s done after %u pass(es).\n", t->name, t->pass + 1);
+    free(stage);
+    free(datagrams);
+    if (s)
+        Socket_Dispose(s);
+    _mcast_transfer_dispose(t);
+    return NULL;
+}
+
+// The running transfer of name, NULL if there is none. Expects the mutex to be held.
+McastTransfer* _mcast_find(McastDistributor* restrict d, const char* restrict name) {
+    McastTransfer* t = d->transfers;
+    while (t && strcmp(t->name, name))
+        t = t->next;
+    return t;
+}
+
+// Next group (network order) no running transfer sends to. There always is one, transfers
+// are fewer than the slots. Expects the mutex to be held.
+u32 _mcast_free_group(McastDistributor* restrict d) {
+    for (;;) {
+        const u32 group = htonl(d->group_base + d->next_slot++ % MCAST_GROUP_SLOTS);
+        const McastTransfer* t = d->transfers;
+        while (t && t->group != group)
+            t = t->next;
+        if (!t)
+            return group;
+    }
+}
+
+// Add a receiver of name (already checked by the caller) to its transfer, starting one if
+// there is none. iface is the local address (network order) of the receiver's connection,
+// a new transfer sends from that interface. Fills info, returns NULL or what went wrong.
+const char* McastDistributor_Join(McastDistributor* restrict d, const char* restrict name, const u32 iface, McastInfo* restrict info) {
+    Mutex_Lock(d->mutex);
+    McastTransfer* t = _mcast_find(d, name);
+    FileHandle* f = NULL;
+    if (!t) {
+        // Opened without the lock, a slow file system must not hold up other joins and
+        // the senders. Another join for the same file may start its transfer meanwhile.
+        Mutex_Unlock(d->mutex);
+        f = File_Open(name, FileMode_Read);
+        if (!f)
+            return "File not found";
+        Mutex_Lock(d->mutex);
+        t = _mcast_find(d, name);
+        if (t)
+            File_Close(f);
+    }
+    if (!t) {
+        if (d->transfer_count >= MCAST_MAX_TRANSFERS) {
+            Mutex_Unlock(d->mutex);
+            File_Close(f);
+            return "Too many multicast transfers, try again later";
+        }
+        t = (McastTransfer*)malloc(sizeof(McastTransfer));
+        memset(t, 0, sizeof(McastTransfer));
+        t->owner = d;
+        snprintf(t->name, sizeof(t->name), "%s", name);
+        t->file = f;
+        t->total = Udp_DatagramCount(f->size);
+        t->transfer_id = d->next_id++;
+        t->group = _mcast_free_group(d);
+        t->iface = iface;
+
+        ThreadAttributes attr;
+        attr.args = (ThreadArg)t;
+        attr.initial_stack_size = 0;
+        attr.detached = true;
+        attr.cpus = NULL;
+        attr.name = "nfs-mcast";
+        attr.routine = _mcast_sender;
+        if (!Thread_New(&attr)) {
+            Mutex_Unlock(d->mutex);
+            _mcast_transfer_dispose(t);
+            return "Failed to start the transfer";
+        }
+        t->next = d->transfers;
+        d->transfers = t;
+        ++d->transfer_count;
+    }
+
+    info->size = t->file->size;
+    info->mtime = (i64)t->file->mtime;
+    info->transfer_id = t->transfer_id;
+    info->group = t->group;
+    info->port = d->port;
+    info->rate = d->rate;
+    info->first_pass = t->pass;
+    if (t->sending) {
+        // Too late for the start of this pass, the next one covers the rest.
+        t->again = true;
+        info->first_pass = t->pass + 1;
+    }
+    Mutex_Unlock(d->mutex);
+    return NULL;
+}
+
+#endif // NETFS_SERVER_MCAST_H
@@ -0,0 +1,126 @@
+#ifndef NETFS_SERVER_MEMBUDGET_H
+#define NETFS_SERVER_MEMBUDGET_H
+
+#include <stdnfs.h>
+#include <cs_threads.h>
+#include <cs_time.h>
+
+// Memory accounting for connections.
+// Everything a connection allocates on behalf of its client (request payloads, queued
+// downloads and their buffers, listings, upload state) is charged to the connection's
+// account. An account has a limit of its own and draws from one server wide budget, a
+// charge that fits in neither is refused and the connection has to back off: stop reading
+// requests until its queued work drained, or answer with an error. The server therefore
+// stays within its budget no matter how many clients push how hard.
+// A connection that can wait for others to give memory back sleeps until a release
+// (MemBudget_WaitRelease) rather than polling.
+
+// A limit of 0 means unlimited.
+typedef struct _netfs_mem_budget {
+    usize used;
+    usize peak;
+    usize limit;
+    u64 refused;   // Charges given up on, see MemAccount_Refuse().
+    u64 releases;  // Bumped by every release, waiters look for it to change.
+    u32 waiters;
+    Mutex* mutex;
+    CondVar* released;
+} MemBudget;
+
+// Only the connection's own thread charges and releases, others may read used and peak.
+typedef struct _netfs_mem_account {
+    MemBudget* budget;
+    usize used;
+    usize peak;
+    usize limit;
+} MemAccount;
+
+void MemBudget_Init(MemBudget* restrict b, const usize limit) {
+    memset(b, 0, sizeof(MemBudget));
+    b->limit = limit;
+    b->mutex = Mutex_New();
+    b->released = CondVar_New();
+}
+
+// Releases so far. Take it before a charge that may fail and hand it to MemBudget_WaitRelease(),
+// so a release in between is not missed.
+u64 MemBudget_Releases(MemBudget* restrict b) {
+    return __atomic_load_n(&b->releases, __ATOMIC_SEQ_CST);
+}
+
+// Wait until something was released after seen was taken, or until deadline_ns. False if
+// the deadline passed.
+bool MemBudget_WaitRelease(MemBudget* restrict b, const u64 seen, const u64 deadline_ns) {
+    Mutex_Lock(b->mutex);
+    __atomic_add_fetch(&b->waiters, 1, __ATOMIC_SEQ_CST);
+    u64 now = Time_NowNs();
+    while (__atomic_load_n(&b->releases, __ATOMIC_SEQ_CST) == seen && now < deadline_ns) {
+        CondVar_TimedWait(b->released, b->mutex, (u32)((deadline_ns - now + CTM_NS_PER_MS - 1) / CTM_NS_PER_MS));
+        now = Time_NowNs();
+    }
+    __atomic_sub_fetch(&b->waiters, 1, __ATOMIC_SEQ_CST);
+    Mutex_Unlock(b->mutex);
+    return now < deadline_ns;
+}
+
+bool _mem_budget_take(MemBudget* restrict b, const usize bytes) {
+    const usize used = __atomic_add_fetch(&b->used, bytes, __ATOMIC_RELAXED);
+    if (b->limit && used > b->limit) {
+        __atomic_sub_fetch(&b->used, bytes, __ATOMIC_RELAXED);
+        return false;
+    }
+    usize peak = __atomic_load_n(&b->peak, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&b->peak, &peak, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return true;
+}
+
+void MemAccount_Init(MemAccount* restrict a, MemBudget* restrict budget, const usize limit) {
+    a->budget = budget;
+    a->used = 0;
+    a->peak = 0;
+    a->limit = limit;
+}
+
+// True if bytes could never be charged to a, however much it releases first.
+bool MemAccount_Exceeds(const MemAccount* restrict a, const usize bytes) {
+    return (a->limit && bytes > a->limit) || (a->budget->limit && bytes > a->budget->limit);
+}
+
+// Charge bytes to a and its budget, false (and nothing charged) if either limit is in the way.
+// The caller may wait and try again, MemAccount_Refuse() once it gives up.
+bool MemAccount_Charge(MemAccount* restrict a, const usize bytes) {
+    if ((a->limit && a->used + bytes > a->limit) || !_mem_budget_take(a->budget, bytes))
+        return false;
+    __atomic_store_n(&a->used, a->used + bytes, __ATOMIC_RELAXED);
+    if (a->used > a->peak)
+        __atomic_store_n(&a->peak, a->used, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Count a request, transfer or connection turned down for lack of memory.
+void MemAccount_Refuse(MemAccount* restrict a) {
+    __atomic_add_fetch(&a->budget->refused, 1, __ATOMIC_RELAXED);
+}
+
+void MemAccount_Release(MemAccount* restrict a, const usize bytes) {
+    if (!bytes)
+        return;
+    MemBudget* b = a->budget;
+    __atomic_store_n(&a->used, a->used - bytes, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&b->used, bytes, __ATOMIC_RELAXED);
+    // Pairs with the waiter counting itself before it looks at releases, one of the two sees the other.
+    __atomic_add_fetch(&b->releases, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&b->waiters, __ATOMIC_SEQ_CST)) {
+        Mutex_Lock(b->mutex);
+        CondVar_Broadcast(b->released);
+        Mutex_Unlock(b->mutex);
+    }
+}
+
+// Hand back whatever is still charged, when the connection goes away.
+void MemAccount_ReleaseAll(MemAccount* restrict a) {
+    MemAccount_Release(a, a->used);
+}
+
+#endif // NETFS_SERVER_MEMBUDGET_H
@@ -0,0 +1,135 @@
+#ifndef NETFS_SERVER_METRICS_H
+#define NETFS_SERVER_METRICS_H
+
+#include <stdnfs.h>
+#include <stdarg.h>
+#include <cs_histogram.h>
+#include <net_common.h>
+
+// Counters of a single connection. Every connection has its own thread, so a shard has
+// exactly one writer and recording never takes a lock: values are published with relaxed
+// atomic stores and readers see a slightly stale but never torn view.
+typedef struct _netfs_metrics_shard {
+    u64 bytes_in;
+    u64 bytes_out;
+    u64 requests[NetPacketType_None];
+    u64 errors;
+    // Service time per request type, allocated on the first request of that type
+    // since most connections only ever send one or two kinds.
+    Histogram* latency[NetPacketType_None];
+} MetricsShard;
+
+const char* Metrics_TypeName(const NetPacketType type) {
+    static const char* names[] = {
+        "message", "error", "ls", "remove", "info", "fget", "fup",
+        "fget_data", "fup_data", "fget_hole", "not_modified", "stats", "set_rate", "busy",
+        "fopen", "fhandle", "read", "read_data", "shm_open", "shm_channel",
+        "uget", "uget_info", "uget_done", "mcget", "mcast_info", "set_integrity", "digest"};
+    return (type < NetPacketType_None) ? names[type] : "?";
+}
+
+void _metrics_add(u64* restrict counter, const u64 value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+void MetricsShard_Record(MetricsShard* restrict m, const NetPacketType type, const u64 latency_ns) {
+    if (type >= NetPacketType_None)
+        return;
+    _metrics_add(&m->requests[type], 1);
+    Histogram* h = m->latency[type];
+    if (!h) {
+        h = (Histogram*)malloc(sizeof(Histogram));
+        Histogram_Reset(h);
+        __atomic_store_n(&m->latency[type], h, __ATOMIC_RELEASE);
+    }
+    Histogram_Record(h, latency_ns);
+}
+
+void MetricsShard_RecordError(MetricsShard* restrict m) {
+    _metrics_add(&m->errors, 1);
+}
+
+// Publish the socket's running byte counts.
+void MetricsShard_SetTraffic(MetricsShard* restrict m, const u64 bytes_in, const u64 bytes_out) {
+    __atomic_store_n(&m->bytes_in, bytes_in, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->bytes_out, bytes_out, __ATOMIC_RELAXED);
+}
+
+// Add src to dst. dst must not be written to concurrently.
+void MetricsShard_Merge(MetricsShard* restrict dst, const MetricsShard* restrict src) {
+    dst->bytes_in += __atomic_load_n(&src->bytes_in, __ATOMIC_RELAXED);
+    dst->bytes_out += __atomic_load_n(&src->bytes_out, __ATOMIC_RELAXED);
+    dst->errors += __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+    for (u32 i = 0; i < NetPacketType_None; ++i) {
+        dst->requests[i] += __atomic_load_n(&src->requests[i], __ATOMIC_RELAXED);
+        const Histogram* h = __atomic_load_n(&src->latency[i], __ATOMIC_ACQUIRE);
+        if (!h)
+            continue;
+        if (!dst->latency[i]) {
+            dst->latency[i] = (Histogram*)malloc(sizeof(Histogram));
+            Histogram_Reset(dst->latency[i]);
+        }
+        Histogram_Merge(dst->latency[i], h);
+    }
+}
+
+// Zero the counters, allocated histograms are kept for the next user of the shard.
+void MetricsShard_Reset(MetricsShard* restrict m) {
+    m->bytes_in = 0;
+    m->bytes_out = 0;
+    m->errors = 0;
+    memset(m->requests, 0, sizeof(m->requests));
+    for (u32 i = 0; i < NetPacketType_None; ++i) {
+        if (m->latency[i])
+            Histogram_Reset(m->latency[i]);
+    }
+}
+
+void MetricsShard_Dispose(MetricsShard* restrict m) {
+    for (u32 i = 0; i < NetPacketType_None; ++i) {
+        free(m->latency[i]);
+        m->latency[i] = NULL;
+    }
+}
+
+// printf into a packet's payload, the result stays NUL terminated.
+void Metrics_Append(NetPacket* restrict p, const char* restrict fmt, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    const i32 length = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (length <= 0)
+        return;
+    const usize size = ((usize)length < sizeof(line)) ? (usize)length : sizeof(line) - 1;
+    // Overwrite the previous terminator.
+    if (p->header.size > 0)
+        --p->header.size;
+    NetPacket_AddData(p, (const u8*)line, size + 1);
+}
+
+// One line of totals, then a line per request type that was seen.
+void Metrics_Format(NetPacket* restrict p, const MetricsShard* restrict m) {
+    u64 requests = 0;
+    for (u32 i = 0; i < NetPacketType_None; ++i)
+        requests += m->requests[i];
+    Metrics_Append(p, "requests %llu, errors %llu, in %.2f MB, out %.2f MB\n",
+                   (unsigned long long)requests,
+                   (unsigned long long)m->errors,
+                   (double)m->bytes_in / (1024.0 * 1024.0),
+                   (double)m->bytes_out / (1024.0 * 1024.0));
+    for (u32 i = 0; i < NetPacketType_None; ++i) {
+        const Histogram* h = m->latency[i];
+        if (m->requests[i] == 0 || !h)
+            continue;
+        Metrics_Append(p, "  %-12s %10llu  mean %9.3f ms  p50 %9.3f ms  p99 %9.3f ms  max %9.3f ms\n",
+                       Metrics_TypeName((NetPacketType)i),
+                       (unsigned long long)m->requests[i],
+                       Histogram_Mean(h) / 1e6,
+                       (double)Histogram_Percentile(h, 50.0) / 1e6,
+                       (double)Histogram_Percentile(h, 99.0) / 1e6,
+                       (double)h->max / 1e6);
+    }
+}
+
+#endif // NETFS_SERVER_METRICS_H
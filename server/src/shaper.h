@@ -0,0 +1,223 @@
+#ifndef NETFS_SERVER_SHAPER_H
+#define NETFS_SERVER_SHAPER_H
+
+#include <stdnfs.h>
+#include <cs_threads.h>
+#include <cs_time.h>
+#include <net_transfer.h>
+#include <time.h>
+
+// Transmit scheduling for file data.
+// Every connection has a token bucket for its own limit. On top of that a global bucket
+// is shared by deficit round robin: connections waiting to send queue up, each turn adds
+// SHAPER_QUANTUM to a connection's deficit and a chunk may go once the deficit and the
+// global bucket both cover it. A bulk download therefore gets the same share as any
+// other active transfer instead of whatever its thread manages to grab.
+//
+// Buckets may go into debt so chunks bigger than the burst still pass, the debt is paid
+// by waiting before the next chunk.
+
+#define SHAPER_QUANTUM NET_CHUNK_MIN_SIZE
+#define SHAPER_BURST_NS (50 * CTM_NS_PER_MS)
+#define SHAPER_MIN_SLEEP_NS (50 * CTM_NS_PER_US)
+#define SHAPER_MAX_SLEEP_NS (5 * CTM_NS_PER_MS)
+
+// rate is in bytes per second, 0 means unlimited.
+typedef struct _netfs_token_bucket {
+    u64 rate;
+    double tokens;
+    u64 last_ns;
+} TokenBucket;
+
+typedef struct _netfs_shaper_flow {
+    TokenBucket bucket;
+    u64 deficit;
+    usize pending;  // Size of the chunk waiting for the global bucket.
+    bool granted;
+    struct _netfs_shaper_flow* next;
+} ShaperFlow;
+
+typedef struct _netfs_shaper {
+    TokenBucket global;
+    u64 flow_rate; // Limit of every connection, applied on their next chunk.
+    ShaperFlow* head;
+    ShaperFlow* tail;
+    Mutex* mutex;
+} Shaper;
+
+double _bucket_burst(const TokenBucket* restrict b) {
+    const double burst = (double)b->rate * (double)SHAPER_BURST_NS / (double)CTM_NS_PER_SEC;
+    return (burst > (double)SHAPER_QUANTUM) ? burst : (double)SHAPER_QUANTUM;
+}
+
+void TokenBucket_SetRate(TokenBucket* restrict b, const u64 rate) {
+    if (b->rate != rate) {
+        __atomic_store_n(&b->rate, rate, __ATOMIC_RELAXED);
+        b->tokens = (rate) ? _bucket_burst(b) : 0.0;
+        b->last_ns = Time_NowNs();
+    }
+}
+
+void TokenBucket_Refill(TokenBucket* restrict b, const u64 now) {
+    if (now > b->last_ns) {
+        b->tokens += (double)b->rate * (double)(now - b->last_ns) / (double)CTM_NS_PER_SEC;
+        b->last_ns = now;
+    }
+    const double burst = _bucket_burst(b);
+    if (b->tokens > burst)
+        b->tokens = burst;
+}
+
+// True if bytes may go now, a chunk larger than the burst only needs a full bucket.
+bool TokenBucket_Ready(const TokenBucket* restrict b, const usize bytes) {
+    if (b->rate == 0)
+        return true;
+    const double burst = _bucket_burst(b);
+    return b->tokens >= (((double)bytes < burst) ? (double)bytes : burst);
+}
+
+// Nanoseconds until TokenBucket_Ready would be true.
+u64 TokenBucket_Delay(const TokenBucket* restrict b, const usize bytes) {
+    if (b->rate == 0)
+        return 0;
+    const double burst = _bucket_burst(b);
+    const double needed = (((double)bytes < burst) ? (double)bytes : burst) - b->tokens;
+    return (needed > 0.0) ? (u64)(needed * (double)CTM_NS_PER_SEC / (double)b->rate) : 0;
+}
+
+void _shaper_sleep(u64 ns) {
+    if (ns < SHAPER_MIN_SLEEP_NS)
+        ns = SHAPER_MIN_SLEEP_NS;
+    if (ns > SHAPER_MAX_SLEEP_NS)
+        ns = SHAPER_MAX_SLEEP_NS;
+    struct timespec ts = {0, (long)ns};
+    nanosleep(&ts, NULL);
+}
+
+Shaper* Shaper_New(const u64 global_rate, const u64 flow_rate) {
+    Shaper* s = (Shaper*)malloc(sizeof(Shaper));
+    memset(s, 0, sizeof(Shaper));
+    TokenBucket_SetRate(&s->global, global_rate);
+    s->flow_rate = flow_rate;
+    s->mutex = Mutex_New();
+    return s;
+}
+
+void Shaper_Dispose(Shaper* restrict s) {
+    Mutex_Dispose(s->mutex);
+    free(s);
+}
+
+// A value of UINT64_MAX leaves that limit as it is.
+void Shaper_SetRates(Shaper* restrict s, const u64 global_rate, const u64 flow_rate) {
+    Mutex_Lock(s->mutex);
+    if (global_rate != UINT64_MAX)
+        TokenBucket_SetRate(&s->global, global_rate);
+    if (flow_rate != UINT64_MAX)
+        __atomic_store_n(&s->flow_rate, flow_rate, __ATOMIC_RELAXED);
+    Mutex_Unlock(s->mutex);
+}
+
+void Shaper_GetRates(Shaper* restrict s, u64* restrict global_rate, u64* restrict flow_rate) {
+    Mutex_Lock(s->mutex);
+    *global_rate = s->global.rate;
+    *flow_rate = s->flow_rate;
+    Mutex_Unlock(s->mutex);
+}
+
+// Largest chunk worth sending in one go under the current limits, 0 if unlimited.
+// Smaller chunks let round robin interleave connections more finely.
+usize Shaper_ChunkLimit(Shaper* restrict s) {
+    u64 limit = 0;
+    const u64 rates[2] = {__atomic_load_n(&s->global.rate, __ATOMIC_RELAXED), __atomic_load_n(&s->flow_rate, __ATOMIC_RELAXED)};
+    for (u32 i = 0; i < 2; ++i) {
+        if (rates[i] == 0)
+            continue;
+        u64 chunk = rates[i] * SHAPER_BURST_NS / CTM_NS_PER_SEC / 2;
+        if (chunk < SHAPER_QUANTUM)
+            chunk = SHAPER_QUANTUM;
+        if (limit == 0 || chunk < limit)
+            limit = chunk;
+    }
+    return (usize)limit;
+}
+
+// Hand out global tokens to queued flows in deficit round robin order. Called with the
+// mutex held by whichever waiting thread gets there first.
+void _shaper_schedule(Shaper* restrict s, const u64 now) {
+    TokenBucket_Refill(&s->global, now);
+    while (s->head) {
+        ShaperFlow* f = s->head;
+        if (f->deficit < f->pending) {
+            // Not its turn yet, top it up and move it to the back.
+            f->deficit += SHAPER_QUANTUM;
+            if (f->deficit < f->pending && s->head != s->tail) {
+                s->head = f->next;
+                f->next = NULL;
+                s->tail->next = f;
+                s->tail = f;
+                continue;
+            }
+            if (f->deficit < f->pending)
+                continue;
+        }
+        if (!TokenBucket_Ready(&s->global, f->pending))
+            break;
+
+        s->global.tokens -= (double)f->pending;
+        f->deficit -= f->pending;
+        // An idle flow does not bank credit, DRR only carries it while it stays busy.
+        if (f->deficit > SHAPER_QUANTUM)
+            f->deficit = SHAPER_QUANTUM;
+        f->granted = true;
+        s->head = f->next;
+        if (!s->head)
+            s->tail = NULL;
+        f->next = NULL;
+    }
+}
+
+// Block until bytes of flow f may be sent under both its own and the global limit.
+void Shaper_Wait(Shaper* restrict s, ShaperFlow* restrict f, const usize bytes) {
+    // Unshaped servers never touch the mutex.
+    if (!__atomic_load_n(&s->global.rate, __ATOMIC_RELAXED) && !__atomic_load_n(&s->flow_rate, __ATOMIC_RELAXED))
+        return;
+    Mutex_Lock(s->mutex);
+    TokenBucket_SetRate(&f->bucket, s->flow_rate);
+    for (;;) {
+        TokenBucket_Refill(&f->bucket, Time_NowNs());
+        if (TokenBucket_Ready(&f->bucket, bytes))
+            break;
+        const u64 delay = TokenBucket_Delay(&f->bucket, bytes);
+        Mutex_Unlock(s->mutex);
+        _shaper_sleep(delay);
+        Mutex_Lock(s->mutex);
+    }
+    if (f->bucket.rate)
+        f->bucket.tokens -= (double)bytes;
+
+    if (s->global.rate) {
+        f->pending = bytes;
+        f->granted = false;
+        if (s->tail)
+            s->tail->next = f;
+        else
+            s->head = f;
+        s->tail = f;
+
+        for (;;) {
+            _shaper_schedule(s, Time_NowNs());
+            if (f->granted)
+                break;
+            // Every waiter wakes on its own, the head's delay is the earliest anything changes.
+            const u64 delay = (s->head) ? TokenBucket_Delay(&s->global, s->head->pending) : 0;
+            Mutex_Unlock(s->mutex);
+            _shaper_sleep(delay);
+            // If the limit was lifted meanwhile the next round grants everyone.
+            Mutex_Lock(s->mutex);
+        }
+    }
+    Mutex_Unlock(s->mutex);
+}
+
+#endif // NETFS_SERVER_SHAPER_H
@@ -0,0 +1,320 @@
+#ifndef NETFS_SERVER_UDPSEND_H
+#define NETFS_SERVER_UDPSEND_H
+
+#include <stdnfs.h>
+#include <cs_sockets.h>
+#include <cs_systemio.h>
+#include <cs_time.h>
+#include <net_udp.h>
+#include <stddef.h>
+#include <time.h>
+#include "shaper.h"
+
+// Sending side of a uget, see net_udp.h. Datagrams go out in paced batches, holes the acks
+// report are filled before new data. One datagram counts as lost once NET_UDP_REORDER
+// newer ones were acknowledged and it has been out for longer than a round trip, whatever
+// is still out after the retransmission timeout counts as lost as well.
+
+#define UDP_RTO_MIN_NS (50 * CTM_NS_PER_MS)
+#define UDP_RTO_MAX_NS (2 * CTM_NS_PER_SEC)
+// How often the TCP connection is looked at for the client hanging up.
+#define UDP_CONTROL_CHECK_NS (100 * CTM_NS_PER_MS)
+
+typedef struct _netfs_udp_sender {
+    Socket* socket; // Connected to the client's port.
+    FileHandle* file;
+    u64 size;
+    u32 total;
+    u32 transfer_id;
+    UdpRate rate;
+
+    // State of the datagrams in the window, slot seq % NET_UDP_WINDOW.
+    u64 sent_ns[NET_UDP_WINDOW]; // When it last went out, 0 while it is not in flight.
+    u8 acked[NET_UDP_SACK_BYTES];
+    u32 cumulative;              // Every datagram below was acknowledged.
+    u32 next;                    // First datagram never sent.
+    u32 highest;                 // One past the highest acknowledged.
+    u32 in_flight;
+    // Lost datagrams to send again, oldest first. A datagram is in here at most once.
+    u32 lost[NET_UDP_WINDOW];
+    u32 lost_head;
+    u32 lost_count;
+
+    u64 next_send_ns;
+    u64 last_progress_ns;        // Last ack that acknowledged anything new.
+    u64 last_timeout_ns;
+    u64 srtt_ns;
+    u32 backoff;                 // Timeouts since the last progress, each doubles the next one.
+    UdpTransferStats stats;
+
+    u8 datagrams[NET_UDP_BATCH][NET_UDP_DATAGRAM_MAX];
+    u8 stage[NET_UDP_BATCH * NET_UDP_PAYLOAD];
+    u8 acks[NET_UDP_BATCH][NET_UDP_ACK_MAX];
+} UdpSender;
+
+// Takes ownership of socket, not of file.
+UdpSender* UdpSender_New(Socket* restrict socket, FileHandle* restrict file, const u32 transfer_id, const u64 max_rate) {
+    UdpSender* s = (UdpSender*)malloc(sizeof(UdpSender));
+    memset(s, 0, offsetof(UdpSender, datagrams));
+    s->socket = socket;
+    s->file = file;
+    s->size = file->size;
+    s->total = Udp_DatagramCount(file->size);
+    s->transfer_id = transfer_id;
+    UdpRate_Init(&s->rate, max_rate);
+    return s;
+}
+
+void UdpSender_Dispose(UdpSender* restrict s) {
+    Socket_Dispose(s->socket);
+    free(s);
+}
+
+bool _udp_sender_is_acked(const UdpSender* restrict s, const u32 seq) {
+    const u32 slot = seq % NET_UDP_WINDOW;
+    return (s->acked[slot / 8] >> (slot % 8)) & 1;
+}
+
+usize _udp_sender_payload_size(const UdpSender* restrict s, const u32 seq) {
+    const u64 offset = (u64)seq * NET_UDP_PAYLOAD;
+    return (s->size - offset < NET_UDP_PAYLOAD) ? (usize)(s->size - offset) : NET_UDP_PAYLOAD;
+}
+
+// Returns the bytes newly acknowledged.
+u64 _udp_sender_ack(UdpSender* restrict s, const u32 seq) {
+    if (seq < s->cumulative || seq >= s->next || _udp_sender_is_acked(s, seq))
+        return 0;
+    const u32 slot = seq % NET_UDP_WINDOW;
+    s->acked[slot / 8] |= (u8)(1u << (slot % 8));
+    if (s->sent_ns[slot]) {
+        s->sent_ns[slot] = 0;
+        --s->in_flight;
+    }
+    return _udp_sender_payload_size(s, seq);
+}
+
+// Take seq out of flight and queue it to go out again. Returns its size.
+u64 _udp_sender_lose(UdpSender* restrict s, const u32 seq) {
+    s->sent_ns[seq % NET_UDP_WINDOW] = 0;
+    --s->in_flight;
+    s->lost[(s->lost_head + s->lost_count++) % NET_UDP_WINDOW] = seq;
+    return _udp_sender_payload_size(s, seq);
+}
+
+void _udp_sender_process_ack(UdpSender* restrict s, const u8* restrict datagram, const usize size, const u64 now) {
+    UdpAckHeader ack;
+    if (size < sizeof(ack))
+        return;
+    memcpy(&ack, datagram, sizeof(ack));
+    if (ack.transfer_id != s->transfer_id || ack.sack_size > size - sizeof(ack) || ack.sack_size > NET_UDP_SACK_BYTES)
+        return;
+
+    u64 rtt_ns = 0;
+    if (ack.echo_ns && ack.echo_ns <= now) {
+        rtt_ns = now - ack.echo_ns;
+        s->srtt_ns = (s->srtt_ns) ? (s->srtt_ns * 7 + rtt_ns) / 8 : rtt_ns;
+    }
+
+    u64 delivered = 0;
+    const u32 cumulative = (ack.cumulative < s->next) ? ack.cumulative : s->next;
+    for (u32 seq = s->cumulative; seq < cumulative; ++seq)
+        delivered += _udp_sender_ack(s, seq);
+    const u8* sack = datagram + sizeof(ack);
+    for (u32 i = 0; i < ack.sack_size; ++i) {
+        if (!sack[i])
+            continue;
+        for (u32 bit = 0; bit < 8; ++bit) {
+            if ((sack[i] >> bit) & 1)
+                delivered += _udp_sender_ack(s, ack.cumulative + i * 8 + bit);
+        }
+    }
+    while (s->cumulative < s->next && _udp_sender_is_acked(s, s->cumulative)) {
+        const u32 slot = s->cumulative % NET_UDP_WINDOW;
+        s->acked[slot / 8] &= (u8)~(1u << (slot % 8));
+        ++s->cumulative;
+    }
+    if (ack.highest > s->highest)
+        s->highest = (ack.highest < s->next) ? ack.highest : s->next;
+    if (delivered) {
+        s->last_progress_ns = now;
+        s->backoff = 0;
+    }
+
+    // Holes behind enough newer arrivals that have been out for longer than a round trip are lost.
+    u64 lost = 0;
+    if (s->rate.min_rtt_ns != UINT64_MAX && s->highest > NET_UDP_REORDER) {
+        const u64 threshold_ns = s->rate.min_rtt_ns + s->rate.min_rtt_ns / 4;
+        for (u32 seq = s->cumulative; seq < s->highest - NET_UDP_REORDER; ++seq) {
+            const u64 sent_ns = s->sent_ns[seq % NET_UDP_WINDOW];
+            if (sent_ns && now - sent_ns > threshold_ns && !_udp_sender_is_acked(s, seq))
+                lost += _udp_sender_lose(s, seq);
+        }
+    }
+    UdpRate_OnAck(&s->rate, now, delivered, lost, rtt_ns);
+}
+
+// Read every ack waiting. False if the client's port is gone.
+bool _udp_sender_receive_acks(UdpSender* restrict s) {
+    Datagram batch[NET_UDP_BATCH];
+    for (;;) {
+        for (u32 i = 0; i < NET_UDP_BATCH; ++i) {
+            batch[i].buffer = s->acks[i];
+            batch[i].size = NET_UDP_ACK_MAX;
+        }
+        const i32 received = Socket_ReceiveBatch(s->socket, batch, NET_UDP_BATCH);
+        if (received == CS_SOCKET_WOULD_BLOCK)
+            return true;
+        if (received == CS_SOCKET_ERROR)
+            return false;
+        const u64 now = Time_NowNs();
+        for (i32 i = 0; i < received; ++i)
+            _udp_sender_process_ack(s, batch[i].buffer, batch[i].size, now);
+        if (received < NET_UDP_BATCH)
+            return true;
+    }
+}
+
+void _udp_sender_stamp(UdpSender* restrict s, const u32 index, const u32 seq, const u64 now) {
+    UdpDataHeader header = {s->transfer_id, seq, now};
+    memcpy(s->datagrams[index], &header, sizeof(header));
+    s->sent_ns[seq % NET_UDP_WINDOW] = now;
+    ++s->in_flight;
+}
+
+// Fill and send the next batch, lost datagrams first. Returns the bytes sent, 0 if the
+// window had no room or nothing was left, -1 on error.
+i64 _udp_sender_send_batch(UdpSender* restrict s, Shaper* restrict shaper, ShaperFlow* restrict flow, const u64 now) {
+    const u64 window = UdpRate_Window(&s->rate);
+    Datagram batch[NET_UDP_BATCH];
+    u32 n = 0;
+    while (n < NET_UDP_BATCH && s->lost_count > 0 && (u64)s->in_flight * NET_UDP_PAYLOAD < window) {
+        const u32 seq = s->lost[s->lost_head];
+        s->lost_head = (s->lost_head + 1) % NET_UDP_WINDOW;
+        --s->lost_count;
+        // Late arrivals may have been acknowledged since.
+        if (seq < s->cumulative || _udp_sender_is_acked(s, seq))
+            continue;
+        const usize payload = _udp_sender_payload_size(s, seq);
+        if (File_ReadAt(s->file, s->datagrams[n] + sizeof(UdpDataHeader), payload, (u64)seq * NET_UDP_PAYLOAD) != (i64)payload)
+            return -1;
+        _udp_sender_stamp(s, n, seq, now);
+        batch[n].buffer = s->datagrams[n];
+        batch[n].size = sizeof(UdpDataHeader) + payload;
+        ++s->stats.retransmitted;
+        ++n;
+    }
+
+    // New datagrams are consecutive, read them at once.
+    u32 fresh = 0;
+    while (n + fresh < NET_UDP_BATCH &&
+           s->next + fresh < s->total &&
+           s->next + fresh - s->cumulative < NET_UDP_WINDOW &&
+           (u64)(s->in_flight + fresh) * NET_UDP_PAYLOAD < window)
+        ++fresh;
+    if (fresh) {
+        const u64 offset = (u64)s->next * NET_UDP_PAYLOAD;
+        const usize length = (s->size - offset < (u64)fresh * NET_UDP_PAYLOAD) ? (usize)(s->size - offset) : fresh * NET_UDP_PAYLOAD;
+        if (File_ReadAt(s->file, s->stage, length, offset) != (i64)length)
+            return -1;
+        for (u32 i = 0; i < fresh; ++i, ++n) {
+            const u32 seq = s->next++;
+            const usize payload = _udp_sender_payload_size(s, seq);
+            memcpy(s->datagrams[n] + sizeof(UdpDataHeader), s->stage + (usize)i * NET_UDP_PAYLOAD, payload);
+            _udp_sender_stamp(s, n, seq, now);
+            batch[n].buffer = s->datagrams[n];
+            batch[n].size = sizeof(UdpDataHeader) + payload;
+        }
+    }
+    if (n == 0)
+        return 0;
+
+    i64 bytes = 0;
+    for (u32 i = 0; i < n; ++i)
+        bytes += (i64)batch[i].size;
+    Shaper_Wait(shaper, flow, (usize)bytes);
+    for (u32 done = 0; done < n;) {
+        const i32 sent = Socket_SendBatch(s->socket, batch + done, n - done);
+        if (sent == CS_SOCKET_ERROR)
+            return -1;
+        if (sent == CS_SOCKET_WOULD_BLOCK) {
+            Socket_Poll(s->socket, POLLOUT, 10);
+            continue;
+        }
+        done += (u32)sent;
+    }
+    s->stats.datagrams += n;
+
+    // Batches go out back to back, spaced to average out at the pacing rate.
+    if (s->next_send_ns < now)
+        s->next_send_ns = now;
+    s->next_send_ns += (u64)((double)bytes * (double)CTM_NS_PER_SEC / s->rate.pacing_rate);
+    return bytes;
+}
+
+// Nothing was acknowledged for a while: count everything still out as lost and slow down.
+void _udp_sender_timeout(UdpSender* restrict s, const u64 now) {
+    for (u32 seq = s->cumulative; seq < s->next; ++seq) {
+        if (s->sent_ns[seq % NET_UDP_WINDOW] && !_udp_sender_is_acked(s, seq))
+            _udp_sender_lose(s, seq);
+    }
+    UdpRate_OnTimeout(&s->rate);
+    ++s->stats.timeouts;
+    ++s->backoff;
+    s->last_timeout_ns = now;
+}
+
+u64 _udp_sender_rto(const UdpSender* restrict s) {
+    u64 rto = s->srtt_ns * 3;
+    if (rto < UDP_RTO_MIN_NS)
+        rto = UDP_RTO_MIN_NS;
+    rto <<= (s->backoff < 5) ? s->backoff : 5;
+    return (rto < UDP_RTO_MAX_NS) ? rto : UDP_RTO_MAX_NS;
+}
+
+// Send the whole file and return true once all of it was acknowledged. False if nothing new
+// was acknowledged for NET_UDP_IDLE_TIMEOUT_MS, the client's port went away or control (the TCP connection
+// of the request, which is quiet during the transfer) became readable: the client hung up.
+bool UdpSender_Run(UdpSender* restrict s, Socket* restrict control, Shaper* restrict shaper, ShaperFlow* restrict flow) {
+    u64 now = Time_NowNs();
+    s->last_progress_ns = now;
+    s->last_timeout_ns = now;
+    u64 next_control_check_ns = now + UDP_CONTROL_CHECK_NS;
+    while (s->cumulative < s->total) {
+        if (!_udp_sender_receive_acks(s))
+            return false;
+        now = Time_NowNs();
+        if (now - s->last_progress_ns > (u64)NET_UDP_IDLE_TIMEOUT_MS * CTM_NS_PER_MS)
+            return false;
+        if (now >= next_control_check_ns) {
+            if (Socket_Poll(control, POLLIN, 0) != 0)
+                return false;
+            next_control_check_ns = now + UDP_CONTROL_CHECK_NS;
+        }
+        const u64 quiet_since_ns = (s->last_progress_ns > s->last_timeout_ns) ? s->last_progress_ns : s->last_timeout_ns;
+        if (s->in_flight > 0 && now - quiet_since_ns > _udp_sender_rto(s))
+            _udp_sender_timeout(s, now);
+
+        const bool has_data = s->lost_count > 0 || (s->next < s->total && s->next - s->cumulative < NET_UDP_WINDOW);
+        const bool window_open = (u64)s->in_flight * NET_UDP_PAYLOAD < UdpRate_Window(&s->rate);
+        if (has_data && window_open) {
+            if (now < s->next_send_ns) {
+                const u64 delay_ns = s->next_send_ns - now;
+                struct timespec ts = {0, (long)((delay_ns < 5 * CTM_NS_PER_MS) ? delay_ns : 5 * CTM_NS_PER_MS)};
+                nanosleep(&ts, NULL);
+                continue;
+            }
+            const i64 sent = _udp_sender_send_batch(s, shaper, flow, now);
+            if (sent < 0)
+                return false;
+            if (sent > 0)
+                continue;
+        }
+        // Window full (or only stale retransmissions queued), wait for acks.
+        Socket_Poll(s->socket, POLLIN, 5);
+    }
+    s->stats.bandwidth = (u64)s->rate.btl_bw;
+    s->stats.min_rtt_us = (s->rate.min_rtt_ns != UINT64_MAX) ? (u32)(s->rate.min_rtt_ns / CTM_NS_PER_US) : 0;
+    return true;
+}
+
+#endif // NETFS_SERVER_UDPSEND_H